@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+#include "bench.h"
+#include "config.h"
+#include "netlink.h"
+#include "run.h"
+#include "seccomp.h"
+#include "trace.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <net/if.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// ./container bench runs /bin/true in containers of a tiny image built from the host's binaries,
+// first one after the other, then several at once, then one after the other with each of the
+// other network modes and storage drivers, and prints percentiles of the time spent in each phase
+// as JSON. ./container bench seccomp measures the cost that seccomp filters add to each system
+// call instead.
+
+#define BENCH_IMAGE "bench"
+#define BENCH_COMMAND "/bin/true"
+// Parent interface of the macvlan and ipvlan containers, a dummy interface or, on kernels
+// without the dummy driver, one end of a veth pair
+#define BENCH_PARENT "ctrbench0"
+#define BENCH_PARENT_PEER "ctrbench1"
+#define BENCH_PARENT_ADDRESS "10.231.0.1/24"
+
+// Copies src to the same path below root, along with its parent directories
+static void copy_into_root(const char *root, const char *src)
+{
+    char dest[PATH_MAX];
+    strformat(dest, PATH_MAX, "%s%s", root, src);
+    char *slash = strrchr(dest, '/');
+    *slash = '\0';
+    create_directory_parents(NULL, dest, 0755);
+    *slash = '/';
+
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (in == -1 || fstat(in, &st) == -1)
+    {
+        errorMessage("Could not open %s\n", src);
+    }
+    int out = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+    if (out == -1)
+    {
+        errorMessage("Could not create %s\n", dest);
+    }
+    ssize_t n;
+    while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0)
+        ;
+    if (n == -1)
+    {
+        errorMessage("Could not copy %s\n", src);
+    }
+    close(in);
+    close(out);
+}
+
+// Builds images/bench.tar.gz out of busybox if the host has it, otherwise out of the host's
+// true binary and the shared libraries it needs
+static void bench_build_image(void)
+{
+    const char *archive = IMAGE_PATH "/" BENCH_IMAGE ".tar.gz";
+    if (exists(archive))
+        return;
+    fprintf(stderr, "=> Building %s\n", archive);
+    char root[] = "/tmp/container-bench-XXXXXX";
+    if (mkdtemp(root) == NULL)
+    {
+        errorMessage("%s\n", "mkdtemp() failed");
+    }
+    chmod(root, 0755);
+
+    char binary[PATH_MAX] = "/bin/busybox";
+    if (!exists(binary) && realpath("/bin/true", binary) == NULL)
+    {
+        errorMessage("%s\n", "Neither busybox nor /bin/true found");
+    }
+    copy_into_root(root, binary);
+    char path[PATH_MAX];
+    strformat(path, PATH_MAX, "%s" BENCH_COMMAND, root);
+    if (!exists(path))
+    {
+        create_directory_exists_ok(root, "/bin", 0755);
+        if (symlink(binary, path) == -1)
+        {
+            errorMessage("Could not create %s\n", path);
+        }
+    }
+
+    // Lines of ldd's output look like "libc.so.6 => /lib/x86_64-linux-gnu/libc.so.6 (0x...)" or
+    // "/lib64/ld-linux-x86-64.so.2 (0x...)", static binaries have none with a path
+    char command[PATH_MAX + 16];
+    strformat(command, sizeof(command), "ldd %s 2>/dev/null", binary);
+    FILE *ldd = popen(command, "r");
+    if (ldd == NULL)
+    {
+        errorMessage("%s\n", "Could not run ldd");
+    }
+    char line[PATH_MAX];
+    while (fgets(line, sizeof(line), ldd) != NULL)
+    {
+        char *library = strchr(line, '/');
+        if (library == NULL)
+            continue;
+        library[strcspn(library, " \n")] = '\0';
+        copy_into_root(root, library);
+    }
+    pclose(ldd);
+
+    char partial[PATH_MAX];
+    strformat(partial, PATH_MAX, "%s.partial", archive);
+    create_directory_exists_ok(NULL, IMAGE_PATH, 0755);
+    char *args[] = {"tar", "-czf", partial, "-C", root, ".", NULL};
+    exec_command("tar", args);
+    if (rename(partial, archive) == -1)
+    {
+        errorMessage("Could not create %s\n", archive);
+    }
+    remove_tree(root);
+}
+
+// Creates the parent interface of the macvlan and ipvlan containers
+static void bench_create_parent(void)
+{
+    struct Netlink nl;
+    netlink_open(&nl);
+    // Left behind by an interrupted benchmark
+    if (if_nametoindex(BENCH_PARENT) != 0)
+    {
+        netlink_delete_link(&nl, BENCH_PARENT);
+        netlink_commit(&nl, 1);
+    }
+    netlink_add_dummy(&nl, BENCH_PARENT);
+    if (netlink_commit(&nl, 1) > 0)
+    {
+        netlink_add_veth(&nl, BENCH_PARENT, BENCH_PARENT_PEER, getpid());
+        netlink_set_up(&nl, BENCH_PARENT_PEER);
+        netlink_commit(&nl, 0);
+    }
+    netlink_add_address(&nl, netlink_link_index(&nl, BENCH_PARENT), BENCH_PARENT_ADDRESS);
+    netlink_set_up(&nl, BENCH_PARENT);
+    netlink_commit(&nl, 0);
+    netlink_close(&nl);
+}
+
+static void bench_delete_parent(void)
+{
+    struct Netlink nl;
+    netlink_open(&nl);
+    netlink_delete_link(&nl, BENCH_PARENT);
+    netlink_commit(&nl, 1);
+    netlink_close(&nl);
+}
+
+// Starts a run of the benchmark command, which records its timestamps in record. network and
+// storage are the values of --network and --storage, NULL for the defaults.
+static pid_t bench_start(struct TraceRecord *record, const char *network, const char *storage)
+{
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        errorMessage("%s\n", "fork() failed");
+    }
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        if (null == -1 || dup2(null, STDOUT_FILENO) == -1)
+        {
+            exit(1);
+        }
+        trace_record = record;
+        char network_option[64];
+        char storage_option[64];
+        strformat(network_option, sizeof(network_option), "--network=%s",
+                  network != NULL ? network : "bridge");
+        strformat(storage_option, sizeof(storage_option), "--storage=%s",
+                  storage != NULL ? storage : "overlay");
+        char *argv[] = {network_option, storage_option, BENCH_IMAGE, BENCH_COMMAND, NULL};
+        cmd_run(4, argv);
+        exit(0);
+    }
+    return pid;
+}
+
+// Waits for a run, returns 0 if it completed
+static int bench_wait(pid_t pid, struct TraceRecord *record)
+{
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    for (int i = 0; i < TRACE_EVENTS; i++)
+    {
+        if (record->events[i] == 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Prints "name": {"p50": ..., "p95": ..., "p99": ...} in milliseconds, using the nearest rank
+static void print_percentiles(const char *name, uint64_t *samples, int n, const char *suffix)
+{
+    qsort(samples, n, sizeof(uint64_t), compare_u64);
+    const int percentiles[] = {50, 95, 99};
+    printf("      \"%s\": {", name);
+    for (int i = 0; i < 3; i++)
+    {
+        int rank = (percentiles[i] * n + 99) / 100;
+        double ms = n > 0 ? samples[rank > 0 ? rank - 1 : 0] / 1e6 : 0;
+        printf("%s\"p%d\": %.3f", i ? ", " : "", percentiles[i], ms);
+    }
+    printf("}%s\n", suffix);
+}
+
+// Runs runs containers, concurrency at a time, and prints the results as a JSON object
+static void bench_series(const char *name, int runs, int concurrency, const char *network,
+                         const char *storage, int last)
+{
+    struct TraceRecord *records = mmap(NULL, runs * sizeof(struct TraceRecord),
+                                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    pid_t *pids = safe_malloc(concurrency * sizeof(pid_t));
+    if (records == MAP_FAILED)
+    {
+        errorMessage("%s\n", "mmap() failed");
+    }
+    memset(records, 0, runs * sizeof(struct TraceRecord));
+    fprintf(stderr, "=> Running %d containers, %d at a time, network %s, storage %s\n", runs,
+            concurrency, network != NULL ? network : "bridge",
+            storage != NULL ? storage : "overlay");
+
+    int completed = 0;
+    // Completed records are moved to the front
+    int *ok = safe_malloc(runs * sizeof(int));
+    uint64_t wall = trace_now();
+    for (int first = 0; first < runs; first += concurrency)
+    {
+        int batch = runs - first < concurrency ? runs - first : concurrency;
+        for (int i = 0; i < batch; i++)
+        {
+            pids[i] = bench_start(&records[first + i], network, storage);
+        }
+        for (int i = 0; i < batch; i++)
+        {
+            if (bench_wait(pids[i], &records[first + i]) == 0)
+                ok[completed++] = first + i;
+        }
+    }
+    wall = trace_now() - wall;
+
+    uint64_t *samples = safe_malloc(runs * sizeof(uint64_t));
+    printf("    \"%s\": {\n", name);
+    printf("      \"runs\": %d,\n", runs);
+    printf("      \"concurrency\": %d,\n", concurrency);
+    printf("      \"failed\": %d,\n", runs - completed);
+    printf("      \"wall_ms\": %.3f,\n", wall / 1e6);
+    for (int i = 0; i < completed; i++)
+    {
+        struct TraceRecord *r = &records[ok[i]];
+        samples[i] = r->events[TRACE_EXEC] - r->events[TRACE_START];
+    }
+    print_percentiles("start_to_exec", samples, completed, ",");
+    for (int i = 0; i < completed; i++)
+    {
+        struct TraceRecord *r = &records[ok[i]];
+        samples[i] = r->events[TRACE_CLEANED] - r->events[TRACE_EXIT];
+    }
+    print_percentiles("exit_to_cleaned", samples, completed, ",");
+    for (int phase = 0; phase < TRACE_PHASES; phase++)
+    {
+        for (int i = 0; i < completed; i++)
+        {
+            struct TraceRecord *r = &records[ok[i]];
+            samples[i] = r->phase_end[phase] - r->phase_begin[phase];
+        }
+        print_percentiles(trace_phase_names[phase], samples, completed,
+                          phase == TRACE_PHASES - 1 ? "" : ",");
+    }
+    printf("    }%s\n", last ? "" : ",");
+
+    free(samples);
+    free(ok);
+    free(pids);
+    munmap(records, runs * sizeof(struct TraceRecord));
+}
+
+// Makes calls system calls in a child which has program installed (none if it is NULL), sets ns
+// to the nanoseconds each call took, of one which is allowed and of one which is denied
+static void bench_seccomp_calls(const struct sock_fprog *program, int calls, double ns[2])
+{
+    int results[2];
+    if (pipe2(results, O_CLOEXEC) == -1)
+    {
+        errorMessage("%s\n", "pipe2() failed");
+    }
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        errorMessage("%s\n", "fork() failed");
+    }
+    if (pid == 0)
+    {
+        if (program != NULL && seccomp_install(program) == -1)
+            _exit(1);
+        uint64_t begin = trace_now();
+        for (int i = 0; i < calls; i++)
+        {
+            syscall(SYS_getppid);
+        }
+        ns[0] = (double)(trace_now() - begin) / calls;
+        // kcmp() of PID 0 fails without doing anything where it is allowed
+        begin = trace_now();
+        for (int i = 0; i < calls; i++)
+        {
+            syscall(SYS_kcmp, 0, 0, 0, 0, 0);
+        }
+        ns[1] = (double)(trace_now() - begin) / calls;
+        _exit(write(results[1], ns, 2 * sizeof(double)) == 2 * sizeof(double) ? 0 : 1);
+    }
+    close(results[1]);
+    int status;
+    if (read(results[0], ns, 2 * sizeof(double)) != 2 * sizeof(double) ||
+        waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        errorMessage("%s\n", "Could not run the system calls with the seccomp filter");
+    }
+    close(results[0]);
+}
+
+// @brief Measures the time a system call takes without a seccomp filter, then with the same
+// allow-list compiled in each order, and prints it as JSON
+// @details The allow-list has every system call the built in profile allows, like the long
+// allow-lists of other runtimes. getppid() is allowed and given as the most frequent call, kcmp()
+// is denied. Kernels since 5.11 skip the filter for system calls it always allows, the calls
+// which are denied still run it.
+static void bench_seccomp(int calls)
+{
+    struct SeccompProfile *profile = safe_malloc(sizeof(struct SeccompProfile));
+    if (seccomp_parse(seccomp_default_profile, profile) == -1)
+    {
+        exit(1);
+    }
+    for (int i = 0; i < SECCOMP_SYSCALLS; i++)
+    {
+        if (profile->actions[i] == SECCOMP_RET_ALLOW && seccomp_syscall_name(i) == NULL)
+            profile->actions[i] = SECCOMP_RET_ERRNO | EPERM;
+    }
+    profile->default_action = SECCOMP_RET_ERRNO | EPERM;
+    profile->frequencies[SYS_getppid] = 1000;
+    profile->frequencies[SYS_read] = 100;
+    profile->frequencies[SYS_write] = 100;
+
+    printf("{\n");
+    printf("  \"calls\": %d,\n", calls);
+    printf("  \"allowed\": \"getppid\",\n");
+    printf("  \"denied\": \"kcmp\",\n");
+    printf("  \"unit\": \"ns\",\n");
+    printf("  \"results\": {\n");
+    double ns[2];
+    bench_seccomp_calls(NULL, calls, ns);
+    printf("    \"none\": {\"allowed\": %.1f, \"denied\": %.1f},\n", ns[0], ns[1]);
+    const char *orders[] = {"linear", "bsearch", "frequency"};
+    const enum SeccompOrder values[] = {SECCOMP_ORDER_LINEAR, SECCOMP_ORDER_BSEARCH,
+                                        SECCOMP_ORDER_FREQUENCY};
+    for (int i = 0; i < 3; i++)
+    {
+        struct sock_fprog program;
+        seccomp_compile(profile, values[i], &program);
+        bench_seccomp_calls(&program, calls, ns);
+        printf("    \"%s\": {\"instructions\": %d, \"allowed\": %.1f, \"denied\": %.1f}%s\n",
+               orders[i], program.len, ns[0], ns[1], i == 2 ? "" : ",");
+        free(program.filter);
+    }
+    printf("  }\n");
+    printf("}\n");
+    free(profile);
+}
+
+/*
+ * @short Benchmarks container start up and tear down
+ * @param argc number of arguments after bench subcommand
+ * @param argv arguments after the bench subcommand: [-n runs] [-c concurrency], or seccomp
+ * [-n calls]
+ */
+void cmd_bench(int argc, char *argv[])
+{
+    if (argc > 0 && strcmp(argv[0], "seccomp") == 0)
+    {
+        int calls = argc == 3 && strcmp(argv[1], "-n") == 0 ? atoi(argv[2]) : 1000000;
+        if ((argc != 1 && argc != 3) || calls < 1)
+        {
+            printf("Usage: ./container bench seccomp [-n calls]\n");
+            exit(1);
+        }
+        bench_seccomp(calls);
+        return;
+    }
+    int runs = 50;
+    int concurrency = 8;
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            runs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            concurrency = atoi(argv[++i]);
+        else
+        {
+            printf("Usage: ./container bench [-n runs] [-c concurrency] | seccomp [-n calls]\n");
+            exit(1);
+        }
+    }
+    if (runs < 1 || concurrency < 1)
+    {
+        fprintf(stderr, "runs and concurrency must be at least 1\n");
+        exit(1);
+    }
+    bench_build_image();
+    // The first run extracts the image, which is not what is being measured
+    struct TraceRecord warmup;
+    trace_record = NULL;
+    pid_t pid = bench_start(&warmup, NULL, NULL);
+    waitpid(pid, NULL, 0);
+    bench_create_parent();
+    fflush(stdout);
+
+    printf("{\n");
+    printf("  \"image\": \"" BENCH_IMAGE "\",\n");
+    printf("  \"command\": \"" BENCH_COMMAND "\",\n");
+    printf("  \"unit\": \"ms\",\n");
+    printf("  \"results\": {\n");
+    fflush(stdout);
+    bench_series("sequential", runs, 1, NULL, NULL, 0);
+    fflush(stdout);
+    bench_series("concurrent", runs, concurrency, NULL, NULL, 0);
+    // The other network modes and storage drivers, one after the other like the sequential runs
+    // in the bridge on an overlay
+    const char *const modes[][3] = {{"network_none", "none", NULL},
+                                    {"network_host", "host", NULL},
+                                    {"network_macvlan", "macvlan:" BENCH_PARENT, NULL},
+                                    {"network_ipvlan", "ipvlan:" BENCH_PARENT, NULL},
+                                    {"storage_reflink", NULL, "reflink"},
+                                    {"storage_btrfs", NULL, "btrfs"}};
+    const int count = sizeof(modes) / sizeof(modes[0]);
+    for (int i = 0; i < count; i++)
+    {
+        fflush(stdout);
+        // The kernel may not support the mode, e.g. without the ipvlan driver, and the
+        // filesystem may not support the storage driver. The first btrfs run also creates the
+        // subvolume of the image.
+        pid = bench_start(&warmup, modes[i][1], modes[i][2]);
+        int status;
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            printf("    \"%s\": {\"unsupported\": true}%s\n", modes[i][0],
+                   i == count - 1 ? "" : ",");
+            continue;
+        }
+        bench_series(modes[i][0], runs, 1, modes[i][1], modes[i][2], i == count - 1);
+    }
+    bench_delete_parent();
+    printf("  }\n");
+    printf("}\n");
+}
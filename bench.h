@@ -0,0 +1,6 @@
+#ifndef CONTAINER_BENCH_H
+#define CONTAINER_BENCH_H
+// Benchmark of starting and tearing down containers
+
+void cmd_bench(int argc, char *argv[]);
+#endif // CONTAINER_BENCH_H
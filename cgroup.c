@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+#include "cgroup.h"
+#include "config.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/magic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+// Every container gets a leaf cgroup CGROUP_PARENT/<id> in the cgroup v2 hierarchy, the
+// controllers needed for its limits are enabled in the subtree_control of the ancestors.
+// The hierarchy is /sys/fs/cgroup on unified systems, and /sys/fs/cgroup/unified on hybrid ones.
+// References:
+// https://docs.kernel.org/admin-guide/cgroup-v2.html
+
+#define CGROUP_CPU_PERIOD 100000
+
+// Returns the mount point of the cgroup v2 hierarchy, or NULL if there is none
+const char *cgroup_root(void)
+{
+    static const char *const candidates[] = {"/sys/fs/cgroup", "/sys/fs/cgroup/unified"};
+    for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++)
+    {
+        struct statfs st;
+        if (statfs(candidates[i], &st) == 0 && st.f_type == CGROUP2_SUPER_MAGIC)
+            return candidates[i];
+    }
+    return NULL;
+}
+
+// Writes value to the control file name of cgroup, returns -1 with errno set on failure
+static int cgroup_write(const char *cgroup, const char *name, const char *value)
+{
+    char path[PATH_MAX];
+    strformat(path, PATH_MAX, "%s/%s", cgroup, name);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    // Control files take a whole value per write()
+    ssize_t n = write(fd, value, strlen(value));
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return n == (ssize_t)strlen(value) ? 0 : -1;
+}
+
+static void cgroup_set(const char *cgroup, const char *name, const char *value)
+{
+    if (cgroup_write(cgroup, name, value) == -1)
+    {
+        errorMessage("Could not set %s to %s in %s\n", name, value, cgroup);
+    }
+}
+
+// Enables controller for the children of cgroup, returns -1 if it is not available
+static int cgroup_try_enable(const char *cgroup, const char *controller)
+{
+    char path[PATH_MAX];
+    char available[1024] = "";
+    strformat(path, PATH_MAX, "%s/cgroup.controllers", cgroup);
+    FILE *f = fopen(path, "r");
+    if (f != NULL)
+    {
+        if (fgets(available, sizeof(available), f) == NULL)
+            available[0] = '\0';
+        fclose(f);
+    }
+    // Controllers are separated by spaces
+    int found = 0;
+    for (char *word = strtok(available, " \n"); word != NULL; word = strtok(NULL, " \n"))
+    {
+        found |= strcmp(word, controller) == 0;
+    }
+    if (!found)
+        return -1;
+    char enable[32];
+    strformat(enable, sizeof(enable), "+%s", controller);
+    cgroup_set(cgroup, "cgroup.subtree_control", enable);
+    return 0;
+}
+
+static void cgroup_enable(const char *cgroup, const char *controller)
+{
+    if (cgroup_try_enable(cgroup, controller) == -1)
+    {
+        fprintf(stderr, "The %s cgroup controller is not available in %s\n", controller, cgroup);
+        exit(1);
+    }
+}
+
+// Parses sizes like 512k, 256m or 1g (powers of 1024) into bytes, returns -1 if invalid
+int cgroup_parse_size(const char *size, long long *bytes)
+{
+    char *end;
+    errno = 0;
+    long long value = strtoll(size, &end, 10);
+    if (errno != 0 || end == size || value < 0)
+        return -1;
+    int shift = 0;
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        shift = 10;
+        break;
+    case 'm':
+    case 'M':
+        shift = 20;
+        break;
+    case 'g':
+    case 'G':
+        shift = 30;
+        break;
+    case '\0':
+        break;
+    default:
+        return -1;
+    }
+    // Sizes which do not fit in bytes are refused rather than wrapped around to small ones
+    if ((*end != '\0' && end[1] != '\0') || value > (LLONG_MAX >> shift))
+        return -1;
+    *bytes = value << shift;
+    return 0;
+}
+
+// io.max takes MAJ:MIN, the device may also be given as the path of a block device
+static void cgroup_set_io_max(const char *cgroup, const char *io_max)
+{
+    char value[256];
+    const char *limits = strchr(io_max, ' ');
+    if (io_max[0] == '/' && limits != NULL)
+    {
+        char device[PATH_MAX];
+        strformat(device, PATH_MAX, "%.*s", (int)(limits - io_max), io_max);
+        struct stat st;
+        if (stat(device, &st) == -1 || !S_ISBLK(st.st_mode))
+        {
+            fprintf(stderr, "%s is not a block device\n", device);
+            exit(1);
+        }
+        strformat(value, sizeof(value), "%u:%u%s", major(st.st_rdev), minor(st.st_rdev), limits);
+    }
+    else
+    {
+        strformat(value, sizeof(value), "%s", io_max);
+    }
+    cgroup_set(cgroup, "io.max", value);
+}
+
+// @brief Creates the cgroup of the container id and applies limits to it
+// @details Returns the path of the cgroup (heap allocated), or NULL if there is no cgroup v2
+// hierarchy and no limits were requested
+char *cgroup_create(const char *id, const struct CgroupLimits *limits)
+{
+    int wants_cpu = limits->cpus > 0 || limits->cpu_weight > 0;
+    int wants_memory = limits->memory > 0 || limits->memory_high > 0;
+    int wants_io = limits->io_max != NULL;
+    int wants_pids = limits->pids > 0;
+    const char *root = cgroup_root();
+    if (root == NULL)
+    {
+        if (wants_cpu || wants_memory || wants_io || wants_pids)
+        {
+            fprintf(stderr, "Resource limits need a cgroup v2 hierarchy\n");
+            exit(1);
+        }
+        return NULL;
+    }
+
+    char parent[PATH_MAX];
+    strformat(parent, PATH_MAX, "%s/" CGROUP_PARENT, root);
+    create_directory_exists_ok(NULL, parent, 0755);
+    const char *controllers[] = {wants_cpu ? "cpu" : NULL, wants_memory ? "memory" : NULL,
+                                 wants_io ? "io" : NULL, wants_pids ? "pids" : NULL};
+    for (size_t i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++)
+    {
+        if (controllers[i] == NULL)
+            continue;
+        cgroup_enable(root, controllers[i]);
+        cgroup_enable(parent, controllers[i]);
+    }
+
+    char *cgroup = safe_malloc(PATH_MAX);
+    strformat(cgroup, PATH_MAX, "%s/%s", parent, id);
+    create_directory(NULL, cgroup, 0755);
+    char value[64];
+    if (limits->cpus > 0)
+    {
+        strformat(value, sizeof(value), "%lld %d",
+                  (long long)(limits->cpus * CGROUP_CPU_PERIOD), CGROUP_CPU_PERIOD);
+        cgroup_set(cgroup, "cpu.max", value);
+    }
+    if (limits->cpu_weight > 0)
+    {
+        strformat(value, sizeof(value), "%d", limits->cpu_weight);
+        cgroup_set(cgroup, "cpu.weight", value);
+    }
+    if (limits->memory > 0)
+    {
+        strformat(value, sizeof(value), "%lld", limits->memory);
+        cgroup_set(cgroup, "memory.max", value);
+    }
+    if (limits->memory_high > 0)
+    {
+        strformat(value, sizeof(value), "%lld", limits->memory_high);
+        cgroup_set(cgroup, "memory.high", value);
+    }
+    if (limits->io_max != NULL)
+    {
+        cgroup_set_io_max(cgroup, limits->io_max);
+    }
+    if (limits->pids > 0)
+    {
+        strformat(value, sizeof(value), "%ld", limits->pids);
+        cgroup_set(cgroup, "pids.max", value);
+    }
+    return cgroup;
+}
+
+// @brief Confines the container id to the CPUs cpus and the memory of the NUMA nodes mems (cpuset
+// lists, mems NULL to leave it as is)
+// @details The cpuset controller is enabled the first time. Returns -1 with errno set if the
+// controller is not available, or the cgroup rejects the lists.
+int cgroup_set_cpuset(const char *id, const char *cpus, const char *mems)
+{
+    static int enabled = 0;
+    const char *root = cgroup_root();
+    char parent[PATH_MAX];
+    if (root == NULL)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    strformat(parent, PATH_MAX, "%s/" CGROUP_PARENT, root);
+    if (!enabled)
+    {
+        if (cgroup_try_enable(root, "cpuset") == -1 || cgroup_try_enable(parent, "cpuset") == -1)
+        {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+        enabled = 1;
+    }
+    char cgroup[PATH_MAX];
+    strformat(cgroup, PATH_MAX, "%s/%s", parent, id);
+    // The memory nodes first, a cgroup with CPUs but no memory node would not be valid
+    if (mems != NULL && cgroup_write(cgroup, "cpuset.mems", mems) == -1)
+        return -1;
+    return cgroup_write(cgroup, "cpuset.cpus", cpus);
+}
+
+// Kills whatever is left in cgroup and removes it
+void cgroup_delete(const char *cgroup)
+{
+    // cgroup.kill exists since Linux 5.14, the processes left are usually already exiting
+    // along with the init of the container anyway
+    cgroup_write(cgroup, "cgroup.kill", "1");
+    // rmdir() fails with EBUSY until the exiting processes are gone
+    for (int i = 0; i < 100; i++)
+    {
+        if (rmdir(cgroup) == 0 || errno == ENOENT)
+            return;
+        if (errno != EBUSY)
+            break;
+        nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+    }
+    fprintf(stderr, "Could not remove cgroup %s: %s\n", cgroup, strerror(errno));
+}
+
+// Opens the cgroup v2 directory of process pid, returns -1 if there is none
+int cgroup_open_process(pid_t pid)
+{
+    const char *root = cgroup_root();
+    if (root == NULL)
+        return -1;
+    char path[PATH_MAX];
+    strformat(path, sizeof(path), "/proc/%d/cgroup", (int)pid);
+    FILE *file = fopen(path, "re");
+    if (file == NULL)
+        return -1;
+    // The cgroup v2 hierarchy is the "0::<path>" line
+    char line[PATH_MAX];
+    int fd = -1;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (strncmp(line, "0::", 3) != 0)
+            continue;
+        line[strcspn(line, "\n")] = '\0';
+        strformat(path, sizeof(path), "%s%s", root, line + 3);
+        fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        break;
+    }
+    fclose(file);
+    return fd;
+}
@@ -0,0 +1,29 @@
+#ifndef CONTAINER_CGROUP_H
+#define CONTAINER_CGROUP_H
+// cgroup v2 leaf per container, with its resource limits
+#include <sys/types.h>
+
+// Unset limits are 0 (or NULL), and are left to the kernel defaults
+struct CgroupLimits
+{
+    // cpu.max, in number of CPUs (1.5 allows 150ms of CPU time every 100ms)
+    double cpus;
+    // cpu.weight, between 1 and 10000
+    int cpu_weight;
+    // memory.max and memory.high, in bytes
+    long long memory;
+    long long memory_high;
+    // io.max, "<device> rbps=... wbps=... riops=... wiops=...", where device is either MAJ:MIN
+    // or the path of a block device
+    const char *io_max;
+    // pids.max
+    long pids;
+};
+
+const char *cgroup_root(void);
+int cgroup_parse_size(const char *size, long long *bytes);
+char *cgroup_create(const char *id, const struct CgroupLimits *limits);
+void cgroup_delete(const char *cgroup);
+int cgroup_open_process(pid_t pid);
+int cgroup_set_cpuset(const char *id, const char *cpus, const char *mems);
+#endif // CONTAINER_CGROUP_H
@@ -5,9 +5,39 @@
 // path which contains the images
 #define IMAGE_PATH "images"
 #define CONTAINER_ID_LENGTH 10
-#define STACK_SIZE 8*1024*1024 // 8MiB of stack size for child process
 #define ARG_MAX_LEN 4096
-#define BRIDGE_NAME "docker0"
-#define BRIDGE_GATEWAY "172.17.0.1"
-#define CONTAINER_IP "172.17.0.8/16"
+// Bridge which containers are connected to, it is created when the first container is run
+#define BRIDGE_NAME "ctr0"
+#define BRIDGE_GATEWAY "172.30.0.1"
+// Subnet of the bridge, the addresses of containers are allocated in it
+#define BRIDGE_SUBNET "172.30.0.0/16"
+// nftables table (of the ip family) with the NAT rules of the bridge
+#define NFT_TABLE "container"
+// Number of threads which write out files while extracting an image
+#define EXTRACT_WRITER_THREADS 4
+// Maximum amount of file data queued for the writer threads at any time
+#define EXTRACT_QUEUE_BYTES 64*1024*1024
+// Files larger than this are written by the tar parser itself instead of being queued
+#define EXTRACT_INLINE_SIZE 8*1024*1024
+// Number of threads which remove the files of deleted containers
+#define TRASH_REAPER_THREADS 8
+// Directory (in CONTAINER_PATH) of the template which /dev of every container is cloned from
+#define DEV_TEMPLATE "__dev"
+// Size limit of the /dev/shm tmpfs of each container
+#define DEV_SHM_SIZE "64m"
+// Size of the tmpfs of run --ephemeral when none is given
+#define EPHEMERAL_SIZE "512m"
+// Directory (in CONTAINER_PATH) of the compiled seccomp profiles, named by the hash of the profile
+#define SECCOMP_CACHE "__seccomp"
+// Number of the most frequent system calls of a profile which its program checks before searching
+#define SECCOMP_HOT_SYSCALLS 8
+// File (in CONTAINER_PATH) recording the CPUs given to containers by run --cpus-exclusive/--numa
+#define PLACEMENT_STATE "__cpuset"
+// How long (in milliseconds) to wait for an answer to the ARP probe of the address of a macvlan
+// or ipvlan container, a host which answers already uses the address
+#define ARP_PROBE_MS 200
+// Number of addresses found in use on the network of a macvlan or ipvlan parent before giving up
+#define ARP_PROBE_ATTEMPTS 8
+// cgroup (below the root of the cgroup v2 hierarchy) in which each container gets its own cgroup
+#define CGROUP_PARENT "container"
 #endif
@@ -1,77 +1,38 @@
+#define _GNU_SOURCE
 #include "container.h"
+#include "cgroup.h"
 #include "config.h"
+#include "image.h"
+#include "ipam.h"
+#include "netlink.h"
+#include "nftables.h"
+#include "placement.h"
+#include "trace.h"
+#include "trash.h"
 #include "utils.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <net/route.h>
+#include <netinet/if_ether.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/sysmacros.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-// Creates a directory using the mkdir() system call
-// prefix is a path to add before the directory, like container root location
-// if prefix is null, or empty, no prefix is added
-void create_directory(const char *prefix, const char *path, mode_t mode)
-{
-    static char buffer[PATH_MAX];
-    if (prefix == NULL || prefix[0] == '\0')
-    {
-        strformat(buffer, PATH_MAX, "%s", path);
-    }
-    else
-    {
-        strformat(buffer, PATH_MAX, "%s/%s", prefix, path);
-    }
-    if (mkdir(buffer, mode) == -1)
-    {
-        errorMessage("%s%s\n", "mkdir() failed to create ", buffer);
-    }
-}
-
-// Same as create_directory, but does not fail if the directory exists
-void create_directory_exists_ok(const char *prefix, const char *path, mode_t mode)
-{
-    static char buffer[PATH_MAX];
-    if (prefix == NULL || prefix[0] == '\0')
-    {
-        strformat(buffer, PATH_MAX, "%s", path);
-    }
-    else
-    {
-        strformat(buffer, PATH_MAX, "%s/%s", prefix, path);
-    }
-    if (mkdir(buffer, mode) == -1)
-    {
-        if (errno == EEXIST)
-            return;
-        errorMessage("%s\n", "mkdir() failed");
-    }
-}
-
-// Creates the parents of the directory if they do not exist
-// Does not modify the mode of the parent and does not error if exists
-// behaves like mkdir -p
-void create_directory_parents(const char *prefix, const char *path, mode_t mode)
-{
-    static char buffer[PATH_MAX];
-    if (prefix == NULL || prefix[0] == '\0')
-    {
-        strformat(buffer, PATH_MAX, "%s", path);
-    }
-    else
-    {
-        strformat(buffer, PATH_MAX, "%s/%s", prefix, path);
-    }
-    // TODO
-    printf("Not implemented");
-    exit(3);
-}
-
 // @brief Creates a new directory in [container.containers_path] for this container
 // @details containers_path must be set before calling this function.
 // Note this function also creates an ID for the container
@@ -83,46 +44,95 @@ void container_create(struct Container *container)
 
     char *container_dir = safe_malloc(PATH_MAX);
     strformat(container_dir, PATH_MAX, "%s/%s", container->containers_path, id_buf);
+    create_directory_exists_ok(NULL, container->containers_path, 0755);
 
     // If a file/folder by the same name exists, keep generating random IDs till a unique name is
-    // found
-    while (exists(container_dir))
+    // found. mkdir() fails if the directory exists, so two processes cannot pick the same ID.
+    while (mkdir(container_dir, 0755) == -1)
     {
+        if (errno != EEXIST)
+        {
+            errorMessage("mkdir() failed to create %s\n", container_dir);
+        }
         random_id(id_buf, container->id_length);
         id_buf[container->id_length] = '\0';
         strformat(container_dir, PATH_MAX, "%s/%s", container->containers_path, id_buf);
     }
-    char *args[] = {"mkdir", "-p", container_dir, NULL};
-    exec_command("mkdir", args);
     container->container_dir = container_dir;
     container->id = id_buf;
+    // Finish removing containers whose reaper was interrupted
+    trash_reap_async(container->containers_path);
 }
 
-// Extracts the image if it is being used for the first time
+// Extracts the image if it is being used for the first time. If a read-only (erofs or
+// squashfs) version of the image exists, it is mounted and used instead, without extraction.
+// This must run in the host mount namespace, so that the mount is shared between containers.
+// For multi-layer images, image_path is a list of layers separated by ':'
 void container_extract_image(struct Container *container)
 {
-    char *path = safe_malloc(PATH_MAX);
-    strformat(path, PATH_MAX, "%s/__extracted/%s", container->containers_path,
-              container->image_name);
-    container->image_path = path;
-    if (exists(path))
+    // Only the overlay can use mounted and multi-layer images
+    if (container->storage == STORAGE_OVERLAY)
     {
-        printf("=> Found existing image cache, not extracting\n");
+        container->image_path = image_mount_lookup(container->containers_path,
+                                                   container->images_path, container->image_name);
     }
-    else
+    if (container->image_path == NULL && container->storage == STORAGE_OVERLAY)
+    {
+        container->image_path = image_layers_lookup(
+            container->containers_path, container->images_path, container->image_name);
+    }
+    if (container->image_path == NULL)
     {
-        printf("=> %s is being used for the first time ... extracting\n", container->image_name);
-        create_directory_exists_ok(container->containers_path, "__extracted", 0755);
-        create_directory(NULL, path, 0755);
-        char image_archive_path[PATH_MAX];
-        strformat(image_archive_path, PATH_MAX, "%s/%s.tar.gz", container->images_path,
-                  container->image_name);
-        char *tar_args[] = {"tar", "xf", image_archive_path, "-C", path, NULL};
-        exec_command("tar", tar_args);
+        container->image_path = image_cache_lookup(
+            container->containers_path, container->images_path, container->image_name);
     }
+    storage_create(container);
 }
 
-void container_create_overlayfs(struct Container *container)
+// Creates a detached mount of fstype, options are pairs of fsconfig() keys and values (NULL for
+// flags), terminated by NULL. attributes are MOUNT_ATTR_* flags of the mount, they are given
+// here since mount_setattr() only accepts the root of a tree which is still detached.
+// Returns the file descriptor of the mount.
+static int container_fsmount(const char *fstype, const char *const *options,
+                             unsigned int attributes)
+{
+    int fs = fsopen(fstype, FSOPEN_CLOEXEC);
+    if (fs == -1)
+    {
+        fprintf(stderr, "Error creating %s: %s\n", fstype, strerror(errno));
+        exit(1);
+    }
+    int failed = 0;
+    for (int i = 0; options != NULL && options[i] != NULL && !failed; i += 2)
+    {
+        if (options[i + 1] == NULL)
+            failed = fsconfig(fs, FSCONFIG_SET_FLAG, options[i], NULL, 0) == -1;
+        else
+            failed = fsconfig(fs, FSCONFIG_SET_STRING, options[i], options[i + 1], 0) == -1;
+    }
+    if (!failed)
+        failed = fsconfig(fs, FSCONFIG_CMD_CREATE, NULL, NULL, 0) == -1;
+    int mnt = failed ? -1 : fsmount(fs, FSMOUNT_CLOEXEC, attributes);
+    if (mnt == -1)
+    {
+        fprintf(stderr, "Error mounting %s: %s\n", fstype, strerror(errno));
+        // The filesystem usually explains itself in the log of the context, one message per line
+        char log[512];
+        ssize_t n;
+        while ((n = read(fs, log, sizeof(log) - 1)) > 0)
+        {
+            log[n] = '\0';
+            fprintf(stderr, "%s\n", log);
+        }
+        exit(1);
+    }
+    close(fs);
+    return mnt;
+}
+
+// @brief Creates the overlay which is the root of the container, as a detached mount
+// @return the file descriptor of the mount, the root of the mount tree of the container
+int container_create_overlayfs(struct Container *container)
 {
     // Create overlayfs
     // https://www.kernel.org/doc/Documentation/filesystems/overlayfs.txt
@@ -130,282 +140,832 @@ void container_create_overlayfs(struct Container *container)
     char *rootdir = safe_malloc(PATH_MAX);
     char *diffdir = safe_malloc(PATH_MAX);
 
-    strformat(workdir, PATH_MAX, "%s/work", container->container_dir, container->id);
     strformat(rootdir, PATH_MAX, "%s/root", container->container_dir, container->id);
-    strformat(diffdir, PATH_MAX, "%s/diff", container->container_dir, container->id);
-
-    create_directory(NULL, workdir, 0755);
     create_directory(NULL, rootdir, 0755);
-    create_directory(NULL, diffdir, 0755);
+    int tmpfs_fd = -1;
+    if (container->ephemeral > 0)
+    {
+        // The upper and work directories are on a tmpfs which is never attached anywhere, it
+        // goes away along with the overlay. Its pages are charged to the memory cgroup of the
+        // container, whose processes write them.
+        char size[32];
+        strformat(size, sizeof(size), "%lld", container->ephemeral);
+        const char *const tmpfs_options[] = {"size", size, "mode", "755", NULL};
+        tmpfs_fd = container_fsmount("tmpfs", tmpfs_options, 0);
+        if (mkdirat(tmpfs_fd, "diff", 0755) == -1 || mkdirat(tmpfs_fd, "work", 0755) == -1)
+        {
+            perror("Error creating the ephemeral upper directory");
+            exit(1);
+        }
+        strformat(workdir, PATH_MAX, "/proc/self/fd/%d/work", tmpfs_fd);
+        strformat(diffdir, PATH_MAX, "/proc/self/fd/%d/diff", tmpfs_fd);
+    }
+    else
+    {
+        strformat(workdir, PATH_MAX, "%s/work", container->container_dir, container->id);
+        strformat(diffdir, PATH_MAX, "%s/diff", container->container_dir, container->id);
+        create_directory(NULL, workdir, 0755);
+        create_directory(NULL, diffdir, 0755);
+    }
 
-    char *opts_string = safe_malloc(PATH_MAX * 4);
-    strformat(opts_string, PATH_MAX * 4, "lowerdir=%s,upperdir=%s,workdir=%s",
-              container->image_path, diffdir, workdir);
-    if (mount("overlay", rootdir, "overlay", 0, opts_string) == -1)
+    // Overlays mounted in a user namespace only take layers which are mounted in its mount
+    // namespace, the idmapped layers are attached in the directory of the container first
+    char *lowerdir = container->image_path;
+    if (container->idmapped_layers_count > 0)
     {
-        fprintf(stderr, "Error mounting overlay %s\n", strerror(errno));
-        exit(1);
+        lowerdir = safe_malloc(PATH_MAX);
+        size_t length = 0;
+        for (int i = 0; i < container->idmapped_layers_count; i++)
+        {
+            char layer[PATH_MAX];
+            strformat(layer, PATH_MAX, "%s/lower%d", container->container_dir, i);
+            create_directory(NULL, layer, 0755);
+            if (move_mount(container->idmapped_layers[i], "", AT_FDCWD, layer,
+                           MOVE_MOUNT_F_EMPTY_PATH) == -1)
+            {
+                fprintf(stderr, "Error mounting %s: %s\n", layer, strerror(errno));
+                exit(1);
+            }
+            close(container->idmapped_layers[i]);
+            length += strformat(lowerdir + length, PATH_MAX - length, "%s%s",
+                                i > 0 ? ":" : "", layer);
+        }
+    }
+    // fsconfig() only takes strings of up to 256 bytes, longer stacks of layers are given one
+    // layer at a time with lowerdir+ (Linux 6.8)
+    int layers_count = 1;
+    for (const char *p = lowerdir; *p != '\0'; p++)
+        layers_count += *p == ':';
+    const char **options = safe_malloc((2 * layers_count + 7) * sizeof(char *));
+    char *layers = NULL;
+    int n = 0;
+    if (strlen(lowerdir) < 256)
+    {
+        options[n++] = "lowerdir";
+        options[n++] = lowerdir;
+    }
+    else
+    {
+        layers = strdup(lowerdir);
+        char *save;
+        for (char *layer = strtok_r(layers, ":", &save); layer != NULL;
+             layer = strtok_r(NULL, ":", &save))
+        {
+            options[n++] = "lowerdir+";
+            options[n++] = layer;
+        }
+    }
+    options[n++] = "upperdir";
+    options[n++] = diffdir;
+    options[n++] = "workdir";
+    options[n++] = workdir;
+    // In a user namespace, the overlay keeps its metadata in user.* instead of trusted.* extended
+    // attributes, which only the root of the host may set
+    if (container->uid_map_count > 0)
+    {
+        options[n++] = "userxattr";
+        options[n++] = NULL;
     }
+    options[n] = NULL;
+    int root_fd = container_fsmount("overlay", options, 0);
+    free(options);
+    free(layers);
+    if (tmpfs_fd != -1)
+        close(tmpfs_fd);
+    if (lowerdir != container->image_path)
+        free(lowerdir);
     container->root = rootdir;
-    free(opts_string);
     free(diffdir);
     free(workdir);
+    return root_fd;
 }
 
 void container_delete(struct Container *container)
 {
-    char *args[10];
-    char *fmt = safe_malloc(ARG_MAX_LEN);
-
-    strformat(fmt, ARG_MAX_LEN, "vb%s", container->id);
-    args[0] = "ip";
-    args[1] = "link";
-    args[2] = "delete";
-    args[3] = fmt;
-    args[4] = NULL;
-    exec_command_fail_ok("ip", args);
-
-    strformat(fmt, ARG_MAX_LEN, "ns%s", container->id);
-    args[0] = "ip";
-    args[1] = "netns";
-    args[2] = "delete";
-    args[3] = fmt;
-    args[4] = NULL;
-    exec_command_fail_ok("ip", args);
-    free(fmt);
+    // Deleting the host side of the veth pair also deletes the peer, the network namespace
+    // itself (along with macvlan and ipvlan interfaces) goes away with the last process in the
+    // container
+    char br[IFNAMSIZ];
+    strformat(br, IFNAMSIZ, "vb%s", container->id);
+    if (container->network == NETWORK_BRIDGE && if_nametoindex(br) != 0)
+    {
+        struct Netlink nl;
+        netlink_open(&nl);
+        netlink_delete_link(&nl, br);
+        netlink_commit(&nl, 1);
+        netlink_close(&nl);
+    }
+    if (container->ports_count > 0)
+    {
+        nftables_unpublish(container->id);
+    }
+    if (container->address != 0)
+    {
+        ipam_release(container->containers_path, container->subnet, container->id,
+                     container->address);
+    }
+
     printf("=> Removing container\n");
-    // Delete container
-    char *rmargs[] = {"rm", "-rf", container->container_dir, NULL};
-    exec_command_fail_ok("rm", rmargs);
+    // The overlay normally goes away with the mount namespace of the container, unless it is
+    // still mounted in the namespace of this process
+    char root[PATH_MAX];
+    strformat(root, PATH_MAX, "%s/root", container->container_dir);
+    umount2(root, MNT_DETACH);
+    storage_delete(container);
+    // Removing the files of the container can take a while, it is done in the background
+    trash_move(container->containers_path, container->container_dir);
+    trash_reap_async(container->containers_path);
+    if (container->cgroup != NULL)
+    {
+        cgroup_delete(container->cgroup);
+        placement_release(container->containers_path, container->id);
+    }
 }
 
-// Creates a mount point within the root of the container
-void container_create_mountpoint(struct Container *container, const char *mpoint, mode_t mode,
-                                 const char *fstype, char *options)
+// Creates the mount point path (relative to root_fd) along with its parents, unless it exists.
+// mode is S_IFDIR or S_IFREG with the permissions. No component may be a symlink, since the
+// image could point it anywhere on the host.
+static void container_create_mount_point(int root_fd, const char *path, mode_t mode)
 {
-    static char path[PATH_MAX];
-    strformat(path, PATH_MAX, "%s/%s", container->root, mpoint);
-    create_directory_exists_ok(NULL, path, mode);
-    if (mount(NULL, path, fstype, 0, options) == -1)
+    char components[PATH_MAX];
+    strformat(components, sizeof(components), "%s", path);
+    int dir_fd = dup(root_fd);
+    char *saveptr;
+    char *name = strtok_r(components, "/", &saveptr);
+    while (name != NULL)
     {
-        fprintf(stderr, "Error mounting %s: %s\n", path, strerror(errno));
-        exit(1);
+        char *next = strtok_r(NULL, "/", &saveptr);
+        int last = next == NULL;
+        struct stat st;
+        if (strcmp(name, "..") == 0)
+        {
+            errno = EINVAL;
+        }
+        else if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+        {
+            int expected = last ? (int)(mode & S_IFMT) : S_IFDIR;
+            errno = (int)(st.st_mode & S_IFMT) == expected ? 0 : ENOTDIR;
+        }
+        else if (errno == ENOENT && (!last || S_ISDIR(mode)))
+        {
+            errno = mkdirat(dir_fd, name, last ? mode & ~S_IFMT : 0755) == 0 ? 0 : errno;
+        }
+        else if (errno == ENOENT)
+        {
+            int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                            mode & ~S_IFMT);
+            errno = fd == -1 ? errno : 0;
+            if (fd != -1)
+                close(fd);
+        }
+        if (errno == 0 && !last)
+        {
+            int fd = openat(dir_fd, name, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            close(dir_fd);
+            dir_fd = fd;
+        }
+        if (errno != 0 || dir_fd == -1)
+        {
+            fprintf(stderr, "Error creating mount point /%s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+        name = next;
     }
+    close(dir_fd);
 }
 
-// Note: mode must be a combination of S_IF* with a permission such as 0755 using OR
-void container_create_node(struct Container *container, const char *node_path, mode_t mode,
-                           unsigned int devmajor, unsigned int devminor)
+// Mounts mount_fd on path (relative to the root of the mount tree root_fd), creating the mount
+// point. Kernels before 6.15 cannot mount on top of a tree which is still detached, the tree is
+// then attached at container->root first.
+static void container_attach_below(struct Container *container, int root_fd, int *attached,
+                                   int mount_fd, const char *path, mode_t mode)
 {
-    static char path[PATH_MAX];
-    int status = snprintf(path, PATH_MAX, "%s/%s", container->root, node_path);
-    if (status < 0 || status >= PATH_MAX)
+    container_create_mount_point(root_fd, path, mode);
+    int status = move_mount(mount_fd, "", root_fd, path, MOVE_MOUNT_F_EMPTY_PATH);
+    if (status == -1 && errno == EINVAL && !*attached)
+    {
+        if (move_mount(root_fd, "", AT_FDCWD, container->root, MOVE_MOUNT_F_EMPTY_PATH) == -1)
+        {
+            fprintf(stderr, "Error attaching %s: %s\n", container->root, strerror(errno));
+            exit(1);
+        }
+        *attached = 1;
+        status = move_mount(mount_fd, "", root_fd, path, MOVE_MOUNT_F_EMPTY_PATH);
+    }
+    if (status == -1)
     {
-        fprintf(stderr, "Either the path was too large or snprintf failed.\n");
+        fprintf(stderr, "Error mounting %s: %s\n", path, strerror(errno));
         exit(1);
     }
+    close(mount_fd);
+}
+
+// Note: mode must be a combination of S_IF* with a permission such as 0755 using OR
+static void container_create_node(int dev_fd, const char *name, mode_t mode,
+                                  unsigned int devmajor, unsigned int devminor)
+{
     dev_t device = makedev(devmajor, devminor);
     // References:
     // https://man7.org/linux/man-pages/man7/inode.7.html
     // https://man7.org/linux/man-pages/man2/mknod.2.html
     // https://git.kernel.org/pub/scm/linux/kernel/git/torvalds/linux.git/tree/Documentation/admin-guide/devices.txt
-    if (mknod(path, mode, device) == -1)
+    if (mknodat(dev_fd, name, mode, device) == -1)
     {
-        fprintf(stderr, "Error creating node at %s: %s\n", path, strerror(errno));
+        fprintf(stderr, "Error creating node at /dev/%s: %s\n", name, strerror(errno));
         exit(1);
     }
 }
 
-// Creates a symlink from->to, if prefix_from is 1, the container's root path is prepended
-// to from, and if prefix_to is 1, the container's root path is prepended to to.
-void container_create_symlink(struct Container *container, int prefix_from, char *from,
-                              int prefix_to, char *to)
+// Creates the symlink /dev/name -> target
+static void container_create_symlink(int dev_fd, const char *target, const char *name)
 {
-    static char from_path[PATH_MAX];
-    static char to_path[PATH_MAX];
+    if (symlinkat(target, dev_fd, name) == -1)
+    {
+        fprintf(stderr, "Error creating symlink /dev/%s->%s\n", name, target);
+    }
+}
 
-    if (prefix_from)
+// Mounts a volume below root_fd. Bind mounts are recursive and private, so that mounts on either
+// side do not propagate to the other one; read-only applies to the submounts as well.
+static void container_mount_volume(struct Container *container, int root_fd, int *attached,
+                                   const struct Volume *volume)
+{
+    int mount_fd;
+    mode_t mode = S_IFDIR | 0755;
+    if (volume->source == NULL)
     {
-        strformat(from_path, PATH_MAX, "%s/%s", container->root, from);
+        char size[32];
+        strformat(size, sizeof(size), "%lld", volume->size);
+        const char *const options[] = {"mode", "1777", volume->size > 0 ? "size" : NULL, size,
+                                       NULL};
+        mount_fd = container_fsmount("tmpfs", options, MOUNT_ATTR_NOSUID | MOUNT_ATTR_NODEV);
     }
     else
     {
-        strformat(from_path, PATH_MAX, "%s", from);
+        struct stat st;
+        if (stat(volume->source, &st) == -1)
+        {
+            fprintf(stderr, "Error mounting %s: %s\n", volume->source, strerror(errno));
+            exit(1);
+        }
+        if (!S_ISDIR(st.st_mode))
+            mode = S_IFREG | 0644;
+        mount_fd = open_tree(AT_FDCWD, volume->source,
+                             OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE);
+        struct mount_attr attr = {
+            .attr_set = volume->read_only ? MOUNT_ATTR_RDONLY : 0,
+            .propagation = MS_PRIVATE,
+        };
+        if (mount_fd == -1 ||
+            mount_setattr(mount_fd, "", AT_EMPTY_PATH | AT_RECURSIVE, &attr, sizeof(attr)) == -1)
+        {
+            fprintf(stderr, "Error mounting %s: %s\n", volume->source, strerror(errno));
+            exit(1);
+        }
     }
+    container_attach_below(container, root_fd, attached, mount_fd, volume->target + 1, mode);
+}
 
-    if (prefix_to)
+// Returns a directory file descriptor of the /dev template, CONTAINER_PATH/__dev, building it
+// first if it does not exist yet. The template holds the nodes, the symlinks and the mount points
+// of /dev, every container gets a read-only clone of it.
+static int container_dev_template(const char *containers_path)
+{
+    char path[PATH_MAX];
+    strformat(path, PATH_MAX, "%s/" DEV_TEMPLATE, containers_path);
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd != -1)
+        return fd;
+
+    // Built aside and renamed into place, so that concurrent runs never see half of it
+    char building[PATH_MAX];
+    strformat(building, PATH_MAX, "%s.%d", path, (int)getpid());
+    remove_tree(building);
+    create_directory(NULL, building, 0755);
+    int dev_fd = open(building, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dev_fd == -1)
     {
-        strformat(to_path, PATH_MAX, "%s/%s", container->root, to);
+        errorMessage("Could not open %s\n", building);
     }
+    // The permissions are given as is
+    mode_t mask = umask(0);
+    container_create_node(dev_fd, "urandom", S_IFCHR | 0666, 1, 9);
+    container_create_node(dev_fd, "random", S_IFCHR | 0666, 1, 8);
+    container_create_node(dev_fd, "full", S_IFCHR | 0666, 1, 7);
+    container_create_node(dev_fd, "zero", S_IFCHR | 0666, 1, 5);
+    container_create_node(dev_fd, "null", S_IFCHR | 0666, 1, 3);
+    container_create_node(dev_fd, "tty", S_IFCHR | 0666, 5, 0);
+    container_create_node(dev_fd, "console", S_IFCHR | 0620, 5, 1);
+    container_create_node(dev_fd, "ptmx", S_IFCHR | 0620, 5, 2);
+    umask(mask);
+
+    // Create symlinks such as /dev/stdin
+    container_create_symlink(dev_fd, "/proc/self/fd/0", "stdin");
+    container_create_symlink(dev_fd, "/proc/self/fd/1", "stdout");
+    container_create_symlink(dev_fd, "/proc/self/fd/2", "stderr");
+    container_create_symlink(dev_fd, "/proc/kcore", "kcore");
+    container_create_symlink(dev_fd, "/proc/fd", "fd");
+    const char *mount_points[] = {"pts", "shm", "mqueue"};
+    for (size_t i = 0; i < sizeof(mount_points) / sizeof(mount_points[0]); i++)
+    {
+        if (mkdirat(dev_fd, mount_points[i], 0755) == -1)
+        {
+            fprintf(stderr, "Error creating /dev/%s: %s\n", mount_points[i], strerror(errno));
+            exit(1);
+        }
+    }
+    close(dev_fd);
+    if (rename(building, path) == -1)
+    {
+        // Another run was faster
+        if (errno != EEXIST && errno != ENOTEMPTY)
+        {
+            errorMessage("Could not rename %s to %s\n", building, path);
+        }
+        remove_tree(building);
+    }
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        errorMessage("Could not open %s\n", path);
+    }
+    return fd;
+}
+
+// @brief Does what a container cannot do from its user namespace, before it is cloned
+// @details Idmapped mounts of the layers of the image are made (the child inherits them), the
+// /dev template is created if needed, and the directory of the container is given to its
+// root, who creates the directories of the overlay in it
+void container_prepare_userns(struct Container *container)
+{
+    close(container_dev_template(container->containers_path));
+    int userns_fd = userns_create(container->uid_map, container->uid_map_count,
+                                  container->gid_map, container->gid_map_count);
+    container->idmapped_layers =
+        userns_idmap_layers(container->image_path, userns_fd, &container->idmapped_layers_count);
+    close(userns_fd);
+    if (chown(container->container_dir,
+              userns_host_id(container->uid_map, container->uid_map_count, 0),
+              userns_host_id(container->gid_map, container->gid_map_count, 0)) == -1)
+    {
+        errorMessage("Could not change the owner of %s\n", container->container_dir);
+    }
+}
+
+// @brief Mounts /proc, /sys and /dev in the mount tree root_fd, and attaches the tree at
+// container->root
+// @details The mounts are created detached and put together with move_mount(), relative to
+// root_fd, so that nothing is looked up through the paths of the host. If setting up fails
+// half way, the detached mounts simply go away along with the process.
+// /dev is a read-only clone of the template, only devpts, /dev/shm and /dev/mqueue are mounted
+// per container.
+void container_create_mounts(struct Container *container, int root_fd)
+{
+    int attached = 0;
+    const unsigned int api = MOUNT_ATTR_NOSUID | MOUNT_ATTR_NODEV | MOUNT_ATTR_NOEXEC;
+    container_attach_below(container, root_fd, &attached, container_fsmount("proc", NULL, api),
+                           "proc", S_IFDIR | 0555);
+    container_attach_below(container, root_fd, &attached,
+                           container_fsmount("sysfs", NULL, api | MOUNT_ATTR_RDONLY), "sys",
+                           S_IFDIR | 0555);
+
+    int template_fd = container_dev_template(container->containers_path);
+    int dev_fd = open_tree(template_fd, "", AT_EMPTY_PATH | OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+    close(template_fd);
+    // The clone has the flags of the mount the template is on, which may well be nodev
+    struct mount_attr attr = {
+        .attr_set = MOUNT_ATTR_RDONLY | MOUNT_ATTR_NOSUID | MOUNT_ATTR_NOEXEC,
+        .attr_clr = MOUNT_ATTR_NODEV,
+    };
+    if (dev_fd == -1 || mount_setattr(dev_fd, "", AT_EMPTY_PATH, &attr, sizeof(attr)) == -1)
+    {
+        perror("Error cloning /dev");
+        exit(1);
+    }
+    container_attach_below(container, root_fd, &attached, dev_fd, "dev", S_IFDIR | 0755);
+    container_attach_below(container, root_fd, &attached,
+                           container_fsmount("devpts", NULL, MOUNT_ATTR_NOSUID | MOUNT_ATTR_NOEXEC),
+                           "dev/pts", S_IFDIR | 0755);
+    const char *const shm_options[] = {"mode", "1777", "size", DEV_SHM_SIZE, NULL};
+    container_attach_below(container, root_fd, &attached,
+                           container_fsmount("tmpfs", shm_options, api), "dev/shm",
+                           S_IFDIR | 0755);
+    // The message queues of the IPC namespace of the container
+    container_attach_below(container, root_fd, &attached, container_fsmount("mqueue", NULL, api),
+                           "dev/mqueue", S_IFDIR | 0755);
+
+    for (int i = 0; i < container->volumes_count; i++)
+    {
+        container_mount_volume(container, root_fd, &attached, &container->volumes[i]);
+    }
+
+    // The whole tree appears at once
+    if (!attached &&
+        move_mount(root_fd, "", AT_FDCWD, container->root, MOVE_MOUNT_F_EMPTY_PATH) == -1)
+    {
+        fprintf(stderr, "Error attaching %s: %s\n", container->root, strerror(errno));
+        exit(1);
+    }
+}
+
+// Creates the bridge along with its NAT rules, unless it exists already. Concurrent runs wait
+// for the one which creates it.
+static void container_setup_bridge(const char *containers_path)
+{
+    if (if_nametoindex(BRIDGE_NAME) != 0)
+        return;
+    char path[PATH_MAX];
+    create_directory_exists_ok(NULL, containers_path, 0755);
+    strformat(path, PATH_MAX, "%s/__network.lock", containers_path);
+    int lock = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock == -1 || flock(lock, LOCK_EX) == -1)
+    {
+        errorMessage("Could not lock %s\n", path);
+    }
+    if (if_nametoindex(BRIDGE_NAME) == 0)
+    {
+        printf("=> Creating bridge %s\n", BRIDGE_NAME);
+        char gateway[32];
+        strformat(gateway, sizeof(gateway), "%s%s", BRIDGE_GATEWAY, strchr(BRIDGE_SUBNET, '/'));
+        struct Netlink nl;
+        netlink_open(&nl);
+        netlink_add_bridge(&nl, BRIDGE_NAME);
+        netlink_commit(&nl, 0);
+        netlink_add_address(&nl, netlink_link_index(&nl, BRIDGE_NAME), gateway);
+        netlink_set_up(&nl, BRIDGE_NAME);
+        netlink_commit(&nl, 0);
+        netlink_close(&nl);
+        // Containers reach the outside through the masquerade rule
+        int forward = open("/proc/sys/net/ipv4/ip_forward", O_WRONLY | O_CLOEXEC);
+        if (forward == -1 || write(forward, "1", 1) != 1)
+        {
+            perror("Could not enable IPv4 forwarding");
+        }
+        if (forward != -1)
+            close(forward);
+        nftables_setup();
+    }
+    close(lock);
+}
+
+// Parses the value of --network, none, host, bridge, macvlan:<parent> or ipvlan:<parent>.
+// Returns -1 if it is invalid.
+int container_parse_network(const char *value, enum NetworkMode *mode, const char **parent)
+{
+    *parent = NULL;
+    if (strcmp(value, "bridge") == 0)
+        *mode = NETWORK_BRIDGE;
+    else if (strcmp(value, "none") == 0)
+        *mode = NETWORK_NONE;
+    else if (strcmp(value, "host") == 0)
+        *mode = NETWORK_HOST;
+    else if (strncmp(value, "macvlan:", 8) == 0 && value[8] != '\0')
+        *mode = NETWORK_MACVLAN, *parent = value + 8;
+    else if (strncmp(value, "ipvlan:", 7) == 0 && value[7] != '\0')
+        *mode = NETWORK_IPVLAN, *parent = value + 7;
     else
+        return -1;
+    return 0;
+}
+
+// Parses the value of -v, host_path:container_path[:ro|:rw], both paths being absolute. Returns
+// -1 if it is invalid.
+int container_parse_volume(char *value, struct Volume *volume)
+{
+    memset(volume, 0, sizeof(struct Volume));
+    char *target = strchr(value, ':');
+    if (target == NULL)
+        return -1;
+    *target++ = '\0';
+    char *flags = strchr(target, ':');
+    if (flags != NULL)
     {
-        strformat(to_path, PATH_MAX, "%s", to);
+        *flags++ = '\0';
+        if (strcmp(flags, "ro") == 0)
+            volume->read_only = 1;
+        else if (strcmp(flags, "rw") != 0)
+            return -1;
     }
-    if (symlink(from_path, to_path) == -1)
+    volume->source = value;
+    volume->target = target;
+    return value[0] == '/' && target[0] == '/' && target[1] != '\0' ? 0 : -1;
+}
+
+// Parses the value of --tmpfs, container_path[:size]. Returns -1 if it is invalid.
+int container_parse_tmpfs(char *value, struct Volume *volume)
+{
+    memset(volume, 0, sizeof(struct Volume));
+    char *size = strchr(value, ':');
+    if (size != NULL)
     {
-        fprintf(stderr, "Error creating symlink between %s->%s\n", from_path, to_path);
+        *size++ = '\0';
+        if (cgroup_parse_size(size, &volume->size) == -1 || volume->size == 0)
+            return -1;
     }
+    volume->target = value;
+    return value[0] == '/' && value[1] != '\0' ? 0 : -1;
 }
 
-void container_create_mounts(struct Container *container)
+// Finds the subnet of the IPv4 address of the interface ifname, and the addresses in it which
+// belong to the host: the address of the interface and the gateway of its default route, if any
+static void container_parent_subnet(const char *ifname, char *subnet, size_t size,
+                                    uint32_t *address, uint32_t *gateway)
 {
-    // Mount /proc, /sys and /dev
-    container_create_mountpoint(container, "proc", 0555, "proc", NULL);
-    container_create_mountpoint(container, "sys", 0555, "sysfs", NULL);
-    container_create_mountpoint(container, "dev", 0755, "tmpfs", NULL);
-    container_create_mountpoint(container, "dev/pts", 0755, "devpts", NULL);
-
-    // Mount other devices in /dev
-    container_create_node(container, "dev/urandom", S_IFCHR | 0666, 1, 9);
-    container_create_node(container, "dev/random", S_IFCHR | 0666, 1, 8);
-    container_create_node(container, "dev/full", S_IFCHR | 0666, 1, 7);
-    container_create_node(container, "dev/zero", S_IFCHR | 0666, 1, 5);
-    container_create_node(container, "dev/null", S_IFCHR | 0666, 1, 3);
-    container_create_node(container, "dev/tty", S_IFCHR | 0666, 5, 0);
-    container_create_node(container, "dev/console", S_IFCHR | 0620, 5, 1);
-    container_create_node(container, "dev/ptmx", S_IFCHR | 0620, 5, 2);
+    struct ifaddrs *addresses;
+    if (getifaddrs(&addresses) == -1)
+    {
+        errorMessage("%s\n", "getifaddrs() failed");
+    }
+    *address = 0;
+    uint32_t mask = 0;
+    for (struct ifaddrs *ifa = addresses; ifa != NULL; ifa = ifa->ifa_next)
+    {
+        if (ifa->ifa_addr != NULL && ifa->ifa_addr->sa_family == AF_INET &&
+            strcmp(ifa->ifa_name, ifname) == 0)
+        {
+            *address = ntohl(((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr);
+            mask = ntohl(((struct sockaddr_in *)ifa->ifa_netmask)->sin_addr.s_addr);
+            break;
+        }
+    }
+    freeifaddrs(addresses);
+    if (*address == 0)
+    {
+        fprintf(stderr, "%s has no IPv4 address to take the subnet of the container from\n",
+                ifname);
+        exit(1);
+    }
+    uint32_t network = *address & mask;
+    strformat(subnet, size, "%u.%u.%u.%u/%d", network >> 24, (network >> 16) & 0xff,
+              (network >> 8) & 0xff, network & 0xff, __builtin_popcount(mask));
+
+    // Lines of /proc/net/route are "<iface> <destination> <gateway> <flags> ...", with the
+    // addresses in hexadecimal, in network byte order
+    *gateway = 0;
+    FILE *routes = fopen("/proc/net/route", "re");
+    char line[256];
+    while (routes != NULL && fgets(line, sizeof(line), routes) != NULL)
+    {
+        char iface[IFNAMSIZ + 1];
+        unsigned int destination, via, flags;
+        if (sscanf(line, "%16s %x %x %x", iface, &destination, &via, &flags) == 4 &&
+            strcmp(iface, ifname) == 0 && destination == 0 && (flags & RTF_GATEWAY))
+        {
+            *gateway = ntohl(via);
+            break;
+        }
+    }
+    if (routes != NULL)
+        fclose(routes);
+}
 
-    // Create symlinks such as /dev/stdin
-    container_create_symlink(container, 0, "/proc/self/fd/0", 1, "dev/stdin");
-    container_create_symlink(container, 0, "/proc/self/fd/1", 1, "dev/stdout");
-    container_create_symlink(container, 0, "/proc/self/fd/2", 1, "dev/stderr");
-    container_create_symlink(container, 0, "/proc/kcore", 1, "dev/kcore");
-    container_create_symlink(container, 0, "/proc/fd", 1, "dev/fd");
-    // TODO:
-    // Add the following to /dev
-    // drwxrwxrwt 1777 mqueue
-    // drwxrwxrwt 1777 shm
+// Returns 1 if a host on the network of ifname answers an ARP probe (RFC 5227) for address.
+// Links without ARP, such as dummy interfaces, have nobody to ask.
+static int container_address_in_use(const char *ifname, uint32_t address)
+{
+    int fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, htons(ETH_P_ARP));
+    if (fd == -1)
+    {
+        errorMessage("%s\n", "Could not open a packet socket for ARP");
+    }
+    struct ifreq ifr = {0};
+    strformat(ifr.ifr_name, IFNAMSIZ, "%s", ifname);
+    if (ioctl(fd, SIOCGIFFLAGS, &ifr) == -1)
+    {
+        errorMessage("Could not get the flags of %s\n", ifname);
+    }
+    if (ifr.ifr_flags & (IFF_NOARP | IFF_LOOPBACK))
+    {
+        close(fd);
+        return 0;
+    }
+    if (ioctl(fd, SIOCGIFHWADDR, &ifr) == -1)
+    {
+        errorMessage("Could not get the hardware address of %s\n", ifname);
+    }
+
+    // A probe has no sender address, so that it does not update the ARP caches of other hosts
+    struct ether_arp probe = {0};
+    probe.arp_hrd = htons(ARPHRD_ETHER);
+    probe.arp_pro = htons(ETH_P_IP);
+    probe.arp_hln = ETH_ALEN;
+    probe.arp_pln = 4;
+    probe.arp_op = htons(ARPOP_REQUEST);
+    memcpy(probe.arp_sha, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+    uint32_t target = htonl(address);
+    memcpy(probe.arp_tpa, &target, 4);
+    struct sockaddr_ll to = {.sll_family = AF_PACKET,
+                             .sll_protocol = htons(ETH_P_ARP),
+                             .sll_ifindex = (int)if_nametoindex(ifname),
+                             .sll_halen = ETH_ALEN};
+    memset(to.sll_addr, 0xff, ETH_ALEN);
+    if (bind(fd, (struct sockaddr *)&to, sizeof(to)) == -1 ||
+        sendto(fd, &probe, sizeof(probe), 0, (struct sockaddr *)&to, sizeof(to)) == -1)
+    {
+        errorMessage("Could not send an ARP probe on %s\n", ifname);
+    }
+
+    // Any ARP packet sent from address means that it is taken
+    int in_use = 0;
+    struct timespec deadline, now;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += (long)ARP_PROBE_MS * 1000000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    while (!in_use)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long timeout = (deadline.tv_sec - now.tv_sec) * 1000 +
+                       (deadline.tv_nsec - now.tv_nsec) / 1000000;
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (timeout <= 0 || poll(&pfd, 1, (int)timeout) <= 0)
+            break;
+        struct ether_arp answer;
+        if (recv(fd, &answer, sizeof(answer), 0) == (ssize_t)sizeof(answer) &&
+            memcmp(answer.arp_spa, &target, 4) == 0)
+        {
+            in_use = 1;
+        }
+    }
+    close(fd);
+    return in_use;
+}
+
+// Creates a macvlan or ipvlan interface on top of network_parent inside the network namespace
+// of the container, with an address in the subnet of network_parent.
+// Other hosts on that network know nothing of the addresses given out here, so each one is
+// probed with ARP first. Those found in use are reserved for good, and the next one is tried.
+static void container_connect_to_parent(struct Container *container, pid_t pid)
+{
+    uint32_t reserved[2 + ARP_PROBE_ATTEMPTS];
+    int reserved_count = 2;
+    container_parent_subnet(container->network_parent, container->subnet,
+                            sizeof(container->subnet), &reserved[0], &reserved[1]);
+    for (;;)
+    {
+        container->address = ipam_allocate(container->containers_path, container->subnet,
+                                           reserved, reserved_count, container->id, pid);
+        if (!container_address_in_use(container->network_parent, container->address))
+            break;
+        ipam_release(container->containers_path, container->subnet, container->id,
+                     container->address);
+        if (reserved_count == 2 + ARP_PROBE_ATTEMPTS)
+        {
+            fprintf(stderr, "No free IP address found on the network of %s\n",
+                    container->network_parent);
+            exit(1);
+        }
+        reserved[reserved_count++] = container->address;
+    }
+    char cidr[32];
+    ipam_format(cidr, sizeof(cidr), container->subnet, container->address);
+    char eth[IFNAMSIZ];
+    strformat(eth, IFNAMSIZ, "eth%s", container->id);
+
+    struct Netlink host;
+    netlink_open(&host);
+    netlink_add_macvlan(&host, eth, container->network == NETWORK_IPVLAN ? "ipvlan" : "macvlan",
+                        container->network_parent, pid);
+    netlink_commit(&host, 0);
+    netlink_close(&host);
+
+    struct Netlink ns;
+    netlink_open_pid_netns(&ns, pid);
+    int eth_index = netlink_link_index(&ns, eth);
+    netlink_set_up(&ns, "lo");
+    netlink_add_address(&ns, eth_index, cidr);
+    netlink_set_up(&ns, eth);
+    if (reserved[1] != 0)
+    {
+        char gateway[INET_ADDRSTRLEN];
+        struct in_addr via = {.s_addr = htonl(reserved[1])};
+        inet_ntop(AF_INET, &via, gateway, sizeof(gateway));
+        netlink_add_default_route(&ns, gateway);
+    }
+    netlink_commit(&ns, 0);
+    netlink_close(&ns);
+}
+
+// Creates a veth pair between the bridge and the network namespace of the container, and
+// configures the container side. All of the work is done over rtnetlink in two batches, one for
+// the host namespace and one for the container namespace.
+static void container_connect_to_bridge(struct Container *container, pid_t pid)
+{
+    container_setup_bridge(container->containers_path);
+    char eth[IFNAMSIZ];
+    char br[IFNAMSIZ];
+    strformat(eth, IFNAMSIZ, "eth%s", container->id);
+    strformat(br, IFNAMSIZ, "vb%s", container->id);
+
+    strformat(container->subnet, sizeof(container->subnet), "%s", BRIDGE_SUBNET);
+    struct in_addr gateway;
+    inet_pton(AF_INET, BRIDGE_GATEWAY, &gateway);
+    uint32_t reserved = ntohl(gateway.s_addr);
+    container->address = ipam_allocate(container->containers_path, container->subnet, &reserved,
+                                       1, container->id, pid);
+    char cidr[32];
+    ipam_format(cidr, sizeof(cidr), container->subnet, container->address);
+
+    struct Netlink host;
+    netlink_open(&host);
+    netlink_add_veth(&host, br, eth, pid);
+    netlink_set_master(&host, br, BRIDGE_NAME);
+    netlink_set_up(&host, br);
+    netlink_commit(&host, 0);
+    netlink_close(&host);
+
+    struct Netlink ns;
+    netlink_open_pid_netns(&ns, pid);
+    int eth_index = netlink_link_index(&ns, eth);
+    netlink_set_up(&ns, "lo");
+    netlink_add_address(&ns, eth_index, cidr);
+    netlink_set_up(&ns, eth);
+    netlink_add_default_route(&ns, BRIDGE_GATEWAY);
+    netlink_commit(&ns, 0);
+    netlink_close(&ns);
+    if (container->ports_count > 0)
+    {
+        nftables_publish(container->id, container->address, container->ports,
+                         container->ports_count);
+    }
+}
+
+// @brief Sets up the root filesystem of the container and moves the calling process into it
+// @details Must be called from the cloned child, inside its new mount and UTS namespaces.
+// On return, the root of the calling process is the root of the container.
+void container_enter(struct Container *container)
+{
+    if (sethostname(container->id, container->id_length) == -1)
+    {
+        perror("Could not set hostname");
+        exit(1);
+    }
+    // Mount the root file system as private so that mount events do not propagate in and out of
+    // it
+    struct mount_attr private = {.propagation = MS_PRIVATE};
+    if (mount_setattr(AT_FDCWD, "/", AT_RECURSIVE, &private, sizeof(private)) == -1)
+    {
+        perror("mount root");
+        exit(1);
+    }
+    trace_begin(TRACE_OVERLAY);
+    int root_fd = storage_mount(container);
+    trace_end(TRACE_OVERLAY);
+    trace_begin(TRACE_MOUNTS);
+    container_create_mounts(container, root_fd);
+    trace_end(TRACE_MOUNTS);
+
+    trace_begin(TRACE_PIVOT_ROOT);
+    // With both the new and the old root being ".", the old root ends up mounted on top of the
+    // new one, from where it is detached. No directory is needed to put it in.
+    if (fchdir(root_fd) == -1)
+    {
+        perror("chdir");
+        exit(1);
+    }
+    close(root_fd);
+    if (syscall(SYS_pivot_root, ".", ".") == -1)
+    {
+        perror("Pivot root");
+        exit(1);
+    }
+    if (umount2(".", MNT_DETACH) == -1)
+    {
+        perror("umount2");
+        exit(1);
+    }
+    if (chdir("/") == -1)
+    {
+        perror("chdir");
+        exit(1);
+    }
+    trace_end(TRACE_PIVOT_ROOT);
 }
 
-void container_connect_to_bridge(struct Container *container, pid_t pid)
+// Sets up the network of the container pid according to its network mode
+void container_connect_network(struct Container *container, pid_t pid)
 {
     printf("=> Bringing up network interfaces\n");
-    char *argument1 = safe_malloc(ARG_MAX_LEN);
-    char *argument2 = safe_malloc(ARG_MAX_LEN);
-    char *ns = safe_malloc(ARG_MAX_LEN);
-
-    // Arbitrarily set 10 as the max number of arguments
-    char *args[10];
-
-    args[0] = "ip";
-    args[1] = "netns";
-    args[2] = "add";
-    args[3] = "temp";
-    args[4] = NULL;
-    exec_command("ip", args);
-
-    args[2] = "delete";
-    exec_command("ip", args);
-
-    strformat(argument1, ARG_MAX_LEN, "/var/run/netns/ns%s", container->id);
-    args[0] = "touch";
-    args[1] = argument1;
-    args[2] = NULL;
-    exec_command("touch", args);
-
-    args[0] = "chmod";
-    args[1] = "0";
-    args[2] = argument1;
-    args[3] = NULL;
-    exec_command("chmod", args);
-
-    strformat(argument1, ARG_MAX_LEN, "/proc/%d/ns/net", pid);
-    strformat(argument2, ARG_MAX_LEN, "/var/run/netns/ns%s", container->id);
-    args[0] = "mount";
-    args[1] = "--bind";
-    args[2] = argument1;
-    args[3] = argument2;
-    args[4] = NULL;
-    exec_command("mount", args);
-
-
-    strformat(argument1, ARG_MAX_LEN, "eth%s", container->id);
-    strformat(argument2, ARG_MAX_LEN, "vb%s", container->id);
-    args[0] = "ip";
-    args[1] = "link";
-    args[2] = "add";
-    args[3] = argument1;
-    args[4] = "type";
-    args[5] = "veth";
-    args[6] = "peer";
-    args[7] = "name";
-    args[8] = argument2;
-    args[9] = NULL;
-    exec_command("ip", args);
-
-    strformat(ns, ARG_MAX_LEN, "ns%s", container->id);
-    char *eth = argument1;
-    char *br = argument2;
-
-    args[0] = "ip";
-    args[1] = "link";
-    args[2] = "set";
-    args[3] = eth;
-    args[4] = "netns";
-    args[5] = ns;
-    args[6] = NULL;
-    exec_command("ip", args);
-
-    args[0] = "ip";
-    args[1] = "link";
-    args[2] = "set";
-    args[3] = br;
-    args[4] = "master";
-    args[5] = BRIDGE_NAME;
-    args[6] = NULL;
-    exec_command("ip", args);
-
-    args[0] = "ip";
-    args[1] = "-n";
-    args[2] = ns;
-    args[3] = "addr";
-    args[4] = "add";
-    args[5] = CONTAINER_IP;
-    args[6] = "dev";
-    args[7] = eth;
-    args[8] = NULL;
-    exec_command("ip", args);
-
-    args[0] = "ip";
-    args[1] = "-n";
-    args[2] = ns;
-    args[3] = "link";
-    args[4] = "set";
-    args[5] = eth;
-    args[6] = "up";
-    args[7] = NULL;
-    exec_command("ip", args);
-
-    args[0] = "ip";
-    args[1] = "-n";
-    args[2] = ns;
-    args[3] = "link";
-    args[4] = "set";
-    args[5] = "lo";
-    args[6] = "up";
-    args[7] = NULL;
-    exec_command("ip", args);
-
-    args[0] = "ip";
-    args[1] = "-n";
-    args[2] = ns;
-    args[3] = "route";
-    args[4] = "add";
-    args[5] = "default";
-    args[6] = "via";
-    args[7] = BRIDGE_GATEWAY;
-    args[8] = NULL;
-    exec_command("ip", args);
-
-    args[0] = "ip";
-    args[1] = "link";
-    args[2] = "set";
-    args[3] = br;
-    args[4] = "up";
-    args[5] = NULL;
-    exec_command("ip", args);
-    
-    free(ns);
-    free(argument1);
-    free(argument2);
+    switch (container->network)
+    {
+    case NETWORK_BRIDGE:
+        container_connect_to_bridge(container, pid);
+        break;
+    case NETWORK_MACVLAN:
+    case NETWORK_IPVLAN:
+        container_connect_to_parent(container, pid);
+        break;
+    case NETWORK_NONE:
+    {
+        struct Netlink ns;
+        netlink_open_pid_netns(&ns, pid);
+        netlink_set_up(&ns, "lo");
+        netlink_commit(&ns, 0);
+        netlink_close(&ns);
+        break;
+    }
+    case NETWORK_HOST:
+        // The container was not given a network namespace of its own
+        break;
+    }
 }
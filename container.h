@@ -1,5 +1,34 @@
 #ifndef CONTAINER_CONTAINER_H
 #define CONTAINER_CONTAINER_H
+#include "nftables.h"
+#include "storage.h"
+#include "userns.h"
+#include <stdint.h>
+
+enum NetworkMode
+{
+    // veth pair into the bridge, with NAT
+    NETWORK_BRIDGE,
+    // Only a loopback interface
+    NETWORK_NONE,
+    // The network namespace of the host
+    NETWORK_HOST,
+    // macvlan or ipvlan interface on top of network_parent, with an address in its subnet
+    NETWORK_MACVLAN,
+    NETWORK_IPVLAN
+};
+
+// A bind mount of a path of the host, or a tmpfs if source is NULL
+struct Volume
+{
+    const char *source;
+    // Absolute path in the container
+    const char *target;
+    int read_only;
+    // Size limit of a tmpfs, 0 for the default of the kernel
+    long long size;
+};
+
 struct Container{
     // ID of the container
     char *id;
@@ -14,16 +43,49 @@ struct Container{
     
     // The directory in which files related to this container are stored
     char *container_dir;
-    // The directory which acts as lowerdir for overlayfs
+    // The directory (or ':' separated directories, top layer first) which acts as lowerdir for
+    // overlayfs
     char *image_path;
     // The path to the root of this container
     char *root;
+    // The cgroup of this container, NULL if it does not have one
+    char *cgroup;
+    enum NetworkMode network;
+    // Interface which macvlan and ipvlan interfaces are created on top of
+    const char *network_parent;
+    // IP address of the container in host byte order, 0 until it is connected, and the subnet
+    // (a.b.c.d/prefix) it was allocated from
+    uint32_t address;
+    char subnet[20];
+    // Ports of the container published on the host
+    const struct PublishedPort *ports;
+    int ports_count;
+    // Size of the tmpfs which holds the upper and work directories of the overlay, 0 to keep
+    // them in container_dir
+    long long ephemeral;
+    enum StorageDriver storage;
+    // Maps of the user namespace of the container, which has none if uid_map_count is 0
+    const struct IdMap *uid_map;
+    int uid_map_count;
+    const struct IdMap *gid_map;
+    int gid_map_count;
+    // Idmapped mounts of the layers of the image for the user namespace, made by the parent
+    int *idmapped_layers;
+    int idmapped_layers_count;
+    // Mounted in the order given, after /proc, /sys and /dev
+    const struct Volume *volumes;
+    int volumes_count;
 };
 
 void container_create(struct Container *container);
 void container_extract_image(struct Container *container);
-void container_create_overlayfs(struct Container *container);
-void container_create_mounts(struct Container *container);
+int container_create_overlayfs(struct Container *container);
+void container_create_mounts(struct Container *container, int root_fd);
 void container_delete(struct Container *container);
-void container_connect_to_bridge(struct Container *container, int pid);
+int container_parse_volume(char *value, struct Volume *volume);
+int container_parse_tmpfs(char *value, struct Volume *volume);
+int container_parse_network(const char *value, enum NetworkMode *mode, const char **parent);
+void container_prepare_userns(struct Container *container);
+void container_connect_network(struct Container *container, int pid);
+void container_enter(struct Container *container);
 #endif // COTNAINER_CONTAINER_H
\ No newline at end of file
@@ -0,0 +1,908 @@
+#define _GNU_SOURCE
+#include "daemon.h"
+#include "cgroup.h"
+#include "config.h"
+#include "ipam.h"
+#include "ipc.h"
+#include "run.h"
+#include "seccomp.h"
+#include "stats.h"
+#include "userns.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/pidfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// ./container daemon listens on containers/__daemon.sock. While it runs, run, ps, stop and exec
+// are thin clients which send their request (along with the environment and stdin, stdout and
+// stderr of the client, over SCM_RIGHTS) and wait for the reply.
+//
+// Each container is run by a shim, a process forked from the daemon which goes through
+// cmd_run like ./container run would, without having to exec and initialize a new program.
+// Errors in the set up of a container end its shim, not the daemon. The shim reports the ID
+// and PID of the container on a pipe, and the daemon keeps track of both the shim and the
+// container through pidfds in a single epoll loop. Exec runs a command in the namespaces and
+// cgroup of a container, through a shim as well. The daemon also samples the resource usage of
+// its containers on request, keeping their cgroup files open between requests.
+
+#define DAEMON_SOCKET "__daemon.sock"
+
+// Requests, sent by the clients
+#define DAEMON_RUN 1
+#define DAEMON_EXEC 2
+#define DAEMON_STOP 3
+#define DAEMON_LIST 4
+#define DAEMON_SIGNAL 5
+#define DAEMON_STATS 6
+// Replies, sent by the daemon. Started has the container ID as its string, exited has the wait
+// status as its value, output and error have text to print as their string. Output too large
+// for a message is passed as a file instead.
+#define DAEMON_STARTED 16
+#define DAEMON_EXITED 17
+#define DAEMON_OUTPUT 18
+#define DAEMON_ERROR 19
+
+// Value of a run request: the index of the image name in its arguments, shifted left by one,
+// or'ed with DAEMON_DETACH to not wait for the container to exit
+#define DAEMON_DETACH 1
+
+enum WatchKind
+{
+    WATCH_LISTEN,
+    WATCH_SIGNAL,
+    WATCH_SHIM,
+    WATCH_NOTIFY,
+    WATCH_CLIENT,
+    WATCH_REQUEST
+};
+
+// What an epoll event is about
+struct Watch
+{
+    enum WatchKind kind;
+    struct Task *task;
+    // Connection of a client whose request has not arrived yet, for WATCH_REQUEST
+    int fd;
+};
+
+// A container run, or a command exec'd in a container
+struct Task
+{
+    int is_exec;
+    // ID of the container, empty until the shim has reported it
+    char id[CONTAINER_ID_LENGTH + 1];
+    char image[NAME_MAX + 1];
+    char command[128];
+    time_t started;
+    pid_t shim_pid;
+    int shim_pidfd;
+    // Pipe on which the shim of a run reports the ID and PID of the container
+    int notify_fd;
+    pid_t container_pid;
+    int container_pidfd;
+    // Whether the container was run with --seccomp, and its program, which commands exec'd in
+    // it get as well (filter is NULL if it could not be loaded)
+    int has_seccomp;
+    struct sock_fprog seccomp;
+    // Connection of the client waiting for the exit status, -1 if there is none
+    int client_fd;
+    int detach;
+    struct Watch shim_watch;
+    struct Watch notify_watch;
+    struct Watch client_watch;
+    struct Task *next;
+};
+
+struct Daemon
+{
+    int epoll_fd;
+    int listen_fd;
+    int signal_fd;
+    struct Task *tasks;
+    struct Watch listen_watch;
+    struct Watch signal_watch;
+    struct Stats stats;
+};
+
+static void daemon_socket_path(char *buffer)
+{
+    strformat(buffer, PATH_MAX, "%s/" DAEMON_SOCKET, CONTAINER_PATH);
+}
+
+static void daemon_watch(struct Daemon *d, int fd, struct Watch *watch)
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = watch};
+    if (epoll_ctl(d->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    {
+        errorMessage("%s\n", "epoll_ctl() failed");
+    }
+}
+
+static void daemon_close(struct Daemon *d, int *fd)
+{
+    if (*fd == -1)
+        return;
+    epoll_ctl(d->epoll_fd, EPOLL_CTL_DEL, *fd, NULL);
+    close(*fd);
+    *fd = -1;
+}
+
+// Sends a reply with an optional string
+static void daemon_reply(int fd, uint32_t type, uint32_t value, const char *text)
+{
+    char *message = safe_malloc(IPC_MESSAGE_MAX);
+    struct IpcHeader header = {.type = type, .value = value};
+    char *strings[] = {(char *)text, NULL};
+    size_t length = ipc_pack(message, &header, text != NULL ? strings : NULL, NULL);
+    if (length > 0)
+    {
+        ipc_send(fd, message, length, NULL, 0);
+    }
+    free(message);
+}
+
+static void join_words(char *buffer, size_t size, char *const words[])
+{
+    buffer[0] = '\0';
+    for (int i = 0; words[i] != NULL; i++)
+    {
+        size_t used = strlen(buffer);
+        snprintf(buffer + used, size - used, "%s%s", i ? " " : "", words[i]);
+    }
+}
+
+// Makes the received stdio the stdio of a shim, and resets what the daemon changed
+static void shim_setup(const int *fds, char **envp)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        if (dup2(fds[i], i) == -1)
+        {
+            _exit(1);
+        }
+    }
+    // The daemon may have been started with signals ignored, which would then never reach the
+    // container
+    for (int sig = 1; sig < NSIG; sig++)
+    {
+        signal(sig, SIG_DFL);
+    }
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    environ = envp;
+}
+
+static struct Task *task_new(struct Daemon *d, int client, int is_exec, char *const command[])
+{
+    struct Task *task = safe_malloc(sizeof(struct Task));
+    memset(task, 0, sizeof(struct Task));
+    task->is_exec = is_exec;
+    task->started = time(NULL);
+    task->notify_fd = -1;
+    task->container_pidfd = -1;
+    task->client_fd = client;
+    task->shim_watch = (struct Watch){WATCH_SHIM, task, -1};
+    task->notify_watch = (struct Watch){WATCH_NOTIFY, task, -1};
+    task->client_watch = (struct Watch){WATCH_CLIENT, task, -1};
+    join_words(task->command, sizeof(task->command), command);
+    task->next = d->tasks;
+    d->tasks = task;
+    return task;
+}
+
+static void task_started(struct Daemon *d, struct Task *task, pid_t shim)
+{
+    task->shim_pid = shim;
+    task->shim_pidfd = pidfd_open(shim, 0);
+    if (task->shim_pidfd == -1)
+    {
+        errorMessage("%s\n", "pidfd_open() failed");
+    }
+    daemon_watch(d, task->shim_pidfd, &task->shim_watch);
+    if (task->client_fd != -1 && !task->detach)
+    {
+        daemon_watch(d, task->client_fd, &task->client_watch);
+    }
+}
+
+static struct Task *task_find(struct Daemon *d, const char *id)
+{
+    for (struct Task *task = d->tasks; task != NULL; task = task->next)
+    {
+        if (!task->is_exec && strcmp(task->id, id) == 0)
+            return task;
+    }
+    return NULL;
+}
+
+// Reaps the shim of task, reports its exit status to the client and forgets about the task
+static void task_exited(struct Daemon *d, struct Task *task)
+{
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    waitid(P_PIDFD, task->shim_pidfd, &info, WEXITED);
+    int status = info.si_code == CLD_EXITED ? W_EXITCODE(info.si_status, 0)
+                                            : W_EXITCODE(0, info.si_status);
+    if (task->client_fd != -1)
+    {
+        daemon_reply(task->client_fd, DAEMON_EXITED, (uint32_t)status, NULL);
+    }
+    if (!task->is_exec)
+    {
+        printf("=> Container %s exited with status %d\n", task->id[0] ? task->id : "(starting)",
+               WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    }
+    daemon_close(d, &task->shim_pidfd);
+    daemon_close(d, &task->notify_fd);
+    daemon_close(d, &task->client_fd);
+    if (task->container_pidfd != -1)
+        close(task->container_pidfd);
+    free(task->seccomp.filter);
+    for (struct Task **p = &d->tasks; *p != NULL; p = &(*p)->next)
+    {
+        if (*p == task)
+        {
+            *p = task->next;
+            break;
+        }
+    }
+    free(task);
+}
+
+// Starts a shim which runs a container, argv are the arguments of ./container run
+static void daemon_run_container(struct Daemon *d, int client, char **argv, char **envp,
+                                 const int *fds, uint32_t value)
+{
+    int argc = 0;
+    while (argv[argc] != NULL)
+        argc++;
+    int first = (int)(value >> 1);
+    if (first >= argc - 1)
+    {
+        daemon_reply(client, DAEMON_ERROR, 0, "Malformed request");
+        close(client);
+        return;
+    }
+    int notify[2];
+    if (pipe2(notify, O_CLOEXEC) == -1)
+    {
+        daemon_reply(client, DAEMON_ERROR, 0, "pipe2() failed");
+        close(client);
+        return;
+    }
+    fflush(stdout);
+    pid_t shim = fork();
+    if (shim == 0)
+    {
+        shim_setup(fds, envp);
+        // Only stdio and the notify pipe are kept, the rest belongs to the daemon
+        if (dup2(notify[1], 3) == -1)
+        {
+            _exit(1);
+        }
+        close_range(4, ~0U, 0);
+        run_notify_fd = 3;
+        // Otherwise every shim would pick the same container ID
+        srand(time(NULL) ^ getpid());
+        cmd_run(argc, argv);
+        exit(0);
+    }
+    close(notify[1]);
+    if (shim == -1)
+    {
+        close(notify[0]);
+        daemon_reply(client, DAEMON_ERROR, 0, "fork() failed");
+        close(client);
+        return;
+    }
+    struct Task *task = task_new(d, client, 0, argv + first + 1);
+    strformat(task->image, sizeof(task->image), "%s", argv[first]);
+    task->detach = value & DAEMON_DETACH;
+    task->notify_fd = notify[0];
+    daemon_watch(d, task->notify_fd, &task->notify_watch);
+    task_started(d, task, shim);
+}
+
+static pid_t exec_child = 0;
+
+static void exec_forward_signal(int sig)
+{
+    if (exec_child > 0)
+        kill(exec_child, sig);
+}
+
+// Starts a shim which runs argv[1..] in the container argv[0]
+static void daemon_exec(struct Daemon *d, int client, char **argv, char **envp, const int *fds)
+{
+    struct Task *container = argv[0] != NULL ? task_find(d, argv[0]) : NULL;
+    if (container == NULL || container->container_pidfd == -1 || argv[1] == NULL)
+    {
+        daemon_reply(client, DAEMON_ERROR, 0, "No such running container");
+        close(client);
+        return;
+    }
+    // Running the command unfiltered would defeat the profile of the container
+    if (container->has_seccomp && container->seccomp.filter == NULL)
+    {
+        daemon_reply(client, DAEMON_ERROR, 0, "Could not load the seccomp filter of the container");
+        close(client);
+        return;
+    }
+    pid_t target = container->container_pid;
+    int target_pidfd = container->container_pidfd;
+    fflush(stdout);
+    pid_t shim = fork();
+    if (shim == 0)
+    {
+        shim_setup(fds, envp);
+        // Opened before joining the mount namespace of the container, which has no cgroupfs
+        int cgroup_fd = cgroup_open_process(target);
+        // A container with a user namespace is joined last, after joining its cgroup, which
+        // needs the privileges this process has outside of it
+        char path[PATH_MAX];
+        struct stat own;
+        struct stat theirs;
+        strformat(path, sizeof(path), "/proc/%d/ns/user", (int)target);
+        int userns = stat("/proc/self/ns/user", &own) == 0 && stat(path, &theirs) == 0 &&
+                     own.st_ino != theirs.st_ino;
+        if (setns(target_pidfd, CONTAINER_NAMESPACES) == -1)
+        {
+            perror("setns");
+            _exit(1);
+        }
+        close_range(3, ~0U, CLOSE_RANGE_CLOEXEC);
+        // Joining the PID namespace only applies to children
+        exec_child = fork();
+        if (exec_child == 0)
+        {
+            if (cgroup_fd != -1)
+            {
+                int procs = openat(cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+                if (procs == -1 || write(procs, "0", 1) != 1)
+                {
+                    perror("Could not join the cgroup of the container");
+                    _exit(1);
+                }
+            }
+            if (userns)
+            {
+                if (setns(target_pidfd, CLONE_NEWUSER) == -1)
+                {
+                    perror("setns");
+                    _exit(1);
+                }
+                userns_become_root();
+            }
+            if (container->seccomp.filter != NULL && seccomp_install(&container->seccomp) == -1)
+            {
+                perror("Could not install the seccomp filter");
+                _exit(1);
+            }
+            execvp(argv[1], argv + 1);
+            fprintf(stderr, "execvp %s: %s\n", argv[1], strerror(errno));
+            _exit(127);
+        }
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = exec_forward_signal;
+        const int forwarded[] = {SIGINT, SIGTERM, SIGHUP, SIGQUIT, SIGUSR1, SIGUSR2};
+        for (size_t i = 0; i < sizeof(forwarded) / sizeof(forwarded[0]); i++)
+        {
+            sigaction(forwarded[i], &sa, NULL);
+        }
+        int status;
+        while (waitpid(exec_child, &status, 0) == -1 && errno == EINTR)
+            ;
+        _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    }
+    if (shim == -1)
+    {
+        daemon_reply(client, DAEMON_ERROR, 0, "fork() failed");
+        close(client);
+        return;
+    }
+    struct Task *task = task_new(d, client, 1, argv + 1);
+    strformat(task->id, sizeof(task->id), "%s", container->id);
+    task_started(d, task, shim);
+}
+
+static void daemon_list(struct Daemon *d, int client)
+{
+    char *text = safe_malloc(IPC_MESSAGE_MAX - sizeof(struct IpcHeader) - 1);
+    size_t size = IPC_MESSAGE_MAX - sizeof(struct IpcHeader) - 1;
+    size_t used = snprintf(text, size, "%-12s %-16s %-8s %-8s %s\n", "CONTAINER ID", "IMAGE",
+                           "PID", "UPTIME", "COMMAND");
+    time_t now = time(NULL);
+    for (struct Task *task = d->tasks; task != NULL && used < size; task = task->next)
+    {
+        if (task->is_exec)
+            continue;
+        char uptime[16];
+        snprintf(uptime, sizeof(uptime), "%lds", (long)(now - task->started));
+        used += snprintf(text + used, size - used, "%-12s %-16s %-8d %-8s %s\n",
+                         task->id[0] ? task->id : "(starting)", task->image, task->container_pid,
+                         uptime, task->command);
+    }
+    daemon_reply(client, DAEMON_OUTPUT, 0, text);
+    free(text);
+    close(client);
+}
+
+// Replies with the Prometheus exposition of the containers, in a memfd since it does not fit in a
+// message with hundreds of containers
+static void daemon_stats_reply(struct Daemon *d, int client)
+{
+    int count = 0;
+    for (struct Task *task = d->tasks; task != NULL; task = task->next)
+    {
+        count++;
+    }
+    char **ids = safe_malloc((count + 1) * sizeof(char *));
+    count = 0;
+    for (struct Task *task = d->tasks; task != NULL; task = task->next)
+    {
+        if (!task->is_exec && task->id[0] != '\0')
+            ids[count++] = task->id;
+    }
+    stats_sample(&d->stats, ids, count);
+    free(ids);
+    for (struct StatsContainer *c = d->stats.containers; c != NULL; c = c->next)
+    {
+        struct Task *task = task_find(d, c->id);
+        strformat(c->image, sizeof(c->image), "%s", task != NULL ? task->image : "");
+    }
+    int fd = memfd_create("stats", MFD_CLOEXEC);
+    FILE *out = fd != -1 ? fdopen(dup(fd), "w") : NULL;
+    if (out == NULL)
+    {
+        daemon_reply(client, DAEMON_ERROR, 0, "Could not create the output");
+    }
+    else
+    {
+        stats_print_prometheus(out, &d->stats);
+        fclose(out);
+        // The client reads it from where this process left off
+        lseek(fd, 0, SEEK_SET);
+        char message[sizeof(struct IpcHeader)];
+        struct IpcHeader header = {.type = DAEMON_OUTPUT};
+        size_t length = ipc_pack(message, &header, NULL, NULL);
+        ipc_send(client, message, length, &fd, 1);
+    }
+    if (fd != -1)
+        close(fd);
+    close(client);
+}
+
+static void daemon_stop(struct Daemon *d, int client, const char *id)
+{
+    struct Task *task = id != NULL ? task_find(d, id) : NULL;
+    if (task == NULL || task->container_pidfd == -1)
+    {
+        daemon_reply(client, DAEMON_ERROR, 0, "No such running container");
+    }
+    else
+    {
+        // Like the timeout of run: the init of the container ignores the signals it does not
+        // handle, so it is killed outright. The shim then cleans up as usual.
+        pidfd_send_signal(task->container_pidfd, SIGKILL, NULL, 0);
+        daemon_reply(client, DAEMON_OUTPUT, 0, "");
+    }
+    close(client);
+}
+
+// Waits for the request of a new client along with the other events, a client which connects
+// and sends nothing must not hold up the containers
+static void daemon_accept(struct Daemon *d)
+{
+    int client = ipc_accept(d->listen_fd);
+    if (client == -1)
+        return;
+    struct Watch *watch = safe_malloc(sizeof(struct Watch));
+    *watch = (struct Watch){WATCH_REQUEST, NULL, client};
+    daemon_watch(d, client, watch);
+}
+
+// The request of a client has arrived, or the client has gone away
+static void daemon_receive(struct Daemon *d, struct Watch *watch)
+{
+    int client = watch->fd;
+    epoll_ctl(d->epoll_fd, EPOLL_CTL_DEL, client, NULL);
+    free(watch);
+    char *message = safe_malloc(IPC_MESSAGE_MAX);
+    int fds[IPC_MAX_FDS];
+    int nfds = 0;
+    struct IpcHeader header;
+    char **argv = NULL;
+    char **envp;
+    ssize_t n = ipc_recv(client, message, IPC_MESSAGE_MAX, fds, &nfds);
+    if (n <= 0 || ipc_unpack(message, (size_t)n, &header, &argv, &envp) == -1)
+    {
+        close(client);
+    }
+    else if ((header.type == DAEMON_RUN || header.type == DAEMON_EXEC) &&
+             (nfds != 3 || header.argc < 2))
+    {
+        daemon_reply(client, DAEMON_ERROR, 0, "Malformed request");
+        close(client);
+    }
+    else if (header.type == DAEMON_RUN)
+    {
+        daemon_run_container(d, client, argv, envp, fds, header.value);
+    }
+    else if (header.type == DAEMON_EXEC)
+    {
+        daemon_exec(d, client, argv, envp, fds);
+    }
+    else if (header.type == DAEMON_STOP)
+    {
+        daemon_stop(d, client, argv[0]);
+    }
+    else if (header.type == DAEMON_LIST)
+    {
+        daemon_list(d, client);
+    }
+    else if (header.type == DAEMON_STATS)
+    {
+        daemon_stats_reply(d, client);
+    }
+    else
+    {
+        daemon_reply(client, DAEMON_ERROR, 0, "Unknown request");
+        close(client);
+    }
+    for (int i = 0; i < nfds; i++)
+    {
+        close(fds[i]);
+    }
+    free(argv);
+    free(message);
+}
+
+// The shim has reported "<id> <pid> <hash of the seccomp program, - for none>" of its container
+static void task_notified(struct Daemon *d, struct Task *task)
+{
+    char line[128];
+    ssize_t n = read(task->notify_fd, line, sizeof(line) - 1);
+    daemon_close(d, &task->notify_fd);
+    char id[32];
+    int pid;
+    char hash[SHA256_HEX_LENGTH + 1];
+    if (n <= 0)
+        return;
+    line[n] = '\0';
+    if (sscanf(line, "%31s %d %64s", id, &pid, hash) != 3)
+        return;
+    if (strcmp(hash, "-") != 0)
+    {
+        task->has_seccomp = 1;
+        if (seccomp_load_cached(CONTAINER_PATH, hash, &task->seccomp) == -1)
+            fprintf(stderr, "Could not load the seccomp program %s of %s\n", hash, id);
+    }
+    strformat(task->id, sizeof(task->id), "%s", id);
+    task->container_pid = pid;
+    task->container_pidfd = pidfd_open(pid, 0);
+    printf("=> Started container %s [pid %d]: %s\n", id, pid, task->command);
+    if (task->client_fd != -1)
+    {
+        daemon_reply(task->client_fd, DAEMON_STARTED, (uint32_t)pid, task->id);
+        if (task->detach)
+        {
+            close(task->client_fd);
+            task->client_fd = -1;
+        }
+    }
+}
+
+// A client waiting for a task has sent a signal to forward, or has gone away
+static void task_client(struct Daemon *d, struct Task *task)
+{
+    struct IpcHeader header;
+    ssize_t n = recv(task->client_fd, &header, sizeof(header), 0);
+    if (n == (ssize_t)sizeof(header) && header.type == DAEMON_SIGNAL)
+    {
+        kill(task->shim_pid, (int)header.value);
+    }
+    else if (n <= 0)
+    {
+        // Nobody is left to see the output or the exit status
+        daemon_close(d, &task->client_fd);
+        if (task->container_pidfd != -1)
+            pidfd_send_signal(task->container_pidfd, SIGKILL, NULL, 0);
+        else
+            kill(task->shim_pid, SIGKILL);
+    }
+}
+
+static void daemon_shutdown(struct Daemon *d, const char *socket_path)
+{
+    printf("=> Stopping daemon\n");
+    unlink(socket_path);
+    for (struct Task *task = d->tasks; task != NULL; task = task->next)
+    {
+        if (task->container_pidfd != -1)
+            pidfd_send_signal(task->container_pidfd, SIGKILL, NULL, 0);
+        else if (task->is_exec)
+            kill(task->shim_pid, SIGKILL);
+    }
+    // The shims of containers clean up once their container is gone
+    while (d->tasks != NULL)
+    {
+        task_exited(d, d->tasks);
+    }
+    exit(0);
+}
+
+/*
+ * @short Runs the daemon until it is interrupted
+ * @param argc number of arguments after the daemon subcommand
+ * @param argv arguments after the daemon subcommand
+ */
+void cmd_daemon(int argc, char *argv[])
+{
+    // The daemon usually runs with its output redirected to a log
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    create_directory_exists_ok(NULL, CONTAINER_PATH, 0755);
+    char socket_path[PATH_MAX];
+    daemon_socket_path(socket_path);
+    struct Daemon d = {.tasks = NULL};
+    d.listen_fd = ipc_listen(socket_path);
+    d.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (d.epoll_fd == -1)
+    {
+        errorMessage("%s\n", "epoll_create1() failed");
+    }
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    d.signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (d.signal_fd == -1)
+    {
+        errorMessage("%s\n", "signalfd() failed");
+    }
+    d.listen_watch = (struct Watch){WATCH_LISTEN, NULL, -1};
+    d.signal_watch = (struct Watch){WATCH_SIGNAL, NULL, -1};
+    stats_init(&d.stats);
+    daemon_watch(&d, d.listen_fd, &d.listen_watch);
+    daemon_watch(&d, d.signal_fd, &d.signal_watch);
+    // Addresses of containers which were running when a previous daemon went away
+    int freed = ipam_reconcile(CONTAINER_PATH, BRIDGE_SUBNET);
+    if (freed > 0)
+    {
+        printf("=> Released %d leaked IP address(es)\n", freed);
+    }
+    printf("=> Daemon listening on %s\n", socket_path);
+
+    struct epoll_event events[64];
+    for (;;)
+    {
+        int n = epoll_wait(d.epoll_fd, events, 64, -1);
+        if (n == -1 && errno != EINTR)
+        {
+            errorMessage("%s\n", "epoll_wait() failed");
+        }
+        // A task which exits is freed, events for it later in the same batch must be skipped
+        struct Task *exited[64];
+        int exited_count = 0;
+        for (int i = 0; i < n; i++)
+        {
+            struct Watch *watch = events[i].data.ptr;
+            if (watch->kind == WATCH_LISTEN)
+            {
+                daemon_accept(&d);
+            }
+            else if (watch->kind == WATCH_SIGNAL)
+            {
+                struct signalfd_siginfo info;
+                if (read(d.signal_fd, &info, sizeof(info)) == sizeof(info))
+                    daemon_shutdown(&d, socket_path);
+            }
+            else if (watch->kind == WATCH_SHIM)
+            {
+                exited[exited_count++] = watch->task;
+            }
+            else if (watch->kind == WATCH_NOTIFY)
+            {
+                task_notified(&d, watch->task);
+            }
+            else if (watch->kind == WATCH_CLIENT && watch->task->client_fd != -1)
+            {
+                task_client(&d, watch->task);
+            }
+            else if (watch->kind == WATCH_REQUEST)
+            {
+                daemon_receive(&d, watch);
+            }
+        }
+        for (int i = 0; i < exited_count; i++)
+        {
+            task_exited(&d, exited[i]);
+        }
+    }
+}
+
+static volatile sig_atomic_t pending_signal = 0;
+
+static void daemon_forward_signal(int sig) { pending_signal = sig; }
+
+// Sends a request to the daemon, returns the connection or -1 if the daemon is not running
+static int daemon_request(uint32_t type, uint32_t value, char *const argv[], int with_stdio,
+                          int detach)
+{
+    char socket_path[PATH_MAX];
+    daemon_socket_path(socket_path);
+    int fd = ipc_connect(socket_path);
+    if (fd == -1)
+        return -1;
+    char *message = safe_malloc(IPC_MESSAGE_MAX);
+    struct IpcHeader header = {.type = type, .value = value};
+    size_t length = ipc_pack(message, &header, argv, with_stdio ? environ : NULL);
+    if (length == 0)
+    {
+        fprintf(stderr, "Command and environment are too large for the daemon\n");
+        exit(1);
+    }
+    int stdio[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    if (detach)
+    {
+        // Nothing is left to read from or write to once the client is gone
+        int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+        if (null == -1)
+        {
+            errorMessage("%s\n", "Could not open /dev/null");
+        }
+        stdio[0] = stdio[1] = stdio[2] = null;
+    }
+    if (ipc_send(fd, message, length, stdio, with_stdio ? 3 : 0) == -1)
+    {
+        errorMessage("%s\n", "Could not send the request to the daemon");
+    }
+    free(message);
+    return fd;
+}
+
+// Waits for the reply to a request, forwarding signals, and exits accordingly
+static void daemon_wait(int fd, int detach)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_forward_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    char *message = safe_malloc(IPC_MESSAGE_MAX);
+    for (;;)
+    {
+        int fds[IPC_MAX_FDS];
+        int nfds;
+        ssize_t n = ipc_recv(fd, message, IPC_MESSAGE_MAX, fds, &nfds);
+        if (n == -1 && errno == EINTR)
+        {
+            struct IpcHeader sig = {.type = DAEMON_SIGNAL, .value = (uint32_t)pending_signal};
+            send(fd, &sig, sizeof(sig), MSG_NOSIGNAL);
+            continue;
+        }
+        struct IpcHeader header;
+        char **strings;
+        char **envp;
+        if (n <= 0 || ipc_unpack(message, (size_t)n, &header, &strings, &envp) == -1)
+        {
+            fprintf(stderr, "Lost connection to the daemon\n");
+            exit(1);
+        }
+        const char *text = header.argc > 0 ? strings[0] : "";
+        switch (header.type)
+        {
+        case DAEMON_STARTED:
+            if (detach)
+            {
+                printf("%s\n", text);
+                exit(0);
+            }
+            break;
+        case DAEMON_EXITED:
+        {
+            if (detach)
+            {
+                // Its output went to /dev/null
+                fprintf(stderr, "The container could not be started\n");
+            }
+            int status = (int)header.value;
+            exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+        }
+        case DAEMON_OUTPUT:
+            fputs(text, stdout);
+            if (nfds == 1)
+            {
+                char buffer[8192];
+                ssize_t length;
+                while ((length = read(fds[0], buffer, sizeof(buffer))) > 0)
+                {
+                    fwrite(buffer, 1, (size_t)length, stdout);
+                }
+            }
+            exit(0);
+        default:
+            fprintf(stderr, "%s\n", text);
+            exit(1);
+        }
+        free(strings);
+    }
+}
+
+static int daemon_request_or_exit(uint32_t type, char *const argv[], int with_stdio)
+{
+    int fd = daemon_request(type, 0, argv, with_stdio, 0);
+    if (fd == -1)
+    {
+        fprintf(stderr, "The daemon is not running, start it with ./container daemon\n");
+        exit(1);
+    }
+    return fd;
+}
+
+/*
+ * @short Runs a container through the daemon, if it is running
+ * @details argv are the arguments of the run subcommand. Does not return if the daemon ran the
+ * container, the process exits with the exit status of the container instead (or right after
+ * the container has started if detach). Returns -1 if the daemon is not running.
+ * @param first index of the image name in argv
+ */
+int daemon_run(int argc, char *argv[], int first, int detach)
+{
+    uint32_t value = (uint32_t)first << 1 | (detach ? DAEMON_DETACH : 0);
+    int fd = daemon_request(DAEMON_RUN, value, argv, 1, detach);
+    if (fd == -1)
+        return -1;
+    daemon_wait(fd, detach);
+    return 0;
+}
+
+// @short Lists the containers run by the daemon
+void cmd_ps(int argc, char *argv[])
+{
+    daemon_wait(daemon_request_or_exit(DAEMON_LIST, NULL, 0), 0);
+}
+
+// @short Prints the resource usage of the containers run by the daemon
+void daemon_stats(void)
+{
+    daemon_wait(daemon_request_or_exit(DAEMON_STATS, NULL, 0), 0);
+}
+
+// @short Kills a container run by the daemon
+void cmd_stop(int argc, char *argv[])
+{
+    if (argc != 1)
+    {
+        printf("Usage: ./container stop container_id\n");
+        exit(1);
+    }
+    daemon_wait(daemon_request_or_exit(DAEMON_STOP, argv, 0), 0);
+}
+
+// @short Runs a command in a container run by the daemon
+void cmd_exec(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: ./container exec container_id command [command options]\n");
+        exit(1);
+    }
+    daemon_wait(daemon_request_or_exit(DAEMON_EXEC, argv, 1), 0);
+}
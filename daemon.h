@@ -0,0 +1,11 @@
+#ifndef CONTAINER_DAEMON_H
+#define CONTAINER_DAEMON_H
+// Long running daemon which runs and supervises containers, and the commands which talk to it
+
+void cmd_daemon(int argc, char *argv[]);
+void cmd_ps(int argc, char *argv[]);
+void cmd_stop(int argc, char *argv[]);
+void cmd_exec(int argc, char *argv[]);
+int daemon_run(int argc, char *argv[], int first, int detach);
+void daemon_stats(void);
+#endif // CONTAINER_DAEMON_H
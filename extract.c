@@ -0,0 +1,1277 @@
+#define _GNU_SOURCE
+#include "extract.h"
+#include "config.h"
+#include "utils.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <linux/openat2.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/time.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// The extractor is a pipeline of threads connected by bounded queues:
+//
+//   reader --(compressed chunks)--> inflater --(tar stream)--> parser --(files)--> writers
+//
+// The parser runs on the calling thread. It creates directories, symlinks and device nodes
+// itself, since later entries depend on them, and hands regular files to a pool of writer
+// threads. Entries at the same path must be applied in archive order: files are sent to the
+// writer picked by the hash of their path, and the parser waits for the files still queued at
+// a path before creating anything else there. Hardlinks and directory metadata are applied
+// once all files have been written.
+// Everything is extracted into a temporary directory next to the destination, which is
+// renamed into place at the end, so an interrupted extraction never looks like a valid image.
+// References:
+// https://www.gnu.org/software/tar/manual/html_node/Standard.html
+// https://pubs.opengroup.org/onlinepubs/9699919799/utilities/pax.html
+
+#define CHUNK_SIZE 1024 * 1024
+#define CHUNK_QUEUE_LENGTH 8
+#define JOB_QUEUE_LENGTH 4096
+// Number of counters of queued files, paths whose hashes collide only wait for each other
+#define QUEUED_SLOTS 1024
+#define BLOCK_SIZE 512
+#define PARTIAL_SUFFIX ".partial-"
+
+struct Chunk
+{
+    size_t length;
+    char data[];
+};
+
+// A bounded queue of pointers, which blocks producers when either the number of items or the
+// number of bytes they hold exceeds the limit
+struct Queue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    void **items;
+    size_t *sizes;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    size_t bytes;
+    size_t max_bytes;
+    int closed;
+};
+
+struct Xattr
+{
+    char *name;
+    char *value;
+    size_t length;
+    struct Xattr *next;
+};
+
+// A single entry of the archive
+struct Entry
+{
+    char *path;
+    char *linkpath;
+    char type;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    struct timespec mtime;
+    unsigned int devmajor;
+    unsigned int devminor;
+    size_t size;
+    struct Xattr *xattrs;
+    // Data of regular files which are written by the writer threads
+    char *data;
+    // Directory in which the entry has to be created (O_PATH)
+    int parent_fd;
+};
+
+// Attributes from PAX extended headers and GNU long name entries, which apply to the next entry
+struct Pending
+{
+    char *path;
+    char *linkpath;
+    long long size;
+    long long uid;
+    long long gid;
+    long long mtime;
+    struct Xattr *xattrs;
+};
+
+struct EntryList
+{
+    struct Entry **items;
+    size_t count;
+    size_t capacity;
+};
+
+// A writer thread and the regular files it has to write
+struct Writer
+{
+    struct Extractor *ex;
+    struct Queue jobs;
+    pthread_t thread;
+};
+
+struct Extractor
+{
+    int flags;
+    int archive_fd;
+    off_t archive_size;
+    unsigned long long bytes_read;
+    // Digest of the compressed archive, computed by the reader thread
+    struct Sha256 digest;
+    int root_fd;
+    struct Queue compressed;
+    struct Queue plain;
+    struct Writer writers[EXTRACT_WRITER_THREADS];
+
+    // Number of regular files queued but not written yet, by hash of their path
+    pthread_mutex_t queued_lock;
+    pthread_cond_t queued_done;
+    unsigned int queued[QUEUED_SLOTS];
+
+    // Chunk of the tar stream currently being parsed
+    struct Chunk *current;
+    size_t offset;
+
+    // Parent directory of the last entry, most entries share their parent with the previous one
+    char *cached_dir;
+    int cached_dir_fd;
+
+    struct EntryList directories;
+    struct EntryList hardlinks;
+    unsigned long files;
+    unsigned long long file_bytes;
+    int progress;
+};
+
+static void queue_init(struct Queue *q, size_t capacity, size_t max_bytes)
+{
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    q->items = safe_malloc(capacity * sizeof(void *));
+    q->sizes = safe_malloc(capacity * sizeof(size_t));
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->bytes = 0;
+    q->max_bytes = max_bytes;
+    q->closed = 0;
+}
+
+static void queue_destroy(struct Queue *q)
+{
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    free(q->items);
+    free(q->sizes);
+}
+
+// An item larger than max_bytes is still accepted when the queue is empty
+static void queue_push(struct Queue *q, void *item, size_t size)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity || (q->count > 0 && q->bytes + size > q->max_bytes))
+    {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    size_t tail = (q->head + q->count) % q->capacity;
+    q->items[tail] = item;
+    q->sizes[tail] = size;
+    q->count++;
+    q->bytes += size;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Returns NULL once the queue has been closed and drained
+static void *queue_pop(struct Queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed)
+    {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    void *item = NULL;
+    if (q->count > 0)
+    {
+        item = q->items[q->head];
+        q->bytes -= q->sizes[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_broadcast(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+static void queue_close(struct Queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static struct Chunk *chunk_new(void)
+{
+    struct Chunk *chunk = safe_malloc(sizeof(struct Chunk) + CHUNK_SIZE);
+    chunk->length = 0;
+    return chunk;
+}
+
+static void *reader_thread(void *data)
+{
+    struct Extractor *ex = data;
+    for (;;)
+    {
+        struct Chunk *chunk = chunk_new();
+        ssize_t n = read(ex->archive_fd, chunk->data, CHUNK_SIZE);
+        if (n == -1 && errno == EINTR)
+        {
+            free(chunk);
+            continue;
+        }
+        if (n == -1)
+        {
+            errorMessage("%s\n", "extract: failed to read archive");
+        }
+        if (n == 0)
+        {
+            free(chunk);
+            break;
+        }
+        chunk->length = (size_t)n;
+        sha256_update(&ex->digest, chunk->data, chunk->length);
+        __atomic_add_fetch(&ex->bytes_read, (unsigned long long)n, __ATOMIC_RELAXED);
+        queue_push(&ex->compressed, chunk, chunk->length);
+    }
+    queue_close(&ex->compressed);
+    return NULL;
+}
+
+// Decompresses the gzip stream, which may consist of several concatenated members
+static void *inflate_thread(void *data)
+{
+    struct Extractor *ex = data;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK)
+    {
+        fprintf(stderr, "extract: inflateInit2 failed\n");
+        exit(1);
+    }
+    struct Chunk *out = chunk_new();
+    zs.next_out = (unsigned char *)out->data;
+    zs.avail_out = CHUNK_SIZE;
+    int member_ended = 0;
+    int trailing_garbage = 0;
+    struct Chunk *in;
+    while ((in = queue_pop(&ex->compressed)) != NULL)
+    {
+        zs.next_in = (unsigned char *)in->data;
+        zs.avail_in = in->length;
+        // zlib may hold back output when the output buffer fills up, so keep calling inflate()
+        // after every full chunk even if all the input has been consumed
+        int output_full = 0;
+        while ((zs.avail_in > 0 || output_full) && !trailing_garbage)
+        {
+            int ret = inflate(&zs, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END)
+            {
+                member_ended = 1;
+                inflateReset(&zs);
+            }
+            else if (ret == Z_DATA_ERROR && member_ended)
+            {
+                // gzip ignores anything after a complete member which is not another member
+                trailing_garbage = 1;
+            }
+            else if (ret == Z_OK)
+            {
+                member_ended = 0;
+            }
+            else if (ret != Z_BUF_ERROR)
+            {
+                fprintf(stderr, "extract: corrupt gzip stream: %s\n", zs.msg ? zs.msg : "");
+                exit(1);
+            }
+            output_full = zs.avail_out == 0;
+            if (output_full)
+            {
+                out->length = CHUNK_SIZE;
+                queue_push(&ex->plain, out, out->length);
+                out = chunk_new();
+                zs.next_out = (unsigned char *)out->data;
+                zs.avail_out = CHUNK_SIZE;
+            }
+            else if (ret == Z_BUF_ERROR)
+            {
+                break;
+            }
+        }
+        free(in);
+    }
+    if (!member_ended && !trailing_garbage)
+    {
+        fprintf(stderr, "extract: unexpected end of compressed archive\n");
+        exit(1);
+    }
+    out->length = CHUNK_SIZE - zs.avail_out;
+    if (out->length > 0)
+    {
+        queue_push(&ex->plain, out, out->length);
+    }
+    else
+    {
+        free(out);
+    }
+    inflateEnd(&zs);
+    queue_close(&ex->plain);
+    return NULL;
+}
+
+// Reads up to n bytes of the tar stream into buffer (or discards them if buffer is NULL),
+// returns the number of bytes read, which is less than n only at the end of the stream
+static size_t stream_read(struct Extractor *ex, void *buffer, size_t n)
+{
+    size_t done = 0;
+    while (done < n)
+    {
+        if (ex->current == NULL || ex->offset == ex->current->length)
+        {
+            free(ex->current);
+            ex->current = queue_pop(&ex->plain);
+            ex->offset = 0;
+            if (ex->current == NULL)
+                break;
+        }
+        size_t available = ex->current->length - ex->offset;
+        size_t count = n - done < available ? n - done : available;
+        if (buffer != NULL)
+        {
+            memcpy((char *)buffer + done, ex->current->data + ex->offset, count);
+        }
+        ex->offset += count;
+        done += count;
+    }
+    return done;
+}
+
+static void stream_read_exact(struct Extractor *ex, void *buffer, size_t n)
+{
+    if (stream_read(ex, buffer, n) != n)
+    {
+        fprintf(stderr, "extract: unexpected end of tar stream\n");
+        exit(1);
+    }
+}
+
+static size_t padding(size_t size) { return (BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE; }
+
+// Parses a numeric header field, which is either octal or base-256 (GNU extension for large
+// values)
+static unsigned long long tar_number(const char *field, size_t length)
+{
+    unsigned long long value = 0;
+    const unsigned char *p = (const unsigned char *)field;
+    if (p[0] & 0x80)
+    {
+        value = p[0] & 0x7f;
+        for (size_t i = 1; i < length; i++)
+        {
+            value = (value << 8) | p[i];
+        }
+        return value;
+    }
+    size_t i = 0;
+    while (i < length && (p[i] == ' ' || p[i] == '\0'))
+        i++;
+    for (; i < length && p[i] >= '0' && p[i] <= '7'; i++)
+    {
+        value = value * 8 + (p[i] - '0');
+    }
+    return value;
+}
+
+static int tar_checksum_ok(const unsigned char *header)
+{
+    unsigned long long expected = tar_number((const char *)header + 148, 8);
+    unsigned long long sum = 0;
+    for (int i = 0; i < BLOCK_SIZE; i++)
+    {
+        sum += (i >= 148 && i < 156) ? ' ' : header[i];
+    }
+    return sum == expected;
+}
+
+static char *copy_string(const char *s, size_t max)
+{
+    size_t length = strnlen(s, max);
+    char *copy = safe_malloc(length + 1);
+    memcpy(copy, s, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+static void xattrs_free(struct Xattr *x)
+{
+    while (x != NULL)
+    {
+        struct Xattr *next = x->next;
+        free(x->name);
+        free(x->value);
+        free(x);
+        x = next;
+    }
+}
+
+static void entry_free(struct Entry *e)
+{
+    free(e->path);
+    free(e->linkpath);
+    free(e->data);
+    xattrs_free(e->xattrs);
+    if (e->parent_fd != -1)
+        close(e->parent_fd);
+    free(e);
+}
+
+// Parses the records of a PAX extended header, of the form "<length> <key>=<value>\n"
+static void parse_pax(struct Pending *pending, char *data, size_t size)
+{
+    size_t pos = 0;
+    while (pos < size)
+    {
+        char *end;
+        unsigned long length = strtoul(data + pos, &end, 10);
+        if (end == data + pos || *end != ' ' || length == 0 || pos + length > size)
+            break;
+        char *key = end + 1;
+        char *record_end = data + pos + length - 1; // points at the trailing newline
+        char *eq = memchr(key, '=', record_end - key);
+        if (eq == NULL)
+            break;
+        *eq = '\0';
+        char *value = eq + 1;
+        size_t value_length = record_end - value;
+        if (strcmp(key, "path") == 0)
+        {
+            free(pending->path);
+            pending->path = copy_string(value, value_length);
+        }
+        else if (strcmp(key, "linkpath") == 0)
+        {
+            free(pending->linkpath);
+            pending->linkpath = copy_string(value, value_length);
+        }
+        else if (strcmp(key, "size") == 0)
+        {
+            pending->size = strtoll(value, NULL, 10);
+        }
+        else if (strcmp(key, "uid") == 0)
+        {
+            pending->uid = strtoll(value, NULL, 10);
+        }
+        else if (strcmp(key, "gid") == 0)
+        {
+            pending->gid = strtoll(value, NULL, 10);
+        }
+        else if (strcmp(key, "mtime") == 0)
+        {
+            pending->mtime = strtoll(value, NULL, 10);
+        }
+        else if (strncmp(key, "SCHILY.xattr.", 13) == 0)
+        {
+            struct Xattr *x = safe_malloc(sizeof(struct Xattr));
+            x->name = copy_string(key + 13, PATH_MAX);
+            x->value = safe_malloc(value_length + 1);
+            memcpy(x->value, value, value_length);
+            x->length = value_length;
+            x->next = pending->xattrs;
+            pending->xattrs = x;
+        }
+        pos += length;
+    }
+}
+
+// Removes leading slashes and "./" components, returns NULL if the path escapes the root
+static char *sanitize_path(char *path)
+{
+    while (*path == '/' || (path[0] == '.' && path[1] == '/'))
+    {
+        path += (*path == '/') ? 1 : 2;
+    }
+    size_t length = strlen(path);
+    while (length > 0 && path[length - 1] == '/')
+    {
+        path[--length] = '\0';
+    }
+    if (length == 0 || strcmp(path, ".") == 0)
+    {
+        return ".";
+    }
+    for (char *component = path; component != NULL;)
+    {
+        char *slash = strchr(component, '/');
+        size_t clen = slash ? (size_t)(slash - component) : strlen(component);
+        if (clen == 2 && component[0] == '.' && component[1] == '.')
+        {
+            return NULL;
+        }
+        component = slash ? slash + 1 : NULL;
+    }
+    return path;
+}
+
+// Opens path (relative to the root of the extraction) as an O_PATH directory, treating the
+// root as "/" for any absolute symlinks on the way, so that entries cannot escape the root
+static int open_in_root(struct Extractor *ex, const char *path)
+{
+    struct open_how how = {.flags = O_PATH | O_DIRECTORY | O_CLOEXEC,
+                           .resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS};
+    return (int)syscall(SYS_openat2, ex->root_fd, path, &how, sizeof(how));
+}
+
+// Creates the missing parents of dir, for archives which do not contain directory entries
+static void make_parents(struct Extractor *ex, const char *dir)
+{
+    char *copy = copy_string(dir, PATH_MAX);
+    for (char *slash = copy;; slash++)
+    {
+        slash = strchr(slash, '/');
+        if (slash != NULL)
+            *slash = '\0';
+        if (mkdirat(ex->root_fd, copy, 0755) == -1 && errno != EEXIST)
+        {
+            int fd = open_in_root(ex, copy);
+            if (fd == -1)
+            {
+                errorMessage("extract: could not create directory %s\n", copy);
+            }
+            close(fd);
+        }
+        if (slash == NULL)
+            break;
+        *slash = '/';
+    }
+    free(copy);
+}
+
+// Returns an O_PATH descriptor of the directory containing path, owned by the caller, and sets
+// name to the last component of path
+static int open_parent(struct Extractor *ex, const char *path, const char **name)
+{
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL)
+    {
+        *name = path;
+        return dup(ex->root_fd);
+    }
+    *name = slash + 1;
+    size_t length = slash - path;
+    if (ex->cached_dir == NULL || strlen(ex->cached_dir) != length ||
+        strncmp(ex->cached_dir, path, length) != 0)
+    {
+        free(ex->cached_dir);
+        if (ex->cached_dir_fd != -1)
+            close(ex->cached_dir_fd);
+        ex->cached_dir = copy_string(path, length);
+        ex->cached_dir_fd = open_in_root(ex, ex->cached_dir);
+        if (ex->cached_dir_fd == -1 && errno == ENOENT)
+        {
+            make_parents(ex, ex->cached_dir);
+            ex->cached_dir_fd = open_in_root(ex, ex->cached_dir);
+        }
+        if (ex->cached_dir_fd == -1)
+        {
+            errorMessage("extract: could not open directory %s\n", ex->cached_dir);
+        }
+    }
+    return dup(ex->cached_dir_fd);
+}
+
+static void forget_cached_dir(struct Extractor *ex)
+{
+    free(ex->cached_dir);
+    if (ex->cached_dir_fd != -1)
+        close(ex->cached_dir_fd);
+    ex->cached_dir = NULL;
+    ex->cached_dir_fd = -1;
+}
+
+static void list_append(struct EntryList *list, struct Entry *e)
+{
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity ? list->capacity * 2 : 256;
+        struct Entry **items = realloc(list->items, list->capacity * sizeof(struct Entry *));
+        if (items == NULL)
+        {
+            exit(2);
+        }
+        list->items = items;
+    }
+    list->items[list->count++] = e;
+}
+
+// Applies ownership, permissions, extended attributes and modification time to an open file.
+// The order matters, chown() clears setuid bits and file capabilities.
+static void apply_metadata(int fd, struct Entry *e)
+{
+    if (fchown(fd, e->uid, e->gid) == -1)
+    {
+        errorMessage("extract: chown %s failed\n", e->path);
+    }
+    if (fchmod(fd, e->mode & 07777) == -1)
+    {
+        errorMessage("extract: chmod %s failed\n", e->path);
+    }
+    for (struct Xattr *x = e->xattrs; x != NULL; x = x->next)
+    {
+        if (fsetxattr(fd, x->name, x->value, x->length, 0) == -1 && errno != ENOTSUP)
+        {
+            fprintf(stderr, "extract: could not set xattr %s on %s: %s\n", x->name, e->path,
+                    strerror(errno));
+        }
+    }
+    struct timespec times[2] = {e->mtime, e->mtime};
+    futimens(fd, times);
+}
+
+// Same as apply_metadata, for entries which cannot be opened (symlinks and device nodes)
+static void apply_metadata_at(int dirfd, const char *name, struct Entry *e)
+{
+    if (fchownat(dirfd, name, e->uid, e->gid, AT_SYMLINK_NOFOLLOW) == -1)
+    {
+        errorMessage("extract: chown %s failed\n", e->path);
+    }
+    if (e->type != '2' && fchmodat(dirfd, name, e->mode & 07777, 0) == -1)
+    {
+        errorMessage("extract: chmod %s failed\n", e->path);
+    }
+    struct timespec times[2] = {e->mtime, e->mtime};
+    utimensat(dirfd, name, times, AT_SYMLINK_NOFOLLOW);
+}
+
+static void write_all(int fd, const char *data, size_t size, const char *path)
+{
+    while (size > 0)
+    {
+        ssize_t n = write(fd, data, size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+        {
+            errorMessage("extract: write to %s failed\n", path);
+        }
+        data += n;
+        size -= (size_t)n;
+    }
+}
+
+// Creates a regular file, replacing whatever existed at its path
+static int create_file(struct Entry *e, const char *name)
+{
+    int fd = openat(e->parent_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                    0600);
+    if (fd == -1 && (errno == ELOOP || errno == EISDIR || errno == ETXTBSY))
+    {
+        unlinkat(e->parent_fd, name, errno == EISDIR ? AT_REMOVEDIR : 0);
+        fd = openat(e->parent_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                    0600);
+    }
+    if (fd == -1)
+    {
+        errorMessage("extract: could not create %s\n", e->path);
+    }
+    return fd;
+}
+
+static const char *base_name(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// FNV-1a
+static uint32_t path_hash(const char *path)
+{
+    uint32_t hash = 2166136261u;
+    for (; *path; path++)
+    {
+        hash = (hash ^ (unsigned char)*path) * 16777619u;
+    }
+    return hash;
+}
+
+static void queue_file(struct Extractor *ex, struct Entry *e)
+{
+    uint32_t hash = path_hash(e->path);
+    pthread_mutex_lock(&ex->queued_lock);
+    ex->queued[hash % QUEUED_SLOTS]++;
+    pthread_mutex_unlock(&ex->queued_lock);
+    queue_push(&ex->writers[hash % EXTRACT_WRITER_THREADS].jobs, e, e->size);
+}
+
+// Waits until the regular files queued at path have been written
+static void wait_for_queued(struct Extractor *ex, const char *path)
+{
+    uint32_t slot = path_hash(path) % QUEUED_SLOTS;
+    pthread_mutex_lock(&ex->queued_lock);
+    while (ex->queued[slot] > 0)
+    {
+        pthread_cond_wait(&ex->queued_done, &ex->queued_lock);
+    }
+    pthread_mutex_unlock(&ex->queued_lock);
+}
+
+static void *writer_thread(void *data)
+{
+    struct Writer *writer = data;
+    struct Extractor *ex = writer->ex;
+    struct Entry *e;
+    while ((e = queue_pop(&writer->jobs)) != NULL)
+    {
+        int fd = create_file(e, base_name(e->path));
+        write_all(fd, e->data, e->size, e->path);
+        apply_metadata(fd, e);
+        close(fd);
+        pthread_mutex_lock(&ex->queued_lock);
+        ex->queued[path_hash(e->path) % QUEUED_SLOTS]--;
+        pthread_cond_broadcast(&ex->queued_done);
+        pthread_mutex_unlock(&ex->queued_lock);
+        entry_free(e);
+    }
+    return NULL;
+}
+
+// Writes a large file directly from the tar stream, without buffering it
+static void write_file_inline(struct Extractor *ex, struct Entry *e)
+{
+    int fd = create_file(e, base_name(e->path));
+    size_t remaining = e->size;
+    while (remaining > 0)
+    {
+        if (ex->current == NULL || ex->offset == ex->current->length)
+        {
+            free(ex->current);
+            ex->current = queue_pop(&ex->plain);
+            ex->offset = 0;
+            if (ex->current == NULL)
+            {
+                fprintf(stderr, "extract: unexpected end of tar stream\n");
+                exit(1);
+            }
+        }
+        size_t available = ex->current->length - ex->offset;
+        size_t count = remaining < available ? remaining : available;
+        write_all(fd, ex->current->data + ex->offset, count, e->path);
+        ex->offset += count;
+        remaining -= count;
+    }
+    apply_metadata(fd, e);
+    close(fd);
+    entry_free(e);
+}
+
+static void create_directory_entry(struct Extractor *ex, struct Entry *e, const char *name)
+{
+    if (mkdirat(e->parent_fd, name, 0700) == -1)
+    {
+        struct stat st;
+        if (errno != EEXIST || fstatat(e->parent_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+            errorMessage("extract: could not create directory %s\n", e->path);
+        }
+        if (!S_ISDIR(st.st_mode))
+        {
+            unlinkat(e->parent_fd, name, 0);
+            if (mkdirat(e->parent_fd, name, 0700) == -1)
+            {
+                errorMessage("extract: could not create directory %s\n", e->path);
+            }
+            forget_cached_dir(ex);
+        }
+    }
+    // Permissions are applied at the end, in case the directory is not writable
+    close(e->parent_fd);
+    e->parent_fd = -1;
+    list_append(&ex->directories, e);
+}
+
+static void create_symlink_entry(struct Entry *e, const char *name)
+{
+    if (symlinkat(e->linkpath, e->parent_fd, name) == -1)
+    {
+        if (errno != EEXIST)
+        {
+            errorMessage("extract: could not create symlink %s\n", e->path);
+        }
+        unlinkat(e->parent_fd, name, 0);
+        if (symlinkat(e->linkpath, e->parent_fd, name) == -1)
+        {
+            errorMessage("extract: could not create symlink %s\n", e->path);
+        }
+    }
+    apply_metadata_at(e->parent_fd, name, e);
+    entry_free(e);
+}
+
+static void create_node_entry(struct Entry *e, const char *name)
+{
+    mode_t type = e->type == '3' ? S_IFCHR : e->type == '4' ? S_IFBLK : S_IFIFO;
+    dev_t dev = makedev(e->devmajor, e->devminor);
+    unlinkat(e->parent_fd, name, 0);
+    if (mknodat(e->parent_fd, name, type | (e->mode & 07777), dev) == -1)
+    {
+        errorMessage("extract: could not create node %s\n", e->path);
+    }
+    apply_metadata_at(e->parent_fd, name, e);
+    entry_free(e);
+}
+
+// OCI layers mark deleted files with an empty file named .wh.<name>, and directories whose
+// contents in lower layers are hidden with .wh..wh..opq. overlayfs expects a 0/0 character
+// device and the trusted.overlay.opaque xattr instead. Overlays mounted with userxattr (in a
+// user namespace) only look at user.overlay.opaque, the extracted layers are shared by both.
+// https://github.com/opencontainers/image-spec/blob/main/layer.md#whiteouts
+static void create_whiteout_entry(struct Entry *e, const char *name)
+{
+    if (strcmp(name, ".wh..wh..opq") == 0)
+    {
+        int fd = openat(e->parent_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1 || fsetxattr(fd, "trusted.overlay.opaque", "y", 1, 0) == -1)
+        {
+            errorMessage("extract: could not mark %s as opaque\n", e->path);
+        }
+        // Filesystems without user xattrs can still be used without --uidmap
+        if (fsetxattr(fd, "user.overlay.opaque", "y", 1, 0) == -1 && errno != ENOTSUP)
+        {
+            errorMessage("extract: could not mark %s as opaque for user namespaces\n", e->path);
+        }
+        close(fd);
+    }
+    else
+    {
+        const char *target = name + 4;
+        unlinkat(e->parent_fd, target, 0);
+        if (mknodat(e->parent_fd, target, S_IFCHR, makedev(0, 0)) == -1)
+        {
+            errorMessage("extract: could not create whiteout for %s\n", e->path);
+        }
+    }
+    entry_free(e);
+}
+
+static void create_hardlink_entry(struct Extractor *ex, struct Entry *e)
+{
+    const char *target_name;
+    const char *name;
+    char *target = sanitize_path(e->linkpath);
+    if (target == NULL)
+    {
+        fprintf(stderr, "extract: hardlink %s points outside the image\n", e->path);
+        exit(1);
+    }
+    int target_fd = open_parent(ex, target, &target_name);
+    int fd = open_parent(ex, e->path, &name);
+    if (linkat(target_fd, target_name, fd, name, 0) == -1)
+    {
+        unlinkat(fd, name, 0);
+        if (linkat(target_fd, target_name, fd, name, 0) == -1)
+        {
+            errorMessage("extract: could not create hardlink %s -> %s\n", e->path, target);
+        }
+    }
+    close(target_fd);
+    close(fd);
+}
+
+static void finish_directory(struct Extractor *ex, struct Entry *e)
+{
+    int fd;
+    if (strcmp(e->path, ".") == 0)
+    {
+        fd = openat(ex->root_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    else
+    {
+        struct open_how how = {.flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC,
+                               .resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS};
+        fd = (int)syscall(SYS_openat2, ex->root_fd, e->path, &how, sizeof(how));
+    }
+    if (fd == -1)
+    {
+        errorMessage("extract: could not open directory %s\n", e->path);
+    }
+    apply_metadata(fd, e);
+    close(fd);
+}
+
+static void print_progress(struct Extractor *ex)
+{
+    if (!isatty(STDOUT_FILENO) || ex->archive_size <= 0)
+        return;
+    unsigned long long done = __atomic_load_n(&ex->bytes_read, __ATOMIC_RELAXED);
+    int percent = (int)(done * 100 / (unsigned long long)ex->archive_size);
+    if (percent != ex->progress)
+    {
+        ex->progress = percent;
+        printf("\r=> Extracting ... %3d%%", percent);
+        fflush(stdout);
+    }
+}
+
+// Reads tar headers from the decompressed stream and dispatches every entry
+static void parse_archive(struct Extractor *ex)
+{
+    unsigned char header[BLOCK_SIZE];
+    struct Pending pending = {NULL, NULL, -1, -1, -1, -1, NULL};
+    int zero_blocks = 0;
+    for (;;)
+    {
+        size_t n = stream_read(ex, header, BLOCK_SIZE);
+        if (n == 0 && zero_blocks > 0)
+            break;
+        if (n != BLOCK_SIZE)
+        {
+            fprintf(stderr, "extract: unexpected end of tar stream\n");
+            exit(1);
+        }
+        int all_zero = 1;
+        for (int i = 0; i < BLOCK_SIZE && all_zero; i++)
+        {
+            all_zero = header[i] == 0;
+        }
+        if (all_zero)
+        {
+            if (++zero_blocks == 2)
+                break;
+            continue;
+        }
+        zero_blocks = 0;
+        if (!tar_checksum_ok(header))
+        {
+            fprintf(stderr, "extract: invalid tar header checksum\n");
+            exit(1);
+        }
+
+        char type = (char)header[156];
+        size_t size = pending.size >= 0 ? (size_t)pending.size
+                                        : (size_t)tar_number((char *)header + 124, 12);
+        if (type == 'x' || type == 'L' || type == 'K')
+        {
+            char *data = safe_malloc(size + 1);
+            stream_read_exact(ex, data, size);
+            data[size] = '\0';
+            stream_read_exact(ex, NULL, padding(size));
+            if (type == 'x')
+            {
+                parse_pax(&pending, data, size);
+                free(data);
+            }
+            else if (type == 'L')
+            {
+                free(pending.path);
+                pending.path = data;
+            }
+            else
+            {
+                free(pending.linkpath);
+                pending.linkpath = data;
+            }
+            continue;
+        }
+        if (type == 'g')
+        {
+            stream_read_exact(ex, NULL, size + padding(size));
+            continue;
+        }
+
+        struct Entry *e = safe_malloc(sizeof(struct Entry));
+        memset(e, 0, sizeof(struct Entry));
+        e->parent_fd = -1;
+        e->type = type == '\0' || type == '7' ? '0' : type;
+        if (pending.path != NULL)
+        {
+            e->path = pending.path;
+        }
+        else
+        {
+            char name[BLOCK_SIZE];
+            char *prefix = copy_string((char *)header + 345, 155);
+            char *base = copy_string((char *)header, 100);
+            strformat(name, sizeof(name), prefix[0] ? "%s/%s" : "%s%s", prefix, base);
+            e->path = copy_string(name, sizeof(name));
+            free(prefix);
+            free(base);
+        }
+        e->linkpath =
+            pending.linkpath ? pending.linkpath : copy_string((char *)header + 157, 100);
+        e->mode = (mode_t)tar_number((char *)header + 100, 8);
+        e->uid = pending.uid >= 0 ? (uid_t)pending.uid : (uid_t)tar_number((char *)header + 108, 8);
+        e->gid = pending.gid >= 0 ? (gid_t)pending.gid : (gid_t)tar_number((char *)header + 116, 8);
+        e->mtime.tv_sec = pending.mtime >= 0 ? (time_t)pending.mtime
+                                             : (time_t)tar_number((char *)header + 136, 12);
+        e->devmajor = (unsigned int)tar_number((char *)header + 329, 8);
+        e->devminor = (unsigned int)tar_number((char *)header + 337, 8);
+        e->size = e->type == '0' ? size : 0;
+        e->xattrs = pending.xattrs;
+        pending = (struct Pending){NULL, NULL, -1, -1, -1, -1, NULL};
+
+        char *path = sanitize_path(e->path);
+        if (path == NULL)
+        {
+            fprintf(stderr, "extract: %s points outside the image\n", e->path);
+            exit(1);
+        }
+        memmove(e->path, path, strlen(path) + 1);
+        if (strcmp(e->path, ".") == 0 && e->type != '5')
+        {
+            fprintf(stderr, "extract: invalid entry for the root directory\n");
+            exit(1);
+        }
+
+        // e is freed by the functions below
+        char entry_type = e->type;
+        const char *name = NULL;
+        if (strcmp(e->path, ".") != 0 && e->type != '1')
+        {
+            e->parent_fd = open_parent(ex, e->path, &name);
+        }
+        if ((ex->flags & EXTRACT_WHITEOUTS) && name != NULL && strncmp(name, ".wh.", 4) == 0)
+        {
+            char target[PATH_MAX];
+            strformat(target, PATH_MAX, "%.*s%s", (int)(name - e->path), e->path, name + 4);
+            wait_for_queued(ex, target);
+            create_whiteout_entry(e, name);
+            stream_read_exact(ex, NULL, size + padding(size));
+            continue;
+        }
+        // Files small enough to be queued keep their order through the writer of their path
+        if (e->type != '1' && (e->type != '0' || e->size > EXTRACT_INLINE_SIZE))
+        {
+            wait_for_queued(ex, e->path);
+        }
+        switch (e->type)
+        {
+        case '0':
+            ex->files++;
+            ex->file_bytes += e->size;
+            if (e->size > EXTRACT_INLINE_SIZE)
+            {
+                write_file_inline(ex, e);
+            }
+            else
+            {
+                e->data = safe_malloc(e->size ? e->size : 1);
+                stream_read_exact(ex, e->data, e->size);
+                queue_file(ex, e);
+            }
+            stream_read_exact(ex, NULL, padding(size));
+            break;
+        case '1':
+            list_append(&ex->hardlinks, e);
+            break;
+        case '2':
+            create_symlink_entry(e, name);
+            break;
+        case '3':
+        case '4':
+        case '6':
+            create_node_entry(e, name);
+            break;
+        case '5':
+            if (name == NULL)
+            {
+                list_append(&ex->directories, e);
+            }
+            else
+            {
+                create_directory_entry(ex, e, name);
+            }
+            break;
+        default:
+            fprintf(stderr, "extract: unsupported entry type '%c' for %s\n", e->type, e->path);
+            exit(1);
+        }
+        // Entries other than regular files may still have data, which is skipped
+        if (entry_type != '0' && size > 0)
+        {
+            stream_read_exact(ex, NULL, size + padding(size));
+        }
+        print_progress(ex);
+    }
+    // Consume anything after the end of archive marker, so that the other threads can finish
+    while (stream_read(ex, NULL, CHUNK_SIZE) > 0)
+        ;
+}
+
+// Removes partially extracted copies of destination, left behind by extractions which were
+// interrupted. A copy is in use as long as its extractor holds a lock on it.
+static void remove_stale_partials(const char *destination)
+{
+    char *dir_copy = copy_string(destination, PATH_MAX);
+    char *base_copy = copy_string(destination, PATH_MAX);
+    char *dir = dirname(dir_copy);
+    char *base = basename(base_copy);
+    char prefix[PATH_MAX];
+    strformat(prefix, PATH_MAX, "%s" PARTIAL_SUFFIX, base);
+
+    DIR *d = opendir(dir);
+    struct dirent *ent;
+    while (d != NULL && (ent = readdir(d)) != NULL)
+    {
+        if (strncmp(ent->d_name, prefix, strlen(prefix)) != 0)
+            continue;
+        char path[PATH_MAX];
+        strformat(path, PATH_MAX, "%s/%s", dir, ent->d_name);
+        int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd != -1 && flock(fd, LOCK_EX | LOCK_NB) == 0)
+        {
+            printf("=> Removing interrupted extraction %s\n", path);
+            remove_tree(path);
+        }
+        if (fd != -1)
+            close(fd);
+    }
+    if (d != NULL)
+        closedir(d);
+    free(dir_copy);
+    free(base_copy);
+}
+
+// Extracts the .tar.gz archive at archive_path into the directory destination, which must not
+// exist. Files are extracted into a temporary directory, which is renamed to destination once
+// the extraction has succeeded. If digest is not NULL, it is set to the SHA-256 of the archive.
+// flags is a combination of EXTRACT_* flags.
+void extract_archive(const char *archive_path, const char *destination, int flags,
+                     char digest[SHA256_HEX_LENGTH + 1])
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    remove_stale_partials(destination);
+
+    char partial[PATH_MAX];
+    strformat(partial, PATH_MAX, "%s" PARTIAL_SUFFIX "XXXXXX", destination);
+    if (mkdtemp(partial) == NULL)
+    {
+        errorMessage("extract: could not create %s\n", partial);
+    }
+
+    struct Extractor ex;
+    memset(&ex, 0, sizeof(ex));
+    ex.flags = flags;
+    ex.cached_dir_fd = -1;
+    ex.progress = -1;
+    sha256_init(&ex.digest);
+    ex.root_fd = open(partial, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ex.root_fd == -1 || flock(ex.root_fd, LOCK_EX) == -1)
+    {
+        errorMessage("extract: could not open %s\n", partial);
+    }
+    // mkdtemp() creates the directory with mode 0700
+    fchmod(ex.root_fd, 0755);
+    ex.archive_fd = open(archive_path, O_RDONLY | O_CLOEXEC);
+    if (ex.archive_fd == -1)
+    {
+        errorMessage("extract: could not open %s\n", archive_path);
+    }
+    struct stat st;
+    if (fstat(ex.archive_fd, &st) == 0)
+    {
+        ex.archive_size = st.st_size;
+    }
+    posix_fadvise(ex.archive_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    queue_init(&ex.compressed, CHUNK_QUEUE_LENGTH, (size_t)CHUNK_QUEUE_LENGTH * CHUNK_SIZE);
+    queue_init(&ex.plain, CHUNK_QUEUE_LENGTH, (size_t)CHUNK_QUEUE_LENGTH * CHUNK_SIZE);
+    pthread_mutex_init(&ex.queued_lock, NULL);
+    pthread_cond_init(&ex.queued_done, NULL);
+
+    pthread_t reader, inflater;
+    pthread_create(&reader, NULL, reader_thread, &ex);
+    pthread_create(&inflater, NULL, inflate_thread, &ex);
+    for (int i = 0; i < EXTRACT_WRITER_THREADS; i++)
+    {
+        struct Writer *writer = &ex.writers[i];
+        writer->ex = &ex;
+        queue_init(&writer->jobs, JOB_QUEUE_LENGTH / EXTRACT_WRITER_THREADS,
+                   EXTRACT_QUEUE_BYTES / EXTRACT_WRITER_THREADS);
+        pthread_create(&writer->thread, NULL, writer_thread, writer);
+    }
+
+    parse_archive(&ex);
+
+    for (int i = 0; i < EXTRACT_WRITER_THREADS; i++)
+    {
+        queue_close(&ex.writers[i].jobs);
+    }
+    for (int i = 0; i < EXTRACT_WRITER_THREADS; i++)
+    {
+        pthread_join(ex.writers[i].thread, NULL);
+        queue_destroy(&ex.writers[i].jobs);
+    }
+    pthread_join(inflater, NULL);
+    pthread_join(reader, NULL);
+    if (digest != NULL)
+    {
+        sha256_final_hex(&ex.digest, digest);
+    }
+
+    for (size_t i = 0; i < ex.hardlinks.count; i++)
+    {
+        create_hardlink_entry(&ex, ex.hardlinks.items[i]);
+        entry_free(ex.hardlinks.items[i]);
+    }
+    // Deepest directories first, since creating entries updates the mtime of the parent
+    for (size_t i = ex.directories.count; i > 0; i--)
+    {
+        finish_directory(&ex, ex.directories.items[i - 1]);
+        entry_free(ex.directories.items[i - 1]);
+    }
+    if (ex.progress != -1)
+    {
+        printf("\n");
+    }
+
+    forget_cached_dir(&ex);
+    free(ex.current);
+    free(ex.hardlinks.items);
+    free(ex.directories.items);
+    queue_destroy(&ex.compressed);
+    queue_destroy(&ex.plain);
+    pthread_mutex_destroy(&ex.queued_lock);
+    pthread_cond_destroy(&ex.queued_done);
+    close(ex.archive_fd);
+
+    if (rename(partial, destination) == -1)
+    {
+        if (errno != EEXIST && errno != ENOTEMPTY)
+        {
+            errorMessage("extract: could not rename %s to %s\n", partial, destination);
+        }
+        // Somebody else extracted the same image in the meantime
+        remove_tree(partial);
+    }
+    close(ex.root_fd);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    printf("=> Extracted %lu files (%llu MiB) in %ld ms\n", ex.files, ex.file_bytes >> 20, ms);
+}
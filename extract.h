@@ -0,0 +1,11 @@
+#ifndef CONTAINER_EXTRACT_H
+#define CONTAINER_EXTRACT_H
+// Streaming extractor for .tar.gz root filesystem images
+#include "sha256.h"
+
+// Convert OCI whiteout files into overlayfs whiteouts, for image layers
+#define EXTRACT_WHITEOUTS 1
+
+void extract_archive(const char *archive_path, const char *destination, int flags,
+                     char digest[SHA256_HEX_LENGTH + 1]);
+#endif // CONTAINER_EXTRACT_H
@@ -0,0 +1,690 @@
+#include "image.h"
+#include "config.h"
+#include "extract.h"
+#include "json.h"
+#include "sha256.h"
+#include "utils.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/loop.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+// Layout of the cache directory (containers/__extracted):
+//   sha256-<digest>/   extracted root filesystem of the archive with that digest
+//   index              one line per image: <name> <digest> <size> <mtime> <inode>
+//   <name>.lock        held while <name> is being extracted, so that only one process does it
+//   index.lock         held while the index is being rewritten
+// The index lets us skip hashing the archive as long as it has not been modified. Directories
+// and the index only ever appear through rename(), so readers never need a lock.
+
+#define CACHE_DIR "__extracted"
+// Read-only images which are loop mounted, shared by all containers using them
+#define MOUNT_DIR "__mounts"
+
+// Formats which can be mounted directly instead of being extracted, in order of preference.
+// The image file is images/<name>.<format>.
+static const char *mountable_formats[] = {"erofs", "squashfs", NULL};
+
+struct IndexEntry
+{
+    char name[NAME_MAX + 1];
+    char digest[SHA256_HEX_LENGTH + 1];
+    long long size;
+    long long mtime;
+    unsigned long long inode;
+};
+
+static int index_matches(const struct IndexEntry *entry, const struct stat *st)
+{
+    return entry->size == (long long)st->st_size &&
+           entry->mtime == (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec &&
+           entry->inode == (unsigned long long)st->st_ino;
+}
+
+static int index_parse(const char *line, struct IndexEntry *entry)
+{
+    return sscanf(line, "%255s %64s %lld %lld %llu", entry->name, entry->digest, &entry->size,
+                  &entry->mtime, &entry->inode) == 5;
+}
+
+// Looks up name in the index, returns 1 if it was found
+static int index_find(const char *cache_dir, const char *name, struct IndexEntry *entry)
+{
+    char path[PATH_MAX];
+    strformat(path, PATH_MAX, "%s/index", cache_dir);
+    FILE *f = fopen(path, "re");
+    if (f == NULL)
+        return 0;
+    char line[512];
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), f) != NULL)
+    {
+        found = index_parse(line, entry) && strcmp(entry->name, name) == 0;
+    }
+    fclose(f);
+    return found;
+}
+
+// Opens and locks path, printing message if somebody else holds the lock
+static int lock_file(const char *path, const char *message)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        errorMessage("Could not open lock file %s\n", path);
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1)
+    {
+        if (message != NULL)
+            printf("%s", message);
+        if (flock(fd, LOCK_EX) == -1)
+        {
+            errorMessage("Could not lock %s\n", path);
+        }
+    }
+    return fd;
+}
+
+// Adds or replaces the index entry for entry->name
+static void index_update(const char *cache_dir, const struct IndexEntry *entry)
+{
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    char lock[PATH_MAX];
+    strformat(path, PATH_MAX, "%s/index", cache_dir);
+    strformat(tmp, PATH_MAX, "%s/index.tmp", cache_dir);
+    strformat(lock, PATH_MAX, "%s/index.lock", cache_dir);
+    int lock_fd = lock_file(lock, NULL);
+
+    FILE *out = fopen(tmp, "we");
+    if (out == NULL)
+    {
+        errorMessage("Could not create %s\n", tmp);
+    }
+    FILE *in = fopen(path, "re");
+    char line[512];
+    struct IndexEntry existing;
+    while (in != NULL && fgets(line, sizeof(line), in) != NULL)
+    {
+        if (index_parse(line, &existing) && strcmp(existing.name, entry->name) != 0)
+        {
+            fputs(line, out);
+        }
+    }
+    if (in != NULL)
+        fclose(in);
+    fprintf(out, "%s %s %lld %lld %llu\n", entry->name, entry->digest, entry->size, entry->mtime,
+            entry->inode);
+    if (fflush(out) != 0 || fsync(fileno(out)) == -1 || fclose(out) != 0)
+    {
+        errorMessage("Could not write %s\n", tmp);
+    }
+    if (rename(tmp, path) == -1)
+    {
+        errorMessage("Could not rename %s\n", tmp);
+    }
+    close(lock_fd);
+}
+
+// Returns the directory of the cached image if the index has an up to date entry for it
+static char *cache_hit(const char *cache_dir, const char *image_name, const struct stat *st)
+{
+    struct IndexEntry entry;
+    if (!index_find(cache_dir, image_name, &entry) || !index_matches(&entry, st))
+        return NULL;
+    char *path = safe_malloc(PATH_MAX);
+    strformat(path, PATH_MAX, "%s/sha256-%s", cache_dir, entry.digest);
+    if (!exists(path))
+    {
+        free(path);
+        return NULL;
+    }
+    return path;
+}
+
+static void validate_image_name(const char *image_name)
+{
+    if (strchr(image_name, '/') != NULL || strchr(image_name, ' ') != NULL ||
+        image_name[0] == '.' || strlen(image_name) > NAME_MAX - 16)
+    {
+        fprintf(stderr, "Invalid image name %s\n", image_name);
+        exit(1);
+    }
+}
+
+// @brief Returns the path of the extracted root filesystem of image_name (heap allocated)
+// @details The image is extracted on first use, or when its archive has changed. Concurrent
+// callers for the same image wait for a single extraction instead of doing their own.
+char *image_cache_lookup(const char *containers_path, const char *images_path,
+                         const char *image_name)
+{
+    validate_image_name(image_name);
+    char cache_dir[PATH_MAX];
+    char archive[PATH_MAX];
+    strformat(cache_dir, PATH_MAX, "%s/" CACHE_DIR, containers_path);
+    strformat(archive, PATH_MAX, "%s/%s.tar.gz", images_path, image_name);
+    create_directory_exists_ok(NULL, containers_path, 0755);
+    create_directory_exists_ok(NULL, cache_dir, 0755);
+
+    struct stat st;
+    if (stat(archive, &st) == -1)
+    {
+        errorMessage("Image %s not found\n", archive);
+    }
+    char *path = cache_hit(cache_dir, image_name, &st);
+    if (path != NULL)
+    {
+        printf("=> Found existing image cache, not extracting\n");
+        return path;
+    }
+
+    char lock[PATH_MAX];
+    strformat(lock, PATH_MAX, "%s/%s.lock", cache_dir, image_name);
+    int lock_fd = lock_file(lock, "=> Waiting for another process to extract the image\n");
+    // The image may have been extracted while we were waiting for the lock
+    path = cache_hit(cache_dir, image_name, &st);
+    if (path != NULL)
+    {
+        close(lock_fd);
+        return path;
+    }
+
+    printf("=> %s is being used for the first time ... extracting\n", image_name);
+    char incoming[PATH_MAX];
+    strformat(incoming, PATH_MAX, "%s/%s.incoming", cache_dir, image_name);
+    // Left behind by a process which died after extracting, we hold the lock so it is stale
+    if (exists(incoming))
+    {
+        remove_tree(incoming);
+    }
+    struct IndexEntry entry;
+    extract_archive(archive, incoming, 0, entry.digest);
+
+    path = safe_malloc(PATH_MAX);
+    strformat(path, PATH_MAX, "%s/sha256-%s", cache_dir, entry.digest);
+    if (rename(incoming, path) == -1)
+    {
+        if (errno != EEXIST && errno != ENOTEMPTY)
+        {
+            errorMessage("Could not rename %s to %s\n", incoming, path);
+        }
+        // Another image with identical contents is already cached
+        remove_tree(incoming);
+    }
+    strformat(entry.name, sizeof(entry.name), "%s", image_name);
+    entry.size = (long long)st.st_size;
+    entry.mtime = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    entry.inode = (unsigned long long)st.st_ino;
+    index_update(cache_dir, &entry);
+    close(lock_fd);
+    return path;
+}
+
+// Returns a pointer to the hex part of an OCI digest (sha256:<hex>), or NULL if it is invalid
+static const char *digest_hex(const char *digest)
+{
+    if (digest == NULL || strncmp(digest, "sha256:", 7) != 0 ||
+        strlen(digest + 7) != SHA256_HEX_LENGTH ||
+        strspn(digest + 7, "0123456789abcdef") != SHA256_HEX_LENGTH)
+    {
+        return NULL;
+    }
+    return digest + 7;
+}
+
+// Reads and verifies the JSON blob with the given digest from an OCI layout
+static struct Json *load_json_blob(const char *layout, const char *digest)
+{
+    const char *hex = digest_hex(digest);
+    if (hex == NULL)
+    {
+        fprintf(stderr, "Invalid digest %s in %s\n", digest ? digest : "(null)", layout);
+        exit(1);
+    }
+    char path[PATH_MAX];
+    char actual[SHA256_HEX_LENGTH + 1];
+    strformat(path, PATH_MAX, "%s/blobs/sha256/%s", layout, hex);
+    if (sha256_file(path, actual) == -1)
+    {
+        errorMessage("Could not read %s\n", path);
+    }
+    if (strcmp(actual, hex) != 0)
+    {
+        fprintf(stderr, "Digest mismatch for %s\n", path);
+        exit(1);
+    }
+    struct Json *json = json_parse_file(path);
+    if (json == NULL)
+    {
+        fprintf(stderr, "Could not parse %s\n", path);
+        exit(1);
+    }
+    return json;
+}
+
+// Returns the OCI name of the architecture we are running on
+static const char *oci_architecture(void)
+{
+    static struct utsname uts;
+    if (uname(&uts) == -1)
+        return "";
+    if (strcmp(uts.machine, "x86_64") == 0)
+        return "amd64";
+    if (strcmp(uts.machine, "aarch64") == 0)
+        return "arm64";
+    return uts.machine;
+}
+
+// Picks the manifest for this machine out of the "manifests" of an image index, or the first
+// one if none of them specify a matching platform
+static const char *select_manifest(const struct Json *index)
+{
+    struct Json *manifests = json_get(index, "manifests");
+    if (manifests == NULL || manifests->type != JSON_ARRAY || manifests->child == NULL)
+        return NULL;
+    for (struct Json *m = manifests->child; m != NULL; m = m->next)
+    {
+        const char *arch = json_get_string(json_get(m, "platform"), "architecture");
+        if (arch != NULL && strcmp(arch, oci_architecture()) == 0)
+            return json_get_string(m, "digest");
+    }
+    return json_get_string(manifests->child, "digest");
+}
+
+static int is_gzip_layer(const char *media_type)
+{
+    return media_type != NULL &&
+           (strcmp(media_type, "application/vnd.oci.image.layer.v1.tar+gzip") == 0 ||
+            strcmp(media_type, "application/vnd.docker.image.rootfs.diff.tar.gzip") == 0);
+}
+
+// Extracts a layer into the cache, unless it is already there, and returns its directory.
+// Layers are shared by every image which contains them.
+static char *layer_cache_lookup(const char *cache_dir, const char *layout, const char *hex)
+{
+    char *path = safe_malloc(PATH_MAX);
+    strformat(path, PATH_MAX, "%s/sha256-%s", cache_dir, hex);
+    if (exists(path))
+        return path;
+
+    char lock[PATH_MAX];
+    strformat(lock, PATH_MAX, "%s.lock", path);
+    int lock_fd = lock_file(lock, "=> Waiting for another process to extract a layer\n");
+    if (!exists(path))
+    {
+        char blob[PATH_MAX];
+        char incoming[PATH_MAX];
+        char digest[SHA256_HEX_LENGTH + 1];
+        strformat(blob, PATH_MAX, "%s/blobs/sha256/%s", layout, hex);
+        strformat(incoming, PATH_MAX, "%s.incoming", path);
+        printf("=> Extracting layer %.12s\n", hex);
+        if (exists(incoming))
+        {
+            remove_tree(incoming);
+        }
+        extract_archive(blob, incoming, EXTRACT_WHITEOUTS, digest);
+        if (strcmp(digest, hex) != 0)
+        {
+            remove_tree(incoming);
+            fprintf(stderr, "Digest mismatch for layer %s\n", blob);
+            exit(1);
+        }
+        if (rename(incoming, path) == -1)
+        {
+            errorMessage("Could not rename %s to %s\n", incoming, path);
+        }
+    }
+    close(lock_fd);
+    return path;
+}
+
+// @brief Returns the overlayfs lowerdir for a multi-layer image, or NULL if there is none
+// @details A multi-layer image is an OCI image layout in images/<name>/. Each layer is
+// extracted once into the image cache, and the returned lowerdir stacks them with the top
+// layer first (lowerdir=L3:L2:L1), as overlayfs expects.
+// https://github.com/opencontainers/image-spec/blob/main/image-layout.md
+char *image_layers_lookup(const char *containers_path, const char *images_path,
+                          const char *image_name)
+{
+    validate_image_name(image_name);
+    char layout[PATH_MAX];
+    char index_path[PATH_MAX];
+    strformat(layout, PATH_MAX, "%s/%s", images_path, image_name);
+    strformat(index_path, PATH_MAX, "%s/index.json", layout);
+    if (!exists(index_path))
+        return NULL;
+    struct Json *json = json_parse_file(index_path);
+    if (json == NULL)
+    {
+        fprintf(stderr, "Could not parse %s\n", index_path);
+        exit(1);
+    }
+    // The index may point to another index (for multi-platform images) before the manifest
+    for (int depth = 0; json_get(json, "layers") == NULL; depth++)
+    {
+        const char *digest = select_manifest(json);
+        if (digest == NULL || depth == 4)
+        {
+            fprintf(stderr, "No image manifest found in %s\n", layout);
+            exit(1);
+        }
+        struct Json *next = load_json_blob(layout, digest);
+        json_free(json);
+        json = next;
+    }
+
+    char cache_dir[PATH_MAX];
+    strformat(cache_dir, PATH_MAX, "%s/" CACHE_DIR, containers_path);
+    create_directory_exists_ok(NULL, containers_path, 0755);
+    create_directory_exists_ok(NULL, cache_dir, 0755);
+
+    // overlayfs mount options are limited to a page
+    size_t capacity = 4096;
+    char *lowerdir = safe_malloc(capacity);
+    lowerdir[0] = '\0';
+    size_t length = 0;
+    int count = 0;
+    struct Json *layers = json_get(json, "layers");
+    for (struct Json *layer = layers->child; layer != NULL; layer = layer->next)
+    {
+        const char *media_type = json_get_string(layer, "mediaType");
+        const char *hex = digest_hex(json_get_string(layer, "digest"));
+        if (!is_gzip_layer(media_type) || hex == NULL)
+        {
+            fprintf(stderr, "Unsupported layer %s in %s\n", media_type ? media_type : "",
+                    layout);
+            exit(1);
+        }
+        char *path = layer_cache_lookup(cache_dir, layout, hex);
+        size_t path_length = strlen(path);
+        if (length + path_length + 2 > capacity)
+        {
+            fprintf(stderr, "%s has too many layers for overlayfs\n", image_name);
+            exit(1);
+        }
+        // Each layer goes in front of the ones below it
+        memmove(lowerdir + path_length + (count > 0), lowerdir, length + 1);
+        memcpy(lowerdir, path, path_length);
+        if (count > 0)
+            lowerdir[path_length] = ':';
+        length += path_length + (count > 0);
+        count++;
+        free(path);
+    }
+    json_free(json);
+    if (count == 0)
+    {
+        fprintf(stderr, "%s has no layers\n", image_name);
+        exit(1);
+    }
+    printf("=> Using %d layer(s) of %s\n", count, image_name);
+    return lowerdir;
+}
+
+// Returns 1 if path is the root of a mount
+static int is_mountpoint(const char *path)
+{
+    char parent[PATH_MAX];
+    struct stat st, parent_st;
+    strformat(parent, PATH_MAX, "%s/..", path);
+    if (stat(path, &st) == -1 || stat(parent, &parent_st) == -1)
+        return 0;
+    return st.st_dev != parent_st.st_dev || st.st_ino == parent_st.st_ino;
+}
+
+// Attaches file to a free loop device, which is detached automatically when it is unmounted.
+// Returns the loop device number.
+static int loop_attach(const char *file)
+{
+    int file_fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (file_fd == -1)
+    {
+        errorMessage("Could not open %s\n", file);
+    }
+    int control = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+    if (control == -1)
+    {
+        errorMessage("%s\n", "Could not open /dev/loop-control");
+    }
+    // Another process may grab the same free device, in which case LOOP_CONFIGURE fails with
+    // EBUSY and we try the next one
+    for (int attempt = 0; attempt < 16; attempt++)
+    {
+        int number = ioctl(control, LOOP_CTL_GET_FREE);
+        if (number == -1)
+        {
+            errorMessage("%s\n", "LOOP_CTL_GET_FREE failed");
+        }
+        char device[PATH_MAX];
+        strformat(device, PATH_MAX, "/dev/loop%d", number);
+        int loop_fd = open(device, O_RDONLY | O_CLOEXEC);
+        if (loop_fd == -1)
+        {
+            errorMessage("Could not open %s\n", device);
+        }
+        struct loop_config config;
+        memset(&config, 0, sizeof(config));
+        config.fd = (unsigned int)file_fd;
+        config.info.lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR | LO_FLAGS_DIRECT_IO;
+        strformat((char *)config.info.lo_file_name, LO_NAME_SIZE, "%.*s", LO_NAME_SIZE - 1,
+                  file);
+        int status = ioctl(loop_fd, LOOP_CONFIGURE, &config);
+        close(loop_fd);
+        if (status == 0)
+        {
+            close(control);
+            close(file_fd);
+            return number;
+        }
+        if (errno != EBUSY)
+        {
+            errorMessage("LOOP_CONFIGURE %s failed\n", device);
+        }
+    }
+    fprintf(stderr, "Could not find a free loop device\n");
+    exit(1);
+}
+
+// Detaches the mounts of the read-only images of image_name in mount_dir, except keep (NULL for
+// none). Containers still using one keep it until they exit, its loop device is then cleared.
+static void image_unmount(const char *mount_dir, const char *image_name, const char *keep)
+{
+    DIR *dir = opendir(mount_dir);
+    if (dir == NULL)
+        return;
+    size_t name_length = strlen(image_name);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        // <name>-<format>-<inode>-<mtime>, image names may contain '-' themselves
+        if (strncmp(entry->d_name, image_name, name_length) != 0 ||
+            entry->d_name[name_length] != '-')
+            continue;
+        const char *rest = entry->d_name + name_length + 1;
+        const char **format;
+        for (format = mountable_formats; *format != NULL; format++)
+        {
+            size_t format_length = strlen(*format);
+            if (strncmp(rest, *format, format_length) == 0 && rest[format_length] == '-')
+                break;
+        }
+        unsigned long long inode;
+        long long mtime;
+        int end = 0;
+        if (*format == NULL ||
+            sscanf(rest + strlen(*format) + 1, "%llu-%lld%n", &inode, &mtime, &end) != 2 ||
+            rest[strlen(*format) + 1 + end] != '\0')
+            continue;
+        char path[PATH_MAX];
+        strformat(path, PATH_MAX, "%s/%s", mount_dir, entry->d_name);
+        if (keep != NULL && strcmp(path, keep) == 0)
+            continue;
+        if (is_mountpoint(path) && umount2(path, MNT_DETACH) == -1)
+        {
+            fprintf(stderr, "Could not unmount %s: %s\n", path, strerror(errno));
+            continue;
+        }
+        rmdir(path);
+        char lock[PATH_MAX];
+        strformat(lock, PATH_MAX, "%s.lock", path);
+        unlink(lock);
+    }
+    closedir(dir);
+}
+
+// @brief Returns the mount point of a read-only image of image_name, or NULL if there is none
+// @details The image is loop mounted the first time it is used, in the mount namespace of the
+// caller, and stays mounted so that every container using it shares the mount and its page
+// cache. The mount point is derived from the inode and mtime of the image file, so a replaced
+// image gets a fresh mount, and the mount of the image it replaced is detached.
+char *image_mount_lookup(const char *containers_path, const char *images_path,
+                         const char *image_name)
+{
+    validate_image_name(image_name);
+    const char **format;
+    char file[PATH_MAX];
+    struct stat st;
+    for (format = mountable_formats; *format != NULL; format++)
+    {
+        strformat(file, PATH_MAX, "%s/%s.%s", images_path, image_name, *format);
+        if (stat(file, &st) == 0)
+            break;
+    }
+    if (*format == NULL)
+        return NULL;
+
+    char mount_dir[PATH_MAX];
+    strformat(mount_dir, PATH_MAX, "%s/" MOUNT_DIR, containers_path);
+    create_directory_exists_ok(NULL, containers_path, 0755);
+    create_directory_exists_ok(NULL, mount_dir, 0755);
+    char *path = safe_malloc(PATH_MAX);
+    strformat(path, PATH_MAX, "%s/%s-%s-%llu-%lld", mount_dir, image_name, *format,
+              (unsigned long long)st.st_ino, (long long)st.st_mtim.tv_sec);
+    if (is_mountpoint(path))
+    {
+        printf("=> Using mounted %s image\n", *format);
+        return path;
+    }
+
+    char lock[PATH_MAX];
+    strformat(lock, PATH_MAX, "%s.lock", path);
+    int lock_fd = lock_file(lock, "=> Waiting for another process to mount the image\n");
+    if (!is_mountpoint(path))
+    {
+        printf("=> Mounting %s image %s\n", *format, file);
+        create_directory_exists_ok(NULL, path, 0755);
+        char device[PATH_MAX];
+        strformat(device, PATH_MAX, "/dev/loop%d", loop_attach(file));
+        if (mount(device, path, *format, MS_RDONLY | MS_NODEV | MS_NOSUID, NULL) == -1)
+        {
+            fprintf(stderr, "Error mounting %s image %s: %s\n", *format, file, strerror(errno));
+            exit(1);
+        }
+        image_unmount(mount_dir, image_name, path);
+    }
+    close(lock_fd);
+    return path;
+}
+
+// Converts images/<name>.tar.gz into a read-only filesystem image using mkfs.erofs or
+// mksquashfs, from the extracted copy in the image cache
+static void image_convert(const char *containers_path, const char *images_path,
+                          const char *image_name, const char *format)
+{
+    char *rootfs = image_cache_lookup(containers_path, images_path, image_name);
+    char output[PATH_MAX];
+    char tmp[PATH_MAX];
+    strformat(output, PATH_MAX, "%s/%s.%s", images_path, image_name, format);
+    strformat(tmp, PATH_MAX, "%s.tmp", output);
+    unlink(tmp);
+    printf("=> Converting %s to %s\n", image_name, output);
+    if (strcmp(format, "erofs") == 0)
+    {
+        char *args[] = {"mkfs.erofs", "-zlz4hc", tmp, rootfs, NULL};
+        exec_command("mkfs.erofs", args);
+    }
+    else
+    {
+        char *args[] = {"mksquashfs", rootfs, tmp, "-noappend", "-comp", "lz4", NULL};
+        exec_command("mksquashfs", args);
+    }
+    if (rename(tmp, output) == -1)
+    {
+        errorMessage("Could not rename %s to %s\n", tmp, output);
+    }
+    printf("=> Created %s, it will be mounted instead of extracted from now on\n", output);
+    free(rootfs);
+}
+
+// Removes the read-only images of image_name made by image convert, and detaches their mounts.
+// The archive they were made from is left alone.
+static void image_remove(const char *containers_path, const char *images_path,
+                         const char *image_name)
+{
+    int removed = 0;
+    for (const char **format = mountable_formats; *format != NULL; format++)
+    {
+        char file[PATH_MAX];
+        strformat(file, PATH_MAX, "%s/%s.%s", images_path, image_name, *format);
+        if (unlink(file) == 0)
+        {
+            printf("=> Removed %s\n", file);
+            removed = 1;
+        }
+        else if (errno != ENOENT)
+        {
+            errorMessage("Could not remove %s\n", file);
+        }
+    }
+    char mount_dir[PATH_MAX];
+    strformat(mount_dir, PATH_MAX, "%s/" MOUNT_DIR, containers_path);
+    image_unmount(mount_dir, image_name, NULL);
+    if (!removed)
+    {
+        fprintf(stderr, "%s has no erofs or squashfs image\n", image_name);
+        exit(1);
+    }
+}
+
+/*
+ * @short Runs the image subcommand
+ * @param argc number of arguments after image subcommand
+ * @param argv arguments after the image subcommand
+ */
+void cmd_image(int argc, char *argv[])
+{
+    if (argc >= 2 && strcmp(argv[0], "convert") == 0)
+    {
+        const char *format = "erofs";
+        if (argc >= 3 && strncmp(argv[2], "--format=", 9) == 0)
+        {
+            format = argv[2] + 9;
+        }
+        if (strcmp(format, "erofs") != 0 && strcmp(format, "squashfs") != 0)
+        {
+            fprintf(stderr, "Unknown format %s, expected erofs or squashfs\n", format);
+            exit(1);
+        }
+        validate_image_name(argv[1]);
+        image_convert(CONTAINER_PATH, IMAGE_PATH, argv[1], format);
+        return;
+    }
+    if (argc == 2 && strcmp(argv[0], "rm") == 0)
+    {
+        validate_image_name(argv[1]);
+        image_remove(CONTAINER_PATH, IMAGE_PATH, argv[1]);
+        return;
+    }
+    printf("Usage: ./container image convert image_name [--format=erofs|squashfs]\n");
+    printf("       ./container image rm image_name\n");
+    exit(1);
+}
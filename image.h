@@ -0,0 +1,14 @@
+#ifndef CONTAINER_IMAGE_H
+#define CONTAINER_IMAGE_H
+// Cache of extracted images, addressed by the digest of the image archive, and read-only
+// images which are mounted instead of extracted. Images are either a single .tar.gz archive
+// or an OCI layout directory with several layers.
+
+char *image_cache_lookup(const char *containers_path, const char *images_path,
+                         const char *image_name);
+char *image_layers_lookup(const char *containers_path, const char *images_path,
+                          const char *image_name);
+char *image_mount_lookup(const char *containers_path, const char *images_path,
+                         const char *image_name);
+void cmd_image(int argc, char *argv[]);
+#endif // CONTAINER_IMAGE_H
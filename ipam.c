@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#include "ipam.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The addresses in use of a subnet (BRIDGE_SUBNET, or the subnet of the parent interface of
+// macvlan and ipvlan containers) are tracked by a bitmap in containers/__ipam-<network>-<prefix>,
+// which is mapped by every process allocating or releasing an address, under an exclusive
+// flock().
+// Allocation is next fit: the search for a free bit goes on, 64 bits at a time, from where the
+// previous one stopped, so that it takes O(1) amortized time and addresses are not reused right
+// away.
+//
+// Next to the bitmap, the owner of each address is recorded: the ID of its container, and the
+// PID of its init along with the inode of its network namespace. A container which crashed, or
+// whose run process was killed, never releases its address. When the subnet is full, addresses
+// whose owner does not exist anymore (its init is gone, or /proc/<pid>/ns/net is now another
+// namespace) are freed before giving up. The daemon does the same when it starts.
+
+#define IPAM_FILE "__ipam-"
+#define IPAM_MAGIC "ctipam1"
+
+struct IpamOwner
+{
+    char id[16];
+    uint64_t netns;
+    int32_t pid;
+    uint32_t reserved;
+};
+
+struct IpamHeader
+{
+    char magic[8];
+    // Subnet the bitmap is for, in host byte order
+    uint32_t network;
+    uint32_t prefix;
+    // Where the next search for a free address starts
+    uint32_t cursor;
+    uint32_t used;
+};
+
+struct Ipam
+{
+    int fd;
+    size_t size;
+    struct IpamHeader *header;
+    uint64_t *bitmap;
+    struct IpamOwner *owners;
+    // Number of addresses in the subnet
+    uint32_t count;
+};
+
+// Parses a.b.c.d/prefix
+static int ipam_subnet(const char *cidr, uint32_t *network, uint32_t *prefix)
+{
+    char subnet[32];
+    strformat(subnet, sizeof(subnet), "%s", cidr);
+    char *slash = strchr(subnet, '/');
+    struct in_addr addr;
+    if (slash == NULL || inet_pton(AF_INET, (*slash = '\0', subnet), &addr) != 1)
+        return -1;
+    *prefix = (uint32_t)atoi(slash + 1);
+    if (*prefix < 8 || *prefix > 30)
+        return -1;
+    *network = ntohl(addr.s_addr) & ~((1u << (32 - *prefix)) - 1);
+    return 0;
+}
+
+static int ipam_test(struct Ipam *ipam, uint32_t index)
+{
+    return (ipam->bitmap[index / 64] >> (index % 64)) & 1;
+}
+
+static void ipam_set(struct Ipam *ipam, uint32_t index, int value)
+{
+    if (value)
+        ipam->bitmap[index / 64] |= 1ull << (index % 64);
+    else
+        ipam->bitmap[index / 64] &= ~(1ull << (index % 64));
+}
+
+// Marks the addresses which must never be given to a container (the network and broadcast
+// addresses, and the addresses of the host such as the gateway) as used
+static void ipam_reserve(struct Ipam *ipam, const uint32_t *reserved, int reserved_count)
+{
+    ipam_set(ipam, 0, 1);
+    ipam_set(ipam, ipam->count - 1, 1);
+    for (int i = 0; i < reserved_count; i++)
+    {
+        if ((reserved[i] & ~(ipam->count - 1)) == ipam->header->network)
+            ipam_set(ipam, reserved[i] & (ipam->count - 1), 1);
+    }
+}
+
+// Maps the state file of subnet and locks it, it is created as needed
+static void ipam_open(struct Ipam *ipam, const char *containers_path, const char *subnet)
+{
+    uint32_t network, prefix;
+    if (ipam_subnet(subnet, &network, &prefix) == -1)
+    {
+        fprintf(stderr, "Invalid subnet %s\n", subnet);
+        exit(1);
+    }
+    ipam->count = 1u << (32 - prefix);
+    size_t bitmap_size = (ipam->count + 63) / 64 * sizeof(uint64_t);
+    ipam->size = sizeof(struct IpamHeader) + bitmap_size + ipam->count * sizeof(struct IpamOwner);
+
+    char path[PATH_MAX];
+    create_directory_exists_ok(NULL, containers_path, 0755);
+    strformat(path, PATH_MAX, "%s/" IPAM_FILE "%s", containers_path, subnet);
+    *strrchr(path, '/') = '-';
+    ipam->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (ipam->fd == -1)
+    {
+        errorMessage("Could not open %s\n", path);
+    }
+    if (flock(ipam->fd, LOCK_EX) == -1)
+    {
+        errorMessage("Could not lock %s\n", path);
+    }
+    struct stat st;
+    if (fstat(ipam->fd, &st) == -1 || ((size_t)st.st_size != ipam->size &&
+                                       ftruncate(ipam->fd, (off_t)ipam->size) == -1))
+    {
+        errorMessage("Could not resize %s\n", path);
+    }
+    char *map = mmap(NULL, ipam->size, PROT_READ | PROT_WRITE, MAP_SHARED, ipam->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        errorMessage("Could not map %s\n", path);
+    }
+    ipam->header = (struct IpamHeader *)map;
+    ipam->bitmap = (uint64_t *)(map + sizeof(struct IpamHeader));
+    ipam->owners = (struct IpamOwner *)(map + sizeof(struct IpamHeader) + bitmap_size);
+    if (memcmp(ipam->header->magic, IPAM_MAGIC, sizeof(IPAM_MAGIC)) != 0 ||
+        ipam->header->network != network || ipam->header->prefix != prefix)
+    {
+        memset(map, 0, ipam->size);
+        memcpy(ipam->header->magic, IPAM_MAGIC, sizeof(IPAM_MAGIC));
+        ipam->header->network = network;
+        ipam->header->prefix = prefix;
+    }
+}
+
+// Unmaps and unlocks the state file
+static void ipam_close(struct Ipam *ipam)
+{
+    munmap(ipam->header, ipam->size);
+    close(ipam->fd);
+}
+
+// Returns the inode of the network namespace of pid, or 0 if pid does not exist
+static uint64_t ipam_netns(pid_t pid)
+{
+    char path[64];
+    struct stat st;
+    strformat(path, sizeof(path), "/proc/%d/ns/net", (int)pid);
+    if (stat(path, &st) == -1)
+        return 0;
+    return (uint64_t)st.st_ino;
+}
+
+// Frees the addresses whose container is gone, returns how many were freed
+static int ipam_reconcile_locked(struct Ipam *ipam)
+{
+    int freed = 0;
+    for (uint32_t index = 1; index < ipam->count - 1; index++)
+    {
+        struct IpamOwner *owner = &ipam->owners[index];
+        // Reserved addresses have no owner
+        if (!ipam_test(ipam, index) || owner->pid == 0)
+            continue;
+        if (ipam_netns(owner->pid) != owner->netns)
+        {
+            ipam_set(ipam, index, 0);
+            memset(owner, 0, sizeof(struct IpamOwner));
+            ipam->header->used--;
+            freed++;
+        }
+    }
+    return freed;
+}
+
+// Returns the index of a free address at or after the cursor, or 0 when the search wrapped
+// around without finding any
+static uint32_t ipam_search(struct Ipam *ipam)
+{
+    uint32_t words = (ipam->count + 63) / 64;
+    uint32_t start = ipam->header->cursor % ipam->count;
+    for (uint32_t i = 0; i <= words; i++)
+    {
+        uint32_t word = (start / 64 + i) % words;
+        uint64_t free_bits = ~ipam->bitmap[word];
+        // On the first word, the bits before the cursor are only looked at after wrapping
+        if (i == 0)
+            free_bits &= ~0ull << (start % 64);
+        if (free_bits != 0)
+        {
+            uint32_t index = word * 64 + (uint32_t)__builtin_ctzll(free_bits);
+            if (index < ipam->count)
+                return index;
+        }
+    }
+    return 0;
+}
+
+/*
+ * @short Allocates an IP address in subnet for a container
+ * @param subnet a.b.c.d/prefix
+ * @param reserved addresses which are used by the host, in host byte order
+ * @param id ID of the container
+ * @param pid PID of the init of the container, whose network namespace gets the address
+ * @return the address, in host byte order
+ */
+uint32_t ipam_allocate(const char *containers_path, const char *subnet, const uint32_t *reserved,
+                       int reserved_count, const char *id, pid_t pid)
+{
+    struct Ipam ipam;
+    ipam_open(&ipam, containers_path, subnet);
+    ipam_reserve(&ipam, reserved, reserved_count);
+    uint32_t index = ipam_search(&ipam);
+    // Only when the subnet looks full are leaked addresses looked for
+    if (index == 0 && ipam_reconcile_locked(&ipam) > 0)
+    {
+        index = ipam_search(&ipam);
+    }
+    if (index == 0)
+    {
+        fprintf(stderr, "No IP address left in %s\n", subnet);
+        exit(1);
+    }
+    ipam_set(&ipam, index, 1);
+    struct IpamOwner *owner = &ipam.owners[index];
+    strformat(owner->id, sizeof(owner->id), "%s", id);
+    owner->pid = pid;
+    owner->netns = ipam_netns(pid);
+    ipam.header->used++;
+    ipam.header->cursor = index + 1;
+    uint32_t address = ipam.header->network | index;
+    ipam_close(&ipam);
+    return address;
+}
+
+// Releases the address of container id, unless it has been given to another container since
+void ipam_release(const char *containers_path, const char *subnet, const char *id,
+                  uint32_t address)
+{
+    struct Ipam ipam;
+    ipam_open(&ipam, containers_path, subnet);
+    uint32_t index = address & (ipam.count - 1);
+    if ((address & ~(ipam.count - 1)) == ipam.header->network && ipam_test(&ipam, index) &&
+        strncmp(ipam.owners[index].id, id, sizeof(ipam.owners[index].id)) == 0)
+    {
+        ipam_set(&ipam, index, 0);
+        memset(&ipam.owners[index], 0, sizeof(struct IpamOwner));
+        ipam.header->used--;
+    }
+    ipam_close(&ipam);
+}
+
+// Frees the addresses in subnet of containers which are gone, returns how many were freed
+int ipam_reconcile(const char *containers_path, const char *subnet)
+{
+    struct Ipam ipam;
+    ipam_open(&ipam, containers_path, subnet);
+    int freed = ipam_reconcile_locked(&ipam);
+    ipam_close(&ipam);
+    return freed;
+}
+
+// Formats address as a.b.c.d/prefix, with the prefix of subnet
+void ipam_format(char *buffer, size_t size, const char *subnet, uint32_t address)
+{
+    uint32_t network, prefix;
+    ipam_subnet(subnet, &network, &prefix);
+    strformat(buffer, size, "%u.%u.%u.%u/%u", address >> 24, (address >> 16) & 0xff,
+              (address >> 8) & 0xff, address & 0xff, prefix);
+}
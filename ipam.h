@@ -0,0 +1,14 @@
+#ifndef CONTAINER_IPAM_H
+#define CONTAINER_IPAM_H
+// Allocation of the IP addresses of containers in the subnet of the bridge, or of the parent
+// interface of macvlan and ipvlan containers
+#include <stdint.h>
+#include <sys/types.h>
+
+uint32_t ipam_allocate(const char *containers_path, const char *subnet, const uint32_t *reserved,
+                       int reserved_count, const char *id, pid_t pid);
+void ipam_release(const char *containers_path, const char *subnet, const char *id,
+                  uint32_t address);
+int ipam_reconcile(const char *containers_path, const char *subnet);
+void ipam_format(char *buffer, size_t size, const char *subnet, uint32_t address);
+#endif // CONTAINER_IPAM_H
@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+#include "ipc.h"
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Listens on the UNIX socket path, replacing a socket left behind by a process which crashed.
+// Only the owner of the socket may connect to it.
+int ipc_listen(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strformat(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        errorMessage("%s\n", "socket() failed");
+    }
+    unlink(path);
+    // The socket is created with mode 0600 rather than changed after bind(), which would leave
+    // a moment in which anyone may connect
+    mode_t umask_saved = umask(0177);
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(umask_saved);
+    if (bound == -1 || listen(fd, 128) == -1)
+    {
+        errorMessage("Could not listen on %s\n", path);
+    }
+    return fd;
+}
+
+// Accepts a connection on listen_fd, returns -1 if there is none or if the peer is neither root
+// nor the user this process runs as. Whoever may send requests may run anything as that user.
+int ipc_accept(int listen_fd)
+{
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    struct ucred cred = {.uid = (uid_t)-1};
+    socklen_t length = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) == -1 ||
+        (cred.uid != 0 && cred.uid != geteuid()))
+    {
+        fprintf(stderr, "=> Refused a connection from uid %d\n", (int)cred.uid);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Returns a connection to the UNIX socket path, or -1 if nothing listens on it
+int ipc_connect(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strformat(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (!exists(path))
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends a message along with up to IPC_MAX_FDS file descriptors
+int ipc_send(int fd, const void *data, size_t length, const int *fds, int nfds)
+{
+    char control[CMSG_SPACE(IPC_MAX_FDS * sizeof(int))];
+    struct iovec iov = {.iov_base = (void *)data, .iov_len = length};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (nfds > 0)
+    {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)length ? 0 : -1;
+}
+
+// Receives a message, and the file descriptors sent with it (close-on-exec)
+ssize_t ipc_recv(int fd, void *data, size_t length, int *fds, int *nfds)
+{
+    char control[CMSG_SPACE(IPC_MAX_FDS * sizeof(int))];
+    struct iovec iov = {.iov_base = data, .iov_len = length};
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    *nfds = 0;
+    if (n <= 0)
+        return n;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+        }
+    }
+    return n;
+}
+
+// @brief Builds a message out of header and the NULL terminated argv and envp (either may be
+// NULL) into message, which has room for IPC_MESSAGE_MAX bytes
+// @details Sets the argc and envc of header, returns the length of the message or 0 if it does
+// not fit
+size_t ipc_pack(char *message, struct IpcHeader *header, char *const argv[], char *const envp[])
+{
+    size_t length = sizeof(struct IpcHeader);
+    header->argc = 0;
+    header->envc = 0;
+    char *const *lists[2] = {argv, envp};
+    uint32_t *counts[2] = {&header->argc, &header->envc};
+    for (int list = 0; list < 2; list++)
+    {
+        for (char *const *s = lists[list]; s != NULL && *s != NULL; s++)
+        {
+            size_t n = strlen(*s) + 1;
+            if (length + n > IPC_MESSAGE_MAX)
+                return 0;
+            memcpy(message + length, *s, n);
+            length += n;
+            (*counts[list])++;
+        }
+    }
+    memcpy(message, header, sizeof(struct IpcHeader));
+    return length;
+}
+
+// @brief Splits a message into its header, and argv and envp arrays pointing into the message
+// @details argv is heap allocated (envp points into it), and must be freed. Returns -1 if the
+// message is malformed.
+int ipc_unpack(char *message, size_t length, struct IpcHeader *header, char ***argv,
+               char ***envp)
+{
+    if (length < sizeof(struct IpcHeader))
+        return -1;
+    memcpy(header, message, sizeof(struct IpcHeader));
+    if (header->argc > length || header->envc > length)
+        return -1;
+    char **strings = safe_malloc((header->argc + header->envc + 2) * sizeof(char *));
+    char *p = message + sizeof(struct IpcHeader);
+    char *end = message + length;
+    for (uint32_t i = 0; i < header->argc + header->envc; i++)
+    {
+        char *nul = memchr(p, '\0', end - p);
+        if (nul == NULL)
+        {
+            free(strings);
+            return -1;
+        }
+        strings[i + (i >= header->argc)] = p;
+        p = nul + 1;
+    }
+    strings[header->argc] = NULL;
+    strings[header->argc + header->envc + 1] = NULL;
+    *argv = strings;
+    *envp = strings + header->argc + 1;
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef CONTAINER_IPC_H
+#define CONTAINER_IPC_H
+// Messages exchanged over SOCK_SEQPACKET UNIX sockets, by the pool and the daemon
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define IPC_MESSAGE_MAX 65536
+// At most this many file descriptors are passed along with a message
+#define IPC_MAX_FDS 3
+
+// Header of every message, followed by argc + envc NUL terminated strings
+struct IpcHeader
+{
+    uint32_t type;
+    uint32_t argc;
+    uint32_t envc;
+    // Meaning depends on the type, e.g. a signal number or an exit status
+    uint32_t value;
+};
+
+int ipc_listen(const char *path);
+int ipc_accept(int listen_fd);
+int ipc_connect(const char *path);
+int ipc_send(int fd, const void *data, size_t length, const int *fds, int nfds);
+ssize_t ipc_recv(int fd, void *data, size_t length, int *fds, int *nfds);
+size_t ipc_pack(char *message, struct IpcHeader *header, char *const argv[], char *const envp[]);
+int ipc_unpack(char *message, size_t length, struct IpcHeader *header, char ***argv,
+               char ***envp);
+#endif // CONTAINER_IPC_H
@@ -0,0 +1,363 @@
+#include "json.h"
+#include "utils.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+// Recursive descent parser for RFC 8259 JSON. Errors are reported by returning NULL.
+// https://www.rfc-editor.org/rfc/rfc8259
+
+#define JSON_MAX_DEPTH 64
+
+struct Parser
+{
+    const char *p;
+    int depth;
+};
+
+static struct Json *parse_value(struct Parser *ps);
+
+static void skip_whitespace(struct Parser *ps)
+{
+    while (*ps->p == ' ' || *ps->p == '\t' || *ps->p == '\n' || *ps->p == '\r')
+        ps->p++;
+}
+
+static struct Json *json_new(enum JsonType type)
+{
+    struct Json *value = safe_malloc(sizeof(struct Json));
+    memset(value, 0, sizeof(struct Json));
+    value->type = type;
+    return value;
+}
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static long parse_hex4(const char *p)
+{
+    long value = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        int digit = hex_digit(p[i]);
+        if (digit < 0)
+            return -1;
+        value = value * 16 + digit;
+    }
+    return value;
+}
+
+// Appends the UTF-8 encoding of codepoint to out, returns the number of bytes written
+static int utf8_encode(unsigned long codepoint, char *out)
+{
+    if (codepoint < 0x80)
+    {
+        out[0] = (char)codepoint;
+        return 1;
+    }
+    if (codepoint < 0x800)
+    {
+        out[0] = (char)(0xc0 | (codepoint >> 6));
+        out[1] = (char)(0x80 | (codepoint & 0x3f));
+        return 2;
+    }
+    if (codepoint < 0x10000)
+    {
+        out[0] = (char)(0xe0 | (codepoint >> 12));
+        out[1] = (char)(0x80 | ((codepoint >> 6) & 0x3f));
+        out[2] = (char)(0x80 | (codepoint & 0x3f));
+        return 3;
+    }
+    out[0] = (char)(0xf0 | (codepoint >> 18));
+    out[1] = (char)(0x80 | ((codepoint >> 12) & 0x3f));
+    out[2] = (char)(0x80 | ((codepoint >> 6) & 0x3f));
+    out[3] = (char)(0x80 | (codepoint & 0x3f));
+    return 4;
+}
+
+// Parses a string starting at the opening quote, returns a heap allocated copy
+static char *parse_string(struct Parser *ps)
+{
+    if (*ps->p != '"')
+        return NULL;
+    ps->p++;
+    // The decoded string is never longer than the encoded one
+    const char *end = ps->p;
+    while (*end != '\0' && *end != '"')
+    {
+        end += (*end == '\\' && end[1] != '\0') ? 2 : 1;
+    }
+    char *out = safe_malloc((size_t)(end - ps->p) + 1);
+    size_t length = 0;
+    while (*ps->p != '"')
+    {
+        char c = *ps->p++;
+        if (c == '\0' || (unsigned char)c < 0x20)
+        {
+            free(out);
+            return NULL;
+        }
+        if (c != '\\')
+        {
+            out[length++] = c;
+            continue;
+        }
+        c = *ps->p++;
+        switch (c)
+        {
+        case '"':
+        case '\\':
+        case '/':
+            out[length++] = c;
+            break;
+        case 'b':
+            out[length++] = '\b';
+            break;
+        case 'f':
+            out[length++] = '\f';
+            break;
+        case 'n':
+            out[length++] = '\n';
+            break;
+        case 'r':
+            out[length++] = '\r';
+            break;
+        case 't':
+            out[length++] = '\t';
+            break;
+        case 'u':
+        {
+            long codepoint = parse_hex4(ps->p);
+            if (codepoint < 0)
+            {
+                free(out);
+                return NULL;
+            }
+            ps->p += 4;
+            if (codepoint >= 0xd800 && codepoint < 0xdc00 && ps->p[0] == '\\' &&
+                ps->p[1] == 'u')
+            {
+                long low = parse_hex4(ps->p + 2);
+                if (low >= 0xdc00 && low < 0xe000)
+                {
+                    codepoint = 0x10000 + ((codepoint - 0xd800) << 10) + (low - 0xdc00);
+                    ps->p += 6;
+                }
+            }
+            length += utf8_encode((unsigned long)codepoint, out + length);
+            break;
+        }
+        default:
+            free(out);
+            return NULL;
+        }
+    }
+    ps->p++;
+    out[length] = '\0';
+    return out;
+}
+
+static struct Json *parse_number(struct Parser *ps)
+{
+    char *end;
+    errno = 0;
+    double number = strtod(ps->p, &end);
+    if (end == ps->p || errno == ERANGE)
+        return NULL;
+    ps->p = end;
+    struct Json *value = json_new(JSON_NUMBER);
+    value->number = number;
+    return value;
+}
+
+static int parse_literal(struct Parser *ps, const char *literal)
+{
+    size_t length = strlen(literal);
+    if (strncmp(ps->p, literal, length) != 0)
+        return 0;
+    ps->p += length;
+    return 1;
+}
+
+// Parses the members of an array or object, up to the closing bracket
+static struct Json *parse_container(struct Parser *ps, enum JsonType type)
+{
+    char close = type == JSON_ARRAY ? ']' : '}';
+    struct Json *value = json_new(type);
+    struct Json **tail = &value->child;
+    if (++ps->depth > JSON_MAX_DEPTH)
+        goto fail;
+    ps->p++;
+    skip_whitespace(ps);
+    if (*ps->p == close)
+    {
+        ps->p++;
+        ps->depth--;
+        return value;
+    }
+    for (;;)
+    {
+        char *key = NULL;
+        skip_whitespace(ps);
+        if (type == JSON_OBJECT)
+        {
+            key = parse_string(ps);
+            skip_whitespace(ps);
+            if (key == NULL || *ps->p != ':')
+            {
+                free(key);
+                goto fail;
+            }
+            ps->p++;
+        }
+        struct Json *member = parse_value(ps);
+        if (member == NULL)
+        {
+            free(key);
+            goto fail;
+        }
+        member->key = key;
+        *tail = member;
+        tail = &member->next;
+        skip_whitespace(ps);
+        if (*ps->p == ',')
+        {
+            ps->p++;
+            continue;
+        }
+        if (*ps->p == close)
+        {
+            ps->p++;
+            ps->depth--;
+            return value;
+        }
+        goto fail;
+    }
+fail:
+    json_free(value);
+    return NULL;
+}
+
+static struct Json *parse_value(struct Parser *ps)
+{
+    skip_whitespace(ps);
+    struct Json *value = NULL;
+    switch (*ps->p)
+    {
+    case '{':
+        return parse_container(ps, JSON_OBJECT);
+    case '[':
+        return parse_container(ps, JSON_ARRAY);
+    case '"':
+    {
+        char *string = parse_string(ps);
+        if (string == NULL)
+            return NULL;
+        value = json_new(JSON_STRING);
+        value->string = string;
+        return value;
+    }
+    case 't':
+    case 'f':
+        if (parse_literal(ps, "true"))
+        {
+            value = json_new(JSON_BOOL);
+            value->boolean = 1;
+        }
+        else if (parse_literal(ps, "false"))
+        {
+            value = json_new(JSON_BOOL);
+        }
+        return value;
+    case 'n':
+        return parse_literal(ps, "null") ? json_new(JSON_NULL) : NULL;
+    default:
+        return parse_number(ps);
+    }
+}
+
+// Parses text, returns NULL if it is not a single valid JSON value
+struct Json *json_parse(const char *text)
+{
+    struct Parser ps = {text, 0};
+    struct Json *value = parse_value(&ps);
+    skip_whitespace(&ps);
+    if (value != NULL && *ps.p != '\0')
+    {
+        json_free(value);
+        return NULL;
+    }
+    return value;
+}
+
+// Reads and parses the file at path, returns NULL if it cannot be read or parsed
+struct Json *json_parse_file(const char *path)
+{
+    FILE *f = fopen(path, "re");
+    if (f == NULL)
+        return NULL;
+    size_t capacity = 4096;
+    size_t length = 0;
+    char *text = safe_malloc(capacity);
+    size_t n;
+    while ((n = fread(text + length, 1, capacity - length - 1, f)) > 0)
+    {
+        length += n;
+        if (capacity - length == 1)
+        {
+            capacity *= 2;
+            char *bigger = realloc(text, capacity);
+            if (bigger == NULL)
+            {
+                exit(2);
+            }
+            text = bigger;
+        }
+    }
+    fclose(f);
+    text[length] = '\0';
+    struct Json *value = json_parse(text);
+    free(text);
+    return value;
+}
+
+// Returns the member key of object, or NULL if object is not an object or has no such member
+struct Json *json_get(const struct Json *object, const char *key)
+{
+    if (object == NULL || object->type != JSON_OBJECT)
+        return NULL;
+    for (struct Json *member = object->child; member != NULL; member = member->next)
+    {
+        if (strcmp(member->key, key) == 0)
+            return member;
+    }
+    return NULL;
+}
+
+// Returns the string member key of object, or NULL if it is missing or not a string
+const char *json_get_string(const struct Json *object, const char *key)
+{
+    struct Json *member = json_get(object, key);
+    return member != NULL && member->type == JSON_STRING ? member->string : NULL;
+}
+
+void json_free(struct Json *value)
+{
+    while (value != NULL)
+    {
+        struct Json *next = value->next;
+        json_free(value->child);
+        free(value->key);
+        free(value->string);
+        free(value);
+        value = next;
+    }
+}
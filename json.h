@@ -0,0 +1,33 @@
+#ifndef CONTAINER_JSON_H
+#define CONTAINER_JSON_H
+// Minimal JSON parser, used to read OCI image layouts
+
+enum JsonType
+{
+    JSON_NULL,
+    JSON_BOOL,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT
+};
+
+// A parsed value. Members of arrays and objects are stored as a linked list of children,
+// object members also have a key.
+struct Json
+{
+    enum JsonType type;
+    char *key;
+    char *string;
+    double number;
+    int boolean;
+    struct Json *child;
+    struct Json *next;
+};
+
+struct Json *json_parse(const char *text);
+struct Json *json_parse_file(const char *path);
+struct Json *json_get(const struct Json *object, const char *key);
+const char *json_get_string(const struct Json *object, const char *key);
+void json_free(struct Json *value);
+#endif // CONTAINER_JSON_H
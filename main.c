@@ -1,5 +1,10 @@
 #define _GNU_SOURCE
 #include "run.h"
+#include "bench.h"
+#include "daemon.h"
+#include "image.h"
+#include "pool.h"
+#include "stats.h"
 #include <errno.h>
 #include <sched.h>
 #include <signal.h>
@@ -18,7 +23,8 @@ void sigint_handler(int s) {}
 int main(int argc, char *argv[])
 {
     // Basic initialization
-    srand(time(NULL));
+    // Containers started within the same second must not get the same IDs
+    srand(time(NULL) ^ getpid());
     // ======
     // Parse command line args and run the appropriate sub command
     if (argc < 2 || (argc >= 2 && strcmp(argv[1], "help") == 0))
@@ -28,6 +34,27 @@ int main(int argc, char *argv[])
         printf("run     Runs the specified image after creating a new container\n");
         printf("        a file called <image_name>.tar.gz must exist within " IMAGE_PATH "\n");
         printf("        Containers will be created in " CONTAINER_PATH "\n");
+        printf("daemon  Runs containers for run, ps, stop and exec while it is running\n");
+        printf("ps      Lists the containers run by the daemon\n");
+        printf("stop    container_id\n");
+        printf("        Kills a container run by the daemon\n");
+        printf("exec    container_id command [command options]\n");
+        printf("        Runs a command in a container run by the daemon\n");
+        printf("stats   [--json] [--prometheus=<file>] [--daemon] [container_id...]\n");
+        printf("        Shows the CPU, memory, IO, pressure and network use of the running\n");
+        printf("        containers\n");
+        printf("pool    image_name [idle_containers]\n");
+        printf("        Keeps idle containers of the image ready, run uses them while the\n");
+        printf("        pool is running\n");
+        printf("bench   [-n runs] [-c concurrency]\n");
+        printf("        Measures how long starting and removing containers takes, as JSON\n");
+        printf("bench   seccomp [-n calls]\n");
+        printf("        Measures how much longer system calls take with seccomp filters\n");
+        printf("image   convert image_name [--format=erofs|squashfs]\n");
+        printf("        Converts " IMAGE_PATH "/<image_name>.tar.gz into a read-only image\n");
+        printf("        which is mounted instead of extracted when a container is run\n");
+        printf("image   rm image_name\n");
+        printf("        Removes the read-only image and unmounts it\n");
         exit(1);
     }
     if (strcmp(argv[1], "run") == 0)
@@ -35,6 +62,38 @@ int main(int argc, char *argv[])
         // Pass arguments after ./container run
         cmd_run(argc - 2, argv + 2);
     }
+    else if (strcmp(argv[1], "daemon") == 0)
+    {
+        cmd_daemon(argc - 2, argv + 2);
+    }
+    else if (strcmp(argv[1], "ps") == 0)
+    {
+        cmd_ps(argc - 2, argv + 2);
+    }
+    else if (strcmp(argv[1], "stop") == 0)
+    {
+        cmd_stop(argc - 2, argv + 2);
+    }
+    else if (strcmp(argv[1], "exec") == 0)
+    {
+        cmd_exec(argc - 2, argv + 2);
+    }
+    else if (strcmp(argv[1], "stats") == 0)
+    {
+        cmd_stats(argc - 2, argv + 2);
+    }
+    else if (strcmp(argv[1], "pool") == 0)
+    {
+        cmd_pool(argc - 2, argv + 2);
+    }
+    else if (strcmp(argv[1], "bench") == 0)
+    {
+        cmd_bench(argc - 2, argv + 2);
+    }
+    else if (strcmp(argv[1], "image") == 0)
+    {
+        cmd_image(argc - 2, argv + 2);
+    }
     else
     {
         printf("Invalid command, run ./container help to view the help.\n");
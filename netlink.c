@@ -0,0 +1,463 @@
+#define _GNU_SOURCE
+#include "netlink.h"
+#include "trace.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/veth.h>
+#include <net/if.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Requests are queued into a single buffer and sent with one sendmsg() in netlink_commit().
+// Every request asks for an ACK, so the kernel replies with one NLMSG_ERROR per request, which
+// tells us exactly which step failed.
+// References:
+// https://man7.org/linux/man-pages/man7/netlink.7.html
+// https://man7.org/linux/man-pages/man7/rtnetlink.7.html
+
+static void netlink_socket(struct Netlink *nl, int protocol)
+{
+    nl->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, protocol);
+    if (nl->fd == -1)
+    {
+        errorMessage("%s\n", "socket(AF_NETLINK) failed");
+    }
+    struct sockaddr_nl addr = {.nl_family = AF_NETLINK};
+    if (bind(nl->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        errorMessage("%s\n", "bind(AF_NETLINK) failed");
+    }
+    nl->seq = 1;
+    nl->batch_start = 1;
+    nl->buffer = safe_malloc(NETLINK_BATCH_SIZE);
+    nl->length = 0;
+    nl->count = 0;
+}
+
+// Opens a netlink socket in the network namespace of the calling process
+void netlink_open(struct Netlink *nl) { netlink_socket(nl, NETLINK_ROUTE); }
+
+// Opens a nfnetlink socket (for nftables) in the network namespace of the calling process
+void netlink_open_netfilter(struct Netlink *nl)
+{
+    netlink_socket(nl, NETLINK_NETFILTER);
+    // Errors do not need to echo the whole request back
+    int one = 1;
+    setsockopt(nl->fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+}
+
+// Opens a netlink socket in the network namespace referred to by netns_fd.
+// A netlink socket stays bound to the namespace it was created in, so the calling process only
+// switches namespaces for the duration of the socket() call.
+void netlink_open_netns(struct Netlink *nl, int netns_fd)
+{
+    int self = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+    if (self == -1)
+    {
+        errorMessage("%s\n", "open /proc/self/ns/net failed");
+    }
+    if (setns(netns_fd, CLONE_NEWNET) == -1)
+    {
+        errorMessage("%s\n", "setns() into container network namespace failed");
+    }
+    netlink_socket(nl, NETLINK_ROUTE);
+    if (setns(self, CLONE_NEWNET) == -1)
+    {
+        errorMessage("%s\n", "setns() back into host network namespace failed");
+    }
+    close(self);
+}
+
+// Opens a netlink socket in the network namespace of the process pid
+void netlink_open_pid_netns(struct Netlink *nl, pid_t pid)
+{
+    char path[PATH_MAX];
+    strformat(path, PATH_MAX, "/proc/%d/ns/net", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        errorMessage("open %s failed\n", path);
+    }
+    netlink_open_netns(nl, fd);
+    close(fd);
+}
+
+void netlink_close(struct Netlink *nl)
+{
+    close(nl->fd);
+    free(nl->buffer);
+    nl->fd = -1;
+    nl->buffer = NULL;
+}
+
+// Starts a new request at the end of the batch, and returns a pointer to its header. Requests
+// are acknowledged unless NLM_F_ACK is cleared from its flags.
+struct nlmsghdr *netlink_request(struct Netlink *nl, unsigned short type, unsigned short flags,
+                                 const char *step)
+{
+    if (nl->count == NETLINK_MAX_BATCH ||
+        nl->length + NLMSG_SPACE(0) > NETLINK_BATCH_SIZE)
+    {
+        fprintf(stderr, "netlink: batch is full, cannot queue %s\n", step);
+        exit(1);
+    }
+    struct nlmsghdr *hdr = (struct nlmsghdr *)(nl->buffer + nl->length);
+    memset(hdr, 0, NLMSG_HDRLEN);
+    hdr->nlmsg_len = NLMSG_HDRLEN;
+    hdr->nlmsg_type = type;
+    hdr->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    hdr->nlmsg_seq = nl->seq++;
+    nl->steps[nl->count++] = step;
+    return hdr;
+}
+
+// Appends len bytes of data to the request, keeping the request aligned
+void *netlink_put(struct Netlink *nl, struct nlmsghdr *hdr, const void *data, size_t len)
+{
+    size_t offset = (char *)hdr - nl->buffer;
+    if (offset + NLMSG_ALIGN(hdr->nlmsg_len) + NLMSG_ALIGN(len) > NETLINK_BATCH_SIZE)
+    {
+        fprintf(stderr, "netlink: request too large\n");
+        exit(1);
+    }
+    char *dest = (char *)hdr + NLMSG_ALIGN(hdr->nlmsg_len);
+    memset(dest, 0, NLMSG_ALIGN(len));
+    if (data != NULL)
+    {
+        memcpy(dest, data, len);
+    }
+    hdr->nlmsg_len = NLMSG_ALIGN(hdr->nlmsg_len) + len;
+    return dest;
+}
+
+void netlink_attr(struct Netlink *nl, struct nlmsghdr *hdr, unsigned short type,
+                  const void *data, size_t len)
+{
+    struct rtattr attr = {.rta_len = RTA_LENGTH(len), .rta_type = type};
+    netlink_put(nl, hdr, &attr, sizeof(attr));
+    netlink_put(nl, hdr, data, len);
+}
+
+void netlink_attr_string(struct Netlink *nl, struct nlmsghdr *hdr, unsigned short type,
+                         const char *value)
+{
+    netlink_attr(nl, hdr, type, value, strlen(value) + 1);
+}
+
+// Starts a nested attribute, its length is fixed up by netlink_nest_end()
+struct rtattr *netlink_nest_begin(struct Netlink *nl, struct nlmsghdr *hdr, unsigned short type)
+{
+    struct rtattr attr = {.rta_len = RTA_LENGTH(0), .rta_type = type};
+    return netlink_put(nl, hdr, &attr, sizeof(attr));
+}
+
+void netlink_nest_end(struct nlmsghdr *hdr, struct rtattr *nest)
+{
+    nest->rta_len = (char *)hdr + hdr->nlmsg_len - (char *)nest;
+}
+
+// Closes the request started by netlink_request()
+void netlink_finish(struct Netlink *nl, struct nlmsghdr *hdr)
+{
+    nl->length += NLMSG_ALIGN(hdr->nlmsg_len);
+}
+
+// Parses an address of the form a.b.c.d/prefix
+static void parse_cidr(const char *cidr, struct in_addr *addr, unsigned char *prefix)
+{
+    char buffer[INET_ADDRSTRLEN + 4];
+    strformat(buffer, sizeof(buffer), "%s", cidr);
+    char *slash = strchr(buffer, '/');
+    *prefix = 32;
+    if (slash != NULL)
+    {
+        *slash = '\0';
+        *prefix = (unsigned char)atoi(slash + 1);
+    }
+    if (inet_pton(AF_INET, buffer, addr) != 1 || *prefix > 32)
+    {
+        fprintf(stderr, "Invalid IPv4 address %s\n", cidr);
+        exit(1);
+    }
+}
+
+// Creates a veth pair ifname <-> peer, where the peer is created directly inside the network
+// namespace of peer_pid, so that it does not have to be moved later
+void netlink_add_veth(struct Netlink *nl, const char *ifname, const char *peer, pid_t peer_pid)
+{
+    struct nlmsghdr *hdr =
+        netlink_request(nl, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, "create veth pair");
+    struct ifinfomsg ifi = {.ifi_family = AF_UNSPEC};
+    netlink_put(nl, hdr, &ifi, sizeof(ifi));
+    netlink_attr_string(nl, hdr, IFLA_IFNAME, ifname);
+
+    struct rtattr *linkinfo = netlink_nest_begin(nl, hdr, IFLA_LINKINFO);
+    netlink_attr_string(nl, hdr, IFLA_INFO_KIND, "veth");
+    struct rtattr *data = netlink_nest_begin(nl, hdr, IFLA_INFO_DATA);
+    struct rtattr *peer_info = netlink_nest_begin(nl, hdr, VETH_INFO_PEER);
+    netlink_put(nl, hdr, &ifi, sizeof(ifi));
+    netlink_attr_string(nl, hdr, IFLA_IFNAME, peer);
+    unsigned int pid = (unsigned int)peer_pid;
+    netlink_attr(nl, hdr, IFLA_NET_NS_PID, &pid, sizeof(pid));
+    netlink_nest_end(hdr, peer_info);
+    netlink_nest_end(hdr, data);
+    netlink_nest_end(hdr, linkinfo);
+    netlink_finish(nl, hdr);
+}
+
+// Creates a bridge
+void netlink_add_bridge(struct Netlink *nl, const char *ifname)
+{
+    struct nlmsghdr *hdr =
+        netlink_request(nl, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, "create bridge");
+    struct ifinfomsg ifi = {.ifi_family = AF_UNSPEC};
+    netlink_put(nl, hdr, &ifi, sizeof(ifi));
+    netlink_attr_string(nl, hdr, IFLA_IFNAME, ifname);
+    struct rtattr *linkinfo = netlink_nest_begin(nl, hdr, IFLA_LINKINFO);
+    netlink_attr_string(nl, hdr, IFLA_INFO_KIND, "bridge");
+    netlink_nest_end(hdr, linkinfo);
+    netlink_finish(nl, hdr);
+}
+
+// Creates a dummy interface, which is a parent for macvlan and ipvlan interfaces in tests
+void netlink_add_dummy(struct Netlink *nl, const char *ifname)
+{
+    struct nlmsghdr *hdr =
+        netlink_request(nl, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, "create dummy interface");
+    struct ifinfomsg ifi = {.ifi_family = AF_UNSPEC};
+    netlink_put(nl, hdr, &ifi, sizeof(ifi));
+    netlink_attr_string(nl, hdr, IFLA_IFNAME, ifname);
+    struct rtattr *linkinfo = netlink_nest_begin(nl, hdr, IFLA_LINKINFO);
+    netlink_attr_string(nl, hdr, IFLA_INFO_KIND, "dummy");
+    netlink_nest_end(hdr, linkinfo);
+    netlink_finish(nl, hdr);
+}
+
+// Creates a macvlan (in bridge mode) or ipvlan (in L2 mode) interface on top of parent, kind
+// being "macvlan" or "ipvlan". Like the peer of a veth pair, it is created directly inside the
+// network namespace of pid.
+void netlink_add_macvlan(struct Netlink *nl, const char *ifname, const char *kind,
+                         const char *parent, pid_t pid)
+{
+    struct nlmsghdr *hdr =
+        netlink_request(nl, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, "create macvlan/ipvlan");
+    struct ifinfomsg ifi = {.ifi_family = AF_UNSPEC};
+    netlink_put(nl, hdr, &ifi, sizeof(ifi));
+    netlink_attr_string(nl, hdr, IFLA_IFNAME, ifname);
+    unsigned int parent_index = if_nametoindex(parent);
+    if (parent_index == 0)
+    {
+        fprintf(stderr, "Interface %s does not exist: %s\n", parent, strerror(errno));
+        exit(1);
+    }
+    netlink_attr(nl, hdr, IFLA_LINK, &parent_index, sizeof(parent_index));
+    unsigned int netns_pid = (unsigned int)pid;
+    netlink_attr(nl, hdr, IFLA_NET_NS_PID, &netns_pid, sizeof(netns_pid));
+    struct rtattr *linkinfo = netlink_nest_begin(nl, hdr, IFLA_LINKINFO);
+    netlink_attr_string(nl, hdr, IFLA_INFO_KIND, kind);
+    struct rtattr *data = netlink_nest_begin(nl, hdr, IFLA_INFO_DATA);
+    if (strcmp(kind, "ipvlan") == 0)
+    {
+        unsigned short mode = IPVLAN_MODE_L2;
+        netlink_attr(nl, hdr, IFLA_IPVLAN_MODE, &mode, sizeof(mode));
+    }
+    else
+    {
+        unsigned int mode = MACVLAN_MODE_BRIDGE;
+        netlink_attr(nl, hdr, IFLA_MACVLAN_MODE, &mode, sizeof(mode));
+    }
+    netlink_nest_end(hdr, data);
+    netlink_nest_end(hdr, linkinfo);
+    netlink_finish(nl, hdr);
+}
+
+// Enslaves ifname to the bridge master
+void netlink_set_master(struct Netlink *nl, const char *ifname, const char *master)
+{
+    struct nlmsghdr *hdr = netlink_request(nl, RTM_NEWLINK, 0, "attach interface to bridge");
+    struct ifinfomsg ifi = {.ifi_family = AF_UNSPEC};
+    netlink_put(nl, hdr, &ifi, sizeof(ifi));
+    netlink_attr_string(nl, hdr, IFLA_IFNAME, ifname);
+    // The kernel does not resolve IFLA_MASTER by name, so look it up in this namespace
+    int master_index = if_nametoindex(master);
+    if (master_index == 0)
+    {
+        fprintf(stderr, "Bridge %s does not exist: %s\n", master, strerror(errno));
+        exit(1);
+    }
+    netlink_attr(nl, hdr, IFLA_MASTER, &master_index, sizeof(master_index));
+    netlink_finish(nl, hdr);
+}
+
+void netlink_set_up(struct Netlink *nl, const char *ifname)
+{
+    struct nlmsghdr *hdr = netlink_request(nl, RTM_NEWLINK, 0, "set link up");
+    struct ifinfomsg ifi = {.ifi_family = AF_UNSPEC, .ifi_flags = IFF_UP, .ifi_change = IFF_UP};
+    netlink_put(nl, hdr, &ifi, sizeof(ifi));
+    netlink_attr_string(nl, hdr, IFLA_IFNAME, ifname);
+    netlink_finish(nl, hdr);
+}
+
+// Deletes a link, deleting one end of a veth pair also deletes its peer
+void netlink_delete_link(struct Netlink *nl, const char *ifname)
+{
+    struct nlmsghdr *hdr = netlink_request(nl, RTM_DELLINK, 0, "delete link");
+    struct ifinfomsg ifi = {.ifi_family = AF_UNSPEC};
+    netlink_put(nl, hdr, &ifi, sizeof(ifi));
+    netlink_attr_string(nl, hdr, IFLA_IFNAME, ifname);
+    netlink_finish(nl, hdr);
+}
+
+// Adds an IPv4 address (a.b.c.d/prefix) to the interface
+void netlink_add_address(struct Netlink *nl, int ifindex, const char *cidr)
+{
+    struct in_addr addr;
+    unsigned char prefix;
+    parse_cidr(cidr, &addr, &prefix);
+
+    struct nlmsghdr *hdr =
+        netlink_request(nl, RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL, "add address");
+    struct ifaddrmsg ifa = {.ifa_family = AF_INET,
+                            .ifa_prefixlen = prefix,
+                            .ifa_scope = RT_SCOPE_UNIVERSE,
+                            .ifa_index = ifindex};
+    netlink_put(nl, hdr, &ifa, sizeof(ifa));
+    netlink_attr(nl, hdr, IFA_LOCAL, &addr, sizeof(addr));
+    netlink_attr(nl, hdr, IFA_ADDRESS, &addr, sizeof(addr));
+    netlink_finish(nl, hdr);
+}
+
+// Adds a default route via gateway, the kernel picks the interface from the gateway address
+void netlink_add_default_route(struct Netlink *nl, const char *gateway)
+{
+    struct in_addr addr;
+    unsigned char prefix;
+    parse_cidr(gateway, &addr, &prefix);
+
+    struct nlmsghdr *hdr =
+        netlink_request(nl, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_EXCL, "add default route");
+    struct rtmsg rtm = {.rtm_family = AF_INET,
+                        .rtm_table = RT_TABLE_MAIN,
+                        .rtm_protocol = RTPROT_BOOT,
+                        .rtm_scope = RT_SCOPE_UNIVERSE,
+                        .rtm_type = RTN_UNICAST};
+    netlink_put(nl, hdr, &rtm, sizeof(rtm));
+    netlink_attr(nl, hdr, RTA_GATEWAY, &addr, sizeof(addr));
+    netlink_finish(nl, hdr);
+}
+
+// Sends the queued batch with a single sendmsg() and waits for the ACK of every request.
+// If fail_ok is 0, the program exits on the first failed request, otherwise the number of
+// failed requests is returned.
+int netlink_commit(struct Netlink *nl, int fail_ok)
+{
+    int failed = 0;
+    int pending = 0;
+    for (size_t offset = 0; offset < nl->length;)
+    {
+        struct nlmsghdr *hdr = (struct nlmsghdr *)(nl->buffer + offset);
+        pending += (hdr->nlmsg_flags & NLM_F_ACK) != 0;
+        offset += NLMSG_ALIGN(hdr->nlmsg_len);
+    }
+    if (nl->count == 0)
+    {
+        return 0;
+    }
+    uint64_t begin = trace_now();
+    struct sockaddr_nl kernel = {.nl_family = AF_NETLINK};
+    struct iovec iov = {.iov_base = nl->buffer, .iov_len = nl->length};
+    struct msghdr msg = {
+        .msg_name = &kernel, .msg_namelen = sizeof(kernel), .msg_iov = &iov, .msg_iovlen = 1};
+    if (sendmsg(nl->fd, &msg, 0) == -1)
+    {
+        errorMessage("%s\n", "netlink: sendmsg() failed");
+    }
+
+    char reply[8192];
+    while (pending > 0)
+    {
+        int n = (int)recv(nl->fd, reply, sizeof(reply), 0);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            errorMessage("%s\n", "netlink: recv() failed");
+        }
+        for (struct nlmsghdr *hdr = (struct nlmsghdr *)reply; NLMSG_OK(hdr, n);
+             hdr = NLMSG_NEXT(hdr, n))
+        {
+            if (hdr->nlmsg_type != NLMSG_ERROR)
+                continue;
+            struct nlmsgerr *err = NLMSG_DATA(hdr);
+            unsigned int index = hdr->nlmsg_seq - nl->batch_start;
+            pending--;
+            // A link which is already gone, e.g. along with its network namespace, needs no
+            // deleting
+            if (err->error == 0 || (err->error == -ENODEV && err->msg.nlmsg_type == RTM_DELLINK))
+                continue;
+            const char *step = index < (unsigned int)nl->count ? nl->steps[index] : "request";
+            failed++;
+            fprintf(stderr, "netlink: %s failed: %s\n", step, strerror(-err->error));
+            if (!fail_ok)
+            {
+                exit(1);
+            }
+        }
+    }
+    nl->length = 0;
+    nl->count = 0;
+    nl->batch_start = nl->seq;
+    trace_span("netlink batch", begin);
+    return failed;
+}
+
+// Returns the index of the interface ifname in the namespace of the socket, or exits if it
+// does not exist. The batch must be empty.
+int netlink_link_index(struct Netlink *nl, const char *ifname)
+{
+    struct nlmsghdr *hdr = netlink_request(nl, RTM_GETLINK, 0, "lookup link");
+    // An ACK is not needed, since the reply itself is the acknowledgement
+    hdr->nlmsg_flags &= ~NLM_F_ACK;
+    struct ifinfomsg ifi = {.ifi_family = AF_UNSPEC};
+    netlink_put(nl, hdr, &ifi, sizeof(ifi));
+    netlink_attr_string(nl, hdr, IFLA_IFNAME, ifname);
+    netlink_finish(nl, hdr);
+
+    if (send(nl->fd, nl->buffer, nl->length, 0) == -1)
+    {
+        errorMessage("%s\n", "netlink: send() failed");
+    }
+    nl->length = 0;
+    nl->count = 0;
+    nl->batch_start = nl->seq;
+
+    char reply[8192];
+    int n = (int)recv(nl->fd, reply, sizeof(reply), 0);
+    if (n == -1)
+    {
+        errorMessage("%s\n", "netlink: recv() failed");
+    }
+    struct nlmsghdr *resp = (struct nlmsghdr *)reply;
+    if (!NLMSG_OK(resp, n))
+    {
+        fprintf(stderr, "netlink: truncated reply while looking up %s\n", ifname);
+        exit(1);
+    }
+    if (resp->nlmsg_type == NLMSG_ERROR)
+    {
+        struct nlmsgerr *err = NLMSG_DATA(resp);
+        fprintf(stderr, "netlink: lookup of %s failed: %s\n", ifname, strerror(-err->error));
+        exit(1);
+    }
+    struct ifinfomsg *info = NLMSG_DATA(resp);
+    return info->ifi_index;
+}
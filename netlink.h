@@ -0,0 +1,55 @@
+#ifndef CONTAINER_NETLINK_H
+#define CONTAINER_NETLINK_H
+// In-process rtnetlink client used to configure container networking without running `ip`
+#include <stddef.h>
+#include <sys/types.h>
+
+#define NETLINK_BATCH_SIZE 16384
+#define NETLINK_MAX_BATCH 32
+
+// A netlink socket bound to one network namespace, along with the batch of requests which
+// have been queued but not yet sent to the kernel
+struct Netlink
+{
+    int fd;
+    unsigned int seq;
+    // Sequence number of the first request in the current batch
+    unsigned int batch_start;
+    char *buffer;
+    size_t length;
+    int count;
+    // Human readable description of each queued request, used for error messages
+    const char *steps[NETLINK_MAX_BATCH];
+};
+
+void netlink_open(struct Netlink *nl);
+void netlink_open_netns(struct Netlink *nl, int netns_fd);
+void netlink_open_pid_netns(struct Netlink *nl, pid_t pid);
+void netlink_open_netfilter(struct Netlink *nl);
+void netlink_close(struct Netlink *nl);
+
+int netlink_link_index(struct Netlink *nl, const char *ifname);
+void netlink_add_bridge(struct Netlink *nl, const char *ifname);
+void netlink_add_dummy(struct Netlink *nl, const char *ifname);
+void netlink_add_macvlan(struct Netlink *nl, const char *ifname, const char *kind,
+                         const char *parent, pid_t pid);
+void netlink_add_veth(struct Netlink *nl, const char *ifname, const char *peer, pid_t peer_pid);
+void netlink_set_master(struct Netlink *nl, const char *ifname, const char *master);
+void netlink_set_up(struct Netlink *nl, const char *ifname);
+void netlink_delete_link(struct Netlink *nl, const char *ifname);
+void netlink_add_address(struct Netlink *nl, int ifindex, const char *cidr);
+void netlink_add_default_route(struct Netlink *nl, const char *gateway);
+int netlink_commit(struct Netlink *nl, int fail_ok);
+
+// Building blocks for the requests of other netlink families, such as nftables
+struct nlmsghdr *netlink_request(struct Netlink *nl, unsigned short type, unsigned short flags,
+                                 const char *step);
+void *netlink_put(struct Netlink *nl, struct nlmsghdr *hdr, const void *data, size_t len);
+void netlink_attr(struct Netlink *nl, struct nlmsghdr *hdr, unsigned short type,
+                  const void *data, size_t len);
+void netlink_attr_string(struct Netlink *nl, struct nlmsghdr *hdr, unsigned short type,
+                         const char *value);
+struct rtattr *netlink_nest_begin(struct Netlink *nl, struct nlmsghdr *hdr, unsigned short type);
+void netlink_nest_end(struct nlmsghdr *hdr, struct rtattr *nest);
+void netlink_finish(struct Netlink *nl, struct nlmsghdr *hdr);
+#endif // CONTAINER_NETLINK_H
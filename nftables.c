@@ -0,0 +1,441 @@
+#define _GNU_SOURCE
+#include "nftables.h"
+#include "config.h"
+#include "netlink.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+// All the rules live in the table "ip NFT_TABLE", which is (re)created along with the bridge:
+//
+//   chain publish { }
+//   chain prerouting { type nat hook prerouting priority -100; fib daddr type local jump publish }
+//   chain output { type nat hook output priority -100; fib daddr type local jump publish }
+//   chain postrouting {
+//       type nat hook postrouting priority 100;
+//       ip saddr BRIDGE_SUBNET oifname != BRIDGE_NAME masquerade
+//   }
+//
+// Every published port of a container adds "meta l4proto tcp th dport <host> dnat to
+// <address>:<port>" to the publish chain, with the ID of the container as its comment, so that
+// its rules can be found and deleted along with it. Each change is a single nfnetlink batch,
+// which the kernel applies as one transaction. The expressions are the ones nft itself
+// generates, `nft --debug=netlink list ruleset` shows them.
+// References:
+// https://wiki.nftables.org/wiki-nftables/index.php/Portal:DeveloperDocs/nftables_internals
+// https://git.netfilter.org/libnftnl/tree/src/expr
+
+#define NFT_CHAIN_PUBLISH "publish"
+// Type of the comment in the userdata of a rule, as encoded by nft (NFTNL_UDATA_RULE_COMMENT)
+#define NFT_UDATA_COMMENT 0
+
+// Parses host_port:container_port[/tcp|/udp], returns -1 if it is invalid
+int nftables_parse_port(const char *spec, struct PublishedPort *port)
+{
+    char protocol[4] = "tcp";
+    unsigned int host, container;
+    int consumed = 0;
+    if (sscanf(spec, "%u:%u%n", &host, &container, &consumed) != 2)
+        return -1;
+    if (spec[consumed] == '/' && sscanf(spec + consumed, "/%3s%n", protocol, &consumed) == 1)
+        consumed = (int)strlen(spec);
+    if (spec[consumed] != '\0' || host == 0 || host > 65535 || container == 0 ||
+        container > 65535)
+        return -1;
+    if (strcmp(protocol, "tcp") == 0)
+        port->protocol = IPPROTO_TCP;
+    else if (strcmp(protocol, "udp") == 0)
+        port->protocol = IPPROTO_UDP;
+    else
+        return -1;
+    port->host_port = (uint16_t)host;
+    port->container_port = (uint16_t)container;
+    return 0;
+}
+
+static void nft_batch_marker(struct Netlink *nl, unsigned short type)
+{
+    struct nlmsghdr *hdr = netlink_request(nl, type, 0, "nftables batch");
+    // The batch markers are not acknowledged
+    hdr->nlmsg_flags &= ~NLM_F_ACK;
+    struct nfgenmsg nfg = {.nfgen_family = AF_UNSPEC,
+                           .version = NFNETLINK_V0,
+                           .res_id = htons(NFNL_SUBSYS_NFTABLES)};
+    netlink_put(nl, hdr, &nfg, sizeof(nfg));
+    netlink_finish(nl, hdr);
+}
+
+static struct nlmsghdr *nft_request(struct Netlink *nl, int type, unsigned short flags,
+                                    const char *step)
+{
+    struct nlmsghdr *hdr =
+        netlink_request(nl, (unsigned short)(NFNL_SUBSYS_NFTABLES << 8 | type), flags, step);
+    struct nfgenmsg nfg = {.nfgen_family = NFPROTO_IPV4, .version = NFNETLINK_V0};
+    netlink_put(nl, hdr, &nfg, sizeof(nfg));
+    // Every message is about the table, NFTA_TABLE_NAME, NFTA_CHAIN_TABLE and NFTA_RULE_TABLE
+    // are the same attribute
+    netlink_attr_string(nl, hdr, NFTA_TABLE_NAME, NFT_TABLE);
+    return hdr;
+}
+
+static void nft_u32(struct Netlink *nl, struct nlmsghdr *hdr, unsigned short type, uint32_t value)
+{
+    uint32_t be = htonl(value);
+    netlink_attr(nl, hdr, type, &be, sizeof(be));
+}
+
+static struct rtattr *nft_nest(struct Netlink *nl, struct nlmsghdr *hdr, unsigned short type)
+{
+    return netlink_nest_begin(nl, hdr, NLA_F_NESTED | type);
+}
+
+// Adds the data attribute type, holding a value for a register
+static void nft_data(struct Netlink *nl, struct nlmsghdr *hdr, unsigned short type,
+                     const void *value, size_t len)
+{
+    struct rtattr *data = nft_nest(nl, hdr, type);
+    netlink_attr(nl, hdr, NFTA_DATA_VALUE, value, len);
+    netlink_nest_end(hdr, data);
+}
+
+// Starts an expression of a rule, nft_expr_end() ends it
+static struct rtattr *nft_expr(struct Netlink *nl, struct nlmsghdr *hdr, const char *name,
+                               struct rtattr **data)
+{
+    struct rtattr *elem = nft_nest(nl, hdr, NFTA_LIST_ELEM);
+    netlink_attr_string(nl, hdr, NFTA_EXPR_NAME, name);
+    *data = nft_nest(nl, hdr, NFTA_EXPR_DATA);
+    return elem;
+}
+
+static void nft_expr_end(struct nlmsghdr *hdr, struct rtattr *elem, struct rtattr *data)
+{
+    netlink_nest_end(hdr, data);
+    netlink_nest_end(hdr, elem);
+}
+
+static void nft_meta(struct Netlink *nl, struct nlmsghdr *hdr, uint32_t key)
+{
+    struct rtattr *data;
+    struct rtattr *elem = nft_expr(nl, hdr, "meta", &data);
+    nft_u32(nl, hdr, NFTA_META_KEY, key);
+    nft_u32(nl, hdr, NFTA_META_DREG, NFT_REG_1);
+    nft_expr_end(hdr, elem, data);
+}
+
+static void nft_payload(struct Netlink *nl, struct nlmsghdr *hdr, uint32_t base, uint32_t offset,
+                        uint32_t len)
+{
+    struct rtattr *data;
+    struct rtattr *elem = nft_expr(nl, hdr, "payload", &data);
+    nft_u32(nl, hdr, NFTA_PAYLOAD_DREG, NFT_REG_1);
+    nft_u32(nl, hdr, NFTA_PAYLOAD_BASE, base);
+    nft_u32(nl, hdr, NFTA_PAYLOAD_OFFSET, offset);
+    nft_u32(nl, hdr, NFTA_PAYLOAD_LEN, len);
+    nft_expr_end(hdr, elem, data);
+}
+
+// Compares register 1 with value
+static void nft_cmp(struct Netlink *nl, struct nlmsghdr *hdr, uint32_t op, const void *value,
+                    size_t len)
+{
+    struct rtattr *data;
+    struct rtattr *elem = nft_expr(nl, hdr, "cmp", &data);
+    nft_u32(nl, hdr, NFTA_CMP_SREG, NFT_REG_1);
+    nft_u32(nl, hdr, NFTA_CMP_OP, op);
+    nft_data(nl, hdr, NFTA_CMP_DATA, value, len);
+    nft_expr_end(hdr, elem, data);
+}
+
+// register 1 &= mask
+static void nft_and(struct Netlink *nl, struct nlmsghdr *hdr, const void *mask, size_t len)
+{
+    char zero[16] = {0};
+    struct rtattr *data;
+    struct rtattr *elem = nft_expr(nl, hdr, "bitwise", &data);
+    nft_u32(nl, hdr, NFTA_BITWISE_SREG, NFT_REG_1);
+    nft_u32(nl, hdr, NFTA_BITWISE_DREG, NFT_REG_1);
+    nft_u32(nl, hdr, NFTA_BITWISE_LEN, (uint32_t)len);
+    nft_data(nl, hdr, NFTA_BITWISE_MASK, mask, len);
+    nft_data(nl, hdr, NFTA_BITWISE_XOR, zero, len);
+    nft_expr_end(hdr, elem, data);
+}
+
+static void nft_immediate(struct Netlink *nl, struct nlmsghdr *hdr, uint32_t reg,
+                          const void *value, size_t len)
+{
+    struct rtattr *data;
+    struct rtattr *elem = nft_expr(nl, hdr, "immediate", &data);
+    nft_u32(nl, hdr, NFTA_IMMEDIATE_DREG, reg);
+    nft_data(nl, hdr, NFTA_IMMEDIATE_DATA, value, len);
+    nft_expr_end(hdr, elem, data);
+}
+
+static void nft_jump(struct Netlink *nl, struct nlmsghdr *hdr, const char *chain)
+{
+    struct rtattr *data;
+    struct rtattr *elem = nft_expr(nl, hdr, "immediate", &data);
+    nft_u32(nl, hdr, NFTA_IMMEDIATE_DREG, NFT_REG_VERDICT);
+    struct rtattr *immediate = nft_nest(nl, hdr, NFTA_IMMEDIATE_DATA);
+    struct rtattr *verdict = nft_nest(nl, hdr, NFTA_DATA_VERDICT);
+    nft_u32(nl, hdr, NFTA_VERDICT_CODE, (uint32_t)NFT_JUMP);
+    netlink_attr_string(nl, hdr, NFTA_VERDICT_CHAIN, chain);
+    netlink_nest_end(hdr, verdict);
+    netlink_nest_end(hdr, immediate);
+    nft_expr_end(hdr, elem, data);
+}
+
+// fib daddr type local
+static void nft_fib_daddr_local(struct Netlink *nl, struct nlmsghdr *hdr)
+{
+    struct rtattr *data;
+    struct rtattr *elem = nft_expr(nl, hdr, "fib", &data);
+    nft_u32(nl, hdr, NFTA_FIB_DREG, NFT_REG_1);
+    nft_u32(nl, hdr, NFTA_FIB_RESULT, NFT_FIB_RESULT_ADDRTYPE);
+    nft_u32(nl, hdr, NFTA_FIB_FLAGS, NFTA_FIB_F_DADDR);
+    nft_expr_end(hdr, elem, data);
+    uint32_t local = RTN_LOCAL;
+    nft_cmp(nl, hdr, NFT_CMP_EQ, &local, sizeof(local));
+}
+
+static void nft_base_chain(struct Netlink *nl, const char *name, uint32_t hook, int32_t priority)
+{
+    struct nlmsghdr *hdr = nft_request(nl, NFT_MSG_NEWCHAIN, NLM_F_CREATE, "create nat chain");
+    netlink_attr_string(nl, hdr, NFTA_CHAIN_NAME, name);
+    struct rtattr *hook_attr = nft_nest(nl, hdr, NFTA_CHAIN_HOOK);
+    nft_u32(nl, hdr, NFTA_HOOK_HOOKNUM, hook);
+    nft_u32(nl, hdr, NFTA_HOOK_PRIORITY, (uint32_t)priority);
+    netlink_nest_end(hdr, hook_attr);
+    netlink_attr_string(nl, hdr, NFTA_CHAIN_TYPE, "nat");
+    netlink_finish(nl, hdr);
+}
+
+// Starts a rule appended to chain, its expressions are added until nft_rule_end()
+static struct nlmsghdr *nft_rule(struct Netlink *nl, const char *chain, const char *step,
+                                 struct rtattr **expressions)
+{
+    struct nlmsghdr *hdr =
+        nft_request(nl, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND, step);
+    netlink_attr_string(nl, hdr, NFTA_RULE_CHAIN, chain);
+    *expressions = nft_nest(nl, hdr, NFTA_RULE_EXPRESSIONS);
+    return hdr;
+}
+
+static void nft_rule_end(struct Netlink *nl, struct nlmsghdr *hdr, struct rtattr *expressions,
+                         const char *comment)
+{
+    netlink_nest_end(hdr, expressions);
+    if (comment != NULL)
+    {
+        unsigned char udata[2 + 64];
+        size_t len = strlen(comment) + 1;
+        if (len > sizeof(udata) - 2)
+            len = sizeof(udata) - 2;
+        udata[0] = NFT_UDATA_COMMENT;
+        udata[1] = (unsigned char)len;
+        memcpy(udata + 2, comment, len);
+        netlink_attr(nl, hdr, NFTA_RULE_USERDATA, udata, 2 + len);
+    }
+    netlink_finish(nl, hdr);
+}
+
+/*
+ * @short (Re)creates the table with the NAT rules of the bridge
+ * @details Any previous version of the table is deleted in the same transaction, along with
+ * the ports published by containers which did not survive the bridge.
+ */
+void nftables_setup(void)
+{
+    char subnet[32];
+    strformat(subnet, sizeof(subnet), "%s", BRIDGE_SUBNET);
+    char *slash = strchr(subnet, '/');
+    struct in_addr network;
+    if (slash == NULL || (*slash = '\0', inet_pton(AF_INET, subnet, &network)) != 1)
+    {
+        fprintf(stderr, "Invalid BRIDGE_SUBNET %s\n", BRIDGE_SUBNET);
+        exit(1);
+    }
+    int prefix = atoi(slash + 1);
+    uint32_t mask = htonl(prefix == 0 ? 0 : ~0u << (32 - prefix));
+
+    struct Netlink nl;
+    netlink_open_netfilter(&nl);
+    nft_batch_marker(&nl, NFNL_MSG_BATCH_BEGIN);
+    // Creating the table first makes deleting it succeed whether or not it existed
+    struct nlmsghdr *hdr = nft_request(&nl, NFT_MSG_NEWTABLE, NLM_F_CREATE, "create table");
+    netlink_finish(&nl, hdr);
+    hdr = nft_request(&nl, NFT_MSG_DELTABLE, 0, "delete table");
+    netlink_finish(&nl, hdr);
+    hdr = nft_request(&nl, NFT_MSG_NEWTABLE, NLM_F_CREATE, "create table");
+    netlink_finish(&nl, hdr);
+
+    hdr = nft_request(&nl, NFT_MSG_NEWCHAIN, NLM_F_CREATE, "create publish chain");
+    netlink_attr_string(&nl, hdr, NFTA_CHAIN_NAME, NFT_CHAIN_PUBLISH);
+    netlink_finish(&nl, hdr);
+    nft_base_chain(&nl, "prerouting", NF_INET_PRE_ROUTING, -100);
+    nft_base_chain(&nl, "output", NF_INET_LOCAL_OUT, -100);
+    nft_base_chain(&nl, "postrouting", NF_INET_POST_ROUTING, 100);
+
+    struct rtattr *expressions;
+    const char *const hooks[] = {"prerouting", "output"};
+    for (int i = 0; i < 2; i++)
+    {
+        hdr = nft_rule(&nl, hooks[i], "add publish jump", &expressions);
+        nft_fib_daddr_local(&nl, hdr);
+        nft_jump(&nl, hdr, NFT_CHAIN_PUBLISH);
+        nft_rule_end(&nl, hdr, expressions, NULL);
+    }
+
+    hdr = nft_rule(&nl, "postrouting", "add masquerade", &expressions);
+    // ip saddr
+    nft_payload(&nl, hdr, NFT_PAYLOAD_NETWORK_HEADER, 12, 4);
+    nft_and(&nl, hdr, &mask, sizeof(mask));
+    nft_cmp(&nl, hdr, NFT_CMP_EQ, &network, sizeof(network));
+    char bridge[IFNAMSIZ] = {0};
+    strformat(bridge, IFNAMSIZ, "%s", BRIDGE_NAME);
+    nft_meta(&nl, hdr, NFT_META_OIFNAME);
+    nft_cmp(&nl, hdr, NFT_CMP_NEQ, bridge, IFNAMSIZ);
+    struct rtattr *data;
+    struct rtattr *elem = nft_expr(&nl, hdr, "masq", &data);
+    nft_expr_end(hdr, elem, data);
+    nft_rule_end(&nl, hdr, expressions, NULL);
+
+    nft_batch_marker(&nl, NFNL_MSG_BATCH_END);
+    netlink_commit(&nl, 0);
+    netlink_close(&nl);
+}
+
+/*
+ * @short Publishes ports of the container id, whose address is address (host byte order)
+ */
+void nftables_publish(const char *id, uint32_t address, const struct PublishedPort *ports,
+                      int count)
+{
+    struct Netlink nl;
+    netlink_open_netfilter(&nl);
+    nft_batch_marker(&nl, NFNL_MSG_BATCH_BEGIN);
+    uint32_t destination = htonl(address);
+    for (int i = 0; i < count; i++)
+    {
+        struct rtattr *expressions;
+        struct nlmsghdr *hdr = nft_rule(&nl, NFT_CHAIN_PUBLISH, "publish port", &expressions);
+        uint8_t protocol = ports[i].protocol;
+        uint16_t host_port = htons(ports[i].host_port);
+        uint16_t container_port = htons(ports[i].container_port);
+        nft_meta(&nl, hdr, NFT_META_L4PROTO);
+        nft_cmp(&nl, hdr, NFT_CMP_EQ, &protocol, sizeof(protocol));
+        // th dport, at the same offset for TCP and UDP
+        nft_payload(&nl, hdr, NFT_PAYLOAD_TRANSPORT_HEADER, 2, 2);
+        nft_cmp(&nl, hdr, NFT_CMP_EQ, &host_port, sizeof(host_port));
+        nft_immediate(&nl, hdr, NFT_REG_1, &destination, sizeof(destination));
+        nft_immediate(&nl, hdr, NFT_REG_2, &container_port, sizeof(container_port));
+        struct rtattr *data;
+        struct rtattr *elem = nft_expr(&nl, hdr, "nat", &data);
+        nft_u32(&nl, hdr, NFTA_NAT_TYPE, NFT_NAT_DNAT);
+        nft_u32(&nl, hdr, NFTA_NAT_FAMILY, NFPROTO_IPV4);
+        nft_u32(&nl, hdr, NFTA_NAT_REG_ADDR_MIN, NFT_REG_1);
+        nft_u32(&nl, hdr, NFTA_NAT_REG_PROTO_MIN, NFT_REG_2);
+        nft_expr_end(hdr, elem, data);
+        nft_rule_end(&nl, hdr, expressions, id);
+    }
+    nft_batch_marker(&nl, NFNL_MSG_BATCH_END);
+    netlink_commit(&nl, 0);
+    netlink_close(&nl);
+}
+
+// Returns whether the rule in the dump message hdr has comment as its comment, and its handle
+static int nft_rule_matches(struct nlmsghdr *hdr, const char *comment, uint64_t *handle)
+{
+    int matches = 0;
+    int len = (int)NLMSG_PAYLOAD(hdr, sizeof(struct nfgenmsg));
+    struct rtattr *attr = (struct rtattr *)((char *)NLMSG_DATA(hdr) +
+                                            NLMSG_ALIGN(sizeof(struct nfgenmsg)));
+    for (; RTA_OK(attr, len); attr = RTA_NEXT(attr, len))
+    {
+        unsigned char *value = RTA_DATA(attr);
+        size_t size = RTA_PAYLOAD(attr);
+        if ((attr->rta_type & NLA_TYPE_MASK) == NFTA_RULE_HANDLE && size == sizeof(uint64_t))
+        {
+            memcpy(handle, value, sizeof(uint64_t));
+        }
+        else if ((attr->rta_type & NLA_TYPE_MASK) == NFTA_RULE_USERDATA && size >= 2 &&
+                 value[0] == NFT_UDATA_COMMENT && value[1] <= size - 2 &&
+                 strncmp((char *)value + 2, comment, value[1]) == 0 &&
+                 value[1] == strlen(comment) + 1)
+        {
+            matches = 1;
+        }
+    }
+    return matches;
+}
+
+// Deletes the rules publishing the ports of the container id
+void nftables_unpublish(const char *id)
+{
+    struct Netlink nl;
+    netlink_open_netfilter(&nl);
+    // The handles of the rules are only known by listing the chain
+    struct nlmsghdr *hdr = nft_request(&nl, NFT_MSG_GETRULE, NLM_F_DUMP, "list rules");
+    hdr->nlmsg_flags &= ~NLM_F_ACK;
+    netlink_attr_string(&nl, hdr, NFTA_RULE_CHAIN, NFT_CHAIN_PUBLISH);
+    netlink_finish(&nl, hdr);
+    if (send(nl.fd, nl.buffer, nl.length, 0) == -1)
+    {
+        errorMessage("%s\n", "netlink: send() failed");
+    }
+    nl.length = 0;
+    nl.count = 0;
+    nl.batch_start = nl.seq;
+
+    uint64_t handles[NETLINK_MAX_BATCH - 2];
+    int count = 0;
+    char reply[16384];
+    for (int done = 0; !done;)
+    {
+        int n = (int)recv(nl.fd, reply, sizeof(reply), 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        for (struct nlmsghdr *msg = (struct nlmsghdr *)reply; NLMSG_OK(msg, n);
+             msg = NLMSG_NEXT(msg, n))
+        {
+            // An error is the table or chain not existing anymore, nothing is left to delete
+            if (msg->nlmsg_type == NLMSG_DONE || msg->nlmsg_type == NLMSG_ERROR)
+            {
+                done = 1;
+                break;
+            }
+            uint64_t handle = 0;
+            if (nft_rule_matches(msg, id, &handle) &&
+                count < (int)(sizeof(handles) / sizeof(handles[0])))
+            {
+                handles[count++] = handle;
+            }
+        }
+    }
+    if (count > 0)
+    {
+        nft_batch_marker(&nl, NFNL_MSG_BATCH_BEGIN);
+        for (int i = 0; i < count; i++)
+        {
+            hdr = nft_request(&nl, NFT_MSG_DELRULE, 0, "unpublish port");
+            netlink_attr_string(&nl, hdr, NFTA_RULE_CHAIN, NFT_CHAIN_PUBLISH);
+            netlink_attr(&nl, hdr, NFTA_RULE_HANDLE, &handles[i], sizeof(handles[i]));
+            netlink_finish(&nl, hdr);
+        }
+        nft_batch_marker(&nl, NFNL_MSG_BATCH_END);
+        netlink_commit(&nl, 1);
+    }
+    netlink_close(&nl);
+}
@@ -0,0 +1,20 @@
+#ifndef CONTAINER_NFTABLES_H
+#define CONTAINER_NFTABLES_H
+// NAT for the bridge (masquerade, published ports) with nftables, configured over nfnetlink
+#include <stdint.h>
+
+// A port of a container published on the host, -p host_port:container_port[/tcp|/udp]
+struct PublishedPort
+{
+    uint16_t host_port;
+    uint16_t container_port;
+    // IPPROTO_TCP or IPPROTO_UDP
+    uint8_t protocol;
+};
+
+int nftables_parse_port(const char *spec, struct PublishedPort *port);
+void nftables_setup(void);
+void nftables_publish(const char *id, uint32_t address, const struct PublishedPort *ports,
+                      int count);
+void nftables_unpublish(const char *id);
+#endif // CONTAINER_NFTABLES_H
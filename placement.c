@@ -0,0 +1,685 @@
+#define _GNU_SOURCE
+#include "placement.h"
+#include "cgroup.h"
+#include "config.h"
+#include "utils.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Containers run with --cpus-exclusive get CPUs which no other container runs on, and containers
+// run with --numa are bound to the CPUs and the memory of a NUMA node. The topology is read from
+// sysfs: the online CPUs, the CPUs of each node, which nodes have memory, and the hyperthreads
+// of each core.
+//
+// What was given to whom is recorded in containers/__cpuset, one line per placed container:
+//   <id> <pid> <start time> exclusive|shared <node, -1 for none> <CPUs, - for shared>
+// It is read and rewritten under an exclusive flock(), so that concurrent runs never hand out
+// the same CPUs. The owner of a line is the run process of its container, identified by its PID
+// and start time, lines of owners which are gone (killed before they could release their CPUs)
+// are dropped by the next run.
+//
+// The CPUs which are not exclusive form the shared pool. Exclusivity is enforced by narrowing
+// the cpuset of every other container to the pool, whenever the exclusive CPUs change. Processes
+// of the host outside of containers are not moved.
+//
+// Exclusive CPUs are taken from a single node if one has enough free CPUs, the one with the
+// fewest (best fit), so that large requests still find a whole node later on. Within a node,
+// whole free cores are taken first, then the free hyperthreads of cores which are partly taken,
+// and only then are free cores split.
+
+#define PLACEMENT_MAX_NODES 64
+// Large enough for any list of CPU_SETSIZE CPUs
+#define PLACEMENT_LIST_MAX 8192
+#define PLACEMENT_SYSFS "/sys/devices/system"
+
+struct PlacementTopology
+{
+    cpu_set_t online;
+    // Online CPUs of each node, and whether it has memory
+    cpu_set_t nodes[PLACEMENT_MAX_NODES];
+    int memory[PLACEMENT_MAX_NODES];
+    int nodes_count;
+    // First CPU of the core of each CPU, hyperthreads have the same one
+    int core[CPU_SETSIZE];
+};
+
+struct PlacementEntry
+{
+    char id[NAME_MAX + 1];
+    pid_t pid;
+    unsigned long long start_time;
+    int exclusive;
+    // Node the container is bound to, -1 if none
+    int node;
+    // CPUs of an exclusive container
+    cpu_set_t cpus;
+};
+
+struct Placement
+{
+    int fd;
+    struct PlacementEntry *entries;
+    int count;
+    struct PlacementTopology topology;
+};
+
+// Reads the small file path into buffer, returns -1 if it cannot be read
+static int placement_read(const char *path, char *buffer, size_t size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    ssize_t n = read(fd, buffer, size - 1);
+    close(fd);
+    if (n < 0)
+        return -1;
+    buffer[n] = '\0';
+    return 0;
+}
+
+// Parses a list of CPUs (or nodes) such as 0-3,8-11
+static int placement_parse_list(const char *list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p != '\0' && *p != '\n')
+    {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p)
+            return -1;
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p)
+                return -1;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return -1;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+static void placement_format_list(const cpu_set_t *set, char *buffer, size_t size)
+{
+    size_t length = 0;
+    buffer[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && length < size; cpu++)
+    {
+        if (!CPU_ISSET(cpu, set))
+            continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+            last++;
+        const char *separator = length == 0 ? "" : ",";
+        if (last == cpu)
+            length += snprintf(buffer + length, size - length, "%s%d", separator, cpu);
+        else
+            length += snprintf(buffer + length, size - length, "%s%d-%d", separator, cpu, last);
+        cpu = last;
+    }
+}
+
+// Removes the CPUs of clear from set
+static void placement_clear(cpu_set_t *set, const cpu_set_t *clear)
+{
+    cpu_set_t common;
+    CPU_AND(&common, set, clear);
+    CPU_XOR(set, set, &common);
+}
+
+static void placement_topology(struct PlacementTopology *topology)
+{
+    char buffer[PLACEMENT_LIST_MAX];
+    char path[PATH_MAX];
+    memset(topology, 0, sizeof(struct PlacementTopology));
+    if (placement_read(PLACEMENT_SYSFS "/cpu/online", buffer, sizeof(buffer)) == -1 ||
+        placement_parse_list(buffer, &topology->online) == -1)
+    {
+        errorMessage("Could not read %s\n", PLACEMENT_SYSFS "/cpu/online");
+    }
+    cpu_set_t memory;
+    int has_memory =
+        placement_read(PLACEMENT_SYSFS "/node/has_memory", buffer, sizeof(buffer)) == 0 &&
+        placement_parse_list(buffer, &memory) == 0;
+    // Node numbers may have holes
+    for (int node = 0; node < PLACEMENT_MAX_NODES; node++)
+    {
+        strformat(path, PATH_MAX, PLACEMENT_SYSFS "/node/node%d/cpulist", node);
+        if (placement_read(path, buffer, sizeof(buffer)) == -1 ||
+            placement_parse_list(buffer, &topology->nodes[node]) == -1)
+            continue;
+        CPU_AND(&topology->nodes[node], &topology->nodes[node], &topology->online);
+        topology->memory[node] = has_memory ? CPU_ISSET(node, &memory) : 1;
+        topology->nodes_count = node + 1;
+    }
+    // Kernels without NUMA support have no nodes, all the CPUs are on node 0
+    if (topology->nodes_count == 0)
+    {
+        topology->nodes[0] = topology->online;
+        topology->memory[0] = 1;
+        topology->nodes_count = 1;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        topology->core[cpu] = cpu;
+        if (!CPU_ISSET(cpu, &topology->online))
+            continue;
+        cpu_set_t siblings;
+        strformat(path, PATH_MAX, PLACEMENT_SYSFS "/cpu/cpu%d/topology/thread_siblings_list", cpu);
+        if (placement_read(path, buffer, sizeof(buffer)) == -1 ||
+            placement_parse_list(buffer, &siblings) == -1)
+            continue;
+        for (int sibling = 0; sibling < cpu; sibling++)
+        {
+            if (CPU_ISSET(sibling, &siblings))
+            {
+                topology->core[cpu] = sibling;
+                break;
+            }
+        }
+    }
+}
+
+// Returns the start time of pid in clock ticks since boot, 0 if it does not exist
+static unsigned long long placement_start_time(pid_t pid)
+{
+    char path[64];
+    char buffer[1024];
+    strformat(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    if (placement_read(path, buffer, sizeof(buffer)) == -1)
+        return 0;
+    // The command name may contain spaces, the fields are counted from its closing parenthesis.
+    // The start time is the 22nd field.
+    char *field = strrchr(buffer, ')');
+    for (int i = 0; field != NULL && i < 20; i++)
+        field = strchr(field + 1, ' ');
+    return field != NULL ? strtoull(field + 1, NULL, 10) : 0;
+}
+
+// Opens and locks the state file and reads its entries along with the topology, returns -1 if
+// the file does not exist and create is 0
+static int placement_open(struct Placement *placement, const char *containers_path, int create)
+{
+    char path[PATH_MAX];
+    strformat(path, PATH_MAX, "%s/" PLACEMENT_STATE, containers_path);
+    if (create)
+    {
+        create_directory_exists_ok(NULL, containers_path, 0755);
+    }
+    placement->fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0600);
+    if (placement->fd == -1 && !create && errno == ENOENT)
+        return -1;
+    if (placement->fd == -1)
+    {
+        errorMessage("Could not open %s\n", path);
+    }
+    if (flock(placement->fd, LOCK_EX) == -1)
+    {
+        errorMessage("Could not lock %s\n", path);
+    }
+    struct stat st;
+    if (fstat(placement->fd, &st) == -1)
+    {
+        errorMessage("Could not stat %s\n", path);
+    }
+    char *text = safe_malloc((size_t)st.st_size + 1);
+    ssize_t n = pread(placement->fd, text, (size_t)st.st_size, 0);
+    text[n > 0 ? n : 0] = '\0';
+
+    placement->entries = NULL;
+    placement->count = 0;
+    char *save;
+    for (char *line = strtok_r(text, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save))
+    {
+        struct PlacementEntry entry;
+        char kind[16];
+        char cpus[PLACEMENT_LIST_MAX];
+        int pid;
+        if (sscanf(line, "%255s %d %llu %15s %d %8191s", entry.id, &pid, &entry.start_time, kind,
+                   &entry.node, cpus) != 6)
+            continue;
+        entry.pid = pid;
+        entry.exclusive = strcmp(kind, "exclusive") == 0;
+        CPU_ZERO(&entry.cpus);
+        if (entry.exclusive && placement_parse_list(cpus, &entry.cpus) == -1)
+            continue;
+        placement->entries =
+            realloc(placement->entries, (placement->count + 1) * sizeof(struct PlacementEntry));
+        if (placement->entries == NULL)
+        {
+            errorMessage("%s\n", "realloc() failed");
+        }
+        placement->entries[placement->count++] = entry;
+    }
+    free(text);
+    placement_topology(&placement->topology);
+    return 0;
+}
+
+// Writes the entries back to the state file
+static void placement_write(struct Placement *placement)
+{
+    if (ftruncate(placement->fd, 0) == -1 || lseek(placement->fd, 0, SEEK_SET) == -1)
+    {
+        errorMessage("Could not truncate " PLACEMENT_STATE " in fd %d\n", placement->fd);
+    }
+    char cpus[PLACEMENT_LIST_MAX];
+    for (int i = 0; i < placement->count; i++)
+    {
+        const struct PlacementEntry *entry = &placement->entries[i];
+        placement_format_list(&entry->cpus, cpus, sizeof(cpus));
+        dprintf(placement->fd, "%s %d %llu %s %d %s\n", entry->id, (int)entry->pid,
+                entry->start_time, entry->exclusive ? "exclusive" : "shared", entry->node,
+                entry->exclusive ? cpus : "-");
+    }
+}
+
+// Unlocks the state file
+static void placement_close(struct Placement *placement)
+{
+    close(placement->fd);
+    free(placement->entries);
+}
+
+static void placement_remove(struct Placement *placement, int index)
+{
+    placement->entries[index] = placement->entries[--placement->count];
+}
+
+// Drops the entries whose run process is gone, returns 1 if exclusive CPUs were freed
+static int placement_reconcile(struct Placement *placement)
+{
+    int freed = 0;
+    for (int i = placement->count - 1; i >= 0; i--)
+    {
+        const struct PlacementEntry *entry = &placement->entries[i];
+        if (placement_start_time(entry->pid) != entry->start_time)
+        {
+            freed |= entry->exclusive;
+            placement_remove(placement, i);
+        }
+    }
+    return freed;
+}
+
+static struct PlacementEntry *placement_find(struct Placement *placement, const char *id)
+{
+    for (int i = 0; i < placement->count; i++)
+    {
+        if (strcmp(placement->entries[i].id, id) == 0)
+            return &placement->entries[i];
+    }
+    return NULL;
+}
+
+// The online CPUs which are not exclusive to a container
+static void placement_pool(const struct Placement *placement, cpu_set_t *pool)
+{
+    *pool = placement->topology.online;
+    for (int i = 0; i < placement->count; i++)
+    {
+        if (placement->entries[i].exclusive)
+            placement_clear(pool, &placement->entries[i].cpus);
+    }
+}
+
+static int placement_has_exclusive(const struct Placement *placement)
+{
+    for (int i = 0; i < placement->count; i++)
+    {
+        if (placement->entries[i].exclusive)
+            return 1;
+    }
+    return 0;
+}
+
+// Formats the cpuset of a container (entry NULL for one which was not placed), mems is left
+// empty unless the container is bound to nodes
+static void placement_cpuset(const struct Placement *placement, const struct PlacementEntry *entry,
+                             char *cpus, char *mems)
+{
+    const struct PlacementTopology *topology = &placement->topology;
+    cpu_set_t set;
+    cpu_set_t nodes;
+    placement_pool(placement, &set);
+    CPU_ZERO(&nodes);
+    if (entry != NULL && entry->exclusive)
+    {
+        set = entry->cpus;
+        // The memory of the nodes of its CPUs, memoryless nodes take it from the closest one
+        for (int node = 0; node < topology->nodes_count; node++)
+        {
+            cpu_set_t common;
+            CPU_AND(&common, &set, &topology->nodes[node]);
+            if (topology->memory[node] && CPU_COUNT(&common) > 0)
+                CPU_SET(node, &nodes);
+        }
+    }
+    else if (entry != NULL && entry->node >= 0)
+    {
+        cpu_set_t common;
+        CPU_AND(&common, &set, &topology->nodes[entry->node]);
+        // If exclusive containers took all the CPUs of the node, it runs on the whole pool
+        if (CPU_COUNT(&common) > 0)
+            set = common;
+        if (topology->memory[entry->node])
+            CPU_SET(entry->node, &nodes);
+    }
+    placement_format_list(&set, cpus, PLACEMENT_LIST_MAX);
+    placement_format_list(&nodes, mems, PLACEMENT_LIST_MAX);
+}
+
+static int placement_apply(const struct Placement *placement, const char *id,
+                           const struct PlacementEntry *entry)
+{
+    char cpus[PLACEMENT_LIST_MAX];
+    char mems[PLACEMENT_LIST_MAX];
+    placement_cpuset(placement, entry, cpus, mems);
+    return cgroup_set_cpuset(id, cpus, mems[0] != '\0' ? mems : NULL);
+}
+
+// Narrows (or widens) the cpusets of all the containers which are not exclusive, except skip,
+// to the shared pool after the exclusive CPUs changed
+static void placement_resync(struct Placement *placement, const char *skip)
+{
+    const char *root = cgroup_root();
+    if (root == NULL)
+        return;
+    char parent[PATH_MAX];
+    strformat(parent, PATH_MAX, "%s/" CGROUP_PARENT, root);
+    DIR *dir = opendir(parent);
+    if (dir == NULL)
+        return;
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL)
+    {
+        if (dirent->d_type != DT_DIR || dirent->d_name[0] == '.' ||
+            (skip != NULL && strcmp(dirent->d_name, skip) == 0))
+            continue;
+        const struct PlacementEntry *entry = placement_find(placement, dirent->d_name);
+        if (entry != NULL && entry->exclusive)
+            continue;
+        // Containers may exit meanwhile, and without the cpuset controller there is nothing to
+        // narrow
+        placement_apply(placement, dirent->d_name, entry);
+    }
+    closedir(dir);
+}
+
+// Takes CPUs of available into taken until it has count of them, whole cores first
+static void placement_take(const struct PlacementTopology *topology, const cpu_set_t *available,
+                           int count, cpu_set_t *taken)
+{
+    for (int pass = 0; pass < 3; pass++)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE && CPU_COUNT(taken) < count; cpu++)
+        {
+            if (!CPU_ISSET(cpu, available) || CPU_ISSET(cpu, taken))
+                continue;
+            int siblings = 0;
+            int free = 0;
+            for (int other = 0; other < CPU_SETSIZE; other++)
+            {
+                if (!CPU_ISSET(other, &topology->online) ||
+                    topology->core[other] != topology->core[cpu])
+                    continue;
+                siblings++;
+                free += CPU_ISSET(other, available) && !CPU_ISSET(other, taken);
+            }
+            int whole = free == siblings;
+            if (pass == 0 && whole && CPU_COUNT(taken) + siblings <= count)
+            {
+                for (int other = cpu; other < CPU_SETSIZE; other++)
+                {
+                    if (CPU_ISSET(other, &topology->online) &&
+                        topology->core[other] == topology->core[cpu])
+                        CPU_SET(other, taken);
+                }
+            }
+            else if ((pass == 1 && !whole) || pass == 2)
+            {
+                CPU_SET(cpu, taken);
+            }
+        }
+    }
+}
+
+// Chooses count exclusive CPUs, on node numa or on any node, returns the node they are on
+// (-1 if they span nodes) or -2 if there are not enough free CPUs
+static int placement_exclusive(const struct Placement *placement, int count, int numa,
+                               cpu_set_t *cpus)
+{
+    const struct PlacementTopology *topology = &placement->topology;
+    cpu_set_t pool;
+    placement_pool(placement, &pool);
+    CPU_ZERO(cpus);
+    // One CPU at least stays shared, for the containers which are not exclusive
+    if (CPU_COUNT(&pool) - count < 1)
+        return -2;
+    int best = -1;
+    int best_free = 0;
+    for (int node = 0; node < topology->nodes_count; node++)
+    {
+        cpu_set_t free;
+        CPU_AND(&free, &pool, &topology->nodes[node]);
+        int n = CPU_COUNT(&free);
+        if ((numa < 0 || node == numa) && n >= count && (best == -1 || n < best_free))
+        {
+            best = node;
+            best_free = n;
+        }
+    }
+    if (best != -1)
+    {
+        cpu_set_t free;
+        CPU_AND(&free, &pool, &topology->nodes[best]);
+        placement_take(topology, &free, count, cpus);
+        return best;
+    }
+    if (numa != PLACEMENT_NUMA_NONE)
+        return -2;
+    // No node has enough, the nodes with the most free CPUs are used up first
+    while (CPU_COUNT(cpus) < count)
+    {
+        int most = -1;
+        int most_free = 0;
+        for (int node = 0; node < topology->nodes_count; node++)
+        {
+            cpu_set_t free;
+            CPU_AND(&free, &pool, &topology->nodes[node]);
+            placement_clear(&free, cpus);
+            if (CPU_COUNT(&free) > most_free)
+            {
+                most = node;
+                most_free = CPU_COUNT(&free);
+            }
+        }
+        cpu_set_t free;
+        CPU_AND(&free, &pool, &topology->nodes[most]);
+        placement_take(topology, &free, count, cpus);
+    }
+    return -1;
+}
+
+// Chooses the node of a container which is not exclusive, the given one or with auto the one
+// with the fewest containers bound to it, returns -1 if it has no shared CPUs
+static int placement_shared_node(const struct Placement *placement, int numa)
+{
+    const struct PlacementTopology *topology = &placement->topology;
+    cpu_set_t pool;
+    placement_pool(placement, &pool);
+    int best = -1;
+    int best_bound = 0;
+    int best_free = 0;
+    for (int node = 0; node < topology->nodes_count; node++)
+    {
+        cpu_set_t free;
+        CPU_AND(&free, &pool, &topology->nodes[node]);
+        int n = CPU_COUNT(&free);
+        if (n == 0 || (numa >= 0 && node != numa) || (numa < 0 && !topology->memory[node]))
+            continue;
+        int bound = 0;
+        for (int i = 0; i < placement->count; i++)
+        {
+            bound += !placement->entries[i].exclusive && placement->entries[i].node == node;
+        }
+        if (best == -1 || bound < best_bound || (bound == best_bound && n > best_free))
+        {
+            best = node;
+            best_bound = bound;
+            best_free = n;
+        }
+    }
+    return best;
+}
+
+// Parses the value of --numa: auto or the number of a node
+int placement_parse_numa(const char *value, int *numa)
+{
+    if (strcmp(value, "auto") == 0)
+    {
+        *numa = PLACEMENT_NUMA_AUTO;
+        return 0;
+    }
+    char *end;
+    long node = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || node < 0 || node >= PLACEMENT_MAX_NODES)
+        return -1;
+    *numa = (int)node;
+    return 0;
+}
+
+/*
+ * @short Sets the cpuset of the cgroup of a new container
+ * @param id ID of the container, its cgroup exists
+ * @param cpus_exclusive number of CPUs which only the container runs on, 0 for none
+ * @param numa node the container is bound to, PLACEMENT_NUMA_AUTO to let it be chosen, or
+ * PLACEMENT_NUMA_NONE
+ * @details Containers run without either only get the shared pool when some CPUs are exclusive.
+ * The calling process owns the placement until placement_release() or its exit.
+ */
+void placement_assign(const char *containers_path, const char *id, int cpus_exclusive, int numa)
+{
+    struct Placement placement;
+    if (cpus_exclusive == 0 && numa == PLACEMENT_NUMA_NONE)
+    {
+        // Without a state file, no container ever had a placement and all share every CPU
+        if (placement_open(&placement, containers_path, 0) == -1)
+            return;
+        int freed = placement_reconcile(&placement);
+        if (freed)
+        {
+            placement_resync(&placement, NULL);
+            placement_write(&placement);
+        }
+        else if (placement_has_exclusive(&placement))
+        {
+            placement_apply(&placement, id, NULL);
+        }
+        placement_close(&placement);
+        return;
+    }
+
+    placement_open(&placement, containers_path, 1);
+    int freed = placement_reconcile(&placement);
+    struct PlacementEntry entry;
+    strformat(entry.id, sizeof(entry.id), "%s", id);
+    entry.pid = getpid();
+    entry.start_time = placement_start_time(entry.pid);
+    entry.exclusive = cpus_exclusive > 0;
+    entry.node = -1;
+    CPU_ZERO(&entry.cpus);
+    if (numa >= 0 && (numa >= placement.topology.nodes_count ||
+                      CPU_COUNT(&placement.topology.nodes[numa]) == 0))
+    {
+        placement_close(&placement);
+        fprintf(stderr, "NUMA node %d has no online CPU\n", numa);
+        exit(1);
+    }
+    if (entry.exclusive)
+    {
+        entry.node = placement_exclusive(&placement, cpus_exclusive, numa, &entry.cpus);
+        if (entry.node == -2)
+        {
+            cpu_set_t pool;
+            placement_pool(&placement, &pool);
+            placement_close(&placement);
+            fprintf(stderr,
+                    "Not enough free CPUs for --cpus-exclusive=%d%s, %d are not exclusive "
+                    "and one of them must stay shared\n",
+                    cpus_exclusive, numa != PLACEMENT_NUMA_NONE ? " on a single node" : "",
+                    CPU_COUNT(&pool));
+            exit(1);
+        }
+    }
+    else
+    {
+        entry.node = placement_shared_node(&placement, numa);
+        if (entry.node == -1)
+        {
+            placement_close(&placement);
+            fprintf(stderr, "No NUMA node has CPUs which are not exclusive\n");
+            exit(1);
+        }
+    }
+    if (placement_apply(&placement, id, &entry) == -1)
+    {
+        placement_close(&placement);
+        errorMessage("%s\n", "Could not set the cpuset of the container, --cpus-exclusive and "
+                             "--numa need the cpuset controller of cgroup v2");
+    }
+    placement.entries =
+        realloc(placement.entries, (placement.count + 1) * sizeof(struct PlacementEntry));
+    if (placement.entries == NULL)
+    {
+        errorMessage("%s\n", "realloc() failed");
+    }
+    placement.entries[placement.count++] = entry;
+    if (entry.exclusive || freed)
+    {
+        placement_resync(&placement, id);
+    }
+    placement_write(&placement);
+
+    char cpus[PLACEMENT_LIST_MAX];
+    char mems[PLACEMENT_LIST_MAX];
+    placement_cpuset(&placement, &entry, cpus, mems);
+    printf("=> Placed container on CPUs %s%s%s%s\n", cpus, entry.exclusive ? " (exclusive)" : "",
+           mems[0] != '\0' ? ", memory of node " : "", mems);
+    placement_close(&placement);
+}
+
+// Gives the exclusive CPUs of container id, if any, back to the shared pool
+void placement_release(const char *containers_path, const char *id)
+{
+    struct Placement placement;
+    if (placement_open(&placement, containers_path, 0) == -1)
+        return;
+    int freed = placement_reconcile(&placement);
+    struct PlacementEntry *entry = placement_find(&placement, id);
+    if (entry != NULL)
+    {
+        freed |= entry->exclusive;
+        placement_remove(&placement, (int)(entry - placement.entries));
+    }
+    if (freed)
+    {
+        placement_resync(&placement, id);
+    }
+    placement_write(&placement);
+    placement_close(&placement);
+}
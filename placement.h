@@ -0,0 +1,12 @@
+#ifndef CONTAINER_PLACEMENT_H
+#define CONTAINER_PLACEMENT_H
+// Placement of containers on the CPUs and NUMA nodes of the host, through their cpuset
+
+// Values of the numa argument of placement_assign besides a node number
+#define PLACEMENT_NUMA_NONE -2
+#define PLACEMENT_NUMA_AUTO -1
+
+int placement_parse_numa(const char *value, int *numa);
+void placement_assign(const char *containers_path, const char *id, int cpus_exclusive, int numa);
+void placement_release(const char *containers_path, const char *id);
+#endif // CONTAINER_PLACEMENT_H
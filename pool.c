@@ -0,0 +1,491 @@
+#define _GNU_SOURCE
+#include "pool.h"
+#include "config.h"
+#include "container.h"
+#include "ipc.h"
+#include "run.h"
+#include "utils.h"
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// A pool is run by a supervisor (./container pool <image>), which keeps a number of idle
+// containers for the image. Each idle container has been cloned into its namespaces, has its
+// root filesystem mounted and pivoted into, and is connected to the bridge. It is parked on a
+// socket, waiting for the command to run.
+//
+// ./container run <image> connects to the supervisor through containers/__pool/<image>.sock
+// and sends its command, environment and stdin/stdout/stderr (SCM_RIGHTS). The supervisor
+// forwards them to an idle container, which execs the command, and sends the exit status of
+// the container back once it terminates. A replacement container is started right after the
+// hand over, so that the pool always has idle containers.
+
+#define POOL_DIR "__pool"
+
+// Messages sent by run. A launch carries the command and its environment, a signal has the
+// signal number as its value.
+#define POOL_MSG_LAUNCH 1
+#define POOL_MSG_SIGNAL 2
+
+enum SlotState
+{
+    SLOT_WARMING,
+    SLOT_READY,
+    SLOT_RUNNING
+};
+
+struct PoolSlot
+{
+    struct Container container;
+    enum SlotState state;
+    pid_t pid;
+    // Supervisor and container ends of the socket pair used to hand over the command
+    int control;
+    int child_control;
+    // Connection of the run command which is using this container
+    int client;
+};
+
+struct Pool
+{
+    const char *image_name;
+    int idle_target;
+    struct PoolSlot *slots;
+    int count;
+    int capacity;
+};
+
+static void pool_socket_path(char *buffer, const char *image_name)
+{
+    strformat(buffer, PATH_MAX, "%s/" POOL_DIR "/%s.sock", CONTAINER_PATH, image_name);
+}
+
+// Splits a launch message into argv and envp, returns -1 if it is not a valid launch message
+static int pool_parse_launch(char *message, size_t length, char ***argv, char ***envp)
+{
+    struct IpcHeader header;
+    if (ipc_unpack(message, length, &header, argv, envp) == -1)
+        return -1;
+    if (header.type != POOL_MSG_LAUNCH || header.argc == 0)
+    {
+        free(*argv);
+        return -1;
+    }
+    return 0;
+}
+
+// Runs in the cloned child: sets up the container, then waits for a command to run
+static int pool_container(void *data)
+{
+    struct PoolSlot *slot = data;
+    // The supervisor blocks signals in favour of a signalfd, the container should not
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    // Without this, the container would hold the supervisor's end open and never see EOF
+    close(slot->control);
+
+    container_enter(&slot->container);
+    if (write(slot->child_control, "R", 1) != 1)
+    {
+        exit(1);
+    }
+
+    char *message = safe_malloc(IPC_MESSAGE_MAX);
+    int fds[IPC_MAX_FDS];
+    int nfds;
+    ssize_t n;
+    while ((n = ipc_recv(slot->child_control, message, IPC_MESSAGE_MAX, fds, &nfds)) == -1 &&
+           errno == EINTR)
+        ;
+    char **argv;
+    char **envp;
+    if (n <= 0 || nfds != 3 || pool_parse_launch(message, (size_t)n, &argv, &envp) == -1)
+    {
+        // The supervisor has gone away
+        exit(1);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        if (dup2(fds[i], i) == -1)
+        {
+            perror("dup2");
+            exit(1);
+        }
+        close(fds[i]);
+    }
+    close(slot->child_control);
+    environ = envp;
+    execvp(argv[0], argv);
+    fprintf(stderr, "execvp %s: %s\n", argv[0], strerror(errno));
+    exit(127);
+}
+
+// Starts a new idle container in the pool
+static void pool_warm(struct Pool *pool)
+{
+    if (pool->count == pool->capacity)
+    {
+        pool->capacity = pool->capacity ? pool->capacity * 2 : 8;
+        pool->slots = realloc(pool->slots, pool->capacity * sizeof(struct PoolSlot));
+        if (pool->slots == NULL)
+        {
+            exit(2);
+        }
+    }
+    struct PoolSlot *slot = &pool->slots[pool->count];
+    memset(slot, 0, sizeof(struct PoolSlot));
+    slot->container.containers_path = CONTAINER_PATH;
+    slot->container.image_name = (char *)pool->image_name;
+    slot->container.images_path = IMAGE_PATH;
+    slot->container.id_length = CONTAINER_ID_LENGTH;
+    slot->client = -1;
+    container_create(&slot->container);
+    container_extract_image(&slot->container);
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == -1)
+    {
+        errorMessage("%s\n", "socketpair() failed");
+    }
+    slot->control = pair[0];
+    slot->child_control = pair[1];
+    slot->pid = run_clone(&pool_container, slot, CONTAINER_NAMESPACES, -1, NULL);
+    if (slot->pid == -1)
+    {
+        errorMessage("%s\n", "clone, container creation");
+    }
+    close(slot->child_control);
+    slot->child_control = -1;
+    container_connect_network(&slot->container, slot->pid);
+    slot->state = SLOT_WARMING;
+    pool->count++;
+    printf("=> Started idle container %s [pid %d]\n", slot->container.id, slot->pid);
+}
+
+static int pool_idle_count(struct Pool *pool)
+{
+    int idle = 0;
+    for (int i = 0; i < pool->count; i++)
+    {
+        idle += pool->slots[i].state != SLOT_RUNNING;
+    }
+    return idle;
+}
+
+// Deletes the container of a slot whose process has exited, and removes the slot
+static void pool_remove(struct Pool *pool, int index)
+{
+    struct PoolSlot *slot = &pool->slots[index];
+    container_delete(&slot->container);
+    if (slot->control != -1)
+        close(slot->control);
+    if (slot->client != -1)
+        close(slot->client);
+    free(slot->container.id);
+    free(slot->container.container_dir);
+    free(slot->container.image_path);
+    pool->slots[index] = pool->slots[pool->count - 1];
+    pool->count--;
+}
+
+// Hands the command sent by a run client over to an idle container
+static void pool_accept(struct Pool *pool, int listen_fd)
+{
+    int client = ipc_accept(listen_fd);
+    if (client == -1)
+        return;
+    char *message = safe_malloc(IPC_MESSAGE_MAX);
+    int fds[IPC_MAX_FDS];
+    int nfds = 0;
+    ssize_t n = ipc_recv(client, message, IPC_MESSAGE_MAX, fds, &nfds);
+    char **argv;
+    char **envp;
+    if (n <= 0 || nfds != 3 || pool_parse_launch(message, (size_t)n, &argv, &envp) == -1)
+    {
+        fprintf(stderr, "=> Ignoring malformed request\n");
+        close(client);
+    }
+    else
+    {
+        free(argv);
+        // Prefer a container which is ready, one which is still warming up will pick the
+        // command up as soon as it is
+        int chosen = -1;
+        for (int i = 0; i < pool->count; i++)
+        {
+            if (pool->slots[i].state == SLOT_READY ||
+                (chosen == -1 && pool->slots[i].state == SLOT_WARMING))
+            {
+                chosen = i;
+            }
+        }
+        if (chosen == -1)
+        {
+            pool_warm(pool);
+            chosen = pool->count - 1;
+        }
+        struct PoolSlot *slot = &pool->slots[chosen];
+        if (ipc_send(slot->control, message, (size_t)n, fds, 3) == -1)
+        {
+            fprintf(stderr, "=> Could not hand over to %s: %s\n", slot->container.id,
+                    strerror(errno));
+            close(client);
+        }
+        else
+        {
+            slot->state = SLOT_RUNNING;
+            slot->client = client;
+            printf("=> Running %s in %s\n", message + sizeof(struct IpcHeader),
+                   slot->container.id);
+        }
+    }
+    for (int i = 0; i < nfds; i++)
+    {
+        close(fds[i]);
+    }
+    free(message);
+}
+
+// Reaps exited containers, reporting the exit status to their client
+static void pool_reap(struct Pool *pool)
+{
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        for (int i = 0; i < pool->count; i++)
+        {
+            struct PoolSlot *slot = &pool->slots[i];
+            if (slot->pid != pid)
+                continue;
+            if (slot->client != -1)
+            {
+                int32_t reply = status;
+                if (send(slot->client, &reply, sizeof(reply), MSG_NOSIGNAL) == -1)
+                {
+                    fprintf(stderr, "=> Could not report exit status to client\n");
+                }
+            }
+            else
+            {
+                fprintf(stderr, "=> Idle container %s exited with status %d\n",
+                        slot->container.id, status);
+            }
+            pool_remove(pool, i);
+            break;
+        }
+    }
+}
+
+static void pool_shutdown(struct Pool *pool, const char *socket_path)
+{
+    printf("=> Stopping pool\n");
+    unlink(socket_path);
+    for (int i = 0; i < pool->count; i++)
+    {
+        kill(pool->slots[i].pid, SIGKILL);
+    }
+    while (pool->count > 0)
+    {
+        waitpid(pool->slots[0].pid, NULL, 0);
+        pool_remove(pool, 0);
+    }
+    free(pool->slots);
+}
+
+/*
+ * @short Runs a pool supervisor for an image, until it is interrupted
+ * @param argc number of arguments after pool subcommand
+ * @param argv arguments after the pool subcommand: image_name [number of idle containers]
+ */
+void cmd_pool(int argc, char *argv[])
+{
+    if (argc < 1)
+    {
+        printf("Usage: ./container pool image_name [idle_containers]\n");
+        exit(1);
+    }
+    struct Pool pool = {argv[0], argc >= 2 ? atoi(argv[1]) : 4, NULL, 0, 0};
+    if (pool.idle_target < 1)
+    {
+        fprintf(stderr, "The pool needs at least one idle container\n");
+        exit(1);
+    }
+
+    // The supervisor usually runs with its output redirected to a log
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    char pool_dir[PATH_MAX];
+    strformat(pool_dir, PATH_MAX, "%s/" POOL_DIR, CONTAINER_PATH);
+    create_directory_exists_ok(NULL, CONTAINER_PATH, 0755);
+    create_directory_exists_ok(NULL, pool_dir, 0755);
+    char socket_path[PATH_MAX];
+    pool_socket_path(socket_path, pool.image_name);
+    int listen_fd = ipc_listen(socket_path);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (signal_fd == -1)
+    {
+        errorMessage("%s\n", "signalfd() failed");
+    }
+
+    while (pool_idle_count(&pool) < pool.idle_target)
+    {
+        pool_warm(&pool);
+    }
+    printf("=> Pool for %s listening on %s\n", pool.image_name, socket_path);
+
+    for (;;)
+    {
+        // Listening socket, signals, and one entry per slot: the control socket while the
+        // container is idle, the client connection while it is running
+        struct pollfd *fds = safe_malloc((pool.count + 2) * sizeof(struct pollfd));
+        fds[0] = (struct pollfd){.fd = signal_fd, .events = POLLIN};
+        fds[1] = (struct pollfd){.fd = listen_fd, .events = POLLIN};
+        for (int i = 0; i < pool.count; i++)
+        {
+            struct PoolSlot *slot = &pool.slots[i];
+            fds[i + 2].fd = slot->state == SLOT_RUNNING ? slot->client : slot->control;
+            fds[i + 2].events = POLLIN;
+            fds[i + 2].revents = 0;
+        }
+        int nslots = pool.count;
+        if (poll(fds, nslots + 2, -1) == -1 && errno != EINTR)
+        {
+            errorMessage("%s\n", "poll() failed");
+        }
+        // Slots are handled before anything which adds or removes them
+        for (int i = 0; i < nslots; i++)
+        {
+            if (!(fds[i + 2].revents & (POLLIN | POLLHUP)))
+                continue;
+            struct PoolSlot *slot = &pool.slots[i];
+            if (slot->state == SLOT_RUNNING)
+            {
+                struct IpcHeader header;
+                ssize_t n = recv(slot->client, &header, sizeof(header), 0);
+                if (n == (ssize_t)sizeof(header) && header.type == POOL_MSG_SIGNAL)
+                {
+                    kill(slot->pid, (int)header.value);
+                }
+                else if (n <= 0)
+                {
+                    // The run command went away, so does its container
+                    kill(slot->pid, SIGKILL);
+                    close(slot->client);
+                    slot->client = -1;
+                }
+            }
+            else
+            {
+                char ready;
+                if (read(slot->control, &ready, 1) == 1)
+                {
+                    slot->state = SLOT_READY;
+                }
+                else
+                {
+                    // The container died while warming up, it is reaped on SIGCHLD
+                    close(slot->control);
+                    slot->control = -1;
+                    slot->state = SLOT_RUNNING;
+                }
+            }
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            if (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+            {
+                if (info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM)
+                {
+                    free(fds);
+                    pool_shutdown(&pool, socket_path);
+                    exit(0);
+                }
+                pool_reap(&pool);
+            }
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            pool_accept(&pool, listen_fd);
+        }
+        free(fds);
+        while (pool_idle_count(&pool) < pool.idle_target)
+        {
+            pool_warm(&pool);
+        }
+    }
+}
+
+static volatile sig_atomic_t pending_signal = 0;
+
+static void pool_forward_signal(int sig) { pending_signal = sig; }
+
+/*
+ * @short Runs the command in a container from the pool of image_name, if there is one
+ * @details Does not return if the command was handed over to a pool, the process exits with the
+ * exit status of the container instead. Returns -1 if there is no pool for the image.
+ */
+int pool_run(const char *image_name, int argc, char *argv[])
+{
+    char path[PATH_MAX];
+    pool_socket_path(path, image_name);
+    int fd = ipc_connect(path);
+    if (fd == -1)
+        return -1;
+
+    char *message = safe_malloc(IPC_MESSAGE_MAX);
+    struct IpcHeader header = {.type = POOL_MSG_LAUNCH};
+    size_t length = ipc_pack(message, &header, argv, environ);
+    if (length == 0)
+    {
+        fprintf(stderr, "Command and environment are too large for the pool\n");
+        exit(1);
+    }
+    int stdio[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    if (ipc_send(fd, message, length, stdio, 3) == -1)
+    {
+        errorMessage("%s\n", "Could not send command to the pool");
+    }
+    free(message);
+
+    // Signals are forwarded to the container, like they would reach a container started by run
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = pool_forward_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    for (;;)
+    {
+        int32_t status;
+        ssize_t n = recv(fd, &status, sizeof(status), 0);
+        if (n == -1 && errno == EINTR)
+        {
+            struct IpcHeader sig = {POOL_MSG_SIGNAL, 0, 0, (uint32_t)pending_signal};
+            send(fd, &sig, sizeof(sig), MSG_NOSIGNAL);
+            continue;
+        }
+        if (n != (ssize_t)sizeof(status))
+        {
+            fprintf(stderr, "Lost connection to the pool\n");
+            exit(1);
+        }
+        exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    }
+}
@@ -0,0 +1,7 @@
+#ifndef CONTAINER_POOL_H
+#define CONTAINER_POOL_H
+// Pools of pre-started containers, which only have to exec the command when run
+
+void cmd_pool(int argc, char *argv[]);
+int pool_run(const char *image_name, int argc, char *argv[]);
+#endif // CONTAINER_POOL_H
@@ -1,33 +1,55 @@
 #define _GNU_SOURCE
 #include "run.h"
+#include "cgroup.h"
 #include "config.h"
 #include "container.h"
+#include "daemon.h"
+#include "placement.h"
+#include "pool.h"
+#include "seccomp.h"
+#include "trace.h"
 #include "string.h"
 #include "utils.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
+#include <linux/sched.h>
+#include <poll.h>
 #include <sched.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <sys/mount.h>
+#include <sys/pidfd.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 struct Container current_container;
+// Set in the shims of the daemon, which are told the ID and PID of the container on it
+int run_notify_fd = -1;
 
-void siginterrupt_handler(int sig) {}
+// The process which registered handler, the child inherits it but must not clean up
+static pid_t handler_pid;
 
 void handler()
 {
+    if (getpid() != handler_pid)
+        return;
     printf("=> Cleaning up\n");
+    uint64_t begin = trace_now();
     container_delete(&current_container);
+    trace_span("cleanup", begin);
+    trace_event(TRACE_CLEANED);
     // Free resources
     free(current_container.id);
     free(current_container.root);
     free(current_container.container_dir);
     free(current_container.image_path);
+    free(current_container.cgroup);
+    trace_write();
 }
 
 /*
@@ -40,6 +62,11 @@ struct container_args
     struct Container container;
     int argc;
     char **argv;
+    // Pipe on which the parent signals that the network of the container is configured
+    int network_read;
+    int network_write;
+    // Filter of --seccomp, installed right before the command runs. filter is NULL without it.
+    struct sock_fprog seccomp;
 };
 
 static int run_container(void *data)
@@ -53,126 +80,637 @@ static int run_container(void *data)
     struct Container container = (c->container);
     int argc = c->argc;
     char **argv = c->argv;
-    if (sethostname(container.id, container.id_length) == -1)
+    // The parent blocks the signals it forwards, the command must get them
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    // Without the write end, read() returns 0 if the parent dies instead of hanging
+    close(c->network_write);
+    char ready;
+    if (container.uid_map_count > 0)
+    {
+        if (read(c->network_read, &ready, 1) != 1)
+        {
+            exit(1);
+        }
+        userns_become_root();
+    }
+    // The filesystem is set up here while the parent sets up the network
+    container_enter(&container);
+
+    // The command must not start before its network is up
+    uint64_t begin = trace_now();
+    if (read(c->network_read, &ready, 1) != 1)
     {
-        perror("Could not set hostname");
         exit(1);
     }
-    // Mount the root file system as private so that mount events do not propagate in and out of
-    // it
-    if (mount(NULL, "/", NULL, MS_PRIVATE | MS_REC, NULL) == -1)
+    close(c->network_read);
+    trace_span("wait for network", begin);
+
+    trace_event(TRACE_EXEC);
+    // Installed last, so that only the command of the container is filtered and not the setting
+    // up of the container
+    if (c->seccomp.filter != NULL && seccomp_install(&c->seccomp) == -1)
     {
-        perror("mount root");
+        perror("Could not install the seccomp filter");
         exit(1);
     }
-    container_extract_image(&container);
-    container_create_overlayfs(&container);
-    container_create_mounts(&container);
+    if (execvp(argv[1], argv + 1))
+    {
+        perror("execvp");
+        exit(1);
+    }
+    return 0;
+}
 
-    char path[PATH_MAX];
-    // TODO: Check if snprintf fails
-    snprintf(path, PATH_MAX, "%s/old-root%s", container.root, container.id);
-    mkdir(path, 0777);
+// @brief Starts a child which runs fn(arg) in the new namespaces flags, usually
+// CONTAINER_NAMESPACES
+// @details The child is started directly in the cgroup cgroup_fd, unless it is -1. If pidfd is
+// not NULL, it is set to a pidfd for the child.
+pid_t run_clone(int (*fn)(void *), void *arg, int flags, int cgroup_fd, int *pidfd)
+{
+    // clone3() without a stack behaves like fork(), the child runs on a copy of the stack of
+    // the parent instead of a separately allocated one
+    struct clone_args args;
+    memset(&args, 0, sizeof(args));
+    // New namespace, new uts for a new hostname, SIGCHLD so that the parent is notified if the
+    // child exits
+    args.flags = (uint64_t)flags;
+    args.exit_signal = SIGCHLD;
+    if (pidfd != NULL)
+    {
+        args.flags |= CLONE_PIDFD;
+        args.pidfd = (uint64_t)(uintptr_t)pidfd;
+    }
+    // Placing the child into its cgroup atomically means that nothing it does escapes the
+    // limits, even before the parent gets to run again
+    if (cgroup_fd != -1)
+    {
+        args.flags |= CLONE_INTO_CGROUP;
+        args.cgroup = (uint64_t)cgroup_fd;
+    }
+    pid_t pid = (pid_t)syscall(SYS_clone3, &args, sizeof(args));
+    if (pid == 0)
+    {
+        _exit(fn(arg));
+    }
+    // After adding CLONE_NEWPID, running ps -e inside the container
+    // does not show any process running on the host
+    // ps -e from outside the container shows the processes inside the container
+    // kill -9 also works from outside the container
+    return pid;
+}
 
-    if (syscall(SYS_pivot_root, container.root, path) == -1)
+// @brief Waits for the container to exit, forwarding signals and enforcing timeout (in seconds,
+// 0 for none)
+// @details signal_fd is a signalfd for the signals which are forwarded. Returns the wait status.
+static int run_wait(int pidfd, int signal_fd, int timeout)
+{
+    uint64_t deadline = timeout > 0 ? trace_now() + (uint64_t)timeout * 1000000000 : 0;
+    int killed = 0;
+    for (;;)
     {
-        perror("Pivot root");
-        exit(1);
+        int wait_ms = -1;
+        if (deadline != 0)
+        {
+            uint64_t now = trace_now();
+            wait_ms = now >= deadline ? 0 : (int)((deadline - now + 999999) / 1000000);
+        }
+        struct pollfd fds[2] = {{.fd = pidfd, .events = POLLIN}, {.fd = signal_fd, .events = POLLIN}};
+        int n = poll(fds, 2, wait_ms);
+        if (n == -1 && errno != EINTR)
+        {
+            errorMessage("%s\n", "poll() failed");
+        }
+        if (n == 0)
+        {
+            // The init of a PID namespace only gets the signals it handles, so SIGTERM would
+            // usually be ignored. A container past its timeout is killed outright.
+            printf("=> Container timed out after %d seconds, killing it\n", timeout);
+            pidfd_send_signal(pidfd, SIGKILL, NULL, 0);
+            deadline = 0;
+            killed = 1;
+            continue;
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            if (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+            {
+                pidfd_send_signal(pidfd, (int)info.ssi_signo, NULL, 0);
+            }
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            siginfo_t info;
+            memset(&info, 0, sizeof(info));
+            if (waitid(P_PIDFD, pidfd, &info, WEXITED) == -1)
+            {
+                errorMessage("%s\n", "waitid() failed");
+            }
+            if (info.si_code == CLD_EXITED)
+                return W_EXITCODE(info.si_status, 0);
+            return W_EXITCODE(0, killed ? SIGKILL : info.si_status);
+        }
     }
+}
+
+struct RunOptions
+{
+    const char *trace_path;
+    int timeout;
+    int detach;
+    struct CgroupLimits limits;
+    struct PublishedPort *ports;
+    int ports_count;
+    enum NetworkMode network;
+    const char *network_parent;
+    long long ephemeral;
+    enum StorageDriver storage;
+    struct Volume *volumes;
+    int volumes_count;
+    struct IdMap *uid_map;
+    int uid_map_count;
+    struct IdMap *gid_map;
+    int gid_map_count;
+    const char *seccomp;
+    int cpus_exclusive;
+    int numa;
+};
+
+static void run_usage(void)
+{
+    printf("Usage: ./container run [options] image_name command [command options]\n");
+    printf("options:\n");
+    printf("  --trace=<file>        Write a Chrome trace of the container's start up and tear "
+           "down\n");
+    printf("  --cpus=<n>            CPU time, in number of CPUs (e.g. 0.5)\n");
+    printf("  --cpu-weight=<n>      Relative share of CPU time under contention, 1-10000 "
+           "(default 100)\n");
+    printf("  --memory=<size>       Memory limit, e.g. 512m, the container is OOM killed "
+           "above it\n");
+    printf("  --memory-high=<size>  Memory above which the container is throttled and "
+           "reclaimed\n");
+    printf("  --io-max=<limits>     Block IO limits, e.g. \"/dev/sda rbps=1048576 wiops=100\"\n");
+    printf("  --pids=<n>            Maximum number of processes\n");
+    printf("  --cpus-exclusive=<n>  Run on n CPUs which no other container runs on, on a single "
+           "NUMA\n");
+    printf("                        node if possible\n");
+    printf("  --numa=<node>         Run on the CPUs and memory of a NUMA node, or auto for the "
+           "least\n");
+    printf("                        used one\n");
+    printf("  --timeout=<seconds>   Kill the container if it is still running after this long\n");
+    printf("  --network=<mode>      bridge (default), none, host, macvlan:<parent> or "
+           "ipvlan:<parent>\n");
+    printf("  -p, --publish=<port>  Forward host_port:container_port[/tcp|/udp] on the host to "
+           "the\n");
+    printf("                        container, may be given several times\n");
+    printf("  --ephemeral[=<size>]  Keep the changes to the image in a tmpfs of this size "
+           "(default\n");
+    printf("                        " EPHEMERAL_SIZE "), charged to the memory of the container\n");
+    printf("  --storage=<driver>    overlay (default), reflink (XFS or btrfs) or btrfs "
+           "(snapshots)\n");
+    printf("  --uidmap=<map>        Run in a user namespace mapping container_id:host_id:count, "
+           "may\n");
+    printf("                        be given several times\n");
+    printf("  --gidmap=<map>        Same for groups, the maps of --uidmap by default\n");
+    printf("  --seccomp=<profile>   Filter the system calls of the command with a seccomp profile "
+           "in\n");
+    printf("                        the JSON format of Docker, or default for the built in "
+           "one\n");
+    printf("  -v, --volume=<volume> Bind mount /host/path:/container/path[:ro|:rw], may be "
+           "given\n");
+    printf("                        several times\n");
+    printf("  --tmpfs=<mount>       Mount a tmpfs at /container/path[:size], may be given "
+           "several\n");
+    printf("                        times\n");
+    printf("  -d, --detach          Print the container ID once it runs instead of waiting "
+           "for it,\n");
+    printf("                        needs the daemon\n");
+    exit(1);
+}
 
-    if (chdir("/") == -1)
+static long long run_parse_number(const char *option, const char *value, long long min,
+                                  long long max)
+{
+    char *end;
+    long long n = strtoll(value, &end, 10);
+    if (end == value || *end != '\0' || n < min || n > max)
     {
-        perror("chdir");
+        fprintf(stderr, "Invalid value %s for --%s\n", value, option);
         exit(1);
     }
+    return n;
+}
 
-    // Remove old mount
-    snprintf(path, PATH_MAX, "/old-root%s", container.id);
-    if (umount2(path, MNT_DETACH) == -1)
+static long long run_parse_size(const char *option, const char *value)
+{
+    long long bytes;
+    if (cgroup_parse_size(value, &bytes) == -1 || bytes == 0)
     {
-        perror("umount2");
+        fprintf(stderr, "Invalid size %s for --%s\n", value, option);
         exit(1);
     }
+    return bytes;
+}
 
-    if (rmdir(path) == -1)
+// Parses the options before the image name, returns the index of the image name in argv
+static int run_parse_options(int argc, char *argv[], struct RunOptions *options)
+{
+    static const struct option long_options[] = {
+        {"trace", required_argument, NULL, 't'},
+        {"cpus", required_argument, NULL, 'c'},
+        {"cpu-weight", required_argument, NULL, 'w'},
+        {"memory", required_argument, NULL, 'm'},
+        {"memory-high", required_argument, NULL, 'M'},
+        {"io-max", required_argument, NULL, 'i'},
+        {"pids", required_argument, NULL, 'n'},
+        {"timeout", required_argument, NULL, 'T'},
+        {"detach", no_argument, NULL, 'd'},
+        {"publish", required_argument, NULL, 'p'},
+        {"network", required_argument, NULL, 'N'},
+        {"ephemeral", optional_argument, NULL, 'e'},
+        {"volume", required_argument, NULL, 'v'},
+        {"tmpfs", required_argument, NULL, 'f'},
+        {"storage", required_argument, NULL, 'S'},
+        {"uidmap", required_argument, NULL, 'u'},
+        {"gidmap", required_argument, NULL, 'g'},
+        {"seccomp", required_argument, NULL, 's'},
+        {"cpus-exclusive", required_argument, NULL, 'x'},
+        {"numa", required_argument, NULL, 'a'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    memset(options, 0, sizeof(struct RunOptions));
+    options->numa = PLACEMENT_NUMA_NONE;
+    // getopt skips the first argument like a program name, which argv (from main, bench or a
+    // request to the daemon) does not start with, so it gets a copy with run in front. The
+    // leading + stops at the image name, so that the options of the command are left alone.
+    char **args = safe_malloc((argc + 2) * sizeof(char *));
+    args[0] = "run";
+    memcpy(args + 1, argv, argc * sizeof(char *));
+    args[argc + 1] = NULL;
+    optind = 1;
+    int opt;
+    while ((opt = getopt_long(argc + 1, args, "+dhp:v:", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            options->trace_path = optarg;
+            break;
+        case 'c':
+        {
+            char *end;
+            options->limits.cpus = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || options->limits.cpus <= 0)
+            {
+                fprintf(stderr, "Invalid value %s for --cpus\n", optarg);
+                exit(1);
+            }
+            break;
+        }
+        case 'w':
+            options->limits.cpu_weight = run_parse_number("cpu-weight", optarg, 1, 10000);
+            break;
+        case 'm':
+            options->limits.memory = run_parse_size("memory", optarg);
+            break;
+        case 'M':
+            options->limits.memory_high = run_parse_size("memory-high", optarg);
+            break;
+        case 'i':
+            options->limits.io_max = optarg;
+            break;
+        case 'n':
+            options->limits.pids = run_parse_number("pids", optarg, 1, INT_MAX);
+            break;
+        case 'T':
+            options->timeout = run_parse_number("timeout", optarg, 1, INT_MAX / 1000);
+            break;
+        case 'd':
+            options->detach = 1;
+            break;
+        case 'N':
+            if (container_parse_network(optarg, &options->network, &options->network_parent) ==
+                -1)
+            {
+                fprintf(stderr, "Invalid network %s\n", optarg);
+                run_usage();
+            }
+            break;
+        case 'e':
+            options->ephemeral =
+                run_parse_size("ephemeral", optarg != NULL ? optarg : EPHEMERAL_SIZE);
+            break;
+        case 'p':
+            options->ports = realloc(options->ports,
+                                     (options->ports_count + 1) * sizeof(struct PublishedPort));
+            if (options->ports == NULL ||
+                nftables_parse_port(optarg, &options->ports[options->ports_count]) == -1)
+            {
+                fprintf(stderr, "Invalid port %s, expected host_port:container_port[/tcp|/udp]\n",
+                        optarg);
+                exit(1);
+            }
+            options->ports_count++;
+            break;
+        case 'S':
+            if (storage_parse(optarg, &options->storage) == -1)
+            {
+                fprintf(stderr, "Invalid storage %s\n", optarg);
+                run_usage();
+            }
+            break;
+        case 'u':
+        case 'g':
+        {
+            struct IdMap **maps = opt == 'u' ? &options->uid_map : &options->gid_map;
+            int *count = opt == 'u' ? &options->uid_map_count : &options->gid_map_count;
+            *maps = realloc(*maps, (*count + 1) * sizeof(struct IdMap));
+            if (*maps == NULL)
+            {
+                errorMessage("%s\n", "realloc() failed");
+            }
+            if (userns_parse_map(optarg, &(*maps)[*count]) == -1)
+            {
+                fprintf(stderr, "Invalid map %s, expected container_id:host_id:count\n", optarg);
+                exit(1);
+            }
+            (*count)++;
+            break;
+        }
+        case 's':
+            options->seccomp = optarg;
+            break;
+        case 'x':
+            options->cpus_exclusive = run_parse_number("cpus-exclusive", optarg, 1, CPU_SETSIZE);
+            break;
+        case 'a':
+            if (placement_parse_numa(optarg, &options->numa) == -1)
+            {
+                fprintf(stderr, "Invalid NUMA node %s\n", optarg);
+                run_usage();
+            }
+            break;
+        case 'v':
+        case 'f':
+        {
+            options->volumes = realloc(options->volumes,
+                                       (options->volumes_count + 1) * sizeof(struct Volume));
+            if (options->volumes == NULL)
+            {
+                errorMessage("%s\n", "realloc() failed");
+            }
+            // The value is split in place, the paths stay in use for the lifetime of the container
+            char *value = strdup(optarg);
+            struct Volume *volume = &options->volumes[options->volumes_count];
+            if (opt == 'v' && container_parse_volume(value, volume) == -1)
+            {
+                fprintf(stderr, "Invalid volume %s, expected /host/path:/container/path[:ro|:rw]\n",
+                        optarg);
+                exit(1);
+            }
+            if (opt == 'f' && container_parse_tmpfs(value, volume) == -1)
+            {
+                fprintf(stderr, "Invalid tmpfs %s, expected /container/path[:size]\n", optarg);
+                exit(1);
+            }
+            options->volumes_count++;
+            break;
+        }
+        default:
+            run_usage();
+        }
+    }
+    if (options->ports_count > 0 && options->network != NETWORK_BRIDGE)
     {
-        perror("rmdir");
+        fprintf(stderr, "Ports can only be published with --network=bridge\n");
         exit(1);
     }
-
-    if (execvp(argv[1], argv + 1))
+    if (options->ephemeral > 0 && options->storage != STORAGE_OVERLAY)
     {
-        perror("execvp");
+        fprintf(stderr, "--ephemeral needs --storage=overlay\n");
         exit(1);
     }
-    return 0;
+    if (options->gid_map_count > 0 && options->uid_map_count == 0)
+    {
+        fprintf(stderr, "--gidmap needs --uidmap\n");
+        exit(1);
+    }
+    // Groups are mapped like users unless told otherwise
+    if (options->gid_map_count == 0)
+    {
+        options->gid_map = options->uid_map;
+        options->gid_map_count = options->uid_map_count;
+    }
+    if (options->uid_map_count > 0 && options->storage != STORAGE_OVERLAY)
+    {
+        fprintf(stderr, "--uidmap needs --storage=overlay\n");
+        exit(1);
+    }
+    // sysfs can only be mounted by the user namespace owning the network namespace
+    if (options->uid_map_count > 0 && options->network == NETWORK_HOST)
+    {
+        fprintf(stderr, "--uidmap cannot be used with --network=host\n");
+        exit(1);
+    }
+    free(args);
+    return optind - 1;
 }
 
 void cmd_run(int argc, char *argv[])
 {
-    atexit(handler);
-    struct sigaction sa;
-    sa.sa_handler = siginterrupt_handler;
-    sigaction(SIGINT, &sa, NULL);
-    if (argc < 2)
+    uint64_t start = trace_now();
+    struct RunOptions options;
+    int first = run_parse_options(argc, argv, &options);
+    if (argc - first < 2)
     {
-        printf("Usage: ./container run [options] image_name command [command options]\n");
-        printf("Only %d argument(s) supplied\n", argc);
+        printf("Only %d argument(s) supplied\n", argc - first);
+        run_usage();
+    }
+    // If the daemon is running it runs the container, unless this is one of its shims
+    if (run_notify_fd == -1 && daemon_run(argc, argv, first, options.detach) == -1 && options.detach)
+    {
+        fprintf(stderr, "--detach needs the daemon, start it with ./container daemon\n");
         exit(1);
     }
-    struct Container container;
+    argc -= first;
+    argv += first;
+    struct CgroupLimits no_limits = {0};
+    int has_limits = memcmp(&options.limits, &no_limits, sizeof(no_limits)) != 0;
+    if (options.trace_path != NULL)
+    {
+        trace_open(options.trace_path);
+    }
+    else if (!has_limits && options.ports_count == 0 && options.network == NETWORK_BRIDGE &&
+             options.ephemeral == 0 && options.volumes_count == 0 &&
+             options.storage == STORAGE_OVERLAY && options.uid_map_count == 0 &&
+             options.seccomp == NULL && options.cpus_exclusive == 0 &&
+             options.numa == PLACEMENT_NUMA_NONE)
+    {
+        // If a pool is running for the image, one of its containers runs the command. Traced
+        // runs, and runs with limits, published ports, another network mode, an ephemeral
+        // overlay, volumes, another storage driver, a user namespace, a seccomp profile or a
+        // CPU placement, always start their own container.
+        pool_run(argv[0], argc - 1, argv + 1);
+    }
+    trace_event(TRACE_START);
+    trace_span("parse options", start);
+
+    handler_pid = getpid();
+    atexit(handler);
+    // Signals meant for the container are forwarded to it, they are blocked here before the
+    // child exists so that none of them is lost
+    sigset_t forwarded;
+    sigemptyset(&forwarded);
+    sigaddset(&forwarded, SIGINT);
+    sigaddset(&forwarded, SIGTERM);
+    sigaddset(&forwarded, SIGHUP);
+    sigaddset(&forwarded, SIGQUIT);
+    sigaddset(&forwarded, SIGUSR1);
+    sigaddset(&forwarded, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &forwarded, NULL);
+    int signal_fd = signalfd(-1, &forwarded, SFD_CLOEXEC);
+    if (signal_fd == -1)
+    {
+        errorMessage("%s\n", "signalfd() failed");
+    }
+    struct Container container = {0};
     container.containers_path = CONTAINER_PATH;
     container.image_name = argv[0];
     container.images_path = IMAGE_PATH;
     container.id_length = CONTAINER_ID_LENGTH;
+    container.image_path = NULL;
+    container.root = NULL;
+    container.cgroup = NULL;
+    container.address = 0;
+    container.network = options.network;
+    container.network_parent = options.network_parent;
+    container.ports = options.ports;
+    container.ports_count = options.ports_count;
+    container.ephemeral = options.ephemeral;
+    container.storage = options.storage;
+    container.uid_map = options.uid_map;
+    container.uid_map_count = options.uid_map_count;
+    container.gid_map = options.gid_map;
+    container.gid_map_count = options.gid_map_count;
+    container.volumes = options.volumes;
+    container.volumes_count = options.volumes_count;
     printf("=> Creating container\n");
+    trace_begin(TRACE_CREATE);
     container_create(&container);
     printf("=> Created container %s [%s] \n", container.image_name, container.id);
+    current_container = container;
+    container.cgroup = cgroup_create(container.id, &options.limits);
+    current_container = container;
+    if (container.cgroup != NULL)
+    {
+        placement_assign(CONTAINER_PATH, container.id, options.cpus_exclusive, options.numa);
+    }
+    else if (options.cpus_exclusive > 0 || options.numa != PLACEMENT_NUMA_NONE)
+    {
+        fprintf(stderr, "--cpus-exclusive and --numa need cgroup v2\n");
+        exit(1);
+    }
+    trace_end(TRACE_CREATE);
+    // Done before cloning, so that mounted images are shared by all containers
+    trace_begin(TRACE_EXTRACT);
+    container_extract_image(&container);
+    trace_end(TRACE_EXTRACT);
+    current_container = container;
     // Clone the process and create the container
     struct container_args data;
     data.argc = argc;
     data.argv = argv;
     data.container = container;
+    data.seccomp.filter = NULL;
+    // Reported to the daemon, whose exec installs the same program
+    char seccomp_hash[SHA256_HEX_LENGTH + 1] = "-";
+    if (options.seccomp != NULL)
+    {
+        // Loaded before cloning, the child only installs it
+        uint64_t begin = trace_now();
+        seccomp_load(CONTAINER_PATH, options.seccomp, &data.seccomp, seccomp_hash);
+        trace_span("load seccomp profile", begin);
+    }
+    if (container.uid_map_count > 0)
+    {
+        container_prepare_userns(&data.container);
+    }
+    int network[2];
+    if (pipe2(network, O_CLOEXEC) == -1)
+    {
+        errorMessage("%s\n", "pipe2() failed");
+    }
+    data.network_read = network[0];
+    data.network_write = network[1];
 
-    char *stack = safe_malloc(STACK_SIZE);
-    char *stack_top = stack + STACK_SIZE; // Since stack grows downwards
-    // +-----+----+ <- char* stack_top (for the child, it grows in downard direction)
-    // |     |    | 0x5000
-    // |     |    | 0x4000
-    // |     |    | 0x3000
-    // |     |    | 0x2000
-    // |     v    | 0x1000
-    // +----------+ <- char* stack
-    // |          |
-    // |          |
-    // |          |
-    // |          |
-    // |          |
-    // +----------+
-    current_container = container;
-    // Clone - new namespace, new uts for a new hostname, sigchld so that the parent is notified
-    // if the child exits
-    pid_t pid =
-        clone(&run_container, stack_top,
-              CLONE_NEWNS | CLONE_NEWUTS | CLONE_NEWPID | CLONE_NEWNET | SIGCHLD, (void *)&data);
-    // After adding CLONE_NEWPID, running ps -e inside the container
-    // does not show any process running on the host
-    // ps -e from outside the container shows the processes inside the container
-    // kill -9 also works from outside the container
+    int cgroup_fd = -1;
+    if (container.cgroup != NULL)
+    {
+        cgroup_fd = open(container.cgroup, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (cgroup_fd == -1)
+        {
+            errorMessage("Could not open %s\n", container.cgroup);
+        }
+    }
 
+    int pidfd;
+    // Containers using the network of the host stay in its network namespace
+    int namespaces = CONTAINER_NAMESPACES;
+    if (container.network == NETWORK_HOST)
+        namespaces &= ~CLONE_NEWNET;
+    if (container.uid_map_count > 0)
+        namespaces |= CLONE_NEWUSER;
+    pid_t pid = run_clone(&run_container, (void *)&data, namespaces, cgroup_fd, &pidfd);
     if (pid == -1)
     {
         perror("clone, container creation");
         exit(1);
     }
+    if (cgroup_fd != -1)
+    {
+        close(cgroup_fd);
+    }
+    close(network[0]);
     printf("=> PID of container: %d\n", pid);
-    // Connect the created container to an existing docker0 bridge for development
-    // TODO: Create a new bridge for this application, along with routing
-    container_connect_to_bridge(&container, (int)pid);
-    int status;
-    waitpid(pid, &status, 0);
+    // The container waits for its user namespace to be mapped before doing anything
+    if (container.uid_map_count > 0)
+    {
+        userns_write_maps(pid, container.uid_map, container.uid_map_count, container.gid_map,
+                          container.gid_map_count);
+        if (write(network[1], "U", 1) != 1)
+        {
+            errorMessage("%s\n", "Could not start the container");
+        }
+    }
+    if (run_notify_fd != -1)
+    {
+        dprintf(run_notify_fd, "%s %d %s\n", container.id, pid, seccomp_hash);
+        close(run_notify_fd);
+        run_notify_fd = -1;
+    }
+    trace_set_child(pid);
+    // Connect the created container to the bridge (which is created on first use), or whatever
+    // its network mode is
+    trace_begin(TRACE_NETWORK);
+    container_connect_network(&container, (int)pid);
+    current_container = container;
+    trace_end(TRACE_NETWORK);
+    // Lets the container exec its command
+    if (write(network[1], "N", 1) != 1)
+    {
+        errorMessage("%s\n", "Could not start the container");
+    }
+    close(network[1]);
+    int status = run_wait(pidfd, signal_fd, options.timeout);
+    close(pidfd);
+    close(signal_fd);
+    trace_event(TRACE_EXIT);
     printf("=> Container terminated\n");
-    free(stack);
+    // The exit status of the command is the exit status of run
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
 }
 
 // sudo debootstrap --arch amd64 jammy images/ubuntu 'http://archive.ubuntu.com/ubuntu/
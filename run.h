@@ -2,6 +2,14 @@
 #define CONTAINER_RUN_H
 #include<stdio.h>
 #include<stdlib.h>
+#include <sched.h>
+#include <sys/types.h>
+// Namespaces created for a container, and joined by ./container exec
+#define CONTAINER_NAMESPACES                                                                   \
+    (CLONE_NEWNS | CLONE_NEWUTS | CLONE_NEWIPC | CLONE_NEWPID | CLONE_NEWNET)
+
+extern int run_notify_fd;
 void cmd_run(int argc, char *argv[]);
+pid_t run_clone(int (*fn)(void *), void *arg, int flags, int cgroup_fd, int *pidfd);
 
 #endif // COTNAINER_RUN_H
\ No newline at end of file
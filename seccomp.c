@@ -0,0 +1,456 @@
+#define _GNU_SOURCE
+#include "seccomp.h"
+#include "config.h"
+#include "json.h"
+#include "sha256.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/audit.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// A container run with --seccomp=<profile> has its system calls filtered by a BPF program, which
+// the kernel runs on every system call the container makes. Profiles use the JSON format of
+// Docker: a defaultAction and rules with the names of system calls and their action. The
+// program is not a list of comparisons, one per system call, but a binary search over the ranges
+// of syscall numbers which have the same action, so that each system call costs a handful of
+// instructions however long the profile is. A profile may also list the observed frequencies of
+// its system calls (e.g. from strace -c), the most frequent ones are then checked before the
+// search.
+// Compiling is only done the first time a profile is used, the program is cached in
+// CONTAINER_PATH/SECCOMP_CACHE under the hash of the profile.
+// References:
+// https://docs.kernel.org/userspace-api/seccomp_filter.html
+// https://docs.docker.com/engine/security/seccomp/
+
+#if defined(__x86_64__)
+#define SECCOMP_ARCH AUDIT_ARCH_X86_64
+#elif defined(__aarch64__)
+#define SECCOMP_ARCH AUDIT_ARCH_AARCH64
+#else
+#error "seccomp profiles are not supported on this architecture"
+#endif
+
+// Changes whenever the programs compiled from the same profile change
+#define SECCOMP_CACHE_VERSION "1"
+
+// Built in profile of --seccomp=default, which denies the system calls acting on the whole host
+// rather than on the container
+const char seccomp_default_profile[] =
+    "{\"defaultAction\": \"SCMP_ACT_ALLOW\", \"syscalls\": [{\"names\": ["
+    "\"acct\", \"add_key\", \"bpf\", \"clock_adjtime\", \"clock_settime\", \"create_module\", "
+    "\"delete_module\", \"finit_module\", \"get_kernel_syms\", \"init_module\", \"ioperm\", "
+    "\"iopl\", \"kcmp\", \"kexec_file_load\", \"kexec_load\", \"keyctl\", \"lookup_dcookie\", "
+    "\"nfsservctl\", \"open_by_handle_at\", \"perf_event_open\", \"process_vm_readv\", "
+    "\"process_vm_writev\", \"query_module\", \"quotactl\", \"reboot\", \"request_key\", "
+    "\"settimeofday\", \"swapoff\", \"swapon\", \"_sysctl\", \"sysfs\", \"syslog\", \"uselib\", "
+    "\"userfaultfd\", \"ustat\", \"vm86\", \"vm86old\"], \"action\": \"SCMP_ACT_ERRNO\"}]}";
+
+struct Syscall
+{
+    const char *name;
+    int number;
+};
+
+static const struct Syscall syscalls[] = {
+#define SYSCALL(name) {#name, __NR_##name},
+#include "syscalls.h"
+#undef SYSCALL
+};
+
+// Returns the name of the system call number, NULL if there is none
+const char *seccomp_syscall_name(int number)
+{
+    for (size_t i = 0; i < sizeof(syscalls) / sizeof(syscalls[0]); i++)
+    {
+        if (syscalls[i].number == number)
+            return syscalls[i].name;
+    }
+    return NULL;
+}
+
+static int seccomp_syscall_number(const char *name)
+{
+    for (size_t i = 0; i < sizeof(syscalls) / sizeof(syscalls[0]); i++)
+    {
+        if (strcmp(syscalls[i].name, name) == 0)
+            return syscalls[i].number;
+    }
+    return -1;
+}
+
+// Parses an SCMP_ACT_* action, errno_ret is the errno of SCMP_ACT_ERRNO. Returns -1 if it is
+// unknown.
+static int seccomp_parse_action(const char *name, int errno_ret, uint32_t *action)
+{
+    if (name == NULL)
+        return -1;
+    if (strcmp(name, "SCMP_ACT_ALLOW") == 0)
+        *action = SECCOMP_RET_ALLOW;
+    else if (strcmp(name, "SCMP_ACT_ERRNO") == 0)
+        *action = SECCOMP_RET_ERRNO | (errno_ret & SECCOMP_RET_DATA);
+    else if (strcmp(name, "SCMP_ACT_KILL") == 0 || strcmp(name, "SCMP_ACT_KILL_THREAD") == 0)
+        *action = SECCOMP_RET_KILL_THREAD;
+    else if (strcmp(name, "SCMP_ACT_KILL_PROCESS") == 0)
+        *action = SECCOMP_RET_KILL_PROCESS;
+    else if (strcmp(name, "SCMP_ACT_TRAP") == 0)
+        *action = SECCOMP_RET_TRAP;
+    else if (strcmp(name, "SCMP_ACT_LOG") == 0)
+        *action = SECCOMP_RET_LOG;
+    else
+        return -1;
+    return 0;
+}
+
+// Returns the number member key of object, or fallback if it has none
+static int seccomp_get_number(const struct Json *object, const char *key, int fallback)
+{
+    struct Json *value = json_get(object, key);
+    return value != NULL && value->type == JSON_NUMBER ? (int)value->number : fallback;
+}
+
+// A rule of the profile. Conditions on the arguments, and on the architecture or capabilities,
+// cannot be compiled into a search on the syscall number, profiles using them are refused
+// rather than compiled into a filter which allows more or less than they say.
+static int seccomp_parse_rule(const struct Json *rule, int default_errno,
+                              struct SeccompProfile *profile)
+{
+    const char *conditions[] = {"args", "includes", "excludes"};
+    for (int i = 0; i < 3; i++)
+    {
+        struct Json *condition = json_get(rule, conditions[i]);
+        if (condition != NULL && condition->type != JSON_NULL && condition->child != NULL)
+        {
+            fprintf(stderr, "seccomp rules with \"%s\" are not supported\n", conditions[i]);
+            return -1;
+        }
+    }
+    uint32_t action;
+    const char *action_name = json_get_string(rule, "action");
+    if (seccomp_parse_action(action_name, seccomp_get_number(rule, "errnoRet", default_errno),
+                             &action) == -1)
+    {
+        fprintf(stderr, "Invalid seccomp action %s\n", action_name != NULL ? action_name : "");
+        return -1;
+    }
+    struct Json *names = json_get(rule, "names");
+    struct Json *name = json_get(rule, "name");
+    if (names != NULL && names->type == JSON_ARRAY)
+        name = names->child;
+    for (; name != NULL; name = names != NULL ? name->next : NULL)
+    {
+        // Profiles name the system calls of every architecture, those this one lacks are skipped
+        int number = name->type == JSON_STRING ? seccomp_syscall_number(name->string) : -1;
+        if (number >= 0 && number < SECCOMP_SYSCALLS)
+            profile->actions[number] = action;
+    }
+    return 0;
+}
+
+// Parses a profile, returns -1 if it is invalid
+int seccomp_parse(const char *text, struct SeccompProfile *profile)
+{
+    struct Json *json = json_parse(text);
+    if (json == NULL || json->type != JSON_OBJECT)
+    {
+        fprintf(stderr, "seccomp profiles must be JSON objects\n");
+        json_free(json);
+        return -1;
+    }
+    memset(profile, 0, sizeof(struct SeccompProfile));
+    int default_errno = seccomp_get_number(json, "defaultErrnoRet", EPERM);
+    const char *default_action = json_get_string(json, "defaultAction");
+    if (seccomp_parse_action(default_action, default_errno, &profile->default_action) == -1)
+    {
+        fprintf(stderr, "Invalid seccomp defaultAction %s\n",
+                default_action != NULL ? default_action : "");
+        json_free(json);
+        return -1;
+    }
+    for (int i = 0; i < SECCOMP_SYSCALLS; i++)
+    {
+        profile->actions[i] = profile->default_action;
+    }
+    // Later rules win over earlier ones naming the same system call
+    struct Json *rules = json_get(json, "syscalls");
+    for (struct Json *rule = rules != NULL ? rules->child : NULL; rule != NULL; rule = rule->next)
+    {
+        if (seccomp_parse_rule(rule, default_errno, profile) == -1)
+        {
+            json_free(json);
+            return -1;
+        }
+    }
+    // Frequencies map the names of system calls to numbers, anything else has no key to look up
+    struct Json *frequencies = json_get(json, "frequencies");
+    if (frequencies != NULL && frequencies->type != JSON_OBJECT)
+    {
+        fprintf(stderr, "seccomp frequencies must be a JSON object\n");
+        json_free(json);
+        return -1;
+    }
+    for (struct Json *frequency = frequencies != NULL ? frequencies->child : NULL;
+         frequency != NULL; frequency = frequency->next)
+    {
+        int number = seccomp_syscall_number(frequency->key);
+        if (number >= 0 && number < SECCOMP_SYSCALLS && frequency->type == JSON_NUMBER)
+            profile->frequencies[number] = frequency->number;
+    }
+    json_free(json);
+    return 0;
+}
+
+struct Program
+{
+    struct sock_filter *filter;
+    int length;
+};
+
+static void seccomp_emit(struct Program *program, uint16_t code, uint32_t k, uint8_t jt,
+                         uint8_t jf)
+{
+    // The kernel refuses longer programs
+    if (program->length == BPF_MAXINSNS)
+    {
+        fprintf(stderr, "The seccomp profile needs more than %d instructions\n", BPF_MAXINSNS);
+        exit(1);
+    }
+    program->filter[program->length++] = (struct sock_filter)BPF_JUMP(code, k, jt, jf);
+}
+
+// Syscall numbers from start on, up to the start of the next range, have action
+struct Range
+{
+    uint32_t start;
+    uint32_t action;
+};
+
+// Returns the number of instructions of the search over count ranges
+static int seccomp_search_length(int count)
+{
+    if (count == 1)
+        return 1;
+    int left = seccomp_search_length(count / 2);
+    // Conditional jumps only reach 255 instructions ahead, farther ones go through a JA
+    return 1 + (left > 255) + left + seccomp_search_length(count - count / 2);
+}
+
+// @brief Emits a binary search for the range of the syscall number in the accumulator
+// @details Each comparison halves the ranges left, the ones above its start are jumped to and
+// the ones below follow it.
+static void seccomp_emit_search(struct Program *program, const struct Range *ranges, int count)
+{
+    if (count == 1)
+    {
+        seccomp_emit(program, BPF_RET | BPF_K, ranges[0].action, 0, 0);
+        return;
+    }
+    int half = count / 2;
+    int left = seccomp_search_length(half);
+    if (left > 255)
+    {
+        seccomp_emit(program, BPF_JMP | BPF_JGE | BPF_K, ranges[half].start, 0, 1);
+        seccomp_emit(program, BPF_JMP | BPF_JA | BPF_K, (uint32_t)left, 0, 0);
+    }
+    else
+    {
+        seccomp_emit(program, BPF_JMP | BPF_JGE | BPF_K, ranges[half].start, (uint8_t)left, 0);
+    }
+    seccomp_emit_search(program, ranges, half);
+    seccomp_emit_search(program, ranges + half, count - half);
+}
+
+static const struct SeccompProfile *sort_profile;
+
+// Most frequent first, then by number
+static int compare_frequency(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    double fx = sort_profile->frequencies[x];
+    double fy = sort_profile->frequencies[y];
+    if (fx != fy)
+        return fx < fy ? 1 : -1;
+    return x - y;
+}
+
+// @brief Compiles profile into a program, which the caller frees
+// @details The program first makes sure that the system call comes from the architecture it was
+// compiled for, any other system call (e.g. of a 32 bit binary or through the x32 ABI) kills the
+// process as its number means something else.
+void seccomp_compile(const struct SeccompProfile *profile, enum SeccompOrder order,
+                     struct sock_fprog *program)
+{
+    struct Program p = {.filter = safe_malloc(BPF_MAXINSNS * sizeof(struct sock_filter))};
+    seccomp_emit(&p, BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch), 0, 0);
+    seccomp_emit(&p, BPF_JMP | BPF_JEQ | BPF_K, SECCOMP_ARCH, 1, 0);
+    seccomp_emit(&p, BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS, 0, 0);
+    seccomp_emit(&p, BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr), 0, 0);
+#ifdef __x86_64__
+    seccomp_emit(&p, BPF_JMP | BPF_JGE | BPF_K, __X32_SYSCALL_BIT, 0, 1);
+    seccomp_emit(&p, BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS, 0, 0);
+#endif
+
+    // The system calls which do not get the default action, most frequent first
+    int numbers[SECCOMP_SYSCALLS];
+    int count = 0;
+    for (int i = 0; i < SECCOMP_SYSCALLS; i++)
+    {
+        if (order == SECCOMP_ORDER_LINEAR ? profile->actions[i] != profile->default_action
+                                          : profile->frequencies[i] > 0)
+            numbers[count++] = i;
+    }
+    sort_profile = profile;
+    qsort(numbers, count, sizeof(int), compare_frequency);
+    if (order == SECCOMP_ORDER_FREQUENCY && count > SECCOMP_HOT_SYSCALLS)
+        count = SECCOMP_HOT_SYSCALLS;
+    if (order == SECCOMP_ORDER_BSEARCH)
+        count = 0;
+    for (int i = 0; i < count; i++)
+    {
+        seccomp_emit(&p, BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)numbers[i], 0, 1);
+        seccomp_emit(&p, BPF_RET | BPF_K, profile->actions[numbers[i]], 0, 0);
+    }
+
+    if (order == SECCOMP_ORDER_LINEAR)
+    {
+        seccomp_emit(&p, BPF_RET | BPF_K, profile->default_action, 0, 0);
+    }
+    else
+    {
+        // Numbers past the table get the default action too
+        struct Range ranges[SECCOMP_SYSCALLS + 1];
+        int ranges_count = 0;
+        for (int i = 0; i <= SECCOMP_SYSCALLS; i++)
+        {
+            uint32_t action =
+                i < SECCOMP_SYSCALLS ? profile->actions[i] : profile->default_action;
+            if (ranges_count == 0 || ranges[ranges_count - 1].action != action)
+                ranges[ranges_count++] = (struct Range){.start = (uint32_t)i, .action = action};
+        }
+        seccomp_emit_search(&p, ranges, ranges_count);
+    }
+    program->filter = p.filter;
+    program->len = (unsigned short)p.length;
+}
+
+// Reads the whole file path, NULL if it cannot be read
+static char *seccomp_read_file(const char *path, size_t *length)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        if (fd != -1)
+            close(fd);
+        return NULL;
+    }
+    char *data = safe_malloc(st.st_size + 1);
+    ssize_t n = read(fd, data, st.st_size);
+    close(fd);
+    if (n != st.st_size)
+    {
+        free(data);
+        return NULL;
+    }
+    data[n] = '\0';
+    *length = n;
+    return data;
+}
+
+// Reads the program cached under hash, returns -1 if there is none
+int seccomp_load_cached(const char *containers_path, const char *hash, struct sock_fprog *program)
+{
+    char path[PATH_MAX];
+    strformat(path, PATH_MAX, "%s/" SECCOMP_CACHE "/%s.bpf", containers_path, hash);
+    size_t size;
+    char *cached = seccomp_read_file(path, &size);
+    if (cached == NULL || size == 0 || size % sizeof(struct sock_filter) != 0 ||
+        size > BPF_MAXINSNS * sizeof(struct sock_filter))
+    {
+        free(cached);
+        return -1;
+    }
+    program->filter = (struct sock_filter *)cached;
+    program->len = (unsigned short)(size / sizeof(struct sock_filter));
+    return 0;
+}
+
+// @brief Loads the program of the profile at profile_path, or of the built in one for "default"
+// @details The program is read from the cache if the profile was compiled before, otherwise it is
+// compiled and added to the cache. It is compiled with the most frequent system calls first if
+// the profile lists frequencies. The hash the program is cached under is stored in hash, for
+// seccomp_load_cached().
+void seccomp_load(const char *containers_path, const char *profile_path,
+                  struct sock_fprog *program, char hash[SHA256_HEX_LENGTH + 1])
+{
+    size_t length = sizeof(seccomp_default_profile) - 1;
+    char *text = strcmp(profile_path, "default") == 0 ? strdup(seccomp_default_profile)
+                                                      : seccomp_read_file(profile_path, &length);
+    if (text == NULL)
+    {
+        errorMessage("Could not read the seccomp profile %s\n", profile_path);
+    }
+    struct Sha256 ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, SECCOMP_CACHE_VERSION, strlen(SECCOMP_CACHE_VERSION));
+    sha256_update(&ctx, text, length);
+    sha256_final_hex(&ctx, hash);
+    if (seccomp_load_cached(containers_path, hash, program) == 0)
+    {
+        free(text);
+        return;
+    }
+    char path[PATH_MAX];
+    strformat(path, PATH_MAX, "%s/" SECCOMP_CACHE "/%s.bpf", containers_path, hash);
+
+    struct SeccompProfile *profile = safe_malloc(sizeof(struct SeccompProfile));
+    if (seccomp_parse(text, profile) == -1)
+    {
+        fprintf(stderr, "Invalid seccomp profile %s\n", profile_path);
+        exit(1);
+    }
+    enum SeccompOrder order = SECCOMP_ORDER_BSEARCH;
+    for (int i = 0; i < SECCOMP_SYSCALLS; i++)
+    {
+        if (profile->frequencies[i] > 0)
+            order = SECCOMP_ORDER_FREQUENCY;
+    }
+    seccomp_compile(profile, order, program);
+    free(profile);
+    free(text);
+
+    // Written under another name first, so that concurrent starts never read half a program
+    char tmp[PATH_MAX];
+    strformat(tmp, PATH_MAX, "%s.%d", path, (int)getpid());
+    create_directory_exists_ok(containers_path, SECCOMP_CACHE, 0700);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    size_t size = program->len * sizeof(struct sock_filter);
+    if (fd == -1 || write(fd, program->filter, size) != (ssize_t)size)
+    {
+        errorMessage("Could not write %s\n", tmp);
+    }
+    close(fd);
+    if (rename(tmp, path) == -1)
+    {
+        errorMessage("Could not rename %s\n", tmp);
+    }
+}
+
+// Installs the program for this process and the processes it starts, returns -1 on failure
+int seccomp_install(const struct sock_fprog *program)
+{
+    // Without CAP_SYS_ADMIN, which the containers have in their user namespace, the kernel only
+    // installs a filter with no_new_privs set
+    if (syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, 0, program) == 0)
+        return 0;
+    if (errno != EACCES || prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1)
+        return -1;
+    return (int)syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, 0, program);
+}
@@ -0,0 +1,43 @@
+#ifndef CONTAINER_SECCOMP_H
+#define CONTAINER_SECCOMP_H
+// seccomp profiles, compiled to BPF programs which filter the system calls of containers
+#include "sha256.h"
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <stdint.h>
+
+// Large enough for the system call numbers of the architectures the profiles are compiled for,
+// numbers from here on always get the default action
+#define SECCOMP_SYSCALLS 512
+
+// How the program finds the action of a system call
+enum SeccompOrder
+{
+    // One comparison after the other, in the order of the syscall numbers, for comparison
+    SECCOMP_ORDER_LINEAR,
+    // A balanced binary search over the ranges of syscall numbers with the same action
+    SECCOMP_ORDER_BSEARCH,
+    // The most frequent system calls of the profile first, then the binary search
+    SECCOMP_ORDER_FREQUENCY,
+};
+
+struct SeccompProfile
+{
+    uint32_t default_action;
+    // SECCOMP_RET_* value of every syscall number, the default action unless a rule names it
+    uint32_t actions[SECCOMP_SYSCALLS];
+    // Observed number of calls, 0 if unknown
+    double frequencies[SECCOMP_SYSCALLS];
+};
+
+extern const char seccomp_default_profile[];
+
+const char *seccomp_syscall_name(int number);
+int seccomp_parse(const char *text, struct SeccompProfile *profile);
+void seccomp_compile(const struct SeccompProfile *profile, enum SeccompOrder order,
+                     struct sock_fprog *program);
+void seccomp_load(const char *containers_path, const char *profile_path,
+                  struct sock_fprog *program, char hash[SHA256_HEX_LENGTH + 1]);
+int seccomp_load_cached(const char *containers_path, const char *hash, struct sock_fprog *program);
+int seccomp_install(const struct sock_fprog *program);
+#endif // CONTAINER_SECCOMP_H
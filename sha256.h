@@ -0,0 +1,23 @@
+#ifndef CONTAINER_SHA256_H
+#define CONTAINER_SHA256_H
+// SHA-256, used to address extracted images by the digest of their archive
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LENGTH 32
+#define SHA256_HEX_LENGTH 64
+
+struct Sha256
+{
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+};
+
+void sha256_init(struct Sha256 *ctx);
+void sha256_update(struct Sha256 *ctx, const void *data, size_t length);
+void sha256_final(struct Sha256 *ctx, unsigned char digest[SHA256_DIGEST_LENGTH]);
+void sha256_final_hex(struct Sha256 *ctx, char hex[SHA256_HEX_LENGTH + 1]);
+int sha256_file(const char *path, char hex[SHA256_HEX_LENGTH + 1]);
+#endif // CONTAINER_SHA256_H
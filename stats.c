@@ -0,0 +1,697 @@
+#define _GNU_SOURCE
+#include "stats.h"
+#include "cgroup.h"
+#include "config.h"
+#include "daemon.h"
+#include "trace.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// ./container stats samples the resource usage of every running container from the files of its
+// cgroup (cpu.stat, memory.current, memory.stat, io.stat, pids.current and the PSI *.pressure
+// files) and from the counters of the host side of its veth pair. The files of a container are
+// opened the first time it is seen and kept open, each sample is then a pread() per file, so
+// sampling hundreds of containers every second costs next to nothing. Files of controllers
+// which are not enabled for the containers are left out.
+// The samples are shown as a table refreshed in place like top, printed as JSON lines, or
+// written as a Prometheus text exposition file. The daemon keeps a sampler of the containers it
+// runs as well, ./container stats --daemon prints its exposition.
+// References:
+// https://docs.kernel.org/admin-guide/cgroup-v2.html
+// https://docs.kernel.org/accounting/psi.html
+// https://prometheus.io/docs/instrumenting/exposition_formats/
+
+// Samples during which files that appear after the cgroup, like the veth interface, are looked for
+#define STATS_OPEN_RETRIES 5
+// Large enough for memory.stat, and io.stat with a few dozen devices
+#define STATS_READ_SIZE 8192
+
+struct StatsMetricInfo
+{
+    // Name in the Prometheus exposition, metrics which share a name are next to each other
+    const char *name;
+    // Extra labels in the exposition, NULL if there are none
+    const char *labels;
+    const char *type;
+    const char *help;
+    // Key in the JSON lines
+    const char *key;
+};
+
+static const struct StatsMetricInfo metrics[STATS_METRICS] = {
+    [STATS_CPU_USAGE] = {"container_cpu_usage_seconds_total", NULL, "counter",
+                         "CPU time used by the container", "cpu_usage_seconds"},
+    [STATS_CPU_USER] = {"container_cpu_user_seconds_total", NULL, "counter",
+                        "CPU time used by the container in user mode", "cpu_user_seconds"},
+    [STATS_CPU_SYSTEM] = {"container_cpu_system_seconds_total", NULL, "counter",
+                          "CPU time used by the container in kernel mode", "cpu_system_seconds"},
+    [STATS_CPU_THROTTLED] = {"container_cpu_throttled_seconds_total", NULL, "counter",
+                             "Time the container was throttled by its CPU limit",
+                             "cpu_throttled_seconds"},
+    [STATS_CPU_THROTTLED_PERIODS] = {"container_cpu_throttled_periods_total", NULL, "counter",
+                                     "Periods in which the container was throttled by its CPU "
+                                     "limit",
+                                     "cpu_throttled_periods"},
+    [STATS_MEMORY_USAGE] = {"container_memory_usage_bytes", NULL, "gauge",
+                            "Memory used by the container", "memory_usage_bytes"},
+    [STATS_MEMORY_LIMIT] = {"container_memory_limit_bytes", NULL, "gauge",
+                            "Memory limit of the container", "memory_limit_bytes"},
+    [STATS_MEMORY_ANON] = {"container_memory_anon_bytes", NULL, "gauge",
+                           "Anonymous memory of the container", "memory_anon_bytes"},
+    [STATS_MEMORY_FILE] = {"container_memory_file_bytes", NULL, "gauge",
+                           "Page cache of the container", "memory_file_bytes"},
+    [STATS_MEMORY_KERNEL] = {"container_memory_kernel_bytes", NULL, "gauge",
+                             "Kernel memory of the container", "memory_kernel_bytes"},
+    [STATS_MEMORY_SHMEM] = {"container_memory_shmem_bytes", NULL, "gauge",
+                            "Shared memory and tmpfs files of the container",
+                            "memory_shmem_bytes"},
+    [STATS_PAGE_FAULTS] = {"container_memory_page_faults_total", NULL, "counter",
+                           "Page faults of the container", "memory_page_faults"},
+    [STATS_MAJOR_PAGE_FAULTS] = {"container_memory_major_page_faults_total", NULL, "counter",
+                                 "Page faults of the container which needed IO",
+                                 "memory_major_page_faults"},
+    [STATS_IO_READ_BYTES] = {"container_io_read_bytes_total", NULL, "counter",
+                             "Bytes read from block devices by the container", "io_read_bytes"},
+    [STATS_IO_WRITE_BYTES] = {"container_io_written_bytes_total", NULL, "counter",
+                              "Bytes written to block devices by the container",
+                              "io_written_bytes"},
+    [STATS_IO_READS] = {"container_io_reads_total", NULL, "counter",
+                        "Reads from block devices by the container", "io_reads"},
+    [STATS_IO_WRITES] = {"container_io_writes_total", NULL, "counter",
+                         "Writes to block devices by the container", "io_writes"},
+    [STATS_CPU_PRESSURE] = {"container_pressure_avg10_percent", "resource=\"cpu\"", "gauge",
+                            "Share of the last 10 seconds in which some processes of the "
+                            "container were stalled on the resource",
+                            "cpu_pressure_avg10"},
+    [STATS_MEMORY_PRESSURE] = {"container_pressure_avg10_percent", "resource=\"memory\"", NULL,
+                               NULL, "memory_pressure_avg10"},
+    [STATS_IO_PRESSURE] = {"container_pressure_avg10_percent", "resource=\"io\"", NULL, NULL,
+                           "io_pressure_avg10"},
+    [STATS_CPU_PRESSURE_TOTAL] = {"container_pressure_seconds_total", "resource=\"cpu\"",
+                                  "counter",
+                                  "Time in which some processes of the container were stalled "
+                                  "on the resource",
+                                  "cpu_pressure_seconds"},
+    [STATS_MEMORY_PRESSURE_TOTAL] = {"container_pressure_seconds_total", "resource=\"memory\"",
+                                     NULL, NULL, "memory_pressure_seconds"},
+    [STATS_IO_PRESSURE_TOTAL] = {"container_pressure_seconds_total", "resource=\"io\"", NULL,
+                                 NULL, "io_pressure_seconds"},
+    [STATS_MEMORY_PRESSURE_FULL_TOTAL] = {"container_pressure_full_seconds_total",
+                                          "resource=\"memory\"", "counter",
+                                          "Time in which all processes of the container were "
+                                          "stalled on the resource",
+                                          "memory_pressure_full_seconds"},
+    [STATS_IO_PRESSURE_FULL_TOTAL] = {"container_pressure_full_seconds_total", "resource=\"io\"",
+                                      NULL, NULL, "io_pressure_full_seconds"},
+    [STATS_PIDS] = {"container_pids", NULL, "gauge", "Processes and threads of the container",
+                    "pids"},
+    [STATS_NET_RX_BYTES] = {"container_network_receive_bytes_total", NULL, "counter",
+                            "Bytes received by the container", "network_receive_bytes"},
+    [STATS_NET_TX_BYTES] = {"container_network_transmit_bytes_total", NULL, "counter",
+                            "Bytes sent by the container", "network_transmit_bytes"},
+    [STATS_NET_RX_PACKETS] = {"container_network_receive_packets_total", NULL, "counter",
+                              "Packets received by the container", "network_receive_packets"},
+    [STATS_NET_TX_PACKETS] = {"container_network_transmit_packets_total", NULL, "counter",
+                              "Packets sent by the container", "network_transmit_packets"},
+};
+
+// Files in the cgroup of a container
+static const char *const cgroup_files[] = {
+    [STATS_FILE_EVENTS] = "cgroup.events",
+    [STATS_FILE_CPU_STAT] = "cpu.stat",
+    [STATS_FILE_MEMORY_CURRENT] = "memory.current",
+    [STATS_FILE_MEMORY_MAX] = "memory.max",
+    [STATS_FILE_MEMORY_STAT] = "memory.stat",
+    [STATS_FILE_IO_STAT] = "io.stat",
+    [STATS_FILE_CPU_PRESSURE] = "cpu.pressure",
+    [STATS_FILE_MEMORY_PRESSURE] = "memory.pressure",
+    [STATS_FILE_IO_PRESSURE] = "io.pressure",
+    [STATS_FILE_PIDS_CURRENT] = "pids.current",
+};
+
+// Counters of the host side of the veth pair, what it receives the container sends
+static const char *const net_files[] = {
+    [STATS_FILE_RX_BYTES] = "tx_bytes",
+    [STATS_FILE_TX_BYTES] = "rx_bytes",
+    [STATS_FILE_RX_PACKETS] = "tx_packets",
+    [STATS_FILE_TX_PACKETS] = "rx_packets",
+};
+
+struct StatsKey
+{
+    const char *key;
+    enum StatsMetric metric;
+    double scale;
+};
+
+static const struct StatsKey cpu_keys[] = {
+    {"usage_usec", STATS_CPU_USAGE, 1e-6},
+    {"user_usec", STATS_CPU_USER, 1e-6},
+    {"system_usec", STATS_CPU_SYSTEM, 1e-6},
+    {"nr_throttled", STATS_CPU_THROTTLED_PERIODS, 1},
+    {"throttled_usec", STATS_CPU_THROTTLED, 1e-6},
+};
+
+static const struct StatsKey memory_keys[] = {
+    {"anon", STATS_MEMORY_ANON, 1},         {"file", STATS_MEMORY_FILE, 1},
+    {"kernel", STATS_MEMORY_KERNEL, 1},     {"shmem", STATS_MEMORY_SHMEM, 1},
+    {"pgfault", STATS_PAGE_FAULTS, 1},      {"pgmajfault", STATS_MAJOR_PAGE_FAULTS, 1},
+};
+
+void stats_init(struct Stats *stats)
+{
+    stats->parent = NULL;
+    stats->containers = NULL;
+}
+
+// Opens the files of the container which are not open yet
+static void stats_open(struct Stats *stats, struct StatsContainer *container)
+{
+    int cgroup_fd = openat(dirfd(stats->parent), container->id, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (int i = 0; i < STATS_FILES; i++)
+    {
+        if (container->fds[i] != -1)
+            continue;
+        if (i < STATS_FILE_RX_BYTES)
+        {
+            if (cgroup_fd != -1)
+                container->fds[i] = openat(cgroup_fd, cgroup_files[i], O_RDONLY | O_CLOEXEC);
+        }
+        else
+        {
+            char path[PATH_MAX];
+            strformat(path, PATH_MAX, "/sys/class/net/vb%s/statistics/%s", container->id,
+                      net_files[i]);
+            container->fds[i] = open(path, O_RDONLY | O_CLOEXEC);
+        }
+    }
+    if (cgroup_fd != -1)
+        close(cgroup_fd);
+}
+
+static void stats_close(struct StatsContainer *container)
+{
+    for (int i = 0; i < STATS_FILES; i++)
+    {
+        if (container->fds[i] != -1)
+            close(container->fds[i]);
+    }
+    free(container);
+}
+
+// Reads file of container into buffer, returns NULL if it cannot be read
+static char *stats_read(const struct StatsContainer *container, enum StatsFile file, char *buffer)
+{
+    if (container->fds[file] == -1)
+        return NULL;
+    ssize_t n = pread(container->fds[file], buffer, STATS_READ_SIZE - 1, 0);
+    if (n <= 0)
+        return NULL;
+    buffer[n] = '\0';
+    return buffer;
+}
+
+// Sets metric to the single number in file, which is NAN if it is "max"
+static void stats_read_value(struct StatsContainer *container, enum StatsFile file,
+                             enum StatsMetric metric, char *buffer)
+{
+    if (stats_read(container, file, buffer) != NULL)
+        container->values[metric] = strncmp(buffer, "max", 3) == 0 ? NAN : strtod(buffer, NULL);
+}
+
+// Sets the metrics of the "key value" lines of file
+static void stats_read_keyed(struct StatsContainer *container, enum StatsFile file,
+                             const struct StatsKey *keys, int count, char *buffer)
+{
+    if (stats_read(container, file, buffer) == NULL)
+        return;
+    char *saveptr;
+    for (char *line = strtok_r(buffer, "\n", &saveptr); line != NULL;
+         line = strtok_r(NULL, "\n", &saveptr))
+    {
+        char *value = strchr(line, ' ');
+        if (value == NULL)
+            continue;
+        *value++ = '\0';
+        for (int i = 0; i < count; i++)
+        {
+            if (strcmp(line, keys[i].key) == 0)
+                container->values[keys[i].metric] = strtod(value, NULL) * keys[i].scale;
+        }
+    }
+}
+
+// Sums the "MAJ:MIN rbytes=... wbytes=... rios=... wios=..." lines of io.stat
+static void stats_read_io(struct StatsContainer *container, char *buffer)
+{
+    if (stats_read(container, STATS_FILE_IO_STAT, buffer) == NULL)
+        return;
+    const char *keys[] = {"rbytes=", "wbytes=", "rios=", "wios="};
+    const enum StatsMetric io_metrics[] = {STATS_IO_READ_BYTES, STATS_IO_WRITE_BYTES,
+                                           STATS_IO_READS, STATS_IO_WRITES};
+    for (int i = 0; i < 4; i++)
+    {
+        container->values[io_metrics[i]] = 0;
+        for (char *field = strstr(buffer, keys[i]); field != NULL;
+             field = strstr(field + 1, keys[i]))
+        {
+            container->values[io_metrics[i]] += strtod(field + strlen(keys[i]), NULL);
+        }
+    }
+}
+
+// Reads "some avg10=... avg60=... avg300=... total=..." and the same for full, full is -1 for
+// the CPU
+static void stats_read_pressure(struct StatsContainer *container, enum StatsFile file,
+                                enum StatsMetric avg10, enum StatsMetric total, int full,
+                                char *buffer)
+{
+    if (stats_read(container, file, buffer) == NULL)
+        return;
+    double some_avg10;
+    unsigned long long some_total;
+    if (sscanf(buffer, "some avg10=%lf avg60=%*f avg300=%*f total=%llu", &some_avg10,
+               &some_total) == 2)
+    {
+        container->values[avg10] = some_avg10;
+        container->values[total] = some_total * 1e-6;
+    }
+    char *line = strstr(buffer, "full ");
+    unsigned long long full_total;
+    if (full != -1 && line != NULL &&
+        sscanf(line, "full avg10=%*f avg60=%*f avg300=%*f total=%llu", &full_total) == 1)
+        container->values[full] = full_total * 1e-6;
+}
+
+static void stats_read_all(struct StatsContainer *container)
+{
+    char buffer[STATS_READ_SIZE];
+    container->previous_time = container->time;
+    memcpy(container->previous, container->values, sizeof(container->values));
+    container->time = trace_now();
+    for (int i = 0; i < STATS_METRICS; i++)
+    {
+        container->values[i] = NAN;
+    }
+    stats_read_keyed(container, STATS_FILE_CPU_STAT, cpu_keys,
+                     sizeof(cpu_keys) / sizeof(cpu_keys[0]), buffer);
+    stats_read_value(container, STATS_FILE_MEMORY_CURRENT, STATS_MEMORY_USAGE, buffer);
+    stats_read_value(container, STATS_FILE_MEMORY_MAX, STATS_MEMORY_LIMIT, buffer);
+    stats_read_keyed(container, STATS_FILE_MEMORY_STAT, memory_keys,
+                     sizeof(memory_keys) / sizeof(memory_keys[0]), buffer);
+    stats_read_io(container, buffer);
+    stats_read_pressure(container, STATS_FILE_CPU_PRESSURE, STATS_CPU_PRESSURE,
+                        STATS_CPU_PRESSURE_TOTAL, -1, buffer);
+    stats_read_pressure(container, STATS_FILE_MEMORY_PRESSURE, STATS_MEMORY_PRESSURE,
+                        STATS_MEMORY_PRESSURE_TOTAL, STATS_MEMORY_PRESSURE_FULL_TOTAL, buffer);
+    stats_read_pressure(container, STATS_FILE_IO_PRESSURE, STATS_IO_PRESSURE,
+                        STATS_IO_PRESSURE_TOTAL, STATS_IO_PRESSURE_FULL_TOTAL, buffer);
+    stats_read_value(container, STATS_FILE_PIDS_CURRENT, STATS_PIDS, buffer);
+    for (int i = STATS_FILE_RX_BYTES; i <= STATS_FILE_TX_PACKETS; i++)
+    {
+        stats_read_value(container, i, STATS_NET_RX_BYTES + (i - STATS_FILE_RX_BYTES), buffer);
+    }
+    container->samples++;
+}
+
+// @brief Samples the running containers, or only those in ids if it is not NULL
+// @details Containers are found in the cgroup CGROUP_PARENT, the files of those seen for the
+// first time are opened and those of the containers which are gone are closed. Returns the
+// number of containers sampled.
+int stats_sample(struct Stats *stats, char *const ids[], int ids_count)
+{
+    if (stats->parent == NULL)
+    {
+        const char *root = cgroup_root();
+        char path[PATH_MAX];
+        if (root == NULL)
+            return 0;
+        strformat(path, PATH_MAX, "%s/" CGROUP_PARENT, root);
+        // Created along with the first container
+        stats->parent = opendir(path);
+        if (stats->parent == NULL)
+            return 0;
+    }
+    struct StatsContainer *old = stats->containers;
+    struct StatsContainer **tail = &stats->containers;
+    *tail = NULL;
+    int count = 0;
+    rewinddir(stats->parent);
+    struct dirent *entry;
+    while ((entry = readdir(stats->parent)) != NULL)
+    {
+        if (entry->d_type != DT_DIR || entry->d_name[0] == '.')
+            continue;
+        int wanted = ids == NULL;
+        for (int i = 0; i < ids_count && !wanted; i++)
+        {
+            wanted = strcmp(ids[i], entry->d_name) == 0;
+        }
+        if (!wanted)
+            continue;
+        struct StatsContainer *container = NULL;
+        for (struct StatsContainer **p = &old; *p != NULL; p = &(*p)->next)
+        {
+            if (strcmp((*p)->id, entry->d_name) == 0)
+            {
+                container = *p;
+                *p = container->next;
+                break;
+            }
+        }
+        if (container == NULL)
+        {
+            container = safe_malloc(sizeof(struct StatsContainer));
+            memset(container, 0, sizeof(struct StatsContainer));
+            strformat(container->id, sizeof(container->id), "%s", entry->d_name);
+            for (int i = 0; i < STATS_FILES; i++)
+            {
+                container->fds[i] = -1;
+            }
+            for (int i = 0; i < STATS_METRICS; i++)
+            {
+                container->values[i] = NAN;
+            }
+        }
+        if (container->samples < STATS_OPEN_RETRIES)
+            stats_open(stats, container);
+        char events[STATS_READ_SIZE];
+        container->populated = stats_read(container, STATS_FILE_EVENTS, events) != NULL &&
+                               strstr(events, "populated 1") != NULL;
+        if (container->populated)
+        {
+            stats_read_all(container);
+            count++;
+        }
+        container->next = NULL;
+        *tail = container;
+        tail = &container->next;
+    }
+    // The containers left have exited
+    while (old != NULL)
+    {
+        struct StatsContainer *next = old->next;
+        stats_close(old);
+        old = next;
+    }
+    return count;
+}
+
+void stats_free(struct Stats *stats)
+{
+    while (stats->containers != NULL)
+    {
+        struct StatsContainer *next = stats->containers->next;
+        stats_close(stats->containers);
+        stats->containers = next;
+    }
+    if (stats->parent != NULL)
+        closedir(stats->parent);
+    stats->parent = NULL;
+}
+
+// Change of metric per second since the previous sample, NAN if there is none
+static double stats_rate(const struct StatsContainer *container, enum StatsMetric metric)
+{
+    if (container->previous_time == 0 || container->time == container->previous_time)
+        return NAN;
+    return (container->values[metric] - container->previous[metric]) /
+           ((container->time - container->previous_time) / 1e9);
+}
+
+// Formats bytes like 12.3MiB, or - if unknown
+static void stats_format_bytes(char *buffer, size_t size, double bytes, const char *suffix)
+{
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int unit = 0;
+    if (isnan(bytes))
+    {
+        strformat(buffer, size, "-");
+        return;
+    }
+    while (bytes >= 1024 && unit < 4)
+    {
+        bytes /= 1024;
+        unit++;
+    }
+    strformat(buffer, size, unit == 0 ? "%.0f%s%s" : "%.1f%s%s", bytes, units[unit], suffix);
+}
+
+static int compare_cpu(const void *a, const void *b)
+{
+    double x = stats_rate(*(struct StatsContainer *const *)a, STATS_CPU_USAGE);
+    double y = stats_rate(*(struct StatsContainer *const *)b, STATS_CPU_USAGE);
+    x = isnan(x) ? -1 : x;
+    y = isnan(y) ? -1 : y;
+    return (x < y) - (x > y);
+}
+
+// Shows the containers as a table in place of the previous one, busiest first
+static void stats_print_top(const struct Stats *stats, int count)
+{
+    struct StatsContainer **sorted = safe_malloc((count + 1) * sizeof(struct StatsContainer *));
+    int n = 0;
+    for (struct StatsContainer *c = stats->containers; c != NULL; c = c->next)
+    {
+        if (c->populated)
+            sorted[n++] = c;
+    }
+    qsort(sorted, n, sizeof(struct StatsContainer *), compare_cpu);
+    // Home and clear the screen
+    printf("\033[H\033[2J");
+    printf("%-12s %7s %21s %6s %21s %21s %17s\n", "CONTAINER ID", "CPU %", "MEM USAGE / LIMIT",
+           "PIDS", "NET RX / TX", "IO READ / WRITE", "PSI CPU MEM IO");
+    for (int i = 0; i < n; i++)
+    {
+        struct StatsContainer *c = sorted[i];
+        char cpu[16];
+        char memory[32];
+        char limit[16];
+        char pids[16];
+        char network[2][16];
+        char io[2][16];
+        char pressure[32];
+        double usage = stats_rate(c, STATS_CPU_USAGE);
+        strformat(cpu, sizeof(cpu), isnan(usage) ? "-" : "%.1f%%", usage * 100);
+        stats_format_bytes(memory, sizeof(memory), c->values[STATS_MEMORY_USAGE], "");
+        stats_format_bytes(limit, sizeof(limit), c->values[STATS_MEMORY_LIMIT], "");
+        strformat(memory + strlen(memory), sizeof(memory) - strlen(memory), " / %s",
+                  isnan(c->values[STATS_MEMORY_LIMIT]) ? "max" : limit);
+        strformat(pids, sizeof(pids), isnan(c->values[STATS_PIDS]) ? "-" : "%.0f",
+                  c->values[STATS_PIDS]);
+        stats_format_bytes(network[0], 16, stats_rate(c, STATS_NET_RX_BYTES), "/s");
+        stats_format_bytes(network[1], 16, stats_rate(c, STATS_NET_TX_BYTES), "/s");
+        stats_format_bytes(io[0], 16, stats_rate(c, STATS_IO_READ_BYTES), "/s");
+        stats_format_bytes(io[1], 16, stats_rate(c, STATS_IO_WRITE_BYTES), "/s");
+        strformat(pressure, sizeof(pressure), "%5.1f %5.1f %5.1f", c->values[STATS_CPU_PRESSURE],
+                  c->values[STATS_MEMORY_PRESSURE], c->values[STATS_IO_PRESSURE]);
+        printf("%-12s %7s %21s %6s %10s / %8s %10s / %8s %17s\n", c->id, cpu, memory, pids,
+               network[0], network[1], io[0], io[1], pressure);
+    }
+    fflush(stdout);
+    free(sorted);
+}
+
+// Prints a JSON object per container, with the metrics it has and the rates since the previous
+// sample
+static void stats_print_json(const struct Stats *stats)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    const char *rate_keys[] = {"cpu_percent", "network_receive_bytes_per_second",
+                               "network_transmit_bytes_per_second", "io_read_bytes_per_second",
+                               "io_written_bytes_per_second"};
+    const enum StatsMetric rate_metrics[] = {STATS_CPU_USAGE, STATS_NET_RX_BYTES,
+                                             STATS_NET_TX_BYTES, STATS_IO_READ_BYTES,
+                                             STATS_IO_WRITE_BYTES};
+    for (struct StatsContainer *c = stats->containers; c != NULL; c = c->next)
+    {
+        if (!c->populated)
+            continue;
+        printf("{\"time\": %.3f, \"id\": \"%s\"", now.tv_sec + now.tv_nsec / 1e9, c->id);
+        if (c->image[0] != '\0')
+            printf(", \"image\": \"%s\"", c->image);
+        for (int i = 0; i < STATS_METRICS; i++)
+        {
+            if (!isnan(c->values[i]))
+                printf(", \"%s\": %.15g", metrics[i].key, c->values[i]);
+        }
+        for (int i = 0; i < 5; i++)
+        {
+            double rate = stats_rate(c, rate_metrics[i]) * (i == 0 ? 100 : 1);
+            if (!isnan(rate))
+                printf(", \"%s\": %.15g", rate_keys[i], rate);
+        }
+        printf("}\n");
+    }
+    fflush(stdout);
+}
+
+// Prints the last sample in the Prometheus text exposition format
+void stats_print_prometheus(FILE *out, const struct Stats *stats)
+{
+    for (int i = 0; i < STATS_METRICS; i++)
+    {
+        // Metrics which no container has, e.g. those of disabled controllers, are left out
+        int family = i;
+        while (metrics[family].help == NULL)
+            family--;
+        int found = 0;
+        for (int j = family; j < STATS_METRICS && (j == family || metrics[j].help == NULL); j++)
+        {
+            for (struct StatsContainer *c = stats->containers; c != NULL; c = c->next)
+            {
+                found |= c->populated && !isnan(c->values[j]);
+            }
+        }
+        if (!found)
+            continue;
+        if (family == i)
+        {
+            fprintf(out, "# HELP %s %s\n", metrics[i].name, metrics[i].help);
+            fprintf(out, "# TYPE %s %s\n", metrics[i].name, metrics[i].type);
+        }
+        for (struct StatsContainer *c = stats->containers; c != NULL; c = c->next)
+        {
+            if (!c->populated || isnan(c->values[i]))
+                continue;
+            fprintf(out, "%s{id=\"%s\"", metrics[i].name, c->id);
+            if (c->image[0] != '\0')
+                fprintf(out, ",image=\"%s\"", c->image);
+            if (metrics[i].labels != NULL)
+                fprintf(out, ",%s", metrics[i].labels);
+            fprintf(out, "} %.15g\n", c->values[i]);
+        }
+    }
+}
+
+// Replaces path with the exposition of the last sample, - is stdout
+static void stats_write_prometheus(const char *path, const struct Stats *stats)
+{
+    if (strcmp(path, "-") == 0)
+    {
+        stats_print_prometheus(stdout, stats);
+        fflush(stdout);
+        return;
+    }
+    // Scrapers never see half a file
+    char tmp[PATH_MAX];
+    strformat(tmp, PATH_MAX, "%s.tmp", path);
+    FILE *out = fopen(tmp, "we");
+    if (out == NULL)
+    {
+        errorMessage("Could not create %s\n", tmp);
+    }
+    stats_print_prometheus(out, stats);
+    if (fclose(out) != 0 || rename(tmp, path) == -1)
+    {
+        errorMessage("Could not write %s\n", path);
+    }
+}
+
+static void stats_usage(void)
+{
+    printf("Usage: ./container stats [options] [container_id...]\n");
+    printf("options:\n");
+    printf("  --json                Print a JSON object per container and sample instead of "
+           "the\n");
+    printf("                        table\n");
+    printf("  --prometheus=<file>   Write each sample to file (- for stdout) in the Prometheus "
+           "text\n");
+    printf("                        format instead of showing the table\n");
+    printf("  --interval=<seconds>  Time between samples (default 1)\n");
+    printf("  --count=<n>           Stop after n samples\n");
+    printf("  --daemon              Print the Prometheus exposition of the containers of the "
+           "daemon\n");
+    exit(1);
+}
+
+/*
+ * @short Samples the resource usage of the running containers until interrupted
+ * @param argc number of arguments after the stats subcommand
+ * @param argv arguments after the stats subcommand
+ */
+void cmd_stats(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"json", no_argument, NULL, 'j'},
+        {"prometheus", required_argument, NULL, 'P'},
+        {"interval", required_argument, NULL, 'i'},
+        {"count", required_argument, NULL, 'n'},
+        {"daemon", no_argument, NULL, 'd'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    int json = 0;
+    const char *prometheus = NULL;
+    double interval = 1;
+    long count = 0;
+    // argv[-1] is the stats subcommand, getopt skips it like a program name
+    optind = 1;
+    int opt;
+    while ((opt = getopt_long(argc + 1, argv - 1, "h", long_options, NULL)) != -1)
+    {
+        char *end;
+        switch (opt)
+        {
+        case 'j':
+            json = 1;
+            break;
+        case 'P':
+            prometheus = optarg;
+            break;
+        case 'i':
+            interval = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || interval <= 0)
+            {
+                fprintf(stderr, "Invalid value %s for --interval\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'n':
+            count = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || count < 1)
+            {
+                fprintf(stderr, "Invalid value %s for --count\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'd':
+            daemon_stats();
+            return;
+        default:
+            stats_usage();
+        }
+    }
+    char **ids = optind - 1 < argc ? argv + optind - 1 : NULL;
+    int ids_count = argc - (optind - 1);
+
+    struct Stats stats;
+    stats_init(&stats);
+    uint64_t interval_ns = (uint64_t)(interval * 1e9);
+    uint64_t next = trace_now();
+    for (long i = 0; count == 0 || i < count; i++)
+    {
+        int sampled = stats_sample(&stats, ids, ids_count);
+        if (json)
+            stats_print_json(&stats);
+        if (prometheus != NULL)
+            stats_write_prometheus(prometheus, &stats);
+        if (!json && prometheus == NULL)
+            stats_print_top(&stats, sampled);
+        if (i + 1 == count)
+            break;
+        // Sampling does not make the interval drift
+        next += interval_ns;
+        struct timespec deadline = {.tv_sec = next / 1000000000, .tv_nsec = next % 1000000000};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+            ;
+    }
+    stats_free(&stats);
+}
@@ -0,0 +1,97 @@
+#ifndef CONTAINER_STATS_H
+#define CONTAINER_STATS_H
+// Resource usage of running containers, sampled from their cgroups and veth interfaces
+#include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum StatsMetric
+{
+    STATS_CPU_USAGE,
+    STATS_CPU_USER,
+    STATS_CPU_SYSTEM,
+    STATS_CPU_THROTTLED,
+    STATS_CPU_THROTTLED_PERIODS,
+    STATS_MEMORY_USAGE,
+    STATS_MEMORY_LIMIT,
+    STATS_MEMORY_ANON,
+    STATS_MEMORY_FILE,
+    STATS_MEMORY_KERNEL,
+    STATS_MEMORY_SHMEM,
+    STATS_PAGE_FAULTS,
+    STATS_MAJOR_PAGE_FAULTS,
+    STATS_IO_READ_BYTES,
+    STATS_IO_WRITE_BYTES,
+    STATS_IO_READS,
+    STATS_IO_WRITES,
+    STATS_CPU_PRESSURE,
+    STATS_MEMORY_PRESSURE,
+    STATS_IO_PRESSURE,
+    STATS_CPU_PRESSURE_TOTAL,
+    STATS_MEMORY_PRESSURE_TOTAL,
+    STATS_IO_PRESSURE_TOTAL,
+    STATS_MEMORY_PRESSURE_FULL_TOTAL,
+    STATS_IO_PRESSURE_FULL_TOTAL,
+    STATS_PIDS,
+    STATS_NET_RX_BYTES,
+    STATS_NET_TX_BYTES,
+    STATS_NET_RX_PACKETS,
+    STATS_NET_TX_PACKETS,
+    STATS_METRICS
+};
+
+// Files of a container which are kept open and read again for every sample
+enum StatsFile
+{
+    STATS_FILE_EVENTS,
+    STATS_FILE_CPU_STAT,
+    STATS_FILE_MEMORY_CURRENT,
+    STATS_FILE_MEMORY_MAX,
+    STATS_FILE_MEMORY_STAT,
+    STATS_FILE_IO_STAT,
+    STATS_FILE_CPU_PRESSURE,
+    STATS_FILE_MEMORY_PRESSURE,
+    STATS_FILE_IO_PRESSURE,
+    STATS_FILE_PIDS_CURRENT,
+    STATS_FILE_RX_BYTES,
+    STATS_FILE_TX_BYTES,
+    STATS_FILE_RX_PACKETS,
+    STATS_FILE_TX_PACKETS,
+    STATS_FILES
+};
+
+struct StatsContainer
+{
+    char id[NAME_MAX + 1];
+    // Image of the container if the sampler knows it, empty otherwise
+    char image[NAME_MAX + 1];
+    // -1 for the files the container does not have, e.g. memory.* without the memory controller
+    int fds[STATS_FILES];
+    // Samples the container has been in, files which appear late are only looked for at first
+    int samples;
+    // Whether the cgroup has processes, cgroups left behind by containers which did not clean up
+    // are kept open but not sampled
+    int populated;
+    // CLOCK_MONOTONIC nanoseconds of the last two samples
+    uint64_t time;
+    uint64_t previous_time;
+    // NAN for the metrics which are unknown
+    double values[STATS_METRICS];
+    double previous[STATS_METRICS];
+    struct StatsContainer *next;
+};
+
+struct Stats
+{
+    // cgroup of all containers, NULL if there is no cgroup v2 hierarchy
+    DIR *parent;
+    struct StatsContainer *containers;
+};
+
+void stats_init(struct Stats *stats);
+int stats_sample(struct Stats *stats, char *const ids[], int ids_count);
+void stats_free(struct Stats *stats);
+void stats_print_prometheus(FILE *out, const struct Stats *stats);
+void cmd_stats(int argc, char *argv[]);
+#endif // CONTAINER_STATS_H
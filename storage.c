@@ -0,0 +1,379 @@
+#define _GNU_SOURCE
+#include "storage.h"
+#include "container.h"
+#include "utils.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <linux/fs.h>
+#include <linux/magic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+// The overlay driver mounts the image as the lowerdir of an overlay, the others give every
+// container its own copy of the image in <container_dir>/rootfs, which is bind mounted as its
+// root. Their copies share the blocks of the image until they are written, so only the blocks
+// which are modified get copied rather than whole files.
+// References:
+// https://man7.org/linux/man-pages/man2/ioctl_ficlone.2.html
+// https://btrfs.readthedocs.io/en/latest/Subvolumes.html
+
+// Directory (in CONTAINER_PATH) of the btrfs subvolumes holding the images
+#define SNAPSHOT_DIR "__snapshots"
+#define ROOTFS "rootfs"
+
+// Files with several links are linked again in the copy instead of being cloned twice
+struct StorageLink
+{
+    dev_t dev;
+    ino_t ino;
+    char *path;
+};
+
+struct StorageClone
+{
+    // The directory being copied and its copy
+    const char *source;
+    int root_fd;
+    struct StorageLink *links;
+    int links_count;
+};
+
+int storage_parse(const char *value, enum StorageDriver *driver)
+{
+    if (strcmp(value, "overlay") == 0)
+        *driver = STORAGE_OVERLAY;
+    else if (strcmp(value, "reflink") == 0)
+        *driver = STORAGE_REFLINK;
+    else if (strcmp(value, "btrfs") == 0)
+        *driver = STORAGE_BTRFS;
+    else
+        return -1;
+    return 0;
+}
+
+static void storage_fail(const struct StorageClone *clone, const char *path, const char *what)
+{
+    fprintf(stderr, "Could not %s %s/%s: %s\n", what, clone->source, path, strerror(errno));
+    exit(1);
+}
+
+// Copies the extended attributes of in to out, e.g. security.capability
+static void storage_copy_xattrs(const struct StorageClone *clone, const char *path, int in,
+                                int out)
+{
+    char names[4096];
+    char value[4096];
+    ssize_t length = flistxattr(in, names, sizeof(names));
+    if (length == -1 && (errno == ENOTSUP || errno == EOPNOTSUPP))
+        return;
+    if (length == -1)
+        storage_fail(clone, path, "list the attributes of");
+    for (char *name = names; name < names + length; name += strlen(name) + 1)
+    {
+        ssize_t size = fgetxattr(in, name, value, sizeof(value));
+        if (size == -1 || fsetxattr(out, name, value, size, 0) == -1)
+            storage_fail(clone, path, "copy the attributes of");
+    }
+}
+
+// Gives the copy the owner, permissions and times of the original. The owner comes first since
+// chown() clears the setuid bits.
+static void storage_copy_metadata(const struct StorageClone *clone, const char *path, int in,
+                                  int out, const struct stat *st)
+{
+    struct timespec times[2] = {st->st_atim, st->st_mtim};
+    storage_copy_xattrs(clone, path, in, out);
+    if (fchown(out, st->st_uid, st->st_gid) == -1 || fchmod(out, st->st_mode & 07777) == -1 ||
+        futimens(out, times) == -1)
+        storage_fail(clone, path, "copy the metadata of");
+}
+
+// Copies the directory src_fd into dst_fd. path is the path of the directory relative to the
+// root of the copy.
+static void storage_clone_directory(struct StorageClone *clone, int src_fd, int dst_fd,
+                                    const char *path)
+{
+    DIR *dir = fdopendir(dup(src_fd));
+    if (dir == NULL)
+        storage_fail(clone, path, "read");
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        const char *name = ent->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        char child[PATH_MAX];
+        strformat(child, PATH_MAX, "%s%s%s", path, path[0] == '\0' ? "" : "/", name);
+        struct stat st;
+        if (fstatat(src_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            storage_fail(clone, child, "stat");
+
+        if (S_ISREG(st.st_mode) && st.st_nlink > 1)
+        {
+            int found = 0;
+            for (int i = 0; i < clone->links_count && !found; i++)
+            {
+                struct StorageLink *link = &clone->links[i];
+                if (link->dev != st.st_dev || link->ino != st.st_ino)
+                    continue;
+                if (linkat(clone->root_fd, link->path, dst_fd, name, 0) == -1)
+                    storage_fail(clone, child, "link");
+                found = 1;
+            }
+            if (found)
+                continue;
+            clone->links = realloc(clone->links,
+                                   (clone->links_count + 1) * sizeof(struct StorageLink));
+            if (clone->links == NULL)
+            {
+                errorMessage("%s\n", "realloc() failed");
+            }
+            clone->links[clone->links_count++] =
+                (struct StorageLink){.dev = st.st_dev, .ino = st.st_ino, .path = strdup(child)};
+        }
+
+        if (S_ISDIR(st.st_mode))
+        {
+            if (mkdirat(dst_fd, name, 0700) == -1)
+                storage_fail(clone, child, "create");
+            int in = openat(src_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            int out = openat(dst_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (in == -1 || out == -1)
+                storage_fail(clone, child, "open");
+            storage_clone_directory(clone, in, out, child);
+            // Last, so that neither the permissions nor the times get in the way of the copy
+            storage_copy_metadata(clone, child, in, out, &st);
+            close(in);
+            close(out);
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            int in = openat(src_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            int out = openat(dst_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                             0600);
+            if (in == -1 || out == -1)
+                storage_fail(clone, child, "open");
+            // The copy shares all the blocks of the original
+            if (ioctl(out, FICLONE, in) == -1)
+            {
+                fprintf(stderr, "Could not reflink %s/%s: %s\n", clone->source, child,
+                        strerror(errno));
+                fprintf(stderr, "The extracted image and the containers must be on the same "
+                                "XFS or btrfs filesystem\n");
+                exit(1);
+            }
+            storage_copy_metadata(clone, child, in, out, &st);
+            close(in);
+            close(out);
+        }
+        else if (S_ISLNK(st.st_mode))
+        {
+            char target[PATH_MAX];
+            ssize_t length = readlinkat(src_fd, name, target, sizeof(target) - 1);
+            if (length == -1)
+                storage_fail(clone, child, "read");
+            target[length] = '\0';
+            struct timespec times[2] = {st.st_atim, st.st_mtim};
+            if (symlinkat(target, dst_fd, name) == -1 ||
+                fchownat(dst_fd, name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) == -1 ||
+                utimensat(dst_fd, name, times, AT_SYMLINK_NOFOLLOW) == -1)
+                storage_fail(clone, child, "copy");
+        }
+        else
+        {
+            // Device nodes, FIFOs and sockets
+            if (mknodat(dst_fd, name, st.st_mode, st.st_rdev) == -1)
+                storage_fail(clone, child, "copy");
+            struct timespec times[2] = {st.st_atim, st.st_mtim};
+            if (fchownat(dst_fd, name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) == -1 ||
+                fchmodat(dst_fd, name, st.st_mode & 07777, 0) == -1 ||
+                utimensat(dst_fd, name, times, AT_SYMLINK_NOFOLLOW) == -1)
+                storage_fail(clone, child, "copy");
+        }
+    }
+    closedir(dir);
+}
+
+// Copies the directory source into the new directory name of parent_fd, with reflinks
+static void storage_clone_tree(const char *source, int parent_fd, const char *name)
+{
+    struct StorageClone clone = {.source = source};
+    int src_fd = open(source, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    if (src_fd == -1 || fstat(src_fd, &st) == -1)
+    {
+        errorMessage("Could not open %s\n", source);
+    }
+    if (mkdirat(parent_fd, name, 0700) == -1 && errno != EEXIST)
+    {
+        errorMessage("Could not create %s\n", name);
+    }
+    clone.root_fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (clone.root_fd == -1)
+    {
+        errorMessage("Could not open %s\n", name);
+    }
+    storage_clone_directory(&clone, src_fd, clone.root_fd, "");
+    storage_copy_metadata(&clone, ".", src_fd, clone.root_fd, &st);
+    for (int i = 0; i < clone.links_count; i++)
+    {
+        free(clone.links[i].path);
+    }
+    free(clone.links);
+    close(clone.root_fd);
+    close(src_fd);
+}
+
+// Returns a file descriptor of the read-only subvolume holding the image, creating it (under a
+// lock, along with the copy of the image in it) if this is the first btrfs container of the image
+static int storage_btrfs_image(struct Container *container)
+{
+    char dir[PATH_MAX];
+    char path[PATH_MAX];
+    strformat(dir, PATH_MAX, "%s/" SNAPSHOT_DIR, container->containers_path);
+    create_directory_exists_ok(NULL, dir, 0755);
+    const char *name = strrchr(container->image_path, '/');
+    name = name != NULL ? name + 1 : container->image_path;
+    strformat(path, PATH_MAX, "%s/%s", dir, name);
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd != -1)
+        return fd;
+
+    struct statfs st;
+    if (statfs(dir, &st) == -1 || st.f_type != BTRFS_SUPER_MAGIC)
+    {
+        fprintf(stderr, "The btrfs storage needs %s to be on btrfs\n", container->containers_path);
+        exit(1);
+    }
+    char lock[PATH_MAX];
+    strformat(lock, PATH_MAX, "%s.lock", path);
+    int lock_fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd == -1 || flock(lock_fd, LOCK_EX) == -1)
+    {
+        errorMessage("Could not lock %s\n", lock);
+    }
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd != -1)
+    {
+        close(lock_fd);
+        return fd;
+    }
+    printf("=> Creating a btrfs subvolume for the image\n");
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct btrfs_ioctl_vol_args args = {0};
+    strformat(args.name, sizeof(args.name), "%s.tmp", name);
+    // Left behind by an interrupted run
+    struct btrfs_ioctl_vol_args destroy = args;
+    ioctl(dir_fd, BTRFS_IOC_SNAP_DESTROY, &destroy);
+    if (dir_fd == -1 || ioctl(dir_fd, BTRFS_IOC_SUBVOL_CREATE, &args) == -1)
+    {
+        errorMessage("Could not create the subvolume %s/%s\n", dir, args.name);
+    }
+    storage_clone_tree(container->image_path, dir_fd, args.name);
+    // Read-only, so that it stays what the image is
+    int subvolume = openat(dir_fd, args.name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    __u64 flags = BTRFS_SUBVOL_RDONLY;
+    if (subvolume == -1 || ioctl(subvolume, BTRFS_IOC_SUBVOL_SETFLAGS, &flags) == -1 ||
+        renameat(dir_fd, args.name, dir_fd, name) == -1)
+    {
+        errorMessage("Could not create the subvolume %s\n", path);
+    }
+    close(dir_fd);
+    close(lock_fd);
+    return subvolume;
+}
+
+// @brief Creates the root filesystem of the container before it is cloned, if the driver needs
+// one of its own
+// @details container->image_path must be set, the reflink and btrfs drivers need it to be a
+// single directory
+void storage_create(struct Container *container)
+{
+    if (container->storage == STORAGE_OVERLAY)
+        return;
+    struct stat st;
+    if (strchr(container->image_path, ':') != NULL || stat(container->image_path, &st) == -1 ||
+        !S_ISDIR(st.st_mode))
+    {
+        fprintf(stderr, "The %s storage needs an image extracted into a single directory\n",
+                container->storage == STORAGE_BTRFS ? "btrfs" : "reflink");
+        exit(1);
+    }
+    int dir_fd = open(container->container_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+    {
+        errorMessage("Could not open %s\n", container->container_dir);
+    }
+    if (container->storage == STORAGE_REFLINK)
+    {
+        storage_clone_tree(container->image_path, dir_fd, ROOTFS);
+    }
+    else
+    {
+        int image_fd = storage_btrfs_image(container);
+        struct btrfs_ioctl_vol_args_v2 args = {.fd = image_fd};
+        strformat(args.name, sizeof(args.name), ROOTFS);
+        if (ioctl(dir_fd, BTRFS_IOC_SNAP_CREATE_V2, &args) == -1)
+        {
+            errorMessage("Could not snapshot the image into %s\n", container->container_dir);
+        }
+        close(image_fd);
+    }
+    close(dir_fd);
+}
+
+// @brief Mounts the root filesystem of the container, in the container
+// @return the file descriptor of the mount, detached
+int storage_mount(struct Container *container)
+{
+    if (container->storage == STORAGE_OVERLAY)
+        return container_create_overlayfs(container);
+    char *rootdir = safe_malloc(PATH_MAX);
+    char rootfs[PATH_MAX];
+    strformat(rootdir, PATH_MAX, "%s/root", container->container_dir);
+    strformat(rootfs, PATH_MAX, "%s/" ROOTFS, container->container_dir);
+    create_directory(NULL, rootdir, 0755);
+    container->root = rootdir;
+    int root_fd = open_tree(AT_FDCWD, rootfs, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+    if (root_fd == -1)
+    {
+        fprintf(stderr, "Error mounting %s: %s\n", rootfs, strerror(errno));
+        exit(1);
+    }
+    return root_fd;
+}
+
+// Deletes what storage_create() created which the removal of the directory of the container
+// does not take care of
+void storage_delete(struct Container *container)
+{
+    if (container->storage != STORAGE_BTRFS || container->container_dir == NULL)
+        return;
+    // Much faster than removing its files one by one, btrfs cleans it up in the background
+    int dir_fd = open(container->container_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+        return;
+    // The root directory of a subvolume is always the same inode, unless the snapshot was never
+    // created
+    struct stat st;
+    struct btrfs_ioctl_vol_args args = {0};
+    strformat(args.name, sizeof(args.name), ROOTFS);
+    if (fstatat(dir_fd, ROOTFS, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+        st.st_ino == BTRFS_FIRST_FREE_OBJECTID &&
+        ioctl(dir_fd, BTRFS_IOC_SNAP_DESTROY, &args) == -1)
+    {
+        perror("Could not delete the snapshot of the container");
+    }
+    close(dir_fd);
+}
@@ -0,0 +1,22 @@
+#ifndef CONTAINER_STORAGE_H
+#define CONTAINER_STORAGE_H
+// Storage drivers, which create, mount and delete the root filesystem of a container out of the
+// extracted image
+
+struct Container;
+
+enum StorageDriver
+{
+    // An overlay with the image as lowerdir, files are copied up whole on their first write
+    STORAGE_OVERLAY,
+    // A copy of the image whose files share their blocks with it (FICLONE, XFS or btrfs)
+    STORAGE_REFLINK,
+    // A btrfs snapshot of a subvolume holding the image
+    STORAGE_BTRFS,
+};
+
+int storage_parse(const char *value, enum StorageDriver *driver);
+void storage_create(struct Container *container);
+int storage_mount(struct Container *container);
+void storage_delete(struct Container *container);
+#endif // CONTAINER_STORAGE_H
@@ -0,0 +1,196 @@
+#include "trace.h"
+#include "utils.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// Probes cost a single nop when nothing is attached to them
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE1(name, a) DTRACE_PROBE1(container, name, a)
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(container, name, a, b)
+#else
+#define TRACE_PROBE1(name, a) ((void)(a))
+#define TRACE_PROBE2(name, a, b) ((void)(a), (void)(b))
+#endif
+
+#define TRACE_MAX_SPANS 1024
+#define TRACE_NAME_LENGTH 48
+
+struct TraceSpan
+{
+    char name[TRACE_NAME_LENGTH];
+    // getpid() of the process which recorded the span, 1 within the container
+    pid_t pid;
+    uint64_t begin;
+    uint64_t end;
+};
+
+// Shared between the run process and the cloned container, since both record spans
+struct TraceBuffer
+{
+    pid_t pid;
+    pid_t child_pid;
+    unsigned int count;
+    struct TraceSpan spans[TRACE_MAX_SPANS];
+};
+
+struct TraceRecord *trace_record = NULL;
+
+static struct TraceBuffer *trace_buffer = NULL;
+static const char *trace_path = NULL;
+// Begin timestamps of the phases in progress in this process
+static uint64_t phase_begin[TRACE_PHASES];
+
+static const char *const trace_event_names[TRACE_EVENTS] = {
+    [TRACE_START] = "start",
+    [TRACE_EXEC] = "exec",
+    [TRACE_EXIT] = "exit",
+    [TRACE_CLEANED] = "cleaned",
+};
+
+const char *const trace_phase_names[TRACE_PHASES] = {
+    [TRACE_CREATE] = "create",   [TRACE_EXTRACT] = "extract",
+    [TRACE_OVERLAY] = "overlay", [TRACE_MOUNTS] = "mounts",
+    [TRACE_PIVOT_ROOT] = "pivot_root", [TRACE_NETWORK] = "network",
+};
+
+uint64_t trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void trace_add_span(const char *name, uint64_t begin, uint64_t end)
+{
+    if (trace_buffer == NULL)
+        return;
+    unsigned int index = __atomic_fetch_add(&trace_buffer->count, 1, __ATOMIC_RELAXED);
+    if (index >= TRACE_MAX_SPANS)
+        return;
+    struct TraceSpan *span = &trace_buffer->spans[index];
+    strncpy(span->name, name, TRACE_NAME_LENGTH - 1);
+    span->name[TRACE_NAME_LENGTH - 1] = '\0';
+    span->pid = getpid();
+    span->begin = begin;
+    span->end = end;
+}
+
+void trace_begin(enum TracePhase phase)
+{
+    uint64_t now = trace_now();
+    phase_begin[phase] = now;
+    if (trace_record != NULL)
+        trace_record->phase_begin[phase] = now;
+    TRACE_PROBE1(phase__begin, trace_phase_names[phase]);
+}
+
+void trace_end(enum TracePhase phase)
+{
+    uint64_t now = trace_now();
+    if (trace_record != NULL)
+        trace_record->phase_end[phase] = now;
+    trace_add_span(trace_phase_names[phase], phase_begin[phase], now);
+    TRACE_PROBE2(phase__end, trace_phase_names[phase], now - phase_begin[phase]);
+}
+
+void trace_event(enum TraceEvent event)
+{
+    uint64_t now = trace_now();
+    if (trace_record != NULL)
+        trace_record->events[event] = now;
+    trace_add_span(trace_event_names[event], now, now);
+    TRACE_PROBE1(event, trace_event_names[event]);
+}
+
+// Records a span which started at begin (from trace_now()) and ends now
+void trace_span(const char *name, uint64_t begin)
+{
+    uint64_t now = trace_now();
+    trace_add_span(name, begin, now);
+    TRACE_PROBE2(span, name, now - begin);
+}
+
+// Starts recording spans, which trace_write() writes to path
+void trace_open(const char *path)
+{
+    trace_buffer = mmap(NULL, sizeof(struct TraceBuffer), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (trace_buffer == MAP_FAILED)
+    {
+        errorMessage("%s\n", "mmap() failed");
+    }
+    trace_buffer->pid = getpid();
+    trace_path = path;
+}
+
+// The container sees itself as pid 1, its spans are attributed to its pid on the host
+void trace_set_child(pid_t pid)
+{
+    if (trace_buffer != NULL)
+        trace_buffer->child_pid = pid;
+}
+
+static void write_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s != '\0'; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', out);
+        if ((unsigned char)*s >= 0x20)
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+// Writes the recorded spans as Chrome trace event JSON (chrome://tracing, ui.perfetto.dev)
+void trace_write(void)
+{
+    // Only the process which opened the trace writes it out
+    if (trace_buffer == NULL || trace_buffer->pid != getpid())
+        return;
+    FILE *out = fopen(trace_path, "w");
+    if (out == NULL)
+    {
+        perror(trace_path);
+        return;
+    }
+    fprintf(out, "{\"traceEvents\": [\n");
+    fprintf(out,
+            "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": "
+            "\"container run\"}}",
+            trace_buffer->pid);
+    if (trace_buffer->child_pid != 0)
+    {
+        fprintf(out,
+                ",\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": "
+                "{\"name\": \"container\"}}",
+                trace_buffer->child_pid);
+    }
+    unsigned int count = trace_buffer->count;
+    if (count > TRACE_MAX_SPANS)
+    {
+        fprintf(stderr, "=> Trace is missing %u spans\n", count - TRACE_MAX_SPANS);
+        count = TRACE_MAX_SPANS;
+    }
+    for (unsigned int i = 0; i < count; i++)
+    {
+        struct TraceSpan *span = &trace_buffer->spans[i];
+        pid_t pid = span->pid == trace_buffer->pid ? span->pid : trace_buffer->child_pid;
+        fprintf(out, ",\n{\"name\": ");
+        write_string(out, span->name);
+        // Zero length spans are instant events
+        if (span->end == span->begin)
+            fprintf(out, ", \"ph\": \"i\", \"s\": \"p\"");
+        else
+            fprintf(out, ", \"ph\": \"X\", \"dur\": %.3f", (span->end - span->begin) / 1e3);
+        fprintf(out, ", \"ts\": %.3f, \"pid\": %d, \"tid\": %d}", span->begin / 1e3, pid, pid);
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    printf("=> Wrote trace to %s\n", trace_path);
+}
@@ -0,0 +1,60 @@
+#ifndef CONTAINER_TRACE_H
+#define CONTAINER_TRACE_H
+// Timestamps of the phases of starting and stopping a container, recorded for the benchmark
+// (trace_record) and as spans written out in the Chrome trace event format (--trace=<file>).
+// Every phase and span also fires a USDT probe in the "container" provider, when the
+// systemtap headers are available at build time:
+//   phase__begin(name), phase__end(name, duration_ns), span(name, duration_ns),
+//   event(name)
+#include <stdint.h>
+#include <sys/types.h>
+
+enum TracePhase
+{
+    TRACE_CREATE,
+    TRACE_EXTRACT,
+    TRACE_OVERLAY,
+    TRACE_MOUNTS,
+    TRACE_PIVOT_ROOT,
+    TRACE_NETWORK,
+    TRACE_PHASES
+};
+
+// Points in the life of a container which are not part of a phase
+enum TraceEvent
+{
+    // cmd_run was entered
+    TRACE_START,
+    // The command is about to be exec'd in the container
+    TRACE_EXEC,
+    // The container has been reaped
+    TRACE_EXIT,
+    // The container has been deleted
+    TRACE_CLEANED,
+    TRACE_EVENTS
+};
+
+// CLOCK_MONOTONIC nanoseconds, 0 if the phase or event has not happened
+struct TraceRecord
+{
+    uint64_t events[TRACE_EVENTS];
+    uint64_t phase_begin[TRACE_PHASES];
+    uint64_t phase_end[TRACE_PHASES];
+};
+
+// Where timestamps are recorded, NULL when nothing is recorded. It must point into a MAP_SHARED
+// mapping, so that the timestamps taken by the cloned container are seen by the caller.
+extern struct TraceRecord *trace_record;
+
+extern const char *const trace_phase_names[TRACE_PHASES];
+
+uint64_t trace_now(void);
+void trace_begin(enum TracePhase phase);
+void trace_end(enum TracePhase phase);
+void trace_event(enum TraceEvent event);
+void trace_span(const char *name, uint64_t begin);
+
+void trace_open(const char *path);
+void trace_set_child(pid_t pid);
+void trace_write(void);
+#endif // CONTAINER_TRACE_H
@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+#include "trash.h"
+#include "config.h"
+#include "utils.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Removing a container directory can take seconds when the container wrote a lot of files. The
+// directory is renamed into containers/__trash instead, which is atomic and instant, and a
+// detached reaper process removes everything in the trash. A lock on the trash makes sure that
+// there is a single reaper at a time. Trash left behind by a reaper which was interrupted is
+// removed when the next container is created.
+//
+// The reaper removes the files of all the trees in the trash with a pool of threads, each
+// listing a directory, unlinking the files in it and queueing its subdirectories. Directories
+// are removed at the end, deepest first, once they are empty.
+
+#define TRASH_DIR "__trash"
+#define TRASH_LOCK ".lock"
+
+struct ReapDirectory
+{
+    // Relative to the trash directory
+    char *path;
+    int depth;
+};
+
+struct Reaper
+{
+    int trash_fd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // Directories which are yet to be listed, used as a stack
+    struct ReapDirectory *pending;
+    int pending_count;
+    int pending_capacity;
+    // Directories which have been listed, removed at the end
+    struct ReapDirectory *listed;
+    int listed_count;
+    int listed_capacity;
+    // Threads which are listing a directory, the reaper is done when there are none and nothing
+    // is pending
+    int busy;
+};
+
+static void trash_directory(char *buffer, const char *containers_path)
+{
+    strformat(buffer, PATH_MAX, "%s/" TRASH_DIR, containers_path);
+}
+
+// Moves path, which is below containers_path, into the trash
+void trash_move(const char *containers_path, const char *path)
+{
+    char trash[PATH_MAX];
+    trash_directory(trash, containers_path);
+    create_directory_exists_ok(NULL, trash, 0700);
+
+    const char *base = strrchr(path, '/');
+    base = base == NULL ? path : base + 1;
+    char id[9];
+    char target[PATH_MAX];
+    do
+    {
+        random_id(id, 8);
+        id[8] = '\0';
+        strformat(target, PATH_MAX, "%s/%s-%s", trash, base, id);
+    } while (rename(path, target) == -1 && errno == EEXIST);
+    if (exists(path))
+    {
+        // Not on the same filesystem, or something else which the reaper cannot help with
+        fprintf(stderr, "Could not move %s to the trash: %s\n", path, strerror(errno));
+        remove_tree(path);
+    }
+}
+
+static void reaper_push(struct ReapDirectory **array, int *count, int *capacity, char *path,
+                        int depth)
+{
+    if (*count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 256;
+        *array = realloc(*array, *capacity * sizeof(struct ReapDirectory));
+        if (*array == NULL)
+        {
+            exit(2);
+        }
+    }
+    (*array)[*count].path = path;
+    (*array)[*count].depth = depth;
+    (*count)++;
+}
+
+static void *reaper_thread(void *data)
+{
+    struct Reaper *r = data;
+    pthread_mutex_lock(&r->lock);
+    for (;;)
+    {
+        while (r->pending_count == 0 && r->busy > 0)
+            pthread_cond_wait(&r->cond, &r->lock);
+        if (r->pending_count == 0)
+            break;
+        struct ReapDirectory dir = r->pending[--r->pending_count];
+        r->busy++;
+        pthread_mutex_unlock(&r->lock);
+
+        // Subdirectories are collected without the lock held, and queued in one go
+        char **subdirs = NULL;
+        int subdir_count = 0;
+        int subdir_capacity = 0;
+        int fd = openat(r->trash_fd, dir.path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        DIR *d = fd == -1 ? NULL : fdopendir(fd);
+        struct dirent *ent;
+        while (d != NULL && (ent = readdir(d)) != NULL)
+        {
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+                continue;
+            int is_dir = ent->d_type == DT_DIR;
+            if (ent->d_type == DT_UNKNOWN)
+            {
+                struct stat st;
+                is_dir = fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                         S_ISDIR(st.st_mode);
+            }
+            if (!is_dir)
+            {
+                unlinkat(fd, ent->d_name, 0);
+                continue;
+            }
+            if (subdir_count == subdir_capacity)
+            {
+                subdir_capacity = subdir_capacity ? subdir_capacity * 2 : 16;
+                subdirs = realloc(subdirs, subdir_capacity * sizeof(char *));
+                if (subdirs == NULL)
+                {
+                    exit(2);
+                }
+            }
+            size_t length = strlen(dir.path) + strlen(ent->d_name) + 2;
+            subdirs[subdir_count] = safe_malloc(length);
+            snprintf(subdirs[subdir_count], length, "%s/%s", dir.path, ent->d_name);
+            subdir_count++;
+        }
+        if (d != NULL)
+            closedir(d);
+        else if (fd != -1)
+            close(fd);
+
+        pthread_mutex_lock(&r->lock);
+        for (int i = 0; i < subdir_count; i++)
+        {
+            reaper_push(&r->pending, &r->pending_count, &r->pending_capacity, subdirs[i],
+                        dir.depth + 1);
+        }
+        reaper_push(&r->listed, &r->listed_count, &r->listed_capacity, dir.path, dir.depth);
+        free(subdirs);
+        r->busy--;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+static int compare_depth(const void *a, const void *b)
+{
+    return ((const struct ReapDirectory *)b)->depth - ((const struct ReapDirectory *)a)->depth;
+}
+
+// Removes everything in the trash, returns the number of trees removed
+static int trash_reap(int trash_fd)
+{
+    struct Reaper r = {.trash_fd = trash_fd};
+    pthread_mutex_init(&r.lock, NULL);
+    pthread_cond_init(&r.cond, NULL);
+
+    // Not dup(), which would share the position in the directory with trash_fd
+    int fd = openat(trash_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *d = fd == -1 ? NULL : fdopendir(fd);
+    struct dirent *ent;
+    while (d != NULL && (ent = readdir(d)) != NULL)
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 ||
+            strcmp(ent->d_name, TRASH_LOCK) == 0)
+            continue;
+        struct stat st;
+        if (fstatat(trash_fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))
+        {
+            size_t length = strlen(ent->d_name) + 1;
+            char *path = safe_malloc(length);
+            memcpy(path, ent->d_name, length);
+            reaper_push(&r.pending, &r.pending_count, &r.pending_capacity, path, 0);
+        }
+        else
+        {
+            unlinkat(trash_fd, ent->d_name, 0);
+        }
+    }
+    if (d != NULL)
+        closedir(d);
+    int trees = r.pending_count;
+    if (trees == 0)
+    {
+        free(r.pending);
+        return 0;
+    }
+
+    pthread_t threads[TRASH_REAPER_THREADS];
+    for (int i = 0; i < TRASH_REAPER_THREADS; i++)
+    {
+        pthread_create(&threads[i], NULL, reaper_thread, &r);
+    }
+    for (int i = 0; i < TRASH_REAPER_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    qsort(r.listed, r.listed_count, sizeof(struct ReapDirectory), compare_depth);
+    for (int i = 0; i < r.listed_count; i++)
+    {
+        if (unlinkat(trash_fd, r.listed[i].path, AT_REMOVEDIR) == -1)
+        {
+            fprintf(stderr, "Could not remove %s: %s\n", r.listed[i].path, strerror(errno));
+        }
+        free(r.listed[i].path);
+    }
+    free(r.listed);
+    free(r.pending);
+    pthread_mutex_destroy(&r.lock);
+    pthread_cond_destroy(&r.cond);
+    return trees;
+}
+
+static int trash_is_empty(const char *trash)
+{
+    DIR *d = opendir(trash);
+    if (d == NULL)
+        return 1;
+    struct dirent *ent;
+    int empty = 1;
+    while (empty && (ent = readdir(d)) != NULL)
+    {
+        empty = strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 ||
+                strcmp(ent->d_name, TRASH_LOCK) == 0;
+    }
+    closedir(d);
+    return empty;
+}
+
+// Starts a detached reaper for the trash of containers_path, unless the trash is empty or
+// another reaper is already running
+void trash_reap_async(const char *containers_path)
+{
+    char trash[PATH_MAX];
+    trash_directory(trash, containers_path);
+    if (trash_is_empty(trash))
+        return;
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        return;
+    }
+    if (pid > 0)
+    {
+        waitpid(pid, NULL, 0);
+        return;
+    }
+    // The reaper is reparented to init once this intermediate child exits, so that nobody has
+    // to wait for it. _exit() is used from here on, since the atexit handlers of the parent
+    // must not run again.
+    if (fork() != 0)
+        _exit(0);
+    setsid();
+    // Nothing inherited is kept open, so that whoever reads the output of the caller (or waits
+    // for EOF on a pipe it holds) is not kept waiting until the trash is empty
+    int null = open("/dev/null", O_RDWR);
+    if (null != -1)
+    {
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+    }
+    close_range(3, ~0U, 0);
+
+    int trash_fd = open(trash, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char lock_path[PATH_MAX];
+    strformat(lock_path, PATH_MAX, "%s/" TRASH_LOCK, trash);
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (trash_fd == -1 || lock_fd == -1)
+        _exit(0);
+    // Containers deleted while reaping are picked up by the next round. A container deleted
+    // after the last round, whose reaper found the lock still held, is seen once the lock
+    // is released.
+    while (flock(lock_fd, LOCK_EX | LOCK_NB) == 0)
+    {
+        while (trash_reap(trash_fd) > 0)
+            ;
+        flock(lock_fd, LOCK_UN);
+        if (trash_is_empty(trash))
+            break;
+    }
+    _exit(0);
+}
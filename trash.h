@@ -0,0 +1,7 @@
+#ifndef CONTAINER_TRASH_H
+#define CONTAINER_TRASH_H
+// Deferred removal of container directories, done in the background instead of on exit
+
+void trash_move(const char *containers_path, const char *path);
+void trash_reap_async(const char *containers_path);
+#endif // CONTAINER_TRASH_H
@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#include "userns.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// The processes of a container with --uidmap run in a user namespace, so that its root is an
+// unprivileged user of the host. The files of the image belong to the IDs of the host, instead
+// of changing their owners for every mapping the image is mounted with an idmapped mount, which
+// shows them with the owners they would have in the namespace. All containers keep sharing the
+// files of the image on disk and in the page cache.
+// References:
+// https://man7.org/linux/man-pages/man7/user_namespaces.7.html
+// https://docs.kernel.org/filesystems/idmappings.html
+
+// Parses inside:outside:count, returns -1 if it is invalid
+int userns_parse_map(const char *value, struct IdMap *map)
+{
+    char end;
+    if (sscanf(value, "%u:%u:%u%c", &map->inside, &map->outside, &map->count, &end) != 3 ||
+        map->count == 0)
+        return -1;
+    return 0;
+}
+
+// Returns the ID of the host which id in the namespace is mapped to, or the overflow ID if it is
+// not mapped
+unsigned int userns_host_id(const struct IdMap *maps, int count, unsigned int id)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (id >= maps[i].inside && id - maps[i].inside < maps[i].count)
+            return maps[i].outside + (id - maps[i].inside);
+    }
+    return 65534;
+}
+
+static void userns_write_map(pid_t pid, const char *name, const struct IdMap *maps, int count)
+{
+    char path[PATH_MAX];
+    char text[4096] = "";
+    size_t length = 0;
+    for (int i = 0; i < count; i++)
+    {
+        length += strformat(text + length, sizeof(text) - length, "%u %u %u\n", maps[i].inside,
+                            maps[i].outside, maps[i].count);
+    }
+    strformat(path, PATH_MAX, "/proc/%d/%s", (int)pid, name);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    // The whole map has to be written at once
+    if (fd == -1 || write(fd, text, length) != (ssize_t)length)
+    {
+        errorMessage("Could not write %s\n", path);
+    }
+    close(fd);
+}
+
+// Sets the uid_map and gid_map of the user namespace of pid
+void userns_write_maps(pid_t pid, const struct IdMap *uid_map, int uid_count,
+                       const struct IdMap *gid_map, int gid_count)
+{
+    userns_write_map(pid, "uid_map", uid_map, uid_count);
+    userns_write_map(pid, "gid_map", gid_map, gid_count);
+}
+
+// @brief Creates a user namespace with the maps, returns a file descriptor of it
+// @details The namespace is created by a child which exits as soon as the namespace is opened,
+// its only use is to describe the mapping to mount_setattr()
+int userns_create(const struct IdMap *uid_map, int uid_count, const struct IdMap *gid_map,
+                  int gid_count)
+{
+    int sync[2];
+    if (pipe2(sync, O_CLOEXEC) == -1)
+    {
+        errorMessage("%s\n", "pipe2() failed");
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(sync[0]);
+        if (unshare(CLONE_NEWUSER) == -1 || write(sync[1], "U", 1) != 1)
+            _exit(1);
+        // Waits for the parent to close the pipe
+        close(sync[1]);
+        pause();
+        _exit(0);
+    }
+    close(sync[1]);
+    char created;
+    if (pid == -1 || read(sync[0], &created, 1) != 1)
+    {
+        errorMessage("%s\n", "Could not create a user namespace");
+    }
+    close(sync[0]);
+    userns_write_maps(pid, uid_map, uid_count, gid_map, gid_count);
+    char path[PATH_MAX];
+    strformat(path, PATH_MAX, "/proc/%d/ns/user", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    if (fd == -1)
+    {
+        errorMessage("Could not open %s\n", path);
+    }
+    return fd;
+}
+
+// @brief Creates an idmapped mount of each of the ':' separated layers, for the user namespace
+// userns_fd
+// @return the detached mounts, which the children of this process inherit. *count is set to their
+// number.
+int *userns_idmap_layers(const char *layers, int userns_fd, int *count)
+{
+    char *copy = strdup(layers);
+    int *fds = NULL;
+    *count = 0;
+    char *saveptr;
+    for (char *layer = strtok_r(copy, ":", &saveptr); layer != NULL;
+         layer = strtok_r(NULL, ":", &saveptr))
+    {
+        int fd = open_tree(AT_FDCWD, layer, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+        struct mount_attr attr = {.attr_set = MOUNT_ATTR_IDMAP, .userns_fd = userns_fd};
+        if (fd == -1 || mount_setattr(fd, "", AT_EMPTY_PATH, &attr, sizeof(attr)) == -1)
+        {
+            fprintf(stderr, "Could not create an idmapped mount of %s: %s\n", layer,
+                    strerror(errno));
+            exit(1);
+        }
+        fds = realloc(fds, (*count + 1) * sizeof(int));
+        if (fds == NULL)
+        {
+            errorMessage("%s\n", "realloc() failed");
+        }
+        fds[(*count)++] = fd;
+    }
+    free(copy);
+    return fds;
+}
+
+// Makes root of its user namespace the user and group of this process, which is still the root
+// of the host (unmapped) after being cloned into the namespace
+void userns_become_root(void)
+{
+    if (setresgid(0, 0, 0) == -1 || setgroups(0, NULL) == -1 || setresuid(0, 0, 0) == -1)
+    {
+        perror("Could not become root of the user namespace");
+        exit(1);
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef CONTAINER_USERNS_H
+#define CONTAINER_USERNS_H
+// User namespaces of containers, and idmapped mounts of the images for them
+#include <sys/types.h>
+
+// count IDs starting at inside in the namespace are outside to the host, a line of uid_map
+struct IdMap
+{
+    unsigned int inside;
+    unsigned int outside;
+    unsigned int count;
+};
+
+int userns_parse_map(const char *value, struct IdMap *map);
+unsigned int userns_host_id(const struct IdMap *maps, int count, unsigned int id);
+void userns_write_maps(pid_t pid, const struct IdMap *uid_map, int uid_count,
+                       const struct IdMap *gid_map, int gid_count);
+int userns_create(const struct IdMap *uid_map, int uid_count, const struct IdMap *gid_map,
+                  int gid_count);
+int *userns_idmap_layers(const char *layers, int userns_fd, int *count);
+void userns_become_root(void);
+#endif // CONTAINER_USERNS_H
@@ -1,8 +1,11 @@
+#define _GNU_SOURCE
 #include "utils.h"
+#include "trace.h"
 #include <unistd.h>
 #include<limits.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -69,6 +72,7 @@ int strformat(char *buffer, size_t bufflen, const char *fmt, ...)
 // Incase of any error, calls exit()
 void exec_command(char *command, char **args)
 {
+    uint64_t begin = trace_now();
     pid_t pid = fork();
     if (pid == -1)
     {
@@ -99,10 +103,12 @@ void exec_command(char *command, char **args)
             exit(1);
         }
     }
+    trace_span(command, begin);
 }
 
 void exec_command_fail_ok(char *command, char **args)
 {
+    uint64_t begin = trace_now();
     pid_t pid = fork();
     if (pid == -1)
     {
@@ -130,4 +136,91 @@ void exec_command_fail_ok(char *command, char **args)
             fprintf(stderr, "sub_command %s failed: %s\n", command, strerror(errno));
         }
     }
-}
\ No newline at end of file
+    trace_span(command, begin);
+}
+
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    if (remove(path) == -1)
+    {
+        fprintf(stderr, "Could not remove %s: %s\n", path, strerror(errno));
+    }
+    return 0;
+}
+
+// Recursively removes path, like rm -rf, without following symlinks or crossing mount points
+void remove_tree(const char *path)
+{
+    nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
+}
+
+// Creates a directory using the mkdir() system call
+// prefix is a path to add before the directory, like container root location
+// if prefix is null, or empty, no prefix is added
+void create_directory(const char *prefix, const char *path, mode_t mode)
+{
+    static char buffer[PATH_MAX];
+    if (prefix == NULL || prefix[0] == '\0')
+    {
+        strformat(buffer, PATH_MAX, "%s", path);
+    }
+    else
+    {
+        strformat(buffer, PATH_MAX, "%s/%s", prefix, path);
+    }
+    if (mkdir(buffer, mode) == -1)
+    {
+        errorMessage("%s%s\n", "mkdir() failed to create ", buffer);
+    }
+}
+
+// Same as create_directory, but does not fail if the directory exists
+void create_directory_exists_ok(const char *prefix, const char *path, mode_t mode)
+{
+    static char buffer[PATH_MAX];
+    if (prefix == NULL || prefix[0] == '\0')
+    {
+        strformat(buffer, PATH_MAX, "%s", path);
+    }
+    else
+    {
+        strformat(buffer, PATH_MAX, "%s/%s", prefix, path);
+    }
+    if (mkdir(buffer, mode) == -1)
+    {
+        if (errno == EEXIST)
+            return;
+        errorMessage("%s\n", "mkdir() failed");
+    }
+}
+
+// Creates the parents of the directory if they do not exist
+// Does not modify the mode of the parent and does not error if exists
+// behaves like mkdir -p
+void create_directory_parents(const char *prefix, const char *path, mode_t mode)
+{
+    static char buffer[PATH_MAX];
+    if (prefix == NULL || prefix[0] == '\0')
+    {
+        strformat(buffer, PATH_MAX, "%s", path);
+    }
+    else
+    {
+        strformat(buffer, PATH_MAX, "%s/%s", prefix, path);
+    }
+    for (char *p = buffer + 1;; p++)
+    {
+        if (*p != '/' && *p != '\0')
+            continue;
+        char c = *p;
+        *p = '\0';
+        if (mkdir(buffer, mode) == -1 && errno != EEXIST)
+        {
+            errorMessage("%s%s\n", "mkdir() failed to create ", buffer);
+        }
+        *p = c;
+        if (c == '\0')
+            break;
+    }
+}
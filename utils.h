@@ -2,6 +2,7 @@
 // Commonly used utility functions
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
 #define CONTAINER_UTIL_H
 
@@ -20,4 +21,8 @@ int exists(const char *path);
 int strformat(char *buffer, size_t bufflen, const char *fmt, ...);
 void exec_command(char *command, char **args);
 void exec_command_fail_ok(char *command, char **args);
+void remove_tree(const char *path);
+void create_directory(const char *prefix, const char *path, mode_t mode);
+void create_directory_exists_ok(const char *prefix, const char *path, mode_t mode);
+void create_directory_parents(const char *prefix, const char *path, mode_t mode);
 #endif // CONTAINER_UTIL_H
\ No newline at end of file